@@ -0,0 +1,652 @@
+/*-
+ * Copyright (c) 2005 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <bzlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+/*
+ * The 48 bit values that start each block and end each stream. They
+ * are not byte aligned other than at the start of a stream.
+ */
+#define BZIP2_BLOCK_MAGIC	0x314159265359ULL
+#define BZIP2_EOS_MAGIC		0x177245385090ULL
+#define BZIP2_MAGIC_MASK	0xffffffffffffULL
+#define BZIP2_MAGIC_BITS	48
+
+/* The block magic is followed by the block's CRC */
+#define BZIP2_CRC_BITS		32
+
+/*
+ * The longest a block at each level may be compressed to. Each of the
+ * up to level * 100000 symbols is at most 20 bits, plus the tables.
+ */
+#define BZIP2_BLOCK_MAX_BITS(level) \
+	((uint64_t)(level) * 100000 * 20 + 65536)
+
+/* The most blocks that may be decoded ahead of the reader per thread */
+#define BZIP2_AHEAD		2
+
+typedef enum {
+	bzip2_queued,
+	bzip2_decoding,
+	bzip2_done,
+	bzip2_failed
+} bzip2_state;
+
+struct bzip2_block {
+	uint64_t	 start;		/* Bit offset of the block magic */
+	uint64_t	 end;		/* Bit offset of the next magic */
+	uint32_t	 crc;
+	uint32_t	 stream_crc;	/* The stream's CRC before this block */
+	int		 level;		/* From the stream header, 1 to 9 */
+	char		*out;
+	size_t		 out_len;
+	bzip2_state	 state;
+};
+
+/*
+ * Blocks between head and next are being decoded or have been, those
+ * between next and tail are waiting for a thread. The reader finds
+ * blocks and adds them at tail then returns them from head in order.
+ */
+struct read_bzip2_data {
+	const unsigned char *map;	/* A mapping of the whole file */
+	size_t		 map_size;
+	uint64_t	 bits;		/* The number of bits in map */
+
+	/* Used only by the reader */
+	uint64_t	 scan;		/* Bit offset of the next marker */
+	int		 scan_level;
+	int		 scan_header;	/* scan is at a stream header */
+	int		 scan_done;
+	int		 scan_error;
+	uint32_t	 stream_crc;
+	char		*last_out;	/* Freed on the next read */
+	unsigned int	 window;	/* Blocks to have ahead of the reader */
+
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 queued;	/* A block was added */
+	pthread_cond_t	 decoded;	/* A block was decoded */
+	pthread_t	*threads;
+	unsigned int	 thread_count;
+	unsigned int	 threads_max;
+	struct bzip2_block *blocks;
+	unsigned int	 block_count;
+	unsigned int	 head;
+	unsigned int	 next;
+	unsigned int	 tail;
+	int		 stop;
+};
+
+int archive_read_open_bzip2(struct archive *, FILE *, unsigned int);
+
+static int	bzip2_close(struct archive *, void *);
+static int	bzip2_open(struct archive *, void *);
+static ssize_t	bzip2_read(struct archive *, void *, const void **buff);
+static int	bzip2_scan(struct read_bzip2_data *, struct bzip2_block *);
+static int	bzip2_join(struct read_bzip2_data *, struct bzip2_block *);
+static void	bzip2_discard(struct read_bzip2_data *);
+static int	bzip2_decode(struct read_bzip2_data *, struct bzip2_block *);
+static void	*bzip2_thread(void *);
+static uint64_t	bzip2_bits(struct read_bzip2_data *, uint64_t, unsigned int);
+static uint64_t	bzip2_find_magic(struct read_bzip2_data *, uint64_t);
+
+/*
+ * Reads a bzip2 compressed archive from a regular file by decoding it's
+ * blocks in parallel. Each bzip2 block can be decoded on it's own so
+ * the file is scanned for the bit pattern that starts a block and each
+ * block is rebuilt into a stream of it's own for libbz2 to decode.
+ * The reader passes the decoded blocks to libarchive in order.
+ *
+ * Blocks are decoded by the reader until more than one is asked for
+ * ahead of it so only reading the start of an archive doesn't start
+ * any threads.
+ *
+ * The block magic may also be found by chance inside a block. The
+ * block before it then fails to decode so is joined with the next
+ * possible block and decoded again until it succeeds.
+ *
+ * threads is the most threads to use, 0 to use one per CPU.
+ *
+ * Returns ARCHIVE_WARN without using the archive if fd isn't a bzip2
+ * compressed regular file or there is only one CPU. The caller should
+ * then read it another way, e.g. with archive_read_open_stream().
+ */
+int
+archive_read_open_bzip2(struct archive *a, FILE *fd, unsigned int threads)
+{
+	struct read_bzip2_data *mine;
+	struct stat sb;
+	const unsigned char *map;
+	off_t offset;
+	long cpus;
+	int file;
+
+	if (threads == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0 ? cpus : 1);
+	}
+	if (threads < 2)
+		return (ARCHIVE_WARN);
+
+	if (fd == NULL || (file = fileno(fd)) == -1)
+		return (ARCHIVE_WARN);
+	if (fstat(file, &sb) != 0 || !S_ISREG(sb.st_mode))
+		return (ARCHIVE_WARN);
+	offset = ftello(fd);
+	if (offset == -1 || sb.st_size - offset < 14 ||
+	    (uintmax_t)sb.st_size > SIZE_MAX)
+		return (ARCHIVE_WARN);
+
+	/* Only use this for bzip2, checking the first block's magic */
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, file, 0);
+	if (map == MAP_FAILED)
+		return (ARCHIVE_WARN);
+	if (memcmp(map + offset, "BZh", 3) != 0 ||
+	    map[offset + 3] < '1' || map[offset + 3] > '9' ||
+	    memcmp(map + offset + 4, "\x31\x41\x59\x26\x53\x59", 6) != 0) {
+		munmap((void *)(uintptr_t)map, sb.st_size);
+		return (ARCHIVE_WARN);
+	}
+	madvise((void *)(uintptr_t)map, sb.st_size, MADV_SEQUENTIAL);
+
+	mine = malloc(sizeof(*mine));
+	if (mine == NULL) {
+		munmap((void *)(uintptr_t)map, sb.st_size);
+		archive_set_error(a, ENOMEM, "No memory");
+		return (ARCHIVE_FATAL);
+	}
+	mine->map = map;
+	mine->map_size = sb.st_size;
+	mine->bits = (uint64_t)sb.st_size * 8;
+	mine->scan = (uint64_t)offset * 8;
+	mine->scan_level = 0;
+	mine->scan_header = 1;
+	mine->scan_done = 0;
+	mine->scan_error = 0;
+	mine->stream_crc = 0;
+	mine->last_out = NULL;
+	mine->window = 1;
+	mine->threads = NULL;
+	mine->thread_count = 0;
+	mine->threads_max = threads;
+	mine->block_count = threads * BZIP2_AHEAD;
+	mine->head = mine->next = mine->tail = 0;
+	mine->stop = 0;
+
+	mine->blocks = calloc(mine->block_count, sizeof(struct bzip2_block));
+	mine->threads = calloc(threads, sizeof(pthread_t));
+	if (mine->blocks == NULL || mine->threads == NULL) {
+		free(mine->threads);
+		free(mine->blocks);
+		munmap((void *)(uintptr_t)map, sb.st_size);
+		free(mine);
+		archive_set_error(a, ENOMEM, "No memory");
+		return (ARCHIVE_FATAL);
+	}
+	pthread_mutex_init(&mine->lock, NULL);
+	pthread_cond_init(&mine->queued, NULL);
+	pthread_cond_init(&mine->decoded, NULL);
+
+	return (archive_read_open2(a, mine, bzip2_open, bzip2_read,
+	    NULL, bzip2_close));
+}
+
+static int
+bzip2_open(struct archive *a, void *client_data)
+{
+
+	(void)a; /* UNUSED */
+	(void)client_data; /* UNUSED */
+	return (ARCHIVE_OK);
+}
+
+static ssize_t
+bzip2_read(struct archive *a, void *client_data, const void **buff)
+{
+	struct read_bzip2_data *mine = client_data;
+	struct bzip2_block *block, found;
+	int ret;
+
+	/* libarchive is finished with the last block */
+	free(mine->last_out);
+	mine->last_out = NULL;
+
+	pthread_mutex_lock(&mine->lock);
+
+	/* The archive is still being read so decode more ahead of it */
+	if (mine->head > 0 && mine->window < mine->block_count)
+		mine->window *= 2;
+	if (mine->window > mine->block_count)
+		mine->window = mine->block_count;
+	while (mine->window > 1 && mine->thread_count < mine->threads_max &&
+	    mine->thread_count < mine->window) {
+		if (pthread_create(&mine->threads[mine->thread_count], NULL,
+		    bzip2_thread, mine) != 0)
+			break;
+		mine->thread_count++;
+	}
+
+	/* The scan state is only used by this thread so isn't locked */
+	while (!mine->scan_done && mine->tail - mine->head < mine->window) {
+		pthread_mutex_unlock(&mine->lock);
+		ret = bzip2_scan(mine, &found);
+		pthread_mutex_lock(&mine->lock);
+		if (ret != 1) {
+			mine->scan_done = 1;
+			mine->scan_error = (ret != 0);
+			break;
+		}
+		block = &mine->blocks[mine->tail % mine->block_count];
+		*block = found;
+		block->state = bzip2_queued;
+		mine->tail++;
+		pthread_cond_signal(&mine->queued);
+	}
+
+	if (mine->head == mine->tail) {
+		pthread_mutex_unlock(&mine->lock);
+		if (mine->scan_error) {
+			archive_set_error(a, EINVAL, "Bad bzip2 data");
+			return (-1);
+		}
+		return (0);
+	}
+
+	block = &mine->blocks[mine->head % mine->block_count];
+	if (block->state == bzip2_queued) {
+		/* No thread has started it so decode it here */
+		mine->next++;
+		block->state = bzip2_decoding;
+		pthread_mutex_unlock(&mine->lock);
+		ret = bzip2_decode(mine, block);
+		pthread_mutex_lock(&mine->lock);
+		block->state = (ret == 0 ? bzip2_done : bzip2_failed);
+	}
+	while (block->state == bzip2_decoding)
+		pthread_cond_wait(&mine->decoded, &mine->lock);
+	if (block->state == bzip2_failed) {
+		/* The blocks after it were found from a false magic */
+		bzip2_discard(mine);
+		pthread_mutex_unlock(&mine->lock);
+		ret = bzip2_join(mine, block);
+		pthread_mutex_lock(&mine->lock);
+		block->state = (ret == 0 ? bzip2_done : bzip2_failed);
+	}
+	mine->head++;
+	pthread_mutex_unlock(&mine->lock);
+
+	if (block->state == bzip2_failed) {
+		free(block->out);
+		block->out = NULL;
+		archive_set_error(a, EINVAL, "Bad bzip2 block");
+		return (-1);
+	}
+
+	*buff = mine->last_out = block->out;
+	block->out = NULL;
+	return (block->out_len);
+}
+
+static int
+bzip2_close(struct archive *a, void *client_data)
+{
+	struct read_bzip2_data *mine = client_data;
+	unsigned int pos;
+
+	(void)a; /* UNUSED */
+	pthread_mutex_lock(&mine->lock);
+	mine->stop = 1;
+	pthread_cond_broadcast(&mine->queued);
+	pthread_mutex_unlock(&mine->lock);
+	for (pos = 0; pos < mine->thread_count; pos++)
+		pthread_join(mine->threads[pos], NULL);
+
+	for (pos = 0; pos < mine->block_count; pos++)
+		free(mine->blocks[pos].out);
+	free(mine->last_out);
+	free(mine->blocks);
+	free(mine->threads);
+	pthread_cond_destroy(&mine->decoded);
+	pthread_cond_destroy(&mine->queued);
+	pthread_mutex_destroy(&mine->lock);
+	munmap((void *)(uintptr_t)mine->map, mine->map_size);
+	free(mine);
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Decodes blocks in the order they were found until the archive is
+ * closed. Blocks the reader is waiting on may be decoded by it.
+ */
+static void *
+bzip2_thread(void *data)
+{
+	struct read_bzip2_data *mine = data;
+	struct bzip2_block *block;
+	int ret;
+
+	pthread_mutex_lock(&mine->lock);
+	for (;;) {
+		while (mine->next == mine->tail && !mine->stop)
+			pthread_cond_wait(&mine->queued, &mine->lock);
+		if (mine->stop)
+			break;
+
+		block = &mine->blocks[mine->next % mine->block_count];
+		mine->next++;
+		block->state = bzip2_decoding;
+
+		pthread_mutex_unlock(&mine->lock);
+		ret = bzip2_decode(mine, block);
+		pthread_mutex_lock(&mine->lock);
+
+		block->state = (ret == 0 ? bzip2_done : bzip2_failed);
+		pthread_cond_broadcast(&mine->decoded);
+	}
+	pthread_mutex_unlock(&mine->lock);
+
+	return (NULL);
+}
+
+/*
+ * Finds the next block. Returns 1 and fills in block if one was
+ * found, 0 at the end of the data or -1 if the data is bad. The CRC
+ * of each stream is checked against the CRCs of it's blocks.
+ */
+static int
+bzip2_scan(struct read_bzip2_data *mine, struct bzip2_block *block)
+{
+	const unsigned char *header;
+	uint64_t magic;
+
+	for (;;) {
+		if (mine->scan_header) {
+			/* Streams may be joined together, e.g. by pbzip2 */
+			if (mine->scan + 32 + BZIP2_MAGIC_BITS > mine->bits)
+				return (0);
+			header = mine->map + mine->scan / 8;
+			if (memcmp(header, "BZh", 3) != 0 ||
+			    header[3] < '1' || header[3] > '9')
+				return (0);
+			mine->scan_level = header[3] - '0';
+			mine->scan += 32;
+			mine->scan_header = 0;
+			mine->stream_crc = 0;
+		}
+
+		if (mine->scan + BZIP2_MAGIC_BITS + BZIP2_CRC_BITS > mine->bits)
+			return (-1);
+		magic = bzip2_bits(mine, mine->scan, BZIP2_MAGIC_BITS);
+		if (magic == BZIP2_EOS_MAGIC) {
+			if (bzip2_bits(mine, mine->scan + BZIP2_MAGIC_BITS,
+			    BZIP2_CRC_BITS) != mine->stream_crc)
+				return (-1);
+			/* The next stream starts on a byte boundary */
+			mine->scan = (mine->scan + BZIP2_MAGIC_BITS +
+			    BZIP2_CRC_BITS + 7) & ~(uint64_t)7;
+			mine->scan_header = 1;
+			continue;
+		}
+		if (magic != BZIP2_BLOCK_MAGIC)
+			return (-1);
+
+		block->start = mine->scan;
+		block->end = bzip2_find_magic(mine,
+		    mine->scan + BZIP2_MAGIC_BITS);
+		if (block->end == 0)
+			return (-1);
+		block->crc = bzip2_bits(mine, mine->scan + BZIP2_MAGIC_BITS,
+		    BZIP2_CRC_BITS);
+		block->stream_crc = mine->stream_crc;
+		block->level = mine->scan_level;
+		block->out = NULL;
+		block->out_len = 0;
+		mine->stream_crc = ((mine->stream_crc << 1) |
+		    (mine->stream_crc >> 31)) ^ block->crc;
+		mine->scan = block->end;
+		return (1);
+	}
+}
+
+/*
+ * Joins a block that failed to decode with the next possible block
+ * until it decodes. Scanning then starts again after it. Returns 0 if
+ * it decoded or -1 if the block is bad.
+ */
+static int
+bzip2_join(struct read_bzip2_data *mine, struct bzip2_block *block)
+{
+	uint64_t end, limit;
+
+	limit = block->start + BZIP2_BLOCK_MAX_BITS(block->level);
+	do {
+		end = bzip2_find_magic(mine, block->end + 1);
+		if (end == 0 || end > limit) {
+			mine->scan_done = 1;
+			mine->scan_error = 1;
+			return (-1);
+		}
+		block->end = end;
+	} while (bzip2_decode(mine, block) != 0);
+
+	mine->scan = block->end;
+	mine->scan_level = block->level;
+	mine->scan_header = 0;
+	mine->scan_done = 0;
+	mine->scan_error = 0;
+	mine->stream_crc = ((block->stream_crc << 1) |
+	    (block->stream_crc >> 31)) ^ block->crc;
+	return (0);
+}
+
+/*
+ * Removes the blocks after the head block, waiting for any being
+ * decoded. Must be called with the lock held.
+ */
+static void
+bzip2_discard(struct read_bzip2_data *mine)
+{
+	struct bzip2_block *block;
+	unsigned int pos;
+
+	/* Stop the threads starting any more */
+	mine->tail = mine->next;
+	for (pos = mine->head + 1; pos < mine->next; pos++) {
+		block = &mine->blocks[pos % mine->block_count];
+		while (block->state == bzip2_decoding)
+			pthread_cond_wait(&mine->decoded, &mine->lock);
+		free(block->out);
+		block->out = NULL;
+	}
+	mine->next = mine->tail = mine->head + 1;
+}
+
+/*
+ * Decodes a block by copying it into a stream with only that block
+ * then passing it to libbz2. A single block stream's CRC is the CRC
+ * of the block.
+ */
+static int
+bzip2_decode(struct read_bzip2_data *mine, struct bzip2_block *block)
+{
+	bz_stream strm;
+	unsigned char *in, *p;
+	char *out, *new_out;
+	uint64_t pos, acc;
+	size_t in_len, out_size;
+	unsigned int n, acc_bits;
+	int ret;
+
+	in_len = 4 + (block->end - block->start + BZIP2_MAGIC_BITS +
+	    BZIP2_CRC_BITS + 7) / 8;
+	in = malloc(in_len);
+	if (in == NULL)
+		return (-1);
+	memcpy(in, "BZh", 3);
+	in[3] = '0' + block->level;
+
+	/* Copy the block's bits so they start on a byte boundary */
+	p = in + 4;
+	acc = 0;
+	acc_bits = 0;
+	for (pos = block->start; pos < block->end; pos += n) {
+		n = (block->end - pos > 32 ? 32 : block->end - pos);
+		acc = (acc << n) | bzip2_bits(mine, pos, n);
+		acc_bits += n;
+		while (acc_bits >= 8) {
+			acc_bits -= 8;
+			*p++ = acc >> acc_bits;
+		}
+	}
+	acc = (acc << 24) | (BZIP2_EOS_MAGIC >> 24);
+	acc_bits += 24;
+	while (acc_bits >= 8) {
+		acc_bits -= 8;
+		*p++ = acc >> acc_bits;
+	}
+	acc = (acc << 24) | (BZIP2_EOS_MAGIC & 0xffffff);
+	acc_bits += 24;
+	while (acc_bits >= 8) {
+		acc_bits -= 8;
+		*p++ = acc >> acc_bits;
+	}
+	acc = (acc << BZIP2_CRC_BITS) | block->crc;
+	acc_bits += BZIP2_CRC_BITS;
+	while (acc_bits >= 8) {
+		acc_bits -= 8;
+		*p++ = acc >> acc_bits;
+	}
+	if (acc_bits > 0)
+		*p++ = acc << (8 - acc_bits);
+
+	/* Most blocks decode to about the block size */
+	out_size = block->level * 100000 + 4096;
+	out = malloc(out_size);
+	if (out == NULL) {
+		free(in);
+		return (-1);
+	}
+
+	memset(&strm, 0, sizeof(strm));
+	if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+		free(out);
+		free(in);
+		return (-1);
+	}
+	strm.next_in = (char *)in;
+	strm.avail_in = p - in;
+	strm.next_out = out;
+	strm.avail_out = out_size;
+	while ((ret = BZ2_bzDecompress(&strm)) == BZ_OK) {
+		if (strm.avail_out > 0) {
+			/* libbz2 wants more input but there is none */
+			ret = BZ_DATA_ERROR;
+			break;
+		}
+		/* Runs of a byte can make a block much larger */
+		new_out = realloc(out, out_size * 2);
+		if (new_out == NULL) {
+			ret = BZ_MEM_ERROR;
+			break;
+		}
+		out = new_out;
+		strm.next_out = out + out_size;
+		strm.avail_out = out_size;
+		out_size *= 2;
+	}
+	block->out_len = out_size - strm.avail_out;
+	BZ2_bzDecompressEnd(&strm);
+	free(in);
+
+	if (ret != BZ_STREAM_END || block->out_len == 0) {
+		free(out);
+		return (-1);
+	}
+	block->out = out;
+	return (0);
+}
+
+/* Reads count bits, up to 57, from a bit offset in the file */
+static uint64_t
+bzip2_bits(struct read_bzip2_data *mine, uint64_t pos, unsigned int count)
+{
+	uint64_t value;
+	size_t byte, last;
+
+	byte = pos / 8;
+	last = (pos + count + 7) / 8;
+	value = 0;
+	for (; byte < last; byte++)
+		value = (value << 8) | mine->map[byte];
+	value >>= (last * 8) - (pos + count);
+	return (value & ((1ULL << count) - 1));
+}
+
+/*
+ * Finds the next block or end of stream magic starting at or after
+ * a bit offset. Returns the bit offset of the magic or 0 if there
+ * isn't one.
+ */
+static uint64_t
+bzip2_find_magic(struct read_bzip2_data *mine, uint64_t from)
+{
+	uint64_t window, magic, start;
+	size_t byte;
+	int shift;
+
+	/* Fill the window with the bits up to the first possible end */
+	byte = from / 8;
+	window = 0;
+	for (; byte < mine->map_size; byte++) {
+		window = (window << 8) | mine->map[byte];
+
+		/* Check for a magic ending at each bit in this byte */
+		for (shift = 7; shift >= 0; shift--) {
+			start = (byte + 1) * 8 - shift;
+			if (start < from + BZIP2_MAGIC_BITS)
+				continue;
+			start -= BZIP2_MAGIC_BITS;
+			magic = (window >> shift) & BZIP2_MAGIC_MASK;
+			if (magic == BZIP2_BLOCK_MAGIC ||
+			    magic == BZIP2_EOS_MAGIC)
+				return (start);
+		}
+	}
+	return (0);
+}
@@ -28,16 +28,30 @@
 //#include "archive_platform.h"
 //__FBSDID("$FreeBSD$");
 
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "archive.h"
 
+/* The largest block read from a stream that can't be mapped */
+#define STREAM_BLOCK_MAX	(1024 * 1024)
+
 struct read_stream_data {
 	FILE	*fd;
-	size_t	 block_size;
 	void	*buffer;
+	size_t	 buffer_size;
+	int	 buffer_full;	/* The last read filled the buffer */
+	void	*map;		/* A mapping of the whole file or NULL */
+	size_t	 map_size;
+	size_t	 map_offset;	/* The next byte to return from map */
 };
 
 int archive_read_open_stream(struct archive *, FILE *, size_t);
@@ -45,7 +59,15 @@ int archive_read_open_stream(struct archive *, FILE *, size_t);
 static int	stream_close(struct archive *, void *);
 static int	stream_open(struct archive *, void *);
 static ssize_t	stream_read(struct archive *, void *, const void **buff);
+static off_t	stream_skip(struct archive *, void *, off_t);
+static int	stream_map(struct read_stream_data *);
 
+/*
+ * Reads an archive from a FILE pointer. Regular files are mapped into
+ * memory and passed to libarchive in one go. Other streams, e.g. pipes
+ * or fetch(3) connections, are read in blocks starting at block_size
+ * that grow up to STREAM_BLOCK_MAX while each read fills the buffer.
+ */
 int
 archive_read_open_stream(struct archive *a, FILE *fd, size_t block_size)
 {
@@ -56,15 +78,75 @@ archive_read_open_stream(struct archive *a, FILE *fd, size_t block_size)
 		archive_set_error(a, ENOMEM, "No memory");
 		return (ARCHIVE_FATAL);
 	}
-	mine->block_size = block_size;
-	mine->buffer = malloc(mine->block_size);
-	if (mine->buffer == NULL) {
-		archive_set_error(a, ENOMEM, "No memory");
-		free(mine);
-		return (ARCHIVE_FATAL);
-	}
 	mine->fd = fd;
-	return (archive_read_open(a, mine, stream_open, stream_read, stream_close));
+	mine->buffer = NULL;
+	mine->buffer_size = 0;
+	mine->buffer_full = 0;
+	mine->map = NULL;
+	mine->map_size = 0;
+	mine->map_offset = 0;
+
+	if (stream_map(mine) != 0) {
+		mine->buffer_size = block_size;
+		mine->buffer = malloc(mine->buffer_size);
+		if (mine->buffer == NULL) {
+			archive_set_error(a, ENOMEM, "No memory");
+			free(mine);
+			return (ARCHIVE_FATAL);
+		}
+	}
+	return (archive_read_open2(a, mine, stream_open, stream_read,
+	    stream_skip, stream_close));
+}
+
+/*
+ * Maps the rest of a regular file into memory. Returns -1 if the
+ * FILE pointer isn't a regular file or can't be mapped.
+ */
+static int
+stream_map(struct read_stream_data *mine)
+{
+	struct stat sb;
+	off_t offset, page;
+	size_t len;
+	int fd;
+
+	if (mine->fd == NULL || (fd = fileno(mine->fd)) == -1)
+		return (-1);
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+		return (-1);
+
+	/* Start from where the caller has read to */
+	offset = ftello(mine->fd);
+	if (offset == -1 || offset >= sb.st_size ||
+	    (uintmax_t)sb.st_size > SIZE_MAX) {
+#ifdef POSIX_FADV_SEQUENTIAL
+		/* Read ahead of the blocks we will ask for */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		return (-1);
+	}
+
+	mine->map_size = sb.st_size;
+	mine->map = mmap(NULL, mine->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mine->map == MAP_FAILED) {
+		mine->map = NULL;
+		return (-1);
+	}
+	mine->map_offset = offset;
+
+	/*
+	 * Let the kernel read the file ahead of the decompressor. Only
+	 * the start is asked for now as the caller may only want the
+	 * first few entries, e.g. a package's control files.
+	 */
+	page = offset & ~((off_t)getpagesize() - 1);
+	len = mine->map_size - page;
+	madvise((char *)mine->map + page, len, MADV_SEQUENTIAL);
+	madvise((char *)mine->map + page,
+	    len < STREAM_BLOCK_MAX ? len : STREAM_BLOCK_MAX, MADV_WILLNEED);
+
+	return (0);
 }
 
 static int
@@ -73,10 +155,9 @@ stream_open(struct archive *a, void *client_data)
 	struct read_stream_data *mine = client_data;
 
 	(void)a; /* UNUSED */
+	/* libarchive calls stream_close() to free mine when this fails */
 	if (mine->fd == NULL) {
 		archive_set_error(a, EINVAL, "Bad FILE pointer");
-		free(mine->buffer);
-		free(mine);
 		return (ARCHIVE_FATAL);
 	}
 	return (ARCHIVE_OK);
@@ -86,10 +167,52 @@ static ssize_t
 stream_read(struct archive *a, void *client_data, const void **buff)
 {
 	struct read_stream_data *mine = client_data;
+	void *new_buffer;
+	size_t len;
 
 	(void)a; /* UNUSED */
+	if (mine->map != NULL) {
+		/* Return everything that is left in one block */
+		*buff = (char *)mine->map + mine->map_offset;
+		len = mine->map_size - mine->map_offset;
+		mine->map_offset = mine->map_size;
+		return (len);
+	}
+
+	/*
+	 * The stream is keeping up so ask for more this time. The old
+	 * block is only used by libarchive until the next read.
+	 */
+	if (mine->buffer_full && mine->buffer_size < STREAM_BLOCK_MAX) {
+		new_buffer = realloc(mine->buffer, mine->buffer_size * 2);
+		if (new_buffer != NULL) {
+			mine->buffer = new_buffer;
+			mine->buffer_size *= 2;
+		}
+	}
+
 	*buff = mine->buffer;
-	return fread(mine->buffer, 1, mine->block_size, mine->fd);
+	len = fread(mine->buffer, 1, mine->buffer_size, mine->fd);
+	mine->buffer_full = (len == mine->buffer_size);
+	return (len);
+}
+
+static off_t
+stream_skip(struct archive *a, void *client_data, off_t request)
+{
+	struct read_stream_data *mine = client_data;
+	size_t len;
+
+	(void)a; /* UNUSED */
+	/* Only a mapped file can skip, others will be read */
+	if (mine->map == NULL || request <= 0)
+		return (0);
+
+	len = mine->map_size - mine->map_offset;
+	if ((uintmax_t)request < len)
+		len = request;
+	mine->map_offset += len;
+	return (len);
 }
 
 static int
@@ -98,6 +221,8 @@ stream_close(struct archive *a, void *client_data)
 	struct read_stream_data *mine = client_data;
 
 	(void)a; /* UNUSED */
+	if (mine->map != NULL)
+		munmap(mine->map, mine->map_size);
 	free(mine->buffer);
 	free(mine);
 	return (ARCHIVE_OK);
@@ -49,10 +49,18 @@
  */
 struct pkgfile;
 
+/**
+ * @brief Callback used by pkgfile_checksum_stream() to pass data to a hash
+ */
+typedef void	 pkgfile_checksum_update(void *, const void *, size_t);
+
 struct pkgfile	*pkgfile_new_from_disk(const char *, int);
 struct pkgfile	*pkgfile_new_regular(const char *, const char *, uint64_t);
+struct pkgfile	*pkgfile_new_regular_owned(const char *, char *, uint64_t);
 struct pkgfile	*pkgfile_new_symlink(const char *, const char *);
+struct pkgfile	*pkgfile_new_symlink_owned(const char *, char *);
 struct pkgfile	*pkgfile_new_hardlink(const char *, const char *);
+struct pkgfile	*pkgfile_new_hardlink_owned(const char *, char *);
 struct pkgfile	*pkgfile_new_directory(const char *);
 const char	*pkgfile_get_name(struct pkgfile *);
 uint64_t	 pkgfile_get_size(struct pkgfile *);
@@ -60,18 +68,36 @@ const char	*pkgfile_get_data(struct pkgfile *);
 FILE		*pkgfile_get_fileptr(struct pkgfile *);
 const char	*pkgfile_get_type_string(struct pkgfile *);
 int		 pkgfile_set_cwd(struct pkgfile *, const char *);
+int		 pkgfile_set_dirfd(struct pkgfile *, int);
 int		 pkgfile_set_checksum_md5(struct pkgfile *, const char *);
 int		 pkgfile_compare_checksum_md5(struct pkgfile *);
+int		 pkgfile_checksum_stream(struct pkgfile *,
+			pkgfile_checksum_update *, void *);
 int		 pkgfile_seek(struct pkgfile *, int64_t, int);
 int		 pkgfile_set_mode(struct pkgfile *, mode_t);
+int		 pkgfile_reserve(struct pkgfile *, uint64_t);
 int		 pkgfile_append(struct pkgfile *, const char *, uint64_t);
 int		 pkgfile_append_string(struct pkgfile *, const char *, ...);
 const char	*pkgfile_find_line(struct pkgfile *, const char *);
 int		 pkgfile_remove_line(struct pkgfile *, const char *);
+int		 pkgfile_edit_begin(struct pkgfile *);
+int		 pkgfile_edit_commit(struct pkgfile *);
 int		 pkgfile_write(struct pkgfile *);
 int		 pkgfile_unlink(struct pkgfile *);
 int		 pkgfile_free(struct pkgfile *);
 
+/**
+ * @brief A set of files being written by a pool of threads
+ * @struct pkgfile_batch pkg.h <pkg.h>
+ */
+struct pkgfile_batch;
+
+struct pkgfile_batch	*pkgfile_batch_new(unsigned int);
+int			 pkgfile_batch_write(struct pkgfile_batch *,
+				struct pkgfile *);
+int			 pkgfile_batch_wait(struct pkgfile_batch *);
+int			 pkgfile_batch_free(struct pkgfile_batch *);
+
 /**
  * @}
  */
@@ -109,8 +135,11 @@ typedef enum _pkg_script {
 
 struct pkg		 *pkg_new_empty(const char *);
 struct pkg		 *pkg_new_freebsd_from_file(FILE *);
+struct pkg		 *pkg_new_freebsd_from_path(const char *);
 struct pkg		 *pkg_new_freebsd_installed(const char *, const char *);
 struct pkg		 *pkg_new_freebsd_empty(const char *);
+int			  pkg_freebsd_create_toc(const char *);
+struct pkg		 *pkg_new_chunked_from_file(FILE *);
 int			  pkg_compare(const void *, const void *);
 int			  pkg_set_prefix(struct pkg *, const char *);
 const char		 *pkg_get_prefix(struct pkg *);
@@ -240,6 +269,10 @@ struct pkg_manifest_item **pkg_manifest_get_items(struct pkg_manifest *);
  * @}
  */
 
+/* Write a package in the chunked format read by pkg_new_chunked_from_file */
+int			  pkg_chunked_write(FILE *, struct pkg_manifest *,
+				struct pkgfile **);
+
 char	*pkg_abspath(const char *);
 
 #endif /* __LIBPKG_PKG_H__ */
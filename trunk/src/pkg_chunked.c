@@ -0,0 +1,1139 @@
+/*
+ * Copyright (C) 2006, Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "pkg.h"
+#include "pkg_private.h"
+
+/* The start of every chunked package */
+#define CHUNKED_MAGIC		"LIBPKGC1"
+#define CHUNKED_MAGIC_LEN	8
+
+/* The size of the parts of a package's header */
+#define CHUNKED_HEADER_LEN	64
+#define CHUNKED_ENTRY_LEN	32
+#define CHUNKED_CHUNK_LEN	16
+
+/* The uncompressed size of each chunk written */
+#ifndef CHUNKED_CHUNK_SIZE
+#define CHUNKED_CHUNK_SIZE	(1024 * 1024)
+#endif
+
+/* The most threads to (de)compress chunks with, 0 is one per CPU */
+#ifndef CHUNKED_THREADS
+#define CHUNKED_THREADS		0
+#endif
+
+/* The chunks to decode ahead of the reader per thread */
+#define CHUNKED_AHEAD		2
+
+/* The file types in the index */
+typedef enum {
+	chunked_regular,
+	chunked_symlink,
+	chunked_hardlink,
+	chunked_dir
+} chunked_type;
+
+typedef enum {
+	chunk_unread,
+	chunk_decoding,
+	chunk_done,
+	chunk_failed
+} chunk_state;
+
+struct pkg_chunked_entry {
+	const char	*name;
+	const char	*link;		/* The target of a symlink or hardlink */
+	uint64_t	 offset;	/* Of the data in the uncompressed chunks */
+	uint64_t	 size;
+	mode_t		 mode;
+	chunked_type	 type;
+};
+
+struct pkg_chunked {
+	FILE		*fd;
+	off_t		 base;		/* Where the package starts in fd */
+	char		*header;	/* Everything before the first chunk */
+	const char	*manifest;
+	uint64_t	 manifest_len;
+	uint64_t	 data_len;
+	uint32_t	 chunk_size;
+	unsigned int	 threads;
+
+	struct pkg_chunked_entry *entries;
+	unsigned int	 entry_count;
+	unsigned int	 control_count;	/* The leading + files */
+	unsigned int	 next;		/* Returned by pkg_chunked_next_file */
+
+	const char	*chunk_table;
+	char		**chunks;	/* Decoded chunks or NULL */
+	chunk_state	*state;
+	unsigned int	 chunk_count;
+	unsigned int	 chunk_low;	/* Chunks before this are freed */
+
+	struct pkgfile	**control;	/* Control files, +CONTENTS first */
+
+	/*
+	 * When reading in order a pool of threads decodes the chunks
+	 * from ahead up to limit while the reader uses those before them.
+	 */
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 queued;	/* limit was raised */
+	pthread_cond_t	 decoded;	/* A chunk was decoded */
+	pthread_t	*pool;
+	unsigned int	 pool_count;
+	unsigned int	 ahead;
+	unsigned int	 limit;
+	int		 stop;
+};
+
+/* A pass over a set of chunks to write that may be split between threads */
+struct chunked_work {
+	pthread_mutex_t	 lock;
+	unsigned int	 next;
+	unsigned int	 count;
+	int		 error;
+	int		(*func)(struct chunked_work *, unsigned int);
+
+	struct pkg_chunked_entry *entries;
+	unsigned int	 entry_count;
+	const char	**data;
+	uint64_t	 data_len;
+	unsigned int	 first;
+	char		**out;
+	uLongf		*out_len;
+};
+
+static unsigned int	 chunked_threads(void);
+static int		 chunked_run(struct chunked_work *, unsigned int);
+static void		*chunked_thread(void *);
+static void		 chunked_start_pool(struct pkg_chunked *);
+static void		*chunked_pool_thread(void *);
+static void		 chunked_read_ahead(struct pkg_chunked *, unsigned int);
+static const char	*chunked_get_chunk(struct pkg_chunked *, unsigned int);
+static void		 chunked_drop_chunk(struct pkg_chunked *, unsigned int);
+static char		*chunked_decode(struct pkg_chunked *, unsigned int);
+static int		 chunked_encode_one(struct chunked_work *,
+				unsigned int);
+static struct pkgfile	*chunked_get_file(struct pkg_chunked *,
+				unsigned int, int);
+static uint32_t		 chunked_chunk_len(uint64_t, uint32_t, unsigned int,
+				unsigned int);
+
+/**
+ * @defgroup PackageChunked Chunked packages
+ * @ingroup Package
+ * @brief A package format that can be read in any order
+ *
+ * A chunked package starts with an uncompressed header holding the
+ * +CONTENTS manifest and an index of the files. The data of the files
+ * follows, joined together then split into chunks that are each
+ * compressed with zlib on their own. This lets the manifest be read
+ * without reading any chunks, a file be read by decompressing only the
+ * chunks it is in, and the chunks be decompressed on more than one CPU.
+ *
+ * All numbers are big endian. The header is:
+ *  - 8 bytes of magic, "LIBPKGC1"
+ *  - The uncompressed chunk size, file count, chunk count and a CRC32
+ *    of the header with the CRC as 0, as 32 bit numbers
+ *  - The manifest length, string table length, total data length and
+ *    offset of the first chunk, as 64 bit numbers
+ *  - The manifest
+ *  - For each file it's data offset and size as 64 bit numbers then
+ *    it's name and link target offsets in the string table, mode and
+ *    type as 32 bit numbers. A missing link target is 0xffffffff.
+ *  - The string table of nul terminated strings
+ *  - For each chunk it's offset as a 64 bit number then it's
+ *    compressed length and a CRC32 of the compressed data as 32 bit
+ *    numbers
+ *
+ * Control files, those starting with a +, are before any other files.
+ *
+ * @{
+ */
+
+/**
+ * @brief Writes a chunked package
+ * @param fd The file to write to. It must be seekable as the header is
+ *     written again after the chunks.
+ * @param manifest The package's manifest
+ * @param files A NULL terminated list of the files in the package,
+ *     including any control files other than +CONTENTS
+ *
+ * The chunks are compressed on one thread per CPU.
+ * @return  0 on success
+ * @return -1 on error
+ */
+int
+pkg_chunked_write(FILE *fd, struct pkg_manifest *manifest,
+		struct pkgfile **files)
+{
+	struct pkgfile *contents, **order;
+	struct pkg_chunked_entry *entries;
+	struct chunked_work work;
+	const char **data, *manifest_data;
+	char *header, *strings, *entry, *chunk, **out;
+	uLongf *out_len;
+	uint64_t manifest_len, strings_len, data_len, offset, header_len;
+	unsigned int count, pos, i, chunk_count, batch, threads;
+	off_t base;
+	int ret;
+
+	if (fd == NULL || manifest == NULL || files == NULL)
+		return -1;
+
+	contents = pkg_manifest_get_file(manifest);
+	manifest_data = pkgfile_get_data(contents);
+	manifest_len = pkgfile_get_size(contents);
+	if (manifest_data == NULL)
+		return -1;
+
+	for (count = 0; files[count] != NULL; count++)
+		continue;
+
+	entries = calloc(count + 1, sizeof(struct pkg_chunked_entry));
+	data = calloc(count + 1, sizeof(const char *));
+	order = calloc(count + 1, sizeof(struct pkgfile *));
+	if (entries == NULL || data == NULL || order == NULL) {
+		free(order);
+		free(data);
+		free(entries);
+		return -1;
+	}
+
+	/* Put the control files first so they can be found quickly */
+	pos = 0;
+	for (i = 0; i < count; i++) {
+		if (files[i]->name[0] == '+' &&
+		    strcmp(files[i]->name, "+CONTENTS") != 0)
+			order[pos++] = files[i];
+	}
+	for (i = 0; i < count; i++) {
+		if (files[i]->name[0] != '+')
+			order[pos++] = files[i];
+	}
+	count = pos;
+
+	/* Find the size of everything */
+	strings_len = 0;
+	data_len = 0;
+	for (pos = 0; pos < count; pos++) {
+		struct pkgfile *file = order[pos];
+		uint64_t size;
+
+		size = pkgfile_get_size(file);
+		data[pos] = pkgfile_get_data(file);
+		entries[pos].name = file->name;
+		entries[pos].link = NULL;
+		entries[pos].mode = file->mode;
+		entries[pos].offset = data_len;
+		entries[pos].size = 0;
+		switch (file->type) {
+		case pkgfile_regular:
+			entries[pos].type = chunked_regular;
+			entries[pos].size = size;
+			data_len += size;
+			break;
+		case pkgfile_symlink:
+			entries[pos].type = chunked_symlink;
+			entries[pos].link = data[pos];
+			break;
+		case pkgfile_hardlink:
+			entries[pos].type = chunked_hardlink;
+			entries[pos].link = data[pos];
+			break;
+		case pkgfile_dir:
+			entries[pos].type = chunked_dir;
+			break;
+		case pkgfile_none:
+			free(order);
+			free(data);
+			free(entries);
+			return -1;
+		}
+		if (data[pos] == NULL && (entries[pos].type != chunked_dir &&
+		    (entries[pos].type != chunked_regular || size > 0))) {
+			free(order);
+			free(data);
+			free(entries);
+			return -1;
+		}
+		strings_len += strlen(entries[pos].name) + 1;
+		if (entries[pos].link != NULL)
+			strings_len += strlen(entries[pos].link) + 1;
+	}
+
+	chunk_count = (data_len + CHUNKED_CHUNK_SIZE - 1) / CHUNKED_CHUNK_SIZE;
+	header_len = CHUNKED_HEADER_LEN + manifest_len +
+	    (uint64_t)count * CHUNKED_ENTRY_LEN + strings_len +
+	    (uint64_t)chunk_count * CHUNKED_CHUNK_LEN;
+	header = calloc(1, header_len);
+	if (header == NULL) {
+		free(order);
+		free(data);
+		free(entries);
+		return -1;
+	}
+
+	memcpy(header, CHUNKED_MAGIC, CHUNKED_MAGIC_LEN);
+	be32enc(header + 8, CHUNKED_CHUNK_SIZE);
+	be32enc(header + 12, count);
+	be32enc(header + 16, chunk_count);
+	be64enc(header + 24, manifest_len);
+	be64enc(header + 32, strings_len);
+	be64enc(header + 40, data_len);
+	be64enc(header + 48, header_len);
+	memcpy(header + CHUNKED_HEADER_LEN, manifest_data, manifest_len);
+
+	entry = header + CHUNKED_HEADER_LEN + manifest_len;
+	strings = entry + count * CHUNKED_ENTRY_LEN;
+	offset = 0;
+	for (pos = 0; pos < count; pos++, entry += CHUNKED_ENTRY_LEN) {
+		be64enc(entry, entries[pos].offset);
+		be64enc(entry + 8, entries[pos].size);
+		be32enc(entry + 16, offset);
+		strcpy(strings + offset, entries[pos].name);
+		offset += strlen(entries[pos].name) + 1;
+		if (entries[pos].link != NULL) {
+			be32enc(entry + 20, offset);
+			strcpy(strings + offset, entries[pos].link);
+			offset += strlen(entries[pos].link) + 1;
+		} else {
+			be32enc(entry + 20, 0xffffffff);
+		}
+		be32enc(entry + 24, entries[pos].mode);
+		be32enc(entry + 28, entries[pos].type);
+	}
+
+	/* Write the header now to find where the chunks start */
+	ret = -1;
+	base = ftello(fd);
+	out = NULL;
+	out_len = NULL;
+	if (base == -1 || fwrite(header, header_len, 1, fd) != 1)
+		goto done;
+
+	/* Compress a few chunks per thread at a time then write them */
+	threads = chunked_threads();
+	batch = threads * CHUNKED_AHEAD;
+	out = calloc(batch, sizeof(char *));
+	out_len = calloc(batch, sizeof(uLongf));
+	if (out == NULL || out_len == NULL)
+		goto done;
+
+	work.entries = entries;
+	work.entry_count = count;
+	work.data = data;
+	work.data_len = data_len;
+	work.out = out;
+	work.out_len = out_len;
+	work.func = chunked_encode_one;
+	chunk = strings + strings_len;
+	offset = header_len;
+	for (pos = 0; pos < chunk_count; pos += batch) {
+		work.first = pos;
+		work.count = (chunk_count - pos < batch ? chunk_count - pos :
+		    batch);
+		if (chunked_run(&work, threads) != 0)
+			goto done;
+
+		for (i = 0; i < work.count; i++) {
+			if (fwrite(out[i], out_len[i], 1, fd) != 1)
+				goto done;
+			be64enc(chunk, offset);
+			be32enc(chunk + 8, out_len[i]);
+			be32enc(chunk + 12, crc32(0, (Bytef *)out[i],
+			    out_len[i]));
+			chunk += CHUNKED_CHUNK_LEN;
+			offset += out_len[i];
+			free(out[i]);
+			out[i] = NULL;
+		}
+	}
+
+	/* Write the header again with the chunk table and CRC */
+	be32enc(header + 20, crc32(0, (Bytef *)header, header_len));
+	if (fseeko(fd, base, SEEK_SET) != 0 ||
+	    fwrite(header, header_len, 1, fd) != 1 ||
+	    fseeko(fd, base + offset, SEEK_SET) != 0 || fflush(fd) != 0)
+		goto done;
+
+	ret = 0;
+done:
+	if (out != NULL) {
+		for (i = 0; i < batch; i++)
+			free(out[i]);
+	}
+	free(out);
+	free(out_len);
+	free(header);
+	free(order);
+	free(data);
+	free(entries);
+
+	return ret;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup PackageChunkedInternal Internal chunked package functions
+ * @ingroup PackageChunked
+ *
+ * @{
+ */
+
+/**
+ * @brief Reads the header of a chunked package
+ * @param fd The file the package is in. It is closed by
+ *     pkg_chunked_free() if this succeeds.
+ *
+ * No chunks are read. The file must be seekable as they are read
+ * with pread(2).
+ * @return A new pkg_chunked object or NULL if fd isn't a chunked package
+ */
+struct pkg_chunked *
+pkg_chunked_open(FILE *fd)
+{
+	struct pkg_chunked *chunked;
+	struct stat sb;
+	char head[CHUNKED_HEADER_LEN];
+	const char *entry, *strings;
+	uint64_t strings_len, header_len, chunk_end;
+	uint32_t crc, name, link;
+	unsigned int pos;
+
+	if (fd == NULL)
+		return NULL;
+
+	chunked = calloc(1, sizeof(struct pkg_chunked));
+	if (chunked == NULL)
+		return NULL;
+	chunked->base = ftello(fd);
+	if (chunked->base == -1 || fstat(fileno(fd), &sb) != 0 ||
+	    pread(fileno(fd), head, sizeof(head), chunked->base) !=
+	    sizeof(head) || memcmp(head, CHUNKED_MAGIC, CHUNKED_MAGIC_LEN) != 0)
+		goto bad;
+
+	chunked->chunk_size = be32dec(head + 8);
+	chunked->entry_count = be32dec(head + 12);
+	chunked->chunk_count = be32dec(head + 16);
+	crc = be32dec(head + 20);
+	chunked->manifest_len = be64dec(head + 24);
+	strings_len = be64dec(head + 32);
+	chunked->data_len = be64dec(head + 40);
+	header_len = be64dec(head + 48);
+
+	/* Check the sizes add up before reading the rest */
+	if (chunked->chunk_size == 0 ||
+	    header_len > (uint64_t)(sb.st_size - chunked->base) ||
+	    chunked->manifest_len > header_len || strings_len > header_len ||
+	    chunked->entry_count > header_len / CHUNKED_ENTRY_LEN ||
+	    chunked->chunk_count > header_len / CHUNKED_CHUNK_LEN ||
+	    header_len != CHUNKED_HEADER_LEN + chunked->manifest_len +
+	    (uint64_t)chunked->entry_count * CHUNKED_ENTRY_LEN + strings_len +
+	    (uint64_t)chunked->chunk_count * CHUNKED_CHUNK_LEN ||
+	    chunked->chunk_count != (chunked->data_len +
+	    chunked->chunk_size - 1) / chunked->chunk_size)
+		goto bad;
+
+	chunked->header = malloc(header_len);
+	if (chunked->header == NULL ||
+	    pread(fileno(fd), chunked->header, header_len, chunked->base) !=
+	    (ssize_t)header_len)
+		goto bad;
+	be32enc(chunked->header + 20, 0);
+	if (crc32(0, (Bytef *)chunked->header, header_len) != crc)
+		goto bad;
+
+	chunked->manifest = chunked->header + CHUNKED_HEADER_LEN;
+	entry = chunked->manifest + chunked->manifest_len;
+	strings = entry + chunked->entry_count * CHUNKED_ENTRY_LEN;
+	chunked->chunk_table = strings + strings_len;
+	if (strings_len > 0 && strings[strings_len - 1] != '\0')
+		goto bad;
+
+	chunked->entries = calloc(chunked->entry_count + 1,
+	    sizeof(struct pkg_chunked_entry));
+	chunked->chunks = calloc(chunked->chunk_count + 1, sizeof(char *));
+	chunked->state = calloc(chunked->chunk_count + 1,
+	    sizeof(chunk_state));
+	if (chunked->entries == NULL || chunked->chunks == NULL ||
+	    chunked->state == NULL)
+		goto bad;
+
+	for (pos = 0; pos < chunked->entry_count;
+	    pos++, entry += CHUNKED_ENTRY_LEN) {
+		struct pkg_chunked_entry *e = &chunked->entries[pos];
+
+		e->offset = be64dec(entry);
+		e->size = be64dec(entry + 8);
+		name = be32dec(entry + 16);
+		link = be32dec(entry + 20);
+		e->mode = be32dec(entry + 24) & ALLPERMS;
+		e->type = be32dec(entry + 28);
+		if (name >= strings_len || e->type > chunked_dir ||
+		    e->offset > chunked->data_len ||
+		    e->size > chunked->data_len - e->offset)
+			goto bad;
+		e->name = strings + name;
+		if (link != 0xffffffff) {
+			if (link >= strings_len)
+				goto bad;
+			e->link = strings + link;
+		} else if (e->type == chunked_symlink ||
+		    e->type == chunked_hardlink) {
+			goto bad;
+		}
+	}
+
+	/* Check the chunks are in the file */
+	for (pos = 0; pos < chunked->chunk_count; pos++) {
+		const char *chunk = chunked->chunk_table +
+		    pos * CHUNKED_CHUNK_LEN;
+
+		chunk_end = be64dec(chunk) + be32dec(chunk + 8);
+		if (be64dec(chunk) < header_len || chunk_end < header_len ||
+		    chunk_end > (uint64_t)sb.st_size - chunked->base)
+			goto bad;
+	}
+
+	while (chunked->control_count < chunked->entry_count &&
+	    chunked->entries[chunked->control_count].name[0] == '+')
+		chunked->control_count++;
+	chunked->next = chunked->control_count;
+	chunked->threads = chunked_threads();
+
+	if (pthread_mutex_init(&chunked->lock, NULL) != 0)
+		goto bad;
+	if (pthread_cond_init(&chunked->queued, NULL) != 0) {
+		pthread_mutex_destroy(&chunked->lock);
+		goto bad;
+	}
+	if (pthread_cond_init(&chunked->decoded, NULL) != 0) {
+		pthread_cond_destroy(&chunked->queued);
+		pthread_mutex_destroy(&chunked->lock);
+		goto bad;
+	}
+	chunked->fd = fd;
+
+	return chunked;
+
+bad:
+	free(chunked->state);
+	free(chunked->chunks);
+	free(chunked->entries);
+	free(chunked->header);
+	free(chunked);
+	return NULL;
+}
+
+/**
+ * @brief Gets a control file from a chunked package
+ *
+ * +CONTENTS is taken from the header. Other control files are read
+ * by decompressing only the chunks they are in.
+ * @param name The name of the file without any directory
+ * @return The file, owned by the package, or NULL
+ */
+struct pkgfile *
+pkg_chunked_get_control(struct pkg_chunked *chunked, const char *name)
+{
+	struct pkgfile **control;
+	const char *entry_name;
+	unsigned int pos;
+
+	assert(chunked != NULL);
+	assert(name != NULL);
+
+	if (chunked->control == NULL) {
+		chunked->control = calloc(chunked->control_count + 2,
+		    sizeof(struct pkgfile *));
+		if (chunked->control == NULL)
+			return NULL;
+	}
+	control = chunked->control;
+
+	if (strcmp(name, "+CONTENTS") == 0) {
+		if (control[0] == NULL)
+			control[0] = pkgfile_new_regular("+CONTENTS",
+			    chunked->manifest, chunked->manifest_len);
+		return control[0];
+	}
+
+	for (pos = 0; pos < chunked->control_count; pos++) {
+		entry_name = strrchr(chunked->entries[pos].name, '/');
+		entry_name = (entry_name == NULL ? chunked->entries[pos].name :
+		    entry_name + 1);
+		if (strcmp(entry_name, name) != 0)
+			continue;
+
+		if (control[pos + 1] == NULL)
+			control[pos + 1] = chunked_get_file(chunked, pos, 0);
+		return control[pos + 1];
+	}
+	return NULL;
+}
+
+/**
+ * @brief Gets all the control files from a chunked package
+ * @return A NULL terminated list of files owned by the package or NULL
+ */
+struct pkgfile **
+pkg_chunked_get_controls(struct pkg_chunked *chunked)
+{
+	unsigned int pos;
+
+	assert(chunked != NULL);
+
+	if (pkg_chunked_get_control(chunked, "+CONTENTS") == NULL)
+		return NULL;
+	for (pos = 0; pos < chunked->control_count; pos++) {
+		if (chunked->control[pos + 1] == NULL)
+			chunked->control[pos + 1] =
+			    chunked_get_file(chunked, pos, 0);
+		if (chunked->control[pos + 1] == NULL)
+			return NULL;
+	}
+	return chunked->control;
+}
+
+/**
+ * @brief Gets the next file that isn't a control file
+ *
+ * A pool of threads, one per CPU, keeps decompressing the chunks after
+ * the file that is returned while the caller uses it. Chunks are freed
+ * once every file in them has been read.
+ * @return A file the caller frees or NULL after the last file
+ */
+struct pkgfile *
+pkg_chunked_next_file(struct pkg_chunked *chunked)
+{
+	assert(chunked != NULL);
+
+	if (chunked->next >= chunked->entry_count)
+		return NULL;
+	return chunked_get_file(chunked, chunked->next++, 1);
+}
+
+/**
+ * @brief Stops pkg_chunked_free() closing a chunked package's file
+ *
+ * This is used when a package can't be created from the file so the
+ * file is given back to the caller of pkg_chunked_open().
+ */
+void
+pkg_chunked_detach(struct pkg_chunked *chunked)
+{
+	assert(chunked != NULL);
+
+	chunked->fd = NULL;
+}
+
+/**
+ * @brief Frees a chunked package and closes it's file
+ */
+void
+pkg_chunked_free(struct pkg_chunked *chunked)
+{
+	unsigned int pos;
+
+	if (chunked == NULL)
+		return;
+
+	/* Stop the pool before the chunks and file it uses are freed */
+	pthread_mutex_lock(&chunked->lock);
+	chunked->stop = 1;
+	pthread_cond_broadcast(&chunked->queued);
+	pthread_mutex_unlock(&chunked->lock);
+	for (pos = 0; pos < chunked->pool_count; pos++)
+		pthread_join(chunked->pool[pos], NULL);
+	free(chunked->pool);
+	pthread_cond_destroy(&chunked->decoded);
+	pthread_cond_destroy(&chunked->queued);
+	pthread_mutex_destroy(&chunked->lock);
+
+	if (chunked->control != NULL) {
+		for (pos = 0; pos < chunked->control_count + 1; pos++)
+			pkgfile_free(chunked->control[pos]);
+		free(chunked->control);
+	}
+	for (pos = 0; pos < chunked->chunk_count; pos++)
+		free(chunked->chunks[pos]);
+	free(chunked->chunks);
+	free(chunked->state);
+	free(chunked->entries);
+	free(chunked->header);
+	if (chunked->fd != NULL)
+		fclose(chunked->fd);
+	free(chunked);
+}
+
+/**
+ * @brief Creates a pkgfile from an entry in the index
+ * @param sequential Set when the files are being read in order, the
+ *     pool decompresses the chunks after the file while the caller uses
+ *     it and those before it are freed.
+ * @return A file the caller frees or NULL
+ */
+static struct pkgfile *
+chunked_get_file(struct pkg_chunked *chunked, unsigned int pos, int sequential)
+{
+	struct pkg_chunked_entry *entry;
+	struct pkgfile *file;
+	const char *chunk;
+	char *data;
+	uint64_t start, done, len;
+	unsigned int first, last, cur;
+
+	assert(chunked != NULL);
+	assert(pos < chunked->entry_count);
+
+	entry = &chunked->entries[pos];
+	file = NULL;
+	switch (entry->type) {
+	case chunked_symlink:
+		file = pkgfile_new_symlink(entry->name, entry->link);
+		break;
+	case chunked_hardlink:
+		file = pkgfile_new_hardlink(entry->name, entry->link);
+		break;
+	case chunked_dir:
+		file = pkgfile_new_directory(entry->name);
+		break;
+	case chunked_regular:
+		if (entry->size == 0) {
+			file = pkgfile_new_regular(entry->name, NULL, 0);
+			break;
+		}
+		data = malloc(entry->size + 1);
+		if (data == NULL)
+			return NULL;
+
+		first = entry->offset / chunked->chunk_size;
+		last = (entry->offset + entry->size - 1) / chunked->chunk_size;
+		if (sequential) {
+			for (; chunked->chunk_low < first; chunked->chunk_low++)
+				chunked_drop_chunk(chunked, chunked->chunk_low);
+			chunked_start_pool(chunked);
+		}
+
+		done = 0;
+		for (cur = first; cur <= last; cur++) {
+			if (sequential)
+				chunked_read_ahead(chunked, cur);
+			chunk = chunked_get_chunk(chunked, cur);
+			if (chunk == NULL) {
+				free(data);
+				return NULL;
+			}
+			start = (uint64_t)cur * chunked->chunk_size;
+			if (start < entry->offset)
+				start = entry->offset;
+			len = (uint64_t)(cur + 1) * chunked->chunk_size;
+			if (len > entry->offset + entry->size)
+				len = entry->offset + entry->size;
+			len -= start;
+			memcpy(data + done,
+			    chunk + (start % chunked->chunk_size), len);
+			done += len;
+
+			/* The last chunk may have the next file */
+			if (cur != last)
+				chunked_drop_chunk(chunked, cur);
+		}
+		data[entry->size] = '\0';
+		file = pkgfile_new_regular_owned(entry->name, data,
+		    entry->size);
+		break;
+	}
+	if (file != NULL)
+		pkgfile_set_mode(file, entry->mode);
+	return file;
+}
+
+/**
+ * @brief Starts the threads that decode chunks ahead of the reader
+ *
+ * If they can't be started the reader decodes every chunk itself.
+ */
+static void
+chunked_start_pool(struct pkg_chunked *chunked)
+{
+
+	assert(chunked != NULL);
+
+	if (chunked->pool != NULL || chunked->chunk_count < 2)
+		return;
+	chunked->pool = malloc(chunked->threads * sizeof(pthread_t));
+	if (chunked->pool == NULL)
+		return;
+	for (; chunked->pool_count < chunked->threads;
+	    chunked->pool_count++) {
+		if (pthread_create(&chunked->pool[chunked->pool_count], NULL,
+		    chunked_pool_thread, chunked) != 0)
+			break;
+	}
+}
+
+/**
+ * @brief Decodes the chunks below limit until the package is freed
+ */
+static void *
+chunked_pool_thread(void *data)
+{
+	struct pkg_chunked *chunked = data;
+	unsigned int index;
+	char *out;
+
+	pthread_mutex_lock(&chunked->lock);
+	for (;;) {
+		/* Skip chunks the reader has decoded or is decoding */
+		while (chunked->ahead < chunked->limit &&
+		    chunked->state[chunked->ahead] != chunk_unread)
+			chunked->ahead++;
+		if (chunked->stop)
+			break;
+		if (chunked->ahead >= chunked->limit) {
+			pthread_cond_wait(&chunked->queued, &chunked->lock);
+			continue;
+		}
+
+		index = chunked->ahead++;
+		chunked->state[index] = chunk_decoding;
+		pthread_mutex_unlock(&chunked->lock);
+		out = chunked_decode(chunked, index);
+		pthread_mutex_lock(&chunked->lock);
+		chunked->chunks[index] = out;
+		chunked->state[index] = (out != NULL ? chunk_done :
+		    chunk_failed);
+		pthread_cond_broadcast(&chunked->decoded);
+	}
+	pthread_mutex_unlock(&chunked->lock);
+	return NULL;
+}
+
+/**
+ * @brief Has the pool decode the chunks after the one being read
+ */
+static void
+chunked_read_ahead(struct pkg_chunked *chunked, unsigned int cur)
+{
+	unsigned int limit;
+
+	assert(chunked != NULL);
+
+	if (chunked->pool_count == 0)
+		return;
+
+	limit = cur + 1 + chunked->threads * CHUNKED_AHEAD;
+	if (limit > chunked->chunk_count)
+		limit = chunked->chunk_count;
+	pthread_mutex_lock(&chunked->lock);
+	if (chunked->ahead < cur)
+		chunked->ahead = cur;
+	if (limit > chunked->limit) {
+		chunked->limit = limit;
+		pthread_cond_broadcast(&chunked->queued);
+	}
+	pthread_mutex_unlock(&chunked->lock);
+}
+
+/**
+ * @brief Gets a decompressed chunk
+ *
+ * If the pool hasn't started on the chunk it is decoded on this thread,
+ * otherwise this waits for the pool to finish it.
+ * @return The chunk, owned by the package, or NULL if it is bad
+ */
+static const char *
+chunked_get_chunk(struct pkg_chunked *chunked, unsigned int index)
+{
+	const char *chunk;
+	char *out;
+
+	assert(chunked != NULL);
+	assert(index < chunked->chunk_count);
+
+	pthread_mutex_lock(&chunked->lock);
+	if (chunked->state[index] == chunk_unread) {
+		chunked->state[index] = chunk_decoding;
+		pthread_mutex_unlock(&chunked->lock);
+		out = chunked_decode(chunked, index);
+		pthread_mutex_lock(&chunked->lock);
+		chunked->chunks[index] = out;
+		chunked->state[index] = (out != NULL ? chunk_done :
+		    chunk_failed);
+		pthread_cond_broadcast(&chunked->decoded);
+	}
+	while (chunked->state[index] == chunk_decoding)
+		pthread_cond_wait(&chunked->decoded, &chunked->lock);
+	chunk = chunked->chunks[index];
+	pthread_mutex_unlock(&chunked->lock);
+	return chunk;
+}
+
+/**
+ * @brief Frees a decompressed chunk the reader has finished with
+ *
+ * The pool won't decode it again. A chunk still being decoded is
+ * freed with the package.
+ */
+static void
+chunked_drop_chunk(struct pkg_chunked *chunked, unsigned int index)
+{
+
+	assert(chunked != NULL);
+	assert(index < chunked->chunk_count);
+
+	pthread_mutex_lock(&chunked->lock);
+	if (chunked->state[index] == chunk_done) {
+		free(chunked->chunks[index]);
+		chunked->chunks[index] = NULL;
+		chunked->state[index] = chunk_unread;
+	}
+	if (chunked->ahead <= index)
+		chunked->ahead = index + 1;
+	pthread_mutex_unlock(&chunked->lock);
+}
+
+/**
+ * @brief Decompresses and checks a chunk
+ * @return The chunk or NULL if it is bad
+ */
+static char *
+chunked_decode(struct pkg_chunked *chunked, unsigned int index)
+{
+	const char *chunk;
+	char *in, *out;
+	uLongf out_len;
+	uint32_t in_len, len;
+
+	chunk = chunked->chunk_table + index * CHUNKED_CHUNK_LEN;
+	in_len = be32dec(chunk + 8);
+	len = chunked_chunk_len(chunked->data_len, chunked->chunk_size,
+	    chunked->chunk_count, index);
+
+	in = malloc(in_len);
+	out = malloc(len);
+	if (in == NULL || out == NULL) {
+		free(out);
+		free(in);
+		return NULL;
+	}
+	if (pread(fileno(chunked->fd), in, in_len,
+	    chunked->base + be64dec(chunk)) != (ssize_t)in_len ||
+	    crc32(0, (Bytef *)in, in_len) != be32dec(chunk + 12)) {
+		free(out);
+		free(in);
+		return NULL;
+	}
+
+	out_len = len;
+	if (uncompress((Bytef *)out, &out_len, (Bytef *)in, in_len) != Z_OK ||
+	    out_len != len) {
+		free(out);
+		free(in);
+		return NULL;
+	}
+	free(in);
+	return out;
+}
+
+/**
+ * @brief Compresses a chunk from the data of the files that are in it
+ */
+static int
+chunked_encode_one(struct chunked_work *work, unsigned int pos)
+{
+	struct pkg_chunked_entry *entry;
+	char *in;
+	uint64_t start, end, from, to;
+	uint32_t len;
+	unsigned int index, lo, hi, mid;
+
+	index = work->first + pos;
+	len = chunked_chunk_len(work->data_len, CHUNKED_CHUNK_SIZE,
+	    (work->data_len + CHUNKED_CHUNK_SIZE - 1) / CHUNKED_CHUNK_SIZE,
+	    index);
+	start = (uint64_t)index * CHUNKED_CHUNK_SIZE;
+	end = start + len;
+
+	in = malloc(len);
+	work->out_len[pos] = compressBound(len);
+	work->out[pos] = malloc(work->out_len[pos]);
+	if (in == NULL || work->out[pos] == NULL) {
+		free(in);
+		return -1;
+	}
+
+	/* Find the last file starting at or before the chunk */
+	lo = 0;
+	hi = work->entry_count;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (work->entries[mid].offset <= start)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	/* Copy from each file in the chunk */
+	for (; lo < work->entry_count && work->entries[lo].offset < end;
+	    lo++) {
+		entry = &work->entries[lo];
+		if (entry->type != chunked_regular || entry->size == 0 ||
+		    entry->offset + entry->size <= start)
+			continue;
+		from = (entry->offset > start ? entry->offset : start);
+		to = entry->offset + entry->size;
+		if (to > end)
+			to = end;
+		memcpy(in + (from - start), work->data[lo] +
+		    (from - entry->offset), to - from);
+	}
+
+	if (compress2((Bytef *)work->out[pos], &work->out_len[pos],
+	    (Bytef *)in, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		free(in);
+		return -1;
+	}
+	free(in);
+	return 0;
+}
+
+/**
+ * @brief Calls work->func for each item in work on up to threads threads
+ * @return  0 on success
+ * @return -1 if any call failed
+ */
+static int
+chunked_run(struct chunked_work *work, unsigned int threads)
+{
+	pthread_t *tids;
+	unsigned int pos, started;
+
+	assert(work != NULL);
+	assert(threads > 0);
+
+	work->next = 0;
+	work->error = 0;
+	if (threads > work->count)
+		threads = work->count;
+	tids = malloc(threads * sizeof(pthread_t));
+	if (tids == NULL)
+		return -1;
+	if (pthread_mutex_init(&work->lock, NULL) != 0) {
+		free(tids);
+		return -1;
+	}
+
+	/* This thread is one of them */
+	for (started = 0; started + 1 < threads; started++) {
+		if (pthread_create(&tids[started], NULL, chunked_thread,
+		    work) != 0)
+			break;
+	}
+	chunked_thread(work);
+	for (pos = 0; pos < started; pos++)
+		pthread_join(tids[pos], NULL);
+	free(tids);
+
+	pthread_mutex_destroy(&work->lock);
+	return work->error;
+}
+
+/**
+ * @brief Takes items from a chunked_work until there are none left
+ */
+static void *
+chunked_thread(void *data)
+{
+	struct chunked_work *work = data;
+	unsigned int pos;
+
+	for (;;) {
+		pthread_mutex_lock(&work->lock);
+		pos = work->next++;
+		pthread_mutex_unlock(&work->lock);
+		if (pos >= work->count)
+			break;
+
+		if (work->func(work, pos) != 0) {
+			pthread_mutex_lock(&work->lock);
+			work->error = -1;
+			pthread_mutex_unlock(&work->lock);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Gets the number of threads to (de)compress with
+ */
+static unsigned int
+chunked_threads(void)
+{
+	long cpus;
+
+	if (CHUNKED_THREADS > 0)
+		return CHUNKED_THREADS;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0 ? cpus : 1);
+}
+
+/**
+ * @brief Gets the uncompressed size of a chunk, all but the last are full
+ */
+static uint32_t
+chunked_chunk_len(uint64_t data_len, uint32_t chunk_size,
+		unsigned int chunk_count, unsigned int index)
+{
+
+	assert(index < chunk_count);
+	if (index + 1 < chunk_count)
+		return chunk_size;
+	return data_len - (uint64_t)index * chunk_size;
+}
+
+/**
+ * @}
+ */
@@ -25,6 +25,9 @@
  *
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -344,12 +347,27 @@ pkg_match_by_origin(struct pkg *pkg, const void *origin)
  * @brief Matches all packages by file.
  * @param pkg The package to attempt to match
  * @param filename The file to match
- * @return 0 if the package origin is the same as origin, otherwise non zero
+ *
+ * The file is looked up in the package's manifest then checked to be
+ * on disk, as it was when each of the package's files was opened.
+ * @return 0 if the package installed filename and it exists,
+ *     otherwise non zero
  */
 int
 pkg_match_by_file(struct pkg *pkg, const void *filename)
 {
+	struct pkg_manifest *manifest;
 	struct pkgfile *file;
+	struct stat sb;
+
+	/* Look in the manifest's path table rather than read each file */
+	manifest = pkg_get_manifest(pkg);
+	if (manifest != NULL) {
+		if (pkg_manifest_find_path(manifest,
+		    (const char *)filename) == -1)
+			return -1;
+		return (lstat((const char *)filename, &sb) == 0 ? 0 : -1);
+	}
 
 	file = pkg_get_next_file(pkg);
 	while (file != NULL) {
@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "pkg_db.h"
@@ -45,6 +46,15 @@
 
 #define DB_LOCATION	"/var/db/pkg"
 
+/* The number of threads used to write a package's files */
+#define INSTALL_THREADS	4
+
+/* A directory opened by freebsd_do_chdir() */
+struct pkg_install_dir {
+	char		*name;
+	int		 fd;
+};
+
 struct pkg_install_data {
 	int		 fake;
 	int		 empty_dirs;	/* Used in the removal of files */
@@ -52,6 +62,10 @@ struct pkg_install_data {
 	const char	*last_dir;
 	char		 last_file[FILENAME_MAX];
 	char		 directory[MAXPATHLEN];
+	int		 dirfd;		/* The open directory for directory */
+	struct pkg_install_dir *dirs;
+	unsigned int	 dir_count;
+	struct pkgfile_batch *batch;	/* Files being written */
 };
 
 /*
@@ -94,6 +108,8 @@ static int	freebsd_deregister(struct pkg *, pkg_db_action *, void *);
 /* Internal */
 static void			 freebsd_format_cmd(char *, int, const char *,
 				const char *, const char *);
+static int			 freebsd_open_dir(struct pkg_install_data *);
+static void			 freebsd_close_dirs(struct pkg_install_data *);
 
 /**
  * @defgroup PackageDBFreebsd FreeBSD Package Database handling
@@ -184,15 +200,12 @@ freebsd_install_pkg_action(struct pkg_db *db, struct pkg *pkg,
     pkg_db_action *pkg_action)
 {
 	struct pkg_install_data install_data;
-	char cwd[MAXPATHLEN];
+	int ret;
 
 	assert(db != NULL);
 	assert(pkg != NULL);
 	assert(pkg_action != NULL);
 
-	if (getwd(cwd) == NULL)
-		return -1;
-
 	/* Set the package environment */
 	if (prefix == NULL) {
 		const char *pkg_prefix = pkg_get_prefix(pkg);
@@ -210,10 +223,8 @@ freebsd_install_pkg_action(struct pkg_db *db, struct pkg *pkg,
 
 	if (!fake) {
 		/** @todo Check if the force flag is set */
-		if (pkg_run_script(pkg, prefix, pkg_script_require) != 0) {
-			chdir(cwd);
+		if (pkg_run_script(pkg, prefix, pkg_script_require) != 0)
 			return -1;
-		}
 	}
 
 	/* Run Pre-install */
@@ -229,12 +240,25 @@ freebsd_install_pkg_action(struct pkg_db *db, struct pkg *pkg,
 	install_data.last_dir = NULL;
 	install_data.last_file[0] = '\0';
 	install_data.directory[0] = '\0';
-	if (pkg_install(pkg, prefix, reg, pkg_action, &install_data,
+	install_data.dirfd = AT_FDCWD;
+	install_data.dirs = NULL;
+	install_data.dir_count = 0;
+	install_data.batch = NULL;
+	if (!fake) {
+		install_data.batch = pkgfile_batch_new(INSTALL_THREADS);
+		if (install_data.batch == NULL)
+			return -1;
+	}
+	ret = pkg_install(pkg, prefix, reg, pkg_action, &install_data,
 	    freebsd_do_chdir, freebsd_install_file, freebsd_do_exec,
-	    freebsd_register) != 0) {
-		chdir(cwd);
+	    freebsd_register);
+	/* The directories must be open until every file is written */
+	if (install_data.batch != NULL &&
+	    pkgfile_batch_free(install_data.batch) != 0)
+		ret = -1;
+	freebsd_close_dirs(&install_data);
+	if (ret != 0)
 		return -1;
-	}
 
 	/* Extract the +MTREE */
 	pkg_action(PKG_DB_INFO, "Running mtree for %s..", pkg_get_name(pkg));
@@ -251,7 +275,6 @@ freebsd_install_pkg_action(struct pkg_db *db, struct pkg *pkg,
 
 	/** @todo Display contents of \@display */
 
-	chdir(cwd);
 	return 0;
 }
 
@@ -387,6 +410,7 @@ freebsd_deinstall_pkg(struct pkg_db *db, struct pkg *the_pkg, int scripts,
 	struct pkg_install_data deinstall_data;
 	struct pkg *real_pkg;
 	struct pkg **deps;
+	int ret;
 
 	assert(db != NULL);
 	assert(the_pkg != NULL);
@@ -503,11 +527,16 @@ freebsd_deinstall_pkg(struct pkg_db *db, struct pkg *the_pkg, int scripts,
 	deinstall_data.last_dir = NULL;
 	deinstall_data.last_file[0] = '\0';
 	deinstall_data.directory[0] = '\0';
-	if (pkg_deinstall(real_pkg, pkg_action, &deinstall_data,
+	deinstall_data.dirfd = AT_FDCWD;
+	deinstall_data.dirs = NULL;
+	deinstall_data.dir_count = 0;
+	deinstall_data.batch = NULL;
+	ret = pkg_deinstall(real_pkg, pkg_action, &deinstall_data,
 	    freebsd_do_chdir, freebsd_deinstall_file,
-	    freebsd_do_exec, freebsd_deregister) != 0 && !force) {
+	    freebsd_do_exec, freebsd_deregister);
+	freebsd_close_dirs(&deinstall_data);
+	if (ret != 0 && !force)
 		return -1;
-	}
 
 	if (!fake && scripts) {
 		/** @todo Run +POST-DEINSTALL <pkg-name>/+DEINSTALL <pkg-name> POST-DEINSTALL */
@@ -535,6 +564,9 @@ freebsd_deinstall_pkg(struct pkg_db *db, struct pkg *the_pkg, int scripts,
 /**
  * @brief The db_chdir callback of pkg_install() for the FreeBSD package
  *     database
+ *
+ * The process's working directory is not changed. The directory is
+ * opened and files are accessed relative to it.
  * @return 0 on success or -1 on error
  */
 static int
@@ -578,8 +610,11 @@ freebsd_do_chdir(struct pkg *pkg, pkg_db_action *pkg_action, void *data,
 	}
 
 	if (!install_data->fake) {
-		pkg_dir_build(install_data->directory, 0);
-		return chdir(install_data->directory);
+		install_data->dirfd = freebsd_open_dir(install_data);
+		if (install_data->dirfd == -1) {
+			install_data->dirfd = AT_FDCWD;
+			return -1;
+		}
 	}
 
 	return 0;
@@ -607,8 +642,12 @@ freebsd_install_file(struct pkg *pkg, pkg_db_action *pkg_action, void *data,
 	    pkgfile_get_name(file));
 
 	pkg_action(PKG_DB_PACKAGE, "%s", pkgfile_get_name(file));
-	if (!install_data->fake)
+	if (!install_data->fake) {
+		pkgfile_set_dirfd(file, install_data->dirfd);
+		if (install_data->batch != NULL)
+			return pkgfile_batch_write(install_data->batch, file);
 		return pkgfile_write(file);
+	}
 	return 0;
 }
 
@@ -631,6 +670,7 @@ freebsd_deinstall_file(struct pkg *pkg __unused, pkg_db_action *pkg_action,
 	install_data = data;
 
 	pkgfile_set_cwd(file, install_data->directory);
+	pkgfile_set_dirfd(file, install_data->dirfd);
 	pkg_action(PKG_DB_PACKAGE, "Delete %s %s",
 	    pkgfile_get_type_string(file), pkgfile_get_name(file));
 
@@ -670,7 +710,11 @@ freebsd_do_exec(struct pkg *pkg, pkg_db_action *pkg_action, void *data,
 
 	pkg_action(PKG_DB_PACKAGE, "execute '%s'", the_cmd);
 	if (!install_data->fake) {
-		return pkg_exec(the_cmd);
+		/* The command may use any file installed before it */
+		if (install_data->batch != NULL &&
+		    pkgfile_batch_wait(install_data->batch) != 0)
+			return -1;
+		return pkg_exec_at(install_data->dirfd, "%s", the_cmd);
 	}
 
 	return 0;
@@ -689,7 +733,7 @@ freebsd_register(struct pkg *pkg, pkg_db_action *pkg_action, void *data,
 	struct pkg_install_data *install_data;
 	struct pkg_db *db;
 	struct pkg **deps;
-	char dir[PATH_MAX], *real_dir;
+	char dir[PATH_MAX], db_dir[PATH_MAX], *real_dir;
 	struct pkgfile **control;
 
 	assert(pkg != NULL);
@@ -738,12 +782,31 @@ freebsd_register(struct pkg *pkg, pkg_db_action *pkg_action, void *data,
 				file = control[pos];
 			freebsd_install_file(pkg, pkg_action_null, data, file);
 
-			/* Make the +INSTALL file executable */
+			/*
+			 * Make the +INSTALL file executable. It is in the
+			 * package's database directory, not the cwd.
+			 */
 			if (strcmp(pkgfile_get_name(control[pos]),
 			    "+INSTALL") == 0) {
-				chmod("+INSTALL", 0755);
+				if (install_data->batch != NULL)
+					pkgfile_batch_wait(install_data->batch);
+				fchmodat(install_data->dirfd, "+INSTALL", 0755,
+				    0);
 			}
 		}
+
+		/*
+		 * Cache the manifest so it needn't be parsed when the
+		 * package is next read. It is made from the +CONTENTS
+		 * on disk so all the files must be written first.
+		 */
+		if (install_data->batch != NULL)
+			pkgfile_batch_wait(install_data->batch);
+		snprintf(db_dir, sizeof(db_dir), "%s" DB_LOCATION "/%s",
+		    db->db_base, pkg_get_name(pkg));
+		pkg_remove_extra_slashes(db_dir);
+		if (pkg_get_manifest(pkg) != NULL)
+			freebsd_cache_write(pkg->pkg_manifest, db_dir);
 	}
 
 	/* Register reverse dependency */
@@ -796,7 +859,7 @@ freebsd_deregister(struct pkg *pkg, pkg_db_action *pkg_action __unused,
 	unsigned int pos;
 	struct pkg_install_data *install_data;
 	struct pkgfile *dir;
-	char db_dir[FILENAME_MAX];
+	char db_dir[FILENAME_MAX], cache[FILENAME_MAX];
 	struct pkgfile **control;
 
 	install_data = data;
@@ -826,6 +889,9 @@ freebsd_deregister(struct pkg *pkg, pkg_db_action *pkg_action __unused,
 	if (install_data->fake) {
 		return 0;
 	} else {
+		/* The manifest cache isn't a control file so remove it here */
+		snprintf(cache, FILENAME_MAX, "%s" FREEBSD_CACHE_NAME, db_dir);
+		unlink(cache);
 		return pkgfile_unlink(dir);
 	}
 }
@@ -958,6 +1024,73 @@ freebsd_format_cmd(char *buf, int max, const char *fmt, const char *dir,
 	*buf = '\0';
 }
 
+/**
+ * @brief Opens the directory in install_data->directory
+ *
+ * Each directory is only opened once during an install. Later calls
+ * with the same directory return the existing descriptor.
+ * @return The directory's file descriptor or -1 on error
+ */
+static int
+freebsd_open_dir(struct pkg_install_data *install_data)
+{
+	struct pkg_install_dir *dirs;
+	unsigned int pos;
+	int fd;
+
+	assert(install_data != NULL);
+
+	for (pos = 0; pos < install_data->dir_count; pos++) {
+		if (strcmp(install_data->dirs[pos].name,
+		    install_data->directory) == 0)
+			return install_data->dirs[pos].fd;
+	}
+
+	pkg_dir_build(install_data->directory, 0);
+	fd = open(install_data->directory, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -1;
+
+	dirs = realloc(install_data->dirs,
+	    (install_data->dir_count + 1) * sizeof(struct pkg_install_dir));
+	if (dirs == NULL) {
+		close(fd);
+		return -1;
+	}
+	install_data->dirs = dirs;
+
+	dirs[install_data->dir_count].name = strdup(install_data->directory);
+	if (dirs[install_data->dir_count].name == NULL) {
+		close(fd);
+		return -1;
+	}
+	dirs[install_data->dir_count].fd = fd;
+	install_data->dir_count++;
+
+	return fd;
+}
+
+/**
+ * @brief Closes the directories opened by freebsd_open_dir()
+ */
+static void
+freebsd_close_dirs(struct pkg_install_data *install_data)
+{
+	unsigned int pos;
+
+	assert(install_data != NULL);
+
+	for (pos = 0; pos < install_data->dir_count; pos++) {
+		close(install_data->dirs[pos].fd);
+		free(install_data->dirs[pos].name);
+	}
+	free(install_data->dirs);
+
+	install_data->dirs = NULL;
+	install_data->dir_count = 0;
+	install_data->dirfd = AT_FDCWD;
+}
+
 /**
  * @}
  */
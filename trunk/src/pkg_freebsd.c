@@ -38,9 +38,30 @@
 #include <err.h>
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Regular files at least this big are written straight from the archive
+ * rather than being read into memory first
+ */
+#ifndef FREEBSD_STREAM_MIN
+#define FREEBSD_STREAM_MIN	(1024 * 1024)
+#endif
+
+/* The first block size to read a package that can't be mapped with */
+#define FREEBSD_READ_BLOCK	(16 * 1024)
+
+/* The most threads to decode a bzip2 package with, 0 is one per CPU */
+#ifndef FREEBSD_BZIP2_THREADS
+#define FREEBSD_BZIP2_THREADS	0
+#endif
+
+/* Limits on the files a decoder thread may read ahead of the installer */
+#define FREEBSD_DECODE_FILES	64
+#define FREEBSD_DECODE_BYTES	(16 * 1024 * 1024)
+
 /* Callbacks */
 static const char	 *freebsd_get_version(struct pkg *);
 static const char	 *freebsd_get_origin(struct pkg *);
@@ -71,29 +92,78 @@ static int		  freebsd_free(struct pkg *);
 
 /* Internal functions */
 static struct freebsd_package	 *freebsd_package_new(void);
+static struct pkg		 *freebsd_package_open(struct freebsd_package *);
+static void			  freebsd_package_free(struct freebsd_package *);
+static int			  freebsd_open_archive(
+					struct freebsd_package *);
+static int			  freebsd_reopen_archive(
+					struct freebsd_package *);
+static void			  freebsd_close_archive(
+					struct freebsd_package *);
+static int			  freebsd_seek_archive(
+					struct freebsd_package *, uint64_t);
+static struct pkgfile		 *freebsd_toc_get_control(
+					struct freebsd_package *,
+					const char *);
 static int			  freebsd_open_control_files(
 					struct freebsd_package *);
 static struct pkgfile		 *freebsd_get_next_entry(struct archive *);
+static struct freebsd_decoder	 *freebsd_decoder_new(struct archive *);
+static struct pkgfile		 *freebsd_decoder_next(
+					struct freebsd_decoder *);
+static void			  freebsd_decoder_free(
+					struct freebsd_decoder *);
+static void			 *freebsd_decoder_thread(void *);
 
 typedef enum {
 	fpkg_unknown,
 	fpkg_from_file,
 	fpkg_from_installed,
-	fpkg_from_empty
+	fpkg_from_empty,
+	fpkg_from_chunked
 } freebsd_type;
 
 struct freebsd_package {
 	FILE *fd;
 	struct archive *archive;
+	char *path;		/* The archive is reopened from here when needed */
 	char *db_dir;
 	const char *version;
 	char *origin;
 	struct pkgfile **control;
 	struct pkgfile *next_file;
 	struct pkgfile *cur_file;
-	unsigned int line;
-	char *curdir;
+	unsigned int line;		/* The next file in the path table */
+	int files_read;			/* The archive's files have all been read */
 	freebsd_type pkg_type;
+	struct freebsd_decoder *decoder;
+	struct freebsd_toc *toc;	/* The package's table of contents */
+	struct pkgfile **toc_files;	/* Control files read using toc */
+	struct pkg_chunked *chunked;	/* The data of a chunked package */
+};
+
+struct freebsd_decoder_slot {
+	struct pkgfile	*file;
+	uint64_t	 size;		/* Memory used by the file */
+};
+
+/*
+ * A thread that reads files from an archive ahead of the installer.
+ * Files are passed back in a ring that is limited by both the number
+ * of files and the size of their data.
+ */
+struct freebsd_decoder {
+	struct archive	*archive;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	struct freebsd_decoder_slot slots[FREEBSD_DECODE_FILES];
+	unsigned int	 head;
+	unsigned int	 tail;
+	uint64_t	 bytes;		/* Total size of the files in slots */
+	unsigned int	 requests;	/* Calls to freebsd_decoder_next() */
+	int		 done;		/* The end of the archive was reached */
+	int		 stop;		/* The installer has finished */
 };
 
 
@@ -110,17 +180,15 @@ struct freebsd_package {
  *
  * This creates a pkg object from a given file pointer.
  * It is able to then manipulate the package and install the it to the pkg_db.
+ * The package closes fd when it is freed. If this fails fd is left open.
  * @todo Write
  * @return A new package object or NULL
  */
 struct pkg *
 pkg_new_freebsd_from_file(FILE *fd)
 {
-	struct pkg *pkg;
 	struct freebsd_package *fpkg;
-	struct pkg_manifest *manifest;
-	const char *pkg_name;
-	int i;
+	struct pkg *pkg;
 
 	if (fd == NULL)
 		return NULL;
@@ -132,47 +200,113 @@ pkg_new_freebsd_from_file(FILE *fd)
 
 	fpkg->fd = fd;
 	fpkg->pkg_type = fpkg_from_file;
-	fpkg->archive = archive_read_new();
-	archive_read_support_compression_bzip2(fpkg->archive);
-	archive_read_support_compression_gzip(fpkg->archive);
-	archive_read_support_format_tar(fpkg->archive);
-	archive_read_open_FILE(fpkg->archive, fd);
+	if (freebsd_open_archive(fpkg) != 0) {
+		free(fpkg);
+		return NULL;
+	}
 
-	/*
-	 * Get the +CONTENTS file.
-	 * We can't use the callbacks as we need the
-	 * package name to use with pkg_new
-	 */
-	freebsd_open_control_files(fpkg);
-	assert(fpkg->control != NULL);
+	pkg = freebsd_package_open(fpkg);
+	if (pkg == NULL) {
+		/* The caller still owns fd */
+		fpkg->fd = NULL;
+		freebsd_package_free(fpkg);
+	}
 
-	/* Read in the manifest to check if this is a FreeBSD package */
-	for (i = 0; fpkg->control[i] != NULL; i++) {
-		if (strcmp("+CONTENTS",
-		    basename(pkgfile_get_name(fpkg->control[i]))) == 0) {
-			manifest =
-			    pkg_manifest_new_freebsd_pkgfile(fpkg->control[i]);
-			break;
+	return pkg;
+}
+
+/**
+ * @brief Creates a new FreeBSD package from the named file
+ * @param path The file containing a FreeBSD Package
+ *
+ * Only the control files are read when the package is created. The
+ * archive and it's file are then closed and only reopened if the
+ * other files in the package are asked for, eg. when installing it.
+ * This allows many packages to be opened to read their +CONTENTS
+ * without keeping a decompressor and file descriptor for each.
+ *
+ * If the package has a table of contents, created with
+ * pkg_freebsd_create_toc(), reading stops at the last control file.
+ * When the package isn't compressed only +CONTENTS is read and other
+ * control files are read by seeking to them when asked for.
+ * @return A new package object or NULL
+ */
+struct pkg *
+pkg_new_freebsd_from_path(const char *path)
+{
+	struct freebsd_package *fpkg;
+	struct pkg *pkg;
+
+	if (path == NULL)
+		return NULL;
+
+	fpkg = freebsd_package_new();
+	if (fpkg == NULL)
+		return NULL;
+
+	fpkg->pkg_type = fpkg_from_file;
+	fpkg->path = strdup(path);
+	if (fpkg->path == NULL) {
+		free(fpkg);
+		return NULL;
+	}
+	fpkg->toc = freebsd_toc_read(path);
+	if (fpkg->toc == NULL || !fpkg->toc->seekable) {
+		fpkg->fd = fopen(path, "r");
+		if (fpkg->fd == NULL || freebsd_open_archive(fpkg) != 0) {
+			freebsd_package_free(fpkg);
+			return NULL;
 		}
 	}
-	if (manifest == NULL) {
-		/* TODO: Cleanup */
+
+	pkg = freebsd_package_open(fpkg);
+	if (pkg == NULL) {
+		/* Don't keep the file open if it isn't a package */
+		freebsd_package_free(fpkg);
 		return NULL;
 	}
 
-	pkg_name = pkg_manifest_get_name(manifest);
-	pkg = pkg_new(pkg_name, manifest, freebsd_get_control_files,
-	    freebsd_get_control_file, freebsd_get_manifest, freebsd_get_deps,
-	    NULL, freebsd_free);
+	/* Nothing but the control files are needed yet */
+	freebsd_close_archive(fpkg);
+
+	return pkg;
+}
+
+/**
+ * @brief Creates a new package from a file in the chunked format
+ * @param fd The file containing the package. It must be seekable.
+ *
+ * Only the package's header is read, the files are decompressed
+ * when asked for. See pkg_chunked_write() for the format.
+ * @return A new package object or NULL
+ */
+struct pkg *
+pkg_new_chunked_from_file(FILE *fd)
+{
+	struct freebsd_package *fpkg;
+	struct pkg *pkg;
+
+	if (fd == NULL)
+		return NULL;
+
+	fpkg = freebsd_package_new();
+	if (fpkg == NULL)
+		return NULL;
+
+	fpkg->pkg_type = fpkg_from_chunked;
+	fpkg->chunked = pkg_chunked_open(fd);
+	if (fpkg->chunked == NULL) {
+		free(fpkg);
+		return NULL;
+	}
+
+	pkg = freebsd_package_open(fpkg);
 	if (pkg == NULL) {
-		/** @todo cleanup */
+		/* The caller still owns fd */
+		pkg_chunked_detach(fpkg->chunked);
+		freebsd_package_free(fpkg);
 		return NULL;
 	}
-	pkg_add_callbacks_data(pkg, freebsd_get_version, freebsd_get_origin,
-	    freebsd_set_origin);
-	pkg_add_callbacks_install(pkg, freebsd_install, NULL,
-	    freebsd_get_next_file, freebsd_run_script);
-	pkg->data = fpkg;
 
 	return pkg;
 }
@@ -188,6 +322,11 @@ pkg_new_freebsd_from_file(FILE *fd)
  * This creates a package object from an installed package.
  * It can be used to retrieve information from the pkg_db and deintall
  * the package.
+ *
+ * Getting the package's manifest may write it's cache, +CONTENTS.idx,
+ * to pkg_db_dir when the cache is missing or older than +CONTENTS and
+ * the directory can be written to. This happens even when the package
+ * is only being read, e.g. by a query run as root.
  * @return A pkg object or NULL
  */
 struct pkg *
@@ -437,6 +576,13 @@ freebsd_get_control_file(struct pkg *pkg, const char *filename)
 	assert(fpkg->pkg_type != fpkg_unknown);
 	assert(fpkg->pkg_type != fpkg_from_empty);
 
+	/* Read only the file asked for if it can be found quickly */
+	if (fpkg->control == NULL && fpkg->pkg_type == fpkg_from_chunked)
+		return pkg_chunked_get_control(fpkg->chunked, filename);
+	if (fpkg->control == NULL && fpkg->toc != NULL &&
+	    fpkg->toc->seekable && fpkg->archive == NULL)
+		return freebsd_toc_get_control(fpkg, filename);
+
 	freebsd_open_control_files(fpkg);
 	if (fpkg->control == NULL)
 		return NULL;
@@ -458,11 +604,20 @@ freebsd_get_control_file(struct pkg *pkg, const char *filename)
 static struct pkg_manifest *
 freebsd_get_manifest(struct pkg *pkg)
 {
+	struct freebsd_package *fpkg;
 	struct pkgfile *contents_file;
 
 	assert(pkg != NULL);
 	assert(pkg->pkg_manifest == NULL);
 
+	/* An installed package can use the cached manifest */
+	fpkg = pkg->data;
+	if (fpkg != NULL && fpkg->pkg_type == fpkg_from_installed) {
+		pkg->pkg_manifest =
+		    pkg_manifest_new_freebsd_installed(fpkg->db_dir);
+		return pkg->pkg_manifest;
+	}
+
 	/* Get the +CONTENTS file */
 	contents_file = pkg_get_control_file(pkg, "+CONTENTS");
 
@@ -718,15 +873,44 @@ freebsd_deinstall(struct pkg *pkg, pkg_db_action *pkg_action, void *data,
 static struct pkgfile *
 freebsd_get_next_file(struct pkg *pkg)
 {
-	struct pkg_manifest_item **items;
+	const struct pkgm_path *paths;
+	struct pkg_manifest_item *item;
 	struct freebsd_package *fpkg;
 	struct pkgfile *file;
+	char the_file[PATH_MAX];
+	unsigned int count;
 
 	assert(pkg != NULL);
 	fpkg = pkg->data;
 	assert(fpkg != NULL);
 
 	file = NULL;
+
+	if (fpkg->pkg_type == fpkg_from_chunked) {
+		if (fpkg->cur_file != NULL)
+			pkgfile_free(fpkg->cur_file);
+		file = pkg_chunked_next_file(fpkg->chunked);
+		fpkg->cur_file = file;
+		return file;
+	}
+
+	/* Only the control files were read when the package was opened */
+	if (fpkg->path != NULL && fpkg->archive == NULL &&
+	    fpkg->next_file == NULL && !fpkg->files_read) {
+		/* They can't be read once the archive is past them */
+		if (fpkg->control == NULL &&
+		    freebsd_open_control_files(fpkg) != 0)
+			return NULL;
+		if (freebsd_reopen_archive(fpkg) != 0)
+			return NULL;
+		if (fpkg->next_file == NULL) {
+			/* There are only control files, eg. a metapackage */
+			freebsd_close_archive(fpkg);
+			fpkg->files_read = 1;
+			return NULL;
+		}
+	}
+
 	if (fpkg->next_file != NULL) {
 		file = fpkg->next_file;
 
@@ -736,86 +920,61 @@ freebsd_get_next_file(struct pkg *pkg)
 		 */
 		fpkg->cur_file = fpkg->next_file;
 		fpkg->next_file = NULL;
-	} else if (fpkg->archive == NULL)  {
+	} else if (fpkg->pkg_type == fpkg_from_installed) {
 		/* Read the file from disk */
-		items = pkg_manifest_get_items(pkg->pkg_manifest);
-		for (; items[fpkg->line] != NULL; fpkg->line++) {
-			switch(pkg_manifest_item_get_type(items[fpkg->line])) {
-			/* Unused item types */
-			case pmt_comment:
-			case pmt_dir:
-			case pmt_dirlist:
-			case pmt_output:
-			case pmt_execute:
-				break;
-			case pmt_chdir:
-			{
-				const char *dir;
-				if (fpkg->curdir != NULL)
-					free(fpkg->curdir);
-				dir = pkg_manifest_item_get_data(
-				    items[fpkg->line]);
-				fpkg->curdir = strdup(dir);
-				break;
-			}
-			case pmt_file:
-			{
-				const char *file_name, *md5;
-				char the_file[FILENAME_MAX + 1];
-
-				/*
-				 * We will always return from
-				 * this so increment the line
-				 * now to stop an infinite loop
-				*/
-				fpkg->line++;
-
-				/* Get the file's absolute name */
-				file_name = pkg_manifest_item_get_data(
-				    items[fpkg->line]);
-				snprintf(the_file, FILENAME_MAX, "%s/%s",
-				    fpkg->curdir, file_name);
-				/* Remove extra slashes from the path */
-				pkg_remove_extra_slashes(the_file);
-
-				/* Open the file */
-				file = pkgfile_new_from_disk(the_file, 1);
-
-				if (file == NULL)
-					return NULL;
-
-				/* Add the recorded md5 to the file */
-				md5 = pkg_manifest_item_get_attr(
-				    items[fpkg->line], pmia_md5);
-				if (md5 != NULL) {
-					strncpy(file->md5, md5, 32);
-					file->md5[33] = '\0';
-				}
-				return file;
-			}
-			case pmt_other:
-			case pmt_error:
-				/*
-				 * This should never happen as
-				 * pmt_other and pmt_error don't
-				 * appear in pkg_freebsd_parser.y
-				 */
-				abort();
-				break;
+		paths = pkg_manifest_get_paths(pkg->pkg_manifest, &count);
+		if (paths != NULL && fpkg->line < count) {
+			/*
+			 * We will always return from this so
+			 * increment the line now to stop an
+			 * infinite loop
+			 */
+			item = paths[fpkg->line].item;
+			fpkg->line++;
+
+			/* Get the file's absolute name */
+			if (pkg_manifest_get_path(pkg->pkg_manifest,
+			    fpkg->line - 1, the_file, sizeof(the_file)) != 0)
+				return NULL;
+
+			/* Open the file */
+			file = pkgfile_new_from_disk(the_file, 1);
+
+			if (file == NULL)
+				return NULL;
+
+			/* Add the recorded md5 to the file */
+			if (item->has_md5) {
+				memcpy(file->md5, item->md5,
+				    sizeof(file->md5));
+				file->has_md5 = 1;
 			}
+			return file;
 		}
 
-
 		/* If we are here there must be no more files in the manifest */
 		fpkg->line = 0;
 		return NULL;
+	} else if (fpkg->archive == NULL) {
+		/* The end of the archive has been read */
+		if (fpkg->cur_file != NULL)
+			pkgfile_free(fpkg->cur_file);
+		fpkg->cur_file = NULL;
+		return NULL;
 	} else {
 		if (fpkg->cur_file != NULL)
 			pkgfile_free(fpkg->cur_file);
-		file = freebsd_get_next_entry(fpkg->archive);
+
+		/* Decompress the rest of the archive in another thread */
+		if (fpkg->decoder == NULL)
+			fpkg->decoder = freebsd_decoder_new(fpkg->archive);
+		if (fpkg->decoder != NULL)
+			file = freebsd_decoder_next(fpkg->decoder);
+		else
+			file = freebsd_get_next_entry(fpkg->archive);
 		if (file == NULL) {
-			archive_read_finish(fpkg->archive);
-			fpkg->archive = NULL;
+			freebsd_close_archive(fpkg);
+			fpkg->files_read = 1;
 		}
 		fpkg->cur_file = file;
 	}
@@ -852,6 +1011,7 @@ freebsd_get_rdeps(struct pkg *pkg)
 	assert(fpkg->pkg_type != fpkg_unknown);
 	assert(fpkg->pkg_type != fpkg_from_file);
 	assert(fpkg->pkg_type != fpkg_from_empty);
+	assert(fpkg->pkg_type != fpkg_from_chunked);
 
 	if (fpkg->pkg_type == fpkg_from_installed) {
 		unsigned int pos, size;
@@ -989,7 +1149,8 @@ freebsd_run_script(struct pkg *pkg, const char *prefix, pkg_script script)
 	if (script_file == NULL)
 		return 0;
 
-	if (fpkg->pkg_type == fpkg_from_file) {
+	if (fpkg->pkg_type == fpkg_from_file ||
+	    fpkg->pkg_type == fpkg_from_chunked) {
 		/**
 		 * @todo Add a lock around mkdtemp as
 		 * arc4random is not thread safe
@@ -1033,7 +1194,8 @@ freebsd_run_script(struct pkg *pkg, const char *prefix, pkg_script script)
 	}
 	unlink(pkgfile_get_name(script_file));
 
-	if (fpkg->pkg_type == fpkg_from_file) {
+	if (fpkg->pkg_type == fpkg_from_file ||
+	    fpkg->pkg_type == fpkg_from_chunked) {
 		chdir(cwd);
 		free(cwd);
 		rmdir(dir);
@@ -1048,42 +1210,10 @@ freebsd_run_script(struct pkg *pkg, const char *prefix, pkg_script script)
 static int
 freebsd_free(struct pkg *pkg)
 {
-	struct freebsd_package *fpkg;
 	assert(pkg != NULL);
 
-	fpkg = pkg->data;
-	if (fpkg) {
-		if (fpkg->db_dir != NULL)
-			free(fpkg->db_dir);
-
-		/** @todo Fix this to only call free when required */
-		/* if (fpkg->origin != NULL)
-			free(fpkg->origin); */
-
-		if (fpkg->next_file != NULL)
-			pkgfile_free(fpkg->next_file);
-
-		if (fpkg->cur_file == NULL)
-			pkgfile_free(fpkg->cur_file);
-
-		if (fpkg->control != NULL) {
-			int cur;
-
-			for (cur = 0; fpkg->control[cur] != NULL; cur++) {
-				pkgfile_free(fpkg->control[cur]);
-			}
-			free(fpkg->control);
-		}
-		if (fpkg->fd != NULL)
-			fclose(fpkg->fd);
-		if (fpkg->archive != NULL)
-			archive_read_finish(fpkg->archive);
-
-		if (fpkg->curdir != NULL)
-			free(fpkg->curdir);
-
-		free(fpkg);
-	}
+	if (pkg->data != NULL)
+		freebsd_package_free(pkg->data);
 
 	return 0;
 }
@@ -1131,12 +1261,336 @@ freebsd_package_new()
 	fpkg->next_file = NULL;
 	fpkg->cur_file = NULL;
 	fpkg->line = 0;
-	fpkg->curdir = NULL;
+	fpkg->files_read = 0;
 	fpkg->pkg_type = fpkg_unknown;
+	fpkg->decoder = NULL;
+	fpkg->path = NULL;
+	fpkg->toc = NULL;
+	fpkg->toc_files = NULL;
+	fpkg->chunked = NULL;
 
 	return fpkg;
 }
 
+/**
+ * @brief Frees a struct freebsd_package and everything it holds
+ *
+ * This closes fpkg->fd so a caller that owns the file should set it
+ * to NULL first.
+ */
+static void
+freebsd_package_free(struct freebsd_package *fpkg)
+{
+	assert(fpkg != NULL);
+
+	if (fpkg->db_dir != NULL)
+		free(fpkg->db_dir);
+
+	/** @todo Fix this to only call free when required */
+	/* if (fpkg->origin != NULL)
+		free(fpkg->origin); */
+
+	/* This also frees next_file */
+	freebsd_close_archive(fpkg);
+	if (fpkg->path != NULL)
+		free(fpkg->path);
+
+	if (fpkg->cur_file == NULL)
+		pkgfile_free(fpkg->cur_file);
+
+	if (fpkg->control != NULL) {
+		int cur;
+
+		for (cur = 0; fpkg->control[cur] != NULL; cur++) {
+			pkgfile_free(fpkg->control[cur]);
+		}
+		free(fpkg->control);
+	}
+
+	if (fpkg->toc_files != NULL) {
+		unsigned int cur;
+
+		for (cur = 0; cur < fpkg->toc->control_count; cur++)
+			pkgfile_free(fpkg->toc_files[cur]);
+		free(fpkg->toc_files);
+	}
+	freebsd_toc_free(fpkg->toc);
+	pkg_chunked_free(fpkg->chunked);
+
+	free(fpkg);
+}
+
+/**
+ * @brief Creates a package object from a package archive
+ *
+ * The control files are read from the archive to find the package name.
+ * @param fpkg A package with the archive open. It is owned by the new
+ *     package on success and left for the caller to free on error.
+ * @return A new package object or NULL
+ */
+static struct pkg *
+freebsd_package_open(struct freebsd_package *fpkg)
+{
+	struct pkg *pkg;
+	struct pkg_manifest *manifest;
+	struct pkgfile *contents;
+	const char *pkg_name;
+	int i;
+
+	assert(fpkg != NULL);
+	assert(fpkg->archive != NULL || fpkg->chunked != NULL ||
+	    (fpkg->toc != NULL && fpkg->toc->seekable));
+
+	/*
+	 * Get the +CONTENTS file.
+	 * We can't use the callbacks as we need the
+	 * package name to use with pkg_new
+	 */
+	contents = NULL;
+	if (fpkg->chunked != NULL) {
+		contents = pkg_chunked_get_control(fpkg->chunked, "+CONTENTS");
+	} else if (fpkg->archive == NULL) {
+		contents = freebsd_toc_get_control(fpkg, "+CONTENTS");
+	} else {
+		freebsd_open_control_files(fpkg);
+		assert(fpkg->control != NULL);
+
+		for (i = 0; fpkg->control[i] != NULL; i++) {
+			if (strcmp("+CONTENTS",
+			    basename(pkgfile_get_name(fpkg->control[i]))) == 0) {
+				contents = fpkg->control[i];
+				break;
+			}
+		}
+	}
+
+	/* Read in the manifest to check if this is a FreeBSD package */
+	manifest = NULL;
+	if (contents != NULL)
+		manifest = pkg_manifest_new_freebsd_pkgfile(contents);
+	if (manifest == NULL)
+		return NULL;
+
+	pkg_name = pkg_manifest_get_name(manifest);
+	pkg = pkg_new(pkg_name, manifest, freebsd_get_control_files,
+	    freebsd_get_control_file, freebsd_get_manifest, freebsd_get_deps,
+	    NULL, freebsd_free);
+	if (pkg == NULL) {
+		pkg_manifest_free(manifest);
+		return NULL;
+	}
+	pkg_add_callbacks_data(pkg, freebsd_get_version, freebsd_get_origin,
+	    freebsd_set_origin);
+	pkg_add_callbacks_install(pkg, freebsd_install, NULL,
+	    freebsd_get_next_file, freebsd_run_script);
+	pkg->data = fpkg;
+
+	return pkg;
+}
+
+/**
+ * @brief Creates the archive object to read fpkg->fd with
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+freebsd_open_archive(struct freebsd_package *fpkg)
+{
+	int ret;
+
+	assert(fpkg != NULL);
+	assert(fpkg->fd != NULL);
+	assert(fpkg->archive == NULL);
+
+	fpkg->archive = archive_read_new();
+	if (fpkg->archive == NULL)
+		return -1;
+	/*
+	 * Let libarchive find the compression from the data. This
+	 * includes xz and, when libarchive was built with it, zstd.
+	 */
+	archive_read_support_compression_all(fpkg->archive);
+	archive_read_support_format_tar(fpkg->archive);
+
+	/* bzip2 packages in a file are decoded with a thread per CPU */
+	ret = archive_read_open_bzip2(fpkg->archive, fpkg->fd,
+	    FREEBSD_BZIP2_THREADS);
+	if (ret == ARCHIVE_WARN)
+		ret = archive_read_open_stream(fpkg->archive, fpkg->fd,
+		    FREEBSD_READ_BLOCK);
+	if (ret != ARCHIVE_OK) {
+		archive_read_finish(fpkg->archive);
+		fpkg->archive = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Opens the archive of a package created with
+ *     pkg_new_freebsd_from_path() again
+ *
+ * The control files have already been read so are skipped. With a
+ * table of contents they are skipped without reading their data, or
+ * if the package isn't compressed by seeking past them.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+freebsd_reopen_archive(struct freebsd_package *fpkg)
+{
+	struct archive_entry *entry;
+	struct pkgfile *file;
+	struct freebsd_toc *toc;
+	unsigned int pos;
+
+	assert(fpkg != NULL);
+	assert(fpkg->path != NULL);
+	assert(fpkg->archive == NULL);
+	assert(fpkg->next_file == NULL);
+
+	toc = fpkg->toc;
+	if (toc != NULL && toc->seekable) {
+		/* There is nothing after the control files */
+		if (toc->control_count == toc->count)
+			return 0;
+		if (freebsd_seek_archive(fpkg,
+		    toc->entries[toc->control_count].offset) != 0)
+			return -1;
+		fpkg->next_file = freebsd_get_next_entry(fpkg->archive);
+		return 0;
+	}
+
+	if (freebsd_seek_archive(fpkg, 0) != 0)
+		return -1;
+
+	if (toc != NULL) {
+		for (pos = 0; pos < toc->control_count; pos++) {
+			if (archive_read_next_header(fpkg->archive,
+			    &entry) != ARCHIVE_OK ||
+			    archive_read_data_skip(fpkg->archive) != ARCHIVE_OK)
+				return -1;
+		}
+		fpkg->next_file = freebsd_get_next_entry(fpkg->archive);
+		return 0;
+	}
+
+	while ((file = freebsd_get_next_entry(fpkg->archive)) != NULL &&
+	    pkgfile_get_name(file)[0] == '+')
+		pkgfile_free(file);
+	fpkg->next_file = file;
+
+	return 0;
+}
+
+/**
+ * @brief Opens the archive of a package created with
+ *     pkg_new_freebsd_from_path() starting from offset
+ * @param offset Where to start reading the file. Unless the package
+ *     isn't compressed this must be 0.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+freebsd_seek_archive(struct freebsd_package *fpkg, uint64_t offset)
+{
+	assert(fpkg != NULL);
+	assert(fpkg->path != NULL);
+	assert(fpkg->fd == NULL);
+	assert(fpkg->archive == NULL);
+
+	fpkg->fd = fopen(fpkg->path, "r");
+	if (fpkg->fd == NULL)
+		return -1;
+	if ((offset > 0 && fseeko(fpkg->fd, offset, SEEK_SET) != 0) ||
+	    freebsd_open_archive(fpkg) != 0) {
+		fclose(fpkg->fd);
+		fpkg->fd = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Reads a single control file using the table of contents
+ *
+ * The package must not be compressed so the file can be seeked to.
+ * The file is kept until the package is freed.
+ * @param name The name of the control file without any directory
+ * @return The control file or NULL
+ */
+static struct pkgfile *
+freebsd_toc_get_control(struct freebsd_package *fpkg, const char *name)
+{
+	struct freebsd_toc_entry *toc_entry;
+	struct pkgfile *file;
+	int pos;
+
+	assert(fpkg != NULL);
+	assert(fpkg->toc != NULL);
+	assert(fpkg->toc->seekable);
+	assert(fpkg->archive == NULL);
+
+	pos = freebsd_toc_find_control(fpkg->toc, name);
+	if (pos == -1)
+		return NULL;
+
+	if (fpkg->toc_files == NULL) {
+		fpkg->toc_files = calloc(fpkg->toc->control_count,
+		    sizeof(struct pkgfile *));
+		if (fpkg->toc_files == NULL)
+			return NULL;
+	}
+	if (fpkg->toc_files[pos] != NULL)
+		return fpkg->toc_files[pos];
+
+	toc_entry = &fpkg->toc->entries[pos];
+	if (freebsd_seek_archive(fpkg, toc_entry->offset) != 0)
+		return NULL;
+	file = freebsd_get_next_entry(fpkg->archive);
+	freebsd_close_archive(fpkg);
+
+	/* Check the table of contents was right */
+	if (file != NULL && strcmp(pkgfile_get_name(file),
+	    toc_entry->name) != 0) {
+		pkgfile_free(file);
+		file = NULL;
+	}
+
+	fpkg->toc_files[pos] = file;
+	return file;
+}
+
+/**
+ * @brief Closes the archive of a package read from a file
+ *
+ * Any file read from the archive but not yet returned is freed.
+ */
+static void
+freebsd_close_archive(struct freebsd_package *fpkg)
+{
+	assert(fpkg != NULL);
+
+	if (fpkg->decoder != NULL) {
+		freebsd_decoder_free(fpkg->decoder);
+		fpkg->decoder = NULL;
+	}
+	if (fpkg->next_file != NULL) {
+		pkgfile_free(fpkg->next_file);
+		fpkg->next_file = NULL;
+	}
+	if (fpkg->archive != NULL) {
+		archive_read_finish(fpkg->archive);
+		fpkg->archive = NULL;
+	}
+	if (fpkg->fd != NULL) {
+		fclose(fpkg->fd);
+		fpkg->fd = NULL;
+	}
+}
+
 /**
  * @brief Frees a file list
  */
@@ -1175,7 +1629,8 @@ freebsd_open_control_files(struct freebsd_package *fpkg)
 		return 0;
 
 	if (fpkg->pkg_type != fpkg_from_installed &&
-	    fpkg->pkg_type != fpkg_from_file) {
+	    fpkg->pkg_type != fpkg_from_file &&
+	    fpkg->pkg_type != fpkg_from_chunked) {
 		assert(0);
 		return -1;
 	}
@@ -1201,6 +1656,10 @@ freebsd_open_control_files(struct freebsd_package *fpkg)
 	
 			if (de->d_name[0] == '.') {
 				continue;
+			} else if (strncmp(de->d_name, FREEBSD_CACHE_NAME,
+			    sizeof(FREEBSD_CACHE_NAME) - 1) == 0) {
+				/* The manifest cache isn't a control file */
+				continue;
 			} else if (de->d_type != DT_REG) {
 				closedir(d);
 				FREE_CONTENTS(fpkg->control);
@@ -1224,11 +1683,54 @@ freebsd_open_control_files(struct freebsd_package *fpkg)
 		}
 		closedir(d);
 
+		return 0;
+	} else if (fpkg->pkg_type == fpkg_from_chunked) {
+		struct pkgfile **files;
+		unsigned int pos;
+
+		/* The chunked package owns the files so keep a reference */
+		files = pkg_chunked_get_controls(fpkg->chunked);
+		if (files == NULL) {
+			FREE_CONTENTS(fpkg->control);
+			fpkg->control = NULL;
+			return -1;
+		}
+		for (pos = 0; files[pos] != NULL; pos++) {
+			pkgfile = pkgfile_ref(files[pos]);
+			addFile(pkgfile);
+		}
 		return 0;
 	} else if (fpkg->pkg_type == fpkg_from_file) {
+		if (fpkg->toc != NULL) {
+			unsigned int pos;
+			int reopened;
+
+			/*
+			 * The table of contents says how many control files
+			 * there are so the next file doesn't need to be read.
+			 */
+			reopened = 0;
+			if (fpkg->archive == NULL) {
+				if (freebsd_seek_archive(fpkg, 0) != 0) {
+					FREE_CONTENTS(fpkg->control);
+					fpkg->control = NULL;
+					return -1;
+				}
+				reopened = 1;
+			}
+			for (pos = 0; pos < fpkg->toc->control_count; pos++) {
+				pkgfile = freebsd_get_next_entry(fpkg->archive);
+				if (pkgfile == NULL)
+					break;
+				addFile(pkgfile);
+			}
+			if (reopened)
+				freebsd_close_archive(fpkg);
+			return 0;
+		}
 		assert(fpkg->archive != NULL);
 		pkgfile = freebsd_get_next_entry(fpkg->archive);
-		while (pkgfile_get_name(pkgfile)[0] == '+') {
+		while (pkgfile != NULL && pkgfile_get_name(pkgfile)[0] == '+') {
 			addFile(pkgfile);
 			pkgfile = freebsd_get_next_entry(fpkg->archive);
 		}
@@ -1264,7 +1766,18 @@ freebsd_get_next_entry(struct archive *a)
 	sb = archive_entry_stat(entry);
 
 	file = NULL;
-	if (S_ISREG(sb->st_mode)) {
+	if (S_ISREG(sb->st_mode) &&
+	    (uint64_t)archive_entry_size(entry) >= FREEBSD_STREAM_MIN &&
+	    archive_entry_pathname(entry)[0] != '+') {
+		/*
+		 * Large files are read from the archive as they are written.
+		 * Control files are kept after the archive has moved past
+		 * them so are always read into memory.
+		 */
+		file = pkgfile_new_regular_archive(
+		    archive_entry_pathname(entry), a,
+		    archive_entry_size(entry));
+	} else if (S_ISREG(sb->st_mode)) {
 		/* Allocate enough space for the file and copy it to the string */
 		length = archive_entry_size(entry);
 		str = malloc(length+1);
@@ -1274,10 +1787,9 @@ freebsd_get_next_entry(struct archive *a)
 		archive_read_data_into_buffer(a, str, length);
 		str[length] = '\0';
 
-		/* Create the pkgfile and return it */
-		file = pkgfile_new_regular(archive_entry_pathname(entry), str,
-		    length);
-		free(str);
+		/* Create the pkgfile and return it, it now owns str */
+		file = pkgfile_new_regular_owned(archive_entry_pathname(entry),
+		    str, length);
 	} else if (S_ISLNK(sb->st_mode)) {
 		file = pkgfile_new_symlink(archive_entry_pathname(entry),
 		    archive_entry_symlink(entry));
@@ -1297,6 +1809,171 @@ freebsd_get_next_entry(struct archive *a)
 	return file;
 }
 
+/**
+ * @brief Starts a thread to read the files from an archive
+ *
+ * This lets the archive be decompressed while the installer is
+ * writing the files it has already been given.
+ * @param a The archive to read. It must not be used by the caller
+ *     until freebsd_decoder_free() is called.
+ * @return A new decoder or NULL
+ */
+static struct freebsd_decoder *
+freebsd_decoder_new(struct archive *a)
+{
+	struct freebsd_decoder *decoder;
+
+	assert(a != NULL);
+
+	decoder = malloc(sizeof(struct freebsd_decoder));
+	if (decoder == NULL)
+		return NULL;
+
+	decoder->archive = a;
+	decoder->head = decoder->tail = 0;
+	decoder->bytes = 0;
+	decoder->requests = 0;
+	decoder->done = 0;
+	decoder->stop = 0;
+
+	if (pthread_mutex_init(&decoder->lock, NULL) != 0) {
+		free(decoder);
+		return NULL;
+	}
+	if (pthread_cond_init(&decoder->cond, NULL) != 0) {
+		pthread_mutex_destroy(&decoder->lock);
+		free(decoder);
+		return NULL;
+	}
+	if (pthread_create(&decoder->thread, NULL, freebsd_decoder_thread,
+	    decoder) != 0) {
+		pthread_cond_destroy(&decoder->cond);
+		pthread_mutex_destroy(&decoder->lock);
+		free(decoder);
+		return NULL;
+	}
+
+	return decoder;
+}
+
+/**
+ * @brief Gets the next file read by a decoder thread
+ *
+ * The file returned by the last call must not be used after this.
+ * @return The next file in the archive or NULL at the end
+ */
+static struct pkgfile *
+freebsd_decoder_next(struct freebsd_decoder *decoder)
+{
+	struct freebsd_decoder_slot *slot;
+	struct pkgfile *file;
+
+	assert(decoder != NULL);
+
+	pthread_mutex_lock(&decoder->lock);
+
+	/* Let the thread know the last file is finished with */
+	decoder->requests++;
+	pthread_cond_broadcast(&decoder->cond);
+
+	while (decoder->head == decoder->tail && !decoder->done)
+		pthread_cond_wait(&decoder->cond, &decoder->lock);
+
+	file = NULL;
+	if (decoder->head != decoder->tail) {
+		slot = &decoder->slots[decoder->head % FREEBSD_DECODE_FILES];
+		file = slot->file;
+		decoder->bytes -= slot->size;
+		decoder->head++;
+		pthread_cond_broadcast(&decoder->cond);
+	}
+
+	pthread_mutex_unlock(&decoder->lock);
+
+	return file;
+}
+
+/**
+ * @brief Stops a decoder thread and frees any files it has read
+ */
+static void
+freebsd_decoder_free(struct freebsd_decoder *decoder)
+{
+	assert(decoder != NULL);
+
+	pthread_mutex_lock(&decoder->lock);
+	decoder->stop = 1;
+	pthread_cond_broadcast(&decoder->cond);
+	pthread_mutex_unlock(&decoder->lock);
+
+	pthread_join(decoder->thread, NULL);
+
+	for (; decoder->head != decoder->tail; decoder->head++)
+		pkgfile_free(decoder->slots[
+		    decoder->head % FREEBSD_DECODE_FILES].file);
+
+	pthread_cond_destroy(&decoder->cond);
+	pthread_mutex_destroy(&decoder->lock);
+	free(decoder);
+}
+
+/**
+ * @brief The function run by a decoder thread
+ *
+ * Files are read in archive order until the ring is full. A file
+ * backed by the archive has to be finished with before the next
+ * header can be read so the thread waits for the installer to ask
+ * for the file after it.
+ */
+static void *
+freebsd_decoder_thread(void *data)
+{
+	struct freebsd_decoder *decoder;
+	struct freebsd_decoder_slot *slot;
+	struct pkgfile *file;
+	unsigned int count;
+	int streamed;
+
+	decoder = data;
+	count = 0;
+	streamed = 0;
+	pthread_mutex_lock(&decoder->lock);
+	for (;;) {
+		/* Wait for space and for any archive backed file to be used */
+		while (!decoder->stop &&
+		    ((streamed && decoder->requests <= count) ||
+		    decoder->tail - decoder->head == FREEBSD_DECODE_FILES ||
+		    (decoder->bytes >= FREEBSD_DECODE_BYTES &&
+		    decoder->head != decoder->tail)))
+			pthread_cond_wait(&decoder->cond, &decoder->lock);
+		if (decoder->stop)
+			break;
+
+		/* Decompress without the lock so the installer can run */
+		pthread_mutex_unlock(&decoder->lock);
+		file = freebsd_get_next_entry(decoder->archive);
+		pthread_mutex_lock(&decoder->lock);
+
+		if (file == NULL) {
+			decoder->done = 1;
+			pthread_cond_broadcast(&decoder->cond);
+			break;
+		}
+
+		streamed = (file->loc == pkgfile_loc_archive);
+		slot = &decoder->slots[decoder->tail % FREEBSD_DECODE_FILES];
+		slot->file = file;
+		slot->size = (streamed ? 0 : file->length);
+		decoder->bytes += slot->size;
+		decoder->tail++;
+		count++;
+		pthread_cond_broadcast(&decoder->cond);
+	}
+	pthread_mutex_unlock(&decoder->lock);
+
+	return NULL;
+}
+
 /**
  * @}
  */
@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) 2007, Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "pkg_private.h"
+
+/* The strings of a cache being written */
+struct freebsd_cache_strings {
+	char		*buf;
+	size_t		 len;
+	size_t		 size;
+
+	/*
+	 * The offset of each string added keyed by it's address. The
+	 * manifest interns it's strings so a repeated string, eg. the
+	 * @cwd directory, has the same address each time.
+	 */
+	const char	**keys;
+	uint32_t	*offsets;
+	unsigned int	 slots;
+};
+
+static char	*freebsd_cache_path(const char *, const char *);
+static int	 freebsd_cache_hash(const char *, uint64_t *);
+static int	 freebsd_cache_add_string(struct freebsd_cache_strings *,
+			const char *, uint32_t *);
+static const char *freebsd_cache_string(const char *, uint32_t, uint32_t,
+			int *);
+static int	 freebsd_cache_load_items(struct pkg_manifest *);
+
+/**
+ * @defgroup FreebsdManifestCache FreeBSD installed package manifest cache
+ * @ingroup FreeBSDManifest
+ * @brief A binary copy of an installed package's manifest
+ *
+ * Parsing +CONTENTS is the most expensive part of reading an installed
+ * package. Next to it in the package database is +CONTENTS.idx, the
+ * parsed manifest in a binary format. It is mapped in to memory and
+ * the manifest's items point at the strings in it so nothing is parsed
+ * or copied.
+ *
+ * The cache records the size, modification time, inode number and hash
+ * of the +CONTENTS it was made from. If any of the first three don't
+ * match it is stale and ignored. The modification time is in seconds
+ * so when the cache was written in the same second as +CONTENTS was
+ * changed +CONTENTS may have changed again unseen. Only then is it
+ * read to check the hash. The cache is written when a package is
+ * registered and again whenever a reader that may write to the
+ * database finds it missing or stale.
+ *
+ * Like pkg_freebsd_parse_contents_head() the items are only added to
+ * the manifest when they are first needed.
+ *
+ * @{
+ */
+
+/**
+ * @brief Reads the cached manifest of an installed package
+ * @param db_dir The package's directory in the package database
+ * @param stale If not NULL set to 1 when there is no cache or it is
+ *     stale or corrupt so writing it again would help, otherwise 0
+ * @return The manifest or NULL if there isn't a current cache
+ */
+struct pkg_manifest *
+freebsd_cache_read(const char *db_dir, int *stale)
+{
+	const struct freebsd_cache_header *header;
+	const struct freebsd_cache_item *items;
+	const struct freebsd_cache_dep *deps;
+	const uint32_t *conflicts;
+	struct pkg_manifest *manifest;
+	struct pkg *dep;
+	struct stat sb, cache_sb;
+	const char *strings, *str, *origin;
+	char *path;
+	void *map;
+	uint64_t hash, needed;
+	unsigned int pos, attr;
+	int bad, fd, ignored;
+
+	assert(db_dir != NULL);
+
+	if (stale == NULL)
+		stale = &ignored;
+	*stale = 0;
+
+	path = freebsd_cache_path(db_dir, FREEBSD_CACHE_NAME);
+	if (path == NULL)
+		return NULL;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1) {
+		*stale = (errno == ENOENT);
+		return NULL;
+	}
+	if (fstat(fd, &cache_sb) != 0) {
+		close(fd);
+		return NULL;
+	}
+	/* From here on a cache that can't be used should be replaced */
+	*stale = 1;
+	if (!S_ISREG(cache_sb.st_mode) ||
+	    (uint64_t)cache_sb.st_size < sizeof(struct freebsd_cache_header) ||
+	    (uint64_t)cache_sb.st_size > SIZE_MAX) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, cache_sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		*stale = 0;
+		return NULL;
+	}
+
+	/* Check the cache is for the current +CONTENTS */
+	header = map;
+	path = freebsd_cache_path(db_dir, "+CONTENTS");
+	if (path == NULL || stat(path, &sb) != 0 ||
+	    header->magic != FREEBSD_CACHE_MAGIC ||
+	    header->version != FREEBSD_CACHE_VERSION ||
+	    header->contents_size != (uint64_t)sb.st_size ||
+	    header->contents_mtime != (int64_t)sb.st_mtime ||
+	    header->contents_ino != (uint64_t)sb.st_ino ||
+	    (header->contents_mtime >= (int64_t)cache_sb.st_mtime &&
+	    (freebsd_cache_hash(path, &hash) != 0 ||
+	    hash != header->contents_hash))) {
+		free(path);
+		munmap(map, cache_sb.st_size);
+		return NULL;
+	}
+	free(path);
+
+	/* Check the file is big enough for what the header says is in it */
+	needed = sizeof(struct freebsd_cache_header) +
+	    (uint64_t)header->item_count * sizeof(struct freebsd_cache_item) +
+	    (uint64_t)header->dep_count * sizeof(struct freebsd_cache_dep) +
+	    (uint64_t)header->conflict_count * sizeof(uint32_t) +
+	    header->strings_size;
+	if (needed != (uint64_t)cache_sb.st_size || header->strings_size == 0) {
+		munmap(map, cache_sb.st_size);
+		return NULL;
+	}
+	items = (const struct freebsd_cache_item *)(header + 1);
+	deps = (const struct freebsd_cache_dep *)(items + header->item_count);
+	conflicts = (const uint32_t *)(deps + header->dep_count);
+	strings = (const char *)(conflicts + header->conflict_count);
+	if (strings[header->strings_size - 1] != '\0') {
+		munmap(map, cache_sb.st_size);
+		return NULL;
+	}
+
+	manifest = pkg_manifest_new();
+	if (manifest == NULL) {
+		*stale = 0;
+		munmap(map, cache_sb.st_size);
+		return NULL;
+	}
+	/* The manifest unmaps the cache when it is freed */
+	manifest->map = map;
+	manifest->map_size = cache_sb.st_size;
+
+	bad = 0;
+	pkg_manifest_set_name(manifest, freebsd_cache_string(strings,
+	    header->strings_size, header->name, &bad));
+	pkg_manifest_set_manifest_version(manifest, freebsd_cache_string(
+	    strings, header->strings_size, header->manifest_version, &bad));
+	pkg_manifest_set_attr(manifest, pkgm_origin, freebsd_cache_string(
+	    strings, header->strings_size, header->origin, &bad));
+	pkg_manifest_set_attr(manifest, pkgm_prefix, freebsd_cache_string(
+	    strings, header->strings_size, header->prefix, &bad));
+
+	/* Check the items now so adding them later can't find a bad one */
+	for (pos = 0; pos < header->item_count && !bad; pos++) {
+		if (items[pos].data == FREEBSD_CACHE_NONE ||
+		    items[pos].type == pmt_error ||
+		    items[pos].type > pmt_execute) {
+			bad = 1;
+			break;
+		}
+		freebsd_cache_string(strings, header->strings_size,
+		    items[pos].data, &bad);
+		for (attr = 0; attr < pmia_md5; attr++) {
+			freebsd_cache_string(strings, header->strings_size,
+			    items[pos].attrs[attr], &bad);
+		}
+	}
+
+	for (pos = 0; pos < header->dep_count && !bad; pos++) {
+		str = freebsd_cache_string(strings, header->strings_size,
+		    deps[pos].name, &bad);
+		origin = freebsd_cache_string(strings, header->strings_size,
+		    deps[pos].origin, &bad);
+		if (bad || str == NULL || (dep = pkg_new_freebsd_empty(str)) ==
+		    NULL) {
+			bad = 1;
+			break;
+		}
+		if (origin != NULL)
+			pkg_set_origin(dep, origin);
+		if (pkg_manifest_add_dependency(manifest, dep) != 0) {
+			pkg_free(dep);
+			bad = 1;
+		}
+	}
+
+	for (pos = 0; pos < header->conflict_count && !bad; pos++) {
+		str = freebsd_cache_string(strings, header->strings_size,
+		    conflicts[pos], &bad);
+		if (bad || pkg_manifest_add_conflict(manifest, str) != 0)
+			bad = 1;
+	}
+
+	if (bad || pkg_manifest_get_name(manifest) == NULL) {
+		pkg_manifest_free(manifest);
+		return NULL;
+	}
+	*stale = 0;
+	manifest->manifest_load_items = freebsd_cache_load_items;
+
+	return manifest;
+}
+
+/**
+ * @brief Writes the cache of an installed package's manifest
+ * @param manifest The manifest parsed from the package's +CONTENTS
+ * @param db_dir The package's directory in the package database
+ *
+ * The cache is written to a temporary file then renamed so a reader
+ * will never find part of one. It is given the same permissions as
+ * +CONTENTS so anyone who can read one can read the other.
+ * @return  0 on success
+ * @return -1 on error
+ */
+int
+freebsd_cache_write(struct pkg_manifest *manifest, const char *db_dir)
+{
+	struct freebsd_cache_header header;
+	struct freebsd_cache_strings strings;
+	struct freebsd_cache_item *items;
+	struct freebsd_cache_dep *deps;
+	uint32_t *conflicts;
+	struct pkg_manifest_item *item;
+	struct stat sb;
+	FILE *fd;
+	char *path, *cache_name, *tmp_name;
+	unsigned int pos, attr, count;
+	int ret, tmp_fd;
+
+	assert(manifest != NULL);
+	assert(db_dir != NULL);
+
+	if (pkg_manifest_load_items(manifest) != 0)
+		return -1;
+
+	memset(&header, 0, sizeof(header));
+	path = freebsd_cache_path(db_dir, "+CONTENTS");
+	if (path == NULL)
+		return -1;
+	ret = stat(path, &sb);
+	if (ret == 0)
+		ret = freebsd_cache_hash(path, &header.contents_hash);
+	free(path);
+	if (ret != 0)
+		return -1;
+
+	header.magic = FREEBSD_CACHE_MAGIC;
+	header.version = FREEBSD_CACHE_VERSION;
+	header.contents_size = sb.st_size;
+	header.contents_mtime = sb.st_mtime;
+	header.contents_ino = sb.st_ino;
+	header.item_count = manifest->items_count;
+	header.dep_count = manifest->deps_count;
+	header.conflict_count = manifest->conflicts_count;
+
+	/* Size the string table for every string to have it's own slot */
+	count = 4 + manifest->conflicts_count + manifest->deps_count * 2;
+	for (pos = 0; pos < manifest->items_count; pos++) {
+		item = manifest->items[pos];
+		count++;
+		for (attr = 0; item->attrs != NULL && attr < pmia_md5; attr++) {
+			if (item->attrs[attr] != NULL)
+				count++;
+		}
+	}
+	strings.slots = 16;
+	while (strings.slots < count * 2)
+		strings.slots *= 2;
+	strings.buf = NULL;
+	strings.len = strings.size = 0;
+	strings.keys = calloc(strings.slots, sizeof(char *));
+	strings.offsets = malloc(strings.slots * sizeof(uint32_t));
+
+	items = calloc(manifest->items_count + 1,
+	    sizeof(struct freebsd_cache_item));
+	deps = calloc(manifest->deps_count + 1,
+	    sizeof(struct freebsd_cache_dep));
+	conflicts = calloc(manifest->conflicts_count + 1, sizeof(uint32_t));
+	cache_name = tmp_name = NULL;
+	fd = NULL;
+	ret = -1;
+	if (strings.keys == NULL || strings.offsets == NULL || items == NULL ||
+	    deps == NULL || conflicts == NULL)
+		goto done;
+
+	if (freebsd_cache_add_string(&strings, manifest->name,
+	    &header.name) != 0 ||
+	    freebsd_cache_add_string(&strings, manifest->manifest_version,
+	    &header.manifest_version) != 0 ||
+	    freebsd_cache_add_string(&strings, manifest->attrs[pkgm_origin],
+	    &header.origin) != 0 ||
+	    freebsd_cache_add_string(&strings, manifest->attrs[pkgm_prefix],
+	    &header.prefix) != 0)
+		goto done;
+
+	for (pos = 0; pos < manifest->items_count; pos++) {
+		item = manifest->items[pos];
+		items[pos].type = item->type;
+		if (item->data == NULL ||
+		    freebsd_cache_add_string(&strings, item->data,
+		    &items[pos].data) != 0)
+			goto done;
+		for (attr = 0; attr < pmia_md5; attr++) {
+			if (freebsd_cache_add_string(&strings,
+			    item->attrs == NULL ? NULL : item->attrs[attr],
+			    &items[pos].attrs[attr]) != 0)
+				goto done;
+		}
+		if (item->has_md5) {
+			items[pos].has_md5 = 1;
+			memcpy(items[pos].md5, item->md5, sizeof(item->md5));
+		} else if (item->attrs != NULL && item->attrs[pmia_md5] != NULL) {
+			/* An MD5 that isn't a digest can't be cached */
+			goto done;
+		}
+	}
+
+	for (pos = 0; pos < manifest->deps_count; pos++) {
+		if (freebsd_cache_add_string(&strings,
+		    pkg_get_name(manifest->deps[pos]), &deps[pos].name) != 0 ||
+		    freebsd_cache_add_string(&strings,
+		    pkg_get_origin(manifest->deps[pos]), &deps[pos].origin) != 0)
+			goto done;
+	}
+
+	for (pos = 0; pos < manifest->conflicts_count; pos++) {
+		if (freebsd_cache_add_string(&strings,
+		    manifest->conflicts[pos], &conflicts[pos]) != 0)
+			goto done;
+	}
+	header.strings_size = strings.len;
+
+	cache_name = freebsd_cache_path(db_dir, FREEBSD_CACHE_NAME);
+	if (cache_name == NULL)
+		goto done;
+	asprintf(&tmp_name, "%s.XXXXXX", cache_name);
+	if (tmp_name == NULL)
+		goto done;
+	tmp_fd = mkstemp(tmp_name);
+	if (tmp_fd == -1) {
+		free(tmp_name);
+		tmp_name = NULL;
+		goto done;
+	}
+	/* mkstemp(3) makes the file only readable by it's owner */
+	if (fchmod(tmp_fd, sb.st_mode & ALLPERMS) != 0) {
+		close(tmp_fd);
+		goto done;
+	}
+	fd = fdopen(tmp_fd, "w");
+	if (fd == NULL) {
+		close(tmp_fd);
+		goto done;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, fd) != 1 ||
+	    fwrite(items, sizeof(struct freebsd_cache_item),
+	    manifest->items_count, fd) != manifest->items_count ||
+	    fwrite(deps, sizeof(struct freebsd_cache_dep),
+	    manifest->deps_count, fd) != manifest->deps_count ||
+	    fwrite(conflicts, sizeof(uint32_t), manifest->conflicts_count,
+	    fd) != manifest->conflicts_count ||
+	    fwrite(strings.buf, 1, strings.len, fd) != strings.len)
+		goto done;
+
+	ret = 0;
+
+done:
+	if (fd != NULL && fclose(fd) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp_name, cache_name) != 0)
+		ret = -1;
+	if (ret != 0 && tmp_name != NULL)
+		unlink(tmp_name);
+	free(tmp_name);
+	free(cache_name);
+	free(conflicts);
+	free(deps);
+	free(items);
+	free(strings.offsets);
+	free(strings.keys);
+	free(strings.buf);
+
+	return ret;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup FreebsdManifestCacheInternal Internal manifest cache functions
+ * @ingroup FreebsdManifestCache
+ *
+ * @{
+ */
+
+/**
+ * @brief Gets the path of a file in a package's database directory
+ * @return A string the caller frees or NULL
+ */
+static char *
+freebsd_cache_path(const char *db_dir, const char *file)
+{
+	char *path;
+
+	assert(db_dir != NULL);
+	assert(file != NULL);
+
+	asprintf(&path, "%s/%s", db_dir, file);
+	if (path != NULL)
+		pkg_remove_extra_slashes(path);
+	return path;
+}
+
+/**
+ * @brief Finds the FNV-1a hash of a file
+ * @param path The file to hash
+ * @param hash Set to the hash
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+freebsd_cache_hash(const char *path, uint64_t *hash)
+{
+	struct pkgfile *file;
+	const unsigned char *data;
+	uint64_t pos, size;
+
+	assert(path != NULL);
+	assert(hash != NULL);
+
+	file = pkgfile_new_from_disk(path, 1);
+	if (file == NULL)
+		return -1;
+	data = (const unsigned char *)pkgfile_get_data(file);
+	size = pkgfile_get_size(file);
+	if (data == NULL && size != 0) {
+		pkgfile_free(file);
+		return -1;
+	}
+
+	*hash = 14695981039346656037ULL;
+	for (pos = 0; pos < size; pos++) {
+		*hash ^= data[pos];
+		*hash *= 1099511628211ULL;
+	}
+	pkgfile_free(file);
+
+	return 0;
+}
+
+/**
+ * @brief Adds a string to a cache's strings
+ * @param str The string, it may be NULL
+ * @param offset Set to the offset of the string
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+freebsd_cache_add_string(struct freebsd_cache_strings *strings,
+    const char *str, uint32_t *offset)
+{
+	char *buf;
+	size_t len, size;
+	unsigned int slot;
+
+	assert(strings != NULL);
+	assert(offset != NULL);
+
+	if (str == NULL) {
+		*offset = FREEBSD_CACHE_NONE;
+		return 0;
+	}
+
+	slot = ((uintptr_t)str * 2654435761U) & (strings->slots - 1);
+	while (strings->keys[slot] != NULL) {
+		if (strings->keys[slot] == str) {
+			*offset = strings->offsets[slot];
+			return 0;
+		}
+		slot = (slot + 1) & (strings->slots - 1);
+	}
+
+	len = strlen(str) + 1;
+	if (strings->len + len >= FREEBSD_CACHE_NONE)
+		return -1;
+	if (strings->len + len > strings->size) {
+		size = (strings->size == 0 ? 4096 : strings->size * 2);
+		while (size < strings->len + len)
+			size *= 2;
+		buf = realloc(strings->buf, size);
+		if (buf == NULL)
+			return -1;
+		strings->buf = buf;
+		strings->size = size;
+	}
+	memcpy(strings->buf + strings->len, str, len);
+
+	*offset = strings->len;
+	strings->keys[slot] = str;
+	strings->offsets[slot] = strings->len;
+	strings->len += len;
+
+	return 0;
+}
+
+/**
+ * @brief Finds a string in a cache
+ * @param strings The cache's strings
+ * @param size The size of strings
+ * @param offset The offset of the string
+ * @param bad Set to 1 if the offset is outside the strings
+ * @return The string or NULL
+ */
+static const char *
+freebsd_cache_string(const char *strings, uint32_t size, uint32_t offset,
+    int *bad)
+{
+	assert(strings != NULL);
+	assert(bad != NULL);
+
+	if (offset == FREEBSD_CACHE_NONE)
+		return NULL;
+	if (offset >= size) {
+		*bad = 1;
+		return NULL;
+	}
+	return strings + offset;
+}
+
+/**
+ * @brief Callback for pkg_manifest_load_items
+ *
+ * Adds the items of a manifest from freebsd_cache_read(). They point
+ * in to the cache which was checked when it was read.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+freebsd_cache_load_items(struct pkg_manifest *manifest)
+{
+	const struct freebsd_cache_header *header;
+	const struct freebsd_cache_item *items;
+	const char *strings;
+	struct pkg_manifest_item *item;
+	unsigned int pos, attr;
+	int bad;
+
+	assert(manifest != NULL);
+	assert(manifest->map != NULL);
+
+	header = manifest->map;
+	items = (const struct freebsd_cache_item *)(header + 1);
+	strings = (const char *)manifest->map + manifest->map_size -
+	    header->strings_size;
+
+	bad = 0;
+	for (pos = 0; pos < header->item_count; pos++) {
+		item = pkg_manifest_append_ref(manifest,
+		    (pkg_manifest_item_type)items[pos].type,
+		    freebsd_cache_string(strings, header->strings_size,
+		    items[pos].data, &bad));
+		if (item == NULL)
+			return -1;
+		for (attr = 0; attr < pmia_md5; attr++) {
+			if (items[pos].attrs[attr] == FREEBSD_CACHE_NONE)
+				continue;
+			pkg_manifest_item_set_attr(item,
+			    (pkg_manifest_item_attr)attr,
+			    freebsd_cache_string(strings, header->strings_size,
+			    items[pos].attrs[attr], &bad));
+		}
+		if (items[pos].has_md5) {
+			memcpy(item->md5, items[pos].md5, sizeof(item->md5));
+			item->has_md5 = 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @}
+ */
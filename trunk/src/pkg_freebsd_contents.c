@@ -0,0 +1,598 @@
+/*
+ * Copyright (C) 2007, Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkg.h"
+#include "pkg_private.h"
+
+/* The kind of each line, these match the tokens of the bison parser */
+typedef enum {
+	contents_none,		/* An unknown line or no value */
+	contents_file,
+	contents_name,
+	contents_cwd,
+	contents_pkgdep,
+	contents_conflicts,
+	contents_exec,
+	contents_unexec,
+	contents_ignore,
+	contents_dirrm,
+	contents_mtree,
+	contents_display,
+	contents_comment,	/* The @comment lines */
+	contents_deporigin,
+	contents_origin,
+	contents_md5,
+	contents_format
+} contents_token;
+
+struct contents_line {
+	contents_token	 token;
+	const char	*value;		/* Not ended with a '\0' */
+	size_t		 len;
+};
+
+/* Which parts of the file are added to the manifest */
+typedef enum {
+	contents_all,
+	contents_start,		/* All but the items */
+	contents_items		/* Only the items */
+} contents_stage;
+
+struct contents_parse {
+	const char	*pos;		/* The start of the next line */
+	const char	*end;
+	contents_stage	 stage;
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item *curitem;
+	struct pkg	*curdep;	/* The last @pkgdep */
+	int		 past_deps;	/* A line after the first @pkgdeps */
+};
+
+/*
+ * The @ directives in a perfect hash table. CONTENTS_HASH() gives a
+ * different slot for each name so only one compare is needed.
+ */
+#define CONTENTS_HASH_SIZE	16
+#define CONTENTS_HASH(name, len) \
+	(((len) * 7 + (unsigned char)(name)[0] + (unsigned char)(name)[1]) & \
+	    (CONTENTS_HASH_SIZE - 1))
+
+static const struct {
+	const char	*name;
+	size_t		 len;
+	contents_token	 token;
+} contents_directives[CONTENTS_HASH_SIZE] = {
+	[0]  = { "dirrm",	5, contents_dirrm },
+	[1]  = { "conflicts",	9, contents_conflicts },
+	[3]  = { "comment",	7, contents_comment },
+	[4]  = { "mtree",	5, contents_mtree },
+	[5]  = { "pkgdep",	6, contents_pkgdep },
+	[9]  = { "exec",	4, contents_exec },
+	[10] = { "ignore",	6, contents_ignore },
+	[11] = { "name",	4, contents_name },
+	[13] = { "unexec",	6, contents_unexec },
+	[14] = { "display",	7, contents_display },
+	[15] = { "cwd",		3, contents_cwd },
+};
+
+static int	contents_next(struct contents_parse *, struct contents_line *);
+static void	contents_comment_token(struct contents_line *);
+static int	contents_head(struct contents_parse *);
+static int	contents_data(struct contents_parse *);
+static int	contents_add_item(struct contents_parse *,
+			pkg_manifest_item_type, struct contents_line *);
+static const char *contents_string(struct contents_parse *,
+			struct contents_line *);
+static int	contents_load_items(struct pkg_manifest *);
+
+/**
+ * @defgroup FreeBSDContents FreeBSD +CONTENTS parser
+ * @ingroup FreeBSDManifest
+ * @brief A single pass parser for +CONTENTS files
+ *
+ * This accepts the same files as the bison parser in
+ * pkg_freebsd_parser.y and creates the same manifest from them. The
+ * file isn't changed or copied, each value is copied once straight into
+ * the manifest's arena. Empty lines are skipped, as FreeBSD's plist
+ * reader does, rather than being joined with the next line and the
+ * last line needn't end with a new line.
+ *
+ * Most queries of an installed package only want it's name, origin,
+ * prefix and dependencies. pkg_freebsd_parse_contents_head() only reads
+ * the start of the file, up to the first line after the @pkgdep and
+ * @conflicts lines that follow the prefix. The rest of the file is
+ * checked and the items are added by a second pass the first time they
+ * are needed. A @pkgdep or @conflicts line after an item is added then.
+ *
+ * @{
+ */
+
+/**
+ * @brief Parses a +CONTENTS file held in memory
+ * @param data The file's contents
+ * @param len The length of data
+ *
+ * This may be used from many threads at once.
+ * @return A new manifest or NULL if the file is invalid
+ */
+struct pkg_manifest *
+pkg_freebsd_parse_contents(const char *data, size_t len)
+{
+	struct contents_parse parse;
+
+	if (data == NULL || len == 0)
+		return NULL;
+
+	parse.manifest = pkg_manifest_new();
+	if (parse.manifest == NULL)
+		return NULL;
+	parse.pos = data;
+	parse.end = data + len;
+	parse.stage = contents_all;
+	parse.curitem = NULL;
+	parse.curdep = NULL;
+	parse.past_deps = 0;
+
+	if (contents_head(&parse) != 0 || contents_data(&parse) != 0) {
+		pkg_manifest_free(parse.manifest);
+		return NULL;
+	}
+	pkg_manifest_set_manifest_version(parse.manifest, "1.1");
+
+	return parse.manifest;
+}
+
+/**
+ * @brief Parses all but the items of a +CONTENTS file
+ * @param file The +CONTENTS file
+ *
+ * The items are only read when they are first needed, eg. by
+ * pkg_manifest_get_items(), which fails if the rest of the file is
+ * invalid. The manifest keeps the file until then and frees it with
+ * itself.
+ * @return A new manifest that owns file or NULL if the start of the
+ *     file is invalid
+ */
+struct pkg_manifest *
+pkg_freebsd_parse_contents_head(struct pkgfile *file)
+{
+	struct contents_parse parse;
+	const char *data;
+	uint64_t len;
+
+	if (file == NULL)
+		return NULL;
+
+	data = pkgfile_get_data(file);
+	len = pkgfile_get_size(file);
+	if (data == NULL || len == 0)
+		return NULL;
+
+	parse.manifest = pkg_manifest_new();
+	if (parse.manifest == NULL)
+		return NULL;
+	parse.pos = data;
+	parse.end = data + len;
+	parse.stage = contents_start;
+	parse.curitem = NULL;
+	parse.curdep = NULL;
+	parse.past_deps = 0;
+
+	if (contents_head(&parse) != 0 || contents_data(&parse) != 0) {
+		pkg_manifest_free(parse.manifest);
+		return NULL;
+	}
+	pkg_manifest_set_manifest_version(parse.manifest, "1.1");
+	parse.manifest->source = file;
+	parse.manifest->manifest_load_items = contents_load_items;
+
+	return parse.manifest;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup FreeBSDContentsInternal Internal +CONTENTS parser functions
+ * @ingroup FreeBSDContents
+ *
+ * @{
+ */
+
+/**
+ * @brief Reads the next line that isn't empty and finds what it is
+ *
+ * line->value points into the file and is line->len bytes long.
+ * @return 1 if a line was read
+ * @return 0 at the end of the file
+ */
+static int
+contents_next(struct contents_parse *parse, struct contents_line *line)
+{
+	const char *start, *nl, *word, *space;
+	size_t len;
+	unsigned int slot;
+
+	assert(parse != NULL);
+	assert(line != NULL);
+
+	do {
+		if (parse->pos >= parse->end)
+			return 0;
+
+		/* memchr(3) is vectorised in libc so finds the end fastest */
+		start = parse->pos;
+		nl = memchr(start, '\n', parse->end - start);
+		if (nl == NULL)
+			nl = parse->end;
+		parse->pos = nl + 1;
+	} while (nl == start);
+
+	line->token = contents_none;
+	line->value = start;
+	line->len = nl - start;
+	if (*start != '@') {
+		line->token = contents_file;
+		return 1;
+	}
+
+	/* All directives but @ignore are followed by a space */
+	word = start + 1;
+	space = memchr(word, ' ', nl - word);
+	len = (space == NULL ? nl : space) - word;
+	if (len >= 2) {
+		slot = CONTENTS_HASH(word, len);
+		if (contents_directives[slot].len == len &&
+		    memcmp(contents_directives[slot].name, word, len) == 0) {
+			line->token = contents_directives[slot].token;
+			if (space == NULL) {
+				if (line->token != contents_ignore)
+					line->token = contents_none;
+				line->value = nl;
+				line->len = 0;
+			} else {
+				line->value = space + 1;
+				line->len = nl - line->value;
+				if (line->token == contents_comment)
+					contents_comment_token(line);
+			}
+			return 1;
+		}
+	}
+	if (nl - word >= 6 && memcmp(word, "ignore", 6) == 0)
+		line->token = contents_ignore;
+
+	return 1;
+}
+
+/**
+ * @brief Finds which kind of @comment a line is
+ */
+static void
+contents_comment_token(struct contents_line *line)
+{
+	const char *value;
+	size_t len, pos;
+
+	assert(line != NULL);
+	assert(line->token == contents_comment);
+
+	value = line->value;
+	len = line->len;
+	if (len == 0) {
+		line->token = contents_none;
+		return;
+	}
+	switch (value[0]) {
+	case 'D':
+		if (len >= 10 && memcmp(value, "DEPORIGIN:", 10) == 0) {
+			line->token = contents_deporigin;
+			line->value += 10;
+			line->len -= 10;
+		}
+		break;
+	case 'M':
+		if (len != 36 || memcmp(value, "MD5:", 4) != 0)
+			break;
+		for (pos = 4; pos < len; pos++) {
+			if ((value[pos] < '0' || value[pos] > '9') &&
+			    (value[pos] < 'a' || value[pos] > 'f'))
+				return;
+		}
+		line->token = contents_md5;
+		line->value += 4;
+		line->len -= 4;
+		break;
+	case 'O':
+		if (len >= 7 && memcmp(value, "ORIGIN:", 7) == 0) {
+			line->token = contents_origin;
+			line->value += 7;
+			line->len -= 7;
+		}
+		break;
+	case 'P':
+		/* The lexer matched any character between the 1s */
+		if (len >= 23 &&
+		    memcmp(value, "PKG_FORMAT_REVISION:1", 21) == 0 &&
+		    value[22] == '1')
+			line->token = contents_format;
+		break;
+	}
+}
+
+/**
+ * @brief Reads the start of the file
+ *
+ * This is the format, name, origin and prefix. The prefix may be the
+ * first line or after the origin.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+contents_head(struct contents_parse *parse)
+{
+	struct contents_line line, name, origin, prefix;
+
+	assert(parse != NULL);
+
+	if (contents_next(parse, &line) != 1)
+		return -1;
+	prefix.token = contents_none;
+	if (line.token == contents_cwd) {
+		prefix = line;
+		if (contents_next(parse, &line) != 1)
+			return -1;
+	}
+	if (line.token != contents_format)
+		return -1;
+
+	if (contents_next(parse, &line) != 1 || line.token != contents_name)
+		return -1;
+	name = line;
+
+	if (contents_next(parse, &line) != 1 || line.token != contents_origin)
+		return -1;
+	origin = line;
+
+	if (prefix.token == contents_none) {
+		if (contents_next(parse, &line) != 1 ||
+		    line.token != contents_cwd)
+			return -1;
+		prefix = line;
+	}
+
+	/* The start was added by the first pass */
+	if (parse->stage == contents_items)
+		return 0;
+
+	pkg_manifest_set_name(parse->manifest, contents_string(parse, &name));
+	pkg_manifest_set_attr(parse->manifest, pkgm_origin,
+	    contents_string(parse, &origin));
+	pkg_manifest_set_attr(parse->manifest, pkgm_prefix,
+	    contents_string(parse, &prefix));
+
+	return 0;
+}
+
+/**
+ * @brief Reads the items, dependencies and conflicts
+ *
+ * The first stage stops at the first line after the dependencies and
+ * conflicts at the start. Every other line is checked but only those
+ * of the current stage are added.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+contents_data(struct contents_parse *parse)
+{
+	struct contents_line line;
+	struct pkg *pkg;
+
+	assert(parse != NULL);
+
+	while (contents_next(parse, &line) == 1) {
+		if (!parse->past_deps && line.token != contents_pkgdep &&
+		    line.token != contents_deporigin &&
+		    line.token != contents_conflicts) {
+			parse->past_deps = 1;
+			if (parse->stage == contents_start)
+				return 0;
+		}
+
+		switch (line.token) {
+		case contents_file:
+			if (contents_add_item(parse, pmt_file, &line) != 0)
+				return -1;
+			break;
+		case contents_cwd:
+			if (contents_add_item(parse, pmt_chdir, &line) != 0)
+				return -1;
+			break;
+		case contents_exec:
+			if (contents_add_item(parse, pmt_execute, &line) != 0)
+				return -1;
+			break;
+		case contents_unexec:
+			if (contents_add_item(parse, pmt_execute, &line) != 0)
+				return -1;
+			pkg_manifest_item_set_attr(parse->curitem,
+			    pmia_deinstall, "YES");
+			break;
+		case contents_dirrm:
+			if (contents_add_item(parse, pmt_dir, &line) != 0)
+				return -1;
+			break;
+		case contents_mtree:
+			if (contents_add_item(parse, pmt_dirlist, &line) != 0)
+				return -1;
+			break;
+		case contents_display:
+			if (contents_add_item(parse, pmt_output, &line) != 0)
+				return -1;
+			break;
+		case contents_ignore:
+			/* The next line is the file to ignore */
+			if (contents_next(parse, &line) != 1 ||
+			    line.token != contents_file)
+				return -1;
+			if (contents_add_item(parse, pmt_file, &line) != 0)
+				return -1;
+			pkg_manifest_item_set_attr(parse->curitem,
+			    pmia_ignore, "YES");
+			break;
+		case contents_comment:
+			if (contents_add_item(parse, pmt_comment, &line) != 0)
+				return -1;
+			break;
+		case contents_pkgdep:
+			parse->curdep = NULL;
+			parse->curitem = NULL;
+			/* Those at the start were added by the first stage */
+			if (parse->stage == contents_items && !parse->past_deps)
+				break;
+			pkg = pkg_new_freebsd_empty(contents_string(parse,
+			    &line));
+			if (pkg == NULL)
+				return -1;
+			pkg_manifest_add_dependency(parse->manifest, pkg);
+			parse->curdep = pkg;
+			break;
+		case contents_conflicts:
+			parse->curdep = NULL;
+			parse->curitem = NULL;
+			if (parse->stage == contents_items && !parse->past_deps)
+				break;
+			pkg_manifest_add_conflict(parse->manifest,
+			    contents_string(parse, &line));
+			break;
+		case contents_deporigin:
+			if (parse->curdep != NULL)
+				pkg_set_origin(parse->curdep,
+				    contents_string(parse, &line));
+			break;
+		case contents_md5:
+			/* Held in binary so it isn't copied as a string */
+			pkg_manifest_item_set_md5(parse->curitem, line.value);
+			break;
+		case contents_none:
+		case contents_name:
+		case contents_origin:
+		case contents_format:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Adds an item with the line's value to the manifest
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+contents_add_item(struct contents_parse *parse, pkg_manifest_item_type type,
+		struct contents_line *line)
+{
+	struct pkg_manifest_item *item;
+
+	assert(parse != NULL);
+	assert(line != NULL);
+
+	assert(parse->stage != contents_start);
+
+	parse->curdep = NULL;
+	item = pkg_manifest_append_data(parse->manifest, type, line->value,
+	    line->len);
+	if (item == NULL)
+		return -1;
+	parse->curitem = item;
+
+	return 0;
+}
+
+/**
+ * @brief Gets a line's value as a string for the functions that need one
+ *
+ * The string is interned in the manifest's arena.
+ * @return The string or NULL on error
+ */
+static const char *
+contents_string(struct contents_parse *parse, struct contents_line *line)
+{
+	assert(parse != NULL);
+	assert(line != NULL);
+
+	return pkg_manifest_intern(parse->manifest, line->value, line->len);
+}
+
+/**
+ * @brief Callback for pkg_manifest_load_items
+ *
+ * Adds the items of a manifest from pkg_freebsd_parse_contents_head()
+ * and checks the part of the file the first pass didn't read.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+contents_load_items(struct pkg_manifest *manifest)
+{
+	struct contents_parse parse;
+	int ret;
+
+	assert(manifest != NULL);
+	assert(manifest->source != NULL);
+
+	parse.manifest = manifest;
+	parse.pos = pkgfile_get_data(manifest->source);
+	parse.end = parse.pos + pkgfile_get_size(manifest->source);
+	parse.stage = contents_items;
+	parse.curitem = NULL;
+	parse.curdep = NULL;
+	parse.past_deps = 0;
+
+	if (contents_head(&parse) != 0)
+		ret = -1;
+	else
+		ret = contents_data(&parse);
+
+	/* The items point in to the arena so the file isn't needed */
+	pkgfile_free(manifest->source);
+	manifest->source = NULL;
+
+	return ret;
+}
+
+/**
+ * @}
+ */
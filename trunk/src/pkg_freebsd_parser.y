@@ -1,22 +1,20 @@
 %{
 #include "pkg.h"
+#include "pkg_private.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
-
-#define YYPARSE_PARAM param
-#define YYPARSE_PARAM_TYPE struct pkg_manifest **
-
-int pkg_freebsd_lex(void);
-int pkg_freebsd_parse(YYPARSE_PARAM_TYPE);
-void pkg_freebsd_error(const char *);
-
-static struct pkg_manifest_item *curitem = NULL;
-static struct pkg *curdep = NULL;
-static struct pkg_manifest *pkg_manifest = NULL;
 %}
 
+/*
+ * All state is kept in the struct freebsd_parse passed to the parser
+ * so more than one +CONTENTS file may be parsed at a time.
+ */
+%pure-parser
+%parse-param { struct freebsd_parse *parse }
+%lex-param { struct freebsd_parse *parse }
+
 %union {
 	char *str_val;
 	struct pkg_manifest_item *item;
@@ -28,77 +26,68 @@ static struct pkg_manifest *pkg_manifest = NULL;
 
 %type <item> contents_line
 
+%{
+int pkg_freebsd_lex(YYSTYPE *, struct freebsd_parse *);
+void pkg_freebsd_error(struct freebsd_parse *, const char *);
+%}
+
 %%
 contents_file:
 	COMMENT FORMAT_1_1 NL head_1_1 CWD NL data_1_1 {
-		assert(pkg_manifest != NULL);
+		assert(parse->manifest != NULL);
 
 		/* Set the package prefix */
-		pkg_manifest_set_attr(pkg_manifest, pkgm_prefix, $5);
+		pkg_manifest_set_attr(parse->manifest, pkgm_prefix, $5);
 		free($5);
 
-		pkg_manifest_set_manifest_version(pkg_manifest, "1.1");
-
-		(*YYPARSE_PARAM) = pkg_manifest;
-
-		/* Reset static values for the next run */
-		curitem = NULL;
-		curdep = NULL;
-		pkg_manifest = NULL;
+		pkg_manifest_set_manifest_version(parse->manifest, "1.1");
 	}
 	| CWD NL COMMENT FORMAT_1_1 NL head_1_1 data_1_1 {
-		assert(pkg_manifest != NULL);
+		assert(parse->manifest != NULL);
 
 		/* Set the package prefix */
-		pkg_manifest_set_attr(pkg_manifest, pkgm_prefix, $1);
+		pkg_manifest_set_attr(parse->manifest, pkgm_prefix, $1);
 		free($1);
 
-		pkg_manifest_set_manifest_version(pkg_manifest, "1.1");
-
-		(*YYPARSE_PARAM) = pkg_manifest;
-
-		/* Reset static values for the next run */
-		curitem = NULL;
-		curdep = NULL;
-		pkg_manifest = NULL;
+		pkg_manifest_set_manifest_version(parse->manifest, "1.1");
 	}
 
 head_1_1:
 	NAME NL COMMENT ORIGIN NL {
-		assert(pkg_manifest == NULL);
-		if (pkg_manifest == NULL)
-			pkg_manifest = pkg_manifest_new();
-		pkg_manifest_set_name(pkg_manifest, $1);
+		assert(parse->manifest == NULL);
+		if (parse->manifest == NULL)
+			parse->manifest = pkg_manifest_new();
+		pkg_manifest_set_name(parse->manifest, $1);
 		free($1);
 
 		/* Set the package origin */
-		pkg_manifest_set_attr(pkg_manifest, pkgm_origin, $4);
+		pkg_manifest_set_attr(parse->manifest, pkgm_origin, $4);
 		free($4);
 	}
 
 data_1_1:
 	| data_1_1 contents_line NL {
-		if (pkg_manifest == NULL)
-			pkg_manifest = pkg_manifest_new();
-		pkg_manifest_append_item(pkg_manifest, $2);
+		if (parse->manifest == NULL)
+			parse->manifest = pkg_manifest_new();
+		pkg_manifest_append_item(parse->manifest, $2);
 	}
 	| data_1_1 PKGDEP NL {
 		struct pkg *pkg;
-		assert(pkg_manifest != NULL);
+		assert(parse->manifest != NULL);
 
 		pkg = pkg_new_freebsd_empty($2);
-		pkg_manifest_add_dependency(pkg_manifest, pkg);
+		pkg_manifest_add_dependency(parse->manifest, pkg);
 		free($2);
-		curdep = pkg;
-		curitem = NULL;
+		parse->curdep = pkg;
+		parse->curitem = NULL;
 	}
 	| data_1_1 CONFLICTS NL {
-		assert(pkg_manifest != NULL);
+		assert(parse->manifest != NULL);
 
-		pkg_manifest_add_conflict(pkg_manifest, $2);
+		pkg_manifest_add_conflict(parse->manifest, $2);
 		free($2);
-		curdep = NULL;
-		curitem = NULL;
+		parse->curdep = NULL;
+		parse->curitem = NULL;
 	}
 	| data_1_1 COMMENT comment_value NL;
 
@@ -106,68 +95,68 @@ contents_line
 	: PKGFILE {
 		$$ = pkg_manifest_item_new(pmt_file, $1);
 		free($1);
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	| CWD {
 		$$ = pkg_manifest_item_new(pmt_chdir, $1);
 		free($1);
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	| EXEC {
 		$$ = pkg_manifest_item_new(pmt_execute, $1);
 		free($1);
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	| UNEXEC {
 		$$ = pkg_manifest_item_new(pmt_execute, $1);
 		pkg_manifest_item_set_attr($$, pmia_deinstall, "YES");
 		free($1);
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	| DIRRM {
 		$$ = pkg_manifest_item_new(pmt_dir, $1);
 		free($1);
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	| MTREE {
 		$$ = pkg_manifest_item_new(pmt_dirlist, $1);
 		free($1);
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	| DISPLAY {
 		$$ = pkg_manifest_item_new(pmt_output, $1);
 		free($1);
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	| IGNORE NL PKGFILE {
 		$$ = pkg_manifest_item_new(pmt_file, $3);
 		free($3);
 		pkg_manifest_item_set_attr($$, pmia_ignore, "YES");
-		curitem = $$;
-		curdep = NULL;
+		parse->curitem = $$;
+		parse->curdep = NULL;
 	}
 	;
 
 comment_value
 	: DATA {
-		curitem = pkg_manifest_item_new(pmt_comment, $1);
-		pkg_manifest_append_item(pkg_manifest, curitem);
+		parse->curitem = pkg_manifest_item_new(pmt_comment, $1);
+		pkg_manifest_append_item(parse->manifest, parse->curitem);
 		free($1);
-		curdep = NULL;
+		parse->curdep = NULL;
 	}
 	| DEPORIGIN {
-		pkg_set_origin(curdep, $1);
+		pkg_set_origin(parse->curdep, $1);
 		free($1);
 	}
 	| MD5 {
-		pkg_manifest_item_set_attr(curitem, pmia_md5, $1);
+		pkg_manifest_item_set_attr(parse->curitem, pmia_md5, $1);
 		free($1);
 	}
 	;
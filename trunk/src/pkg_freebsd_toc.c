@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2006, Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "pkg_private.h"
+
+/* The first line of a table of contents */
+#define FREEBSD_TOC_MAGIC	"+TOC"
+#define FREEBSD_TOC_VERSION	2
+
+/* The longest line in a table of contents */
+#define FREEBSD_TOC_LINE	(FILENAME_MAX + 64)
+
+/* The number of entries first allocated in a table of contents */
+#define FREEBSD_TOC_MIN		16
+
+static char	*freebsd_toc_name(const char *);
+static int	 freebsd_toc_add(struct freebsd_toc *, uint64_t, uint64_t,
+			const char *);
+
+/**
+ * @defgroup FreebsdPackageToc FreeBSD package table of contents
+ * @ingroup FreebsdPackage
+ * @brief An index of the entries in a package
+ *
+ * A package archive can only be read from the start. The table of
+ * contents is a file next to the package, named with a .toc suffix,
+ * listing each entry's name, size and offset in the uncompressed
+ * archive. It tells the reader where the control files end so it can
+ * stop without reading the first of the other files. When the package
+ * isn't compressed the offset is also the position in the file so any
+ * entry can be read by seeking to it.
+ *
+ * The first line holds the format version, the size, modification time
+ * and inode of the package and if it can be seeked in. The nanoseconds
+ * of the modification time are kept as a package rebuilt in the same
+ * second is often the same size after the archive is padded. Each
+ * following line is an entry's offset, size then name. A table that
+ * doesn't match the package it is next to is ignored.
+ *
+ * @{
+ */
+
+/**
+ * @brief Creates the table of contents for a package
+ * @param path The package file
+ *
+ * The package is read once to find it's entries. The table is written
+ * to a temporary file then renamed so a reader will never find part
+ * of one.
+ * @return  0 on success
+ * @return -1 on error
+ */
+int
+pkg_freebsd_create_toc(const char *path)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	struct stat sb;
+	FILE *pkg_fd, *toc_fd;
+	char *toc_name, *tmp_name;
+	int64_t offset;
+	int fd, ret, seekable;
+
+	if (path == NULL)
+		return -1;
+
+	toc_name = freebsd_toc_name(path);
+	if (toc_name == NULL)
+		return -1;
+	asprintf(&tmp_name, "%s.XXXXXX", toc_name);
+	if (tmp_name == NULL) {
+		free(toc_name);
+		return -1;
+	}
+
+	pkg_fd = fopen(path, "r");
+	if (pkg_fd == NULL) {
+		free(tmp_name);
+		free(toc_name);
+		return -1;
+	}
+	if (fstat(fileno(pkg_fd), &sb) != 0 || !S_ISREG(sb.st_mode)) {
+		fclose(pkg_fd);
+		free(tmp_name);
+		free(toc_name);
+		return -1;
+	}
+
+	fd = mkstemp(tmp_name);
+	if (fd == -1 || (toc_fd = fdopen(fd, "w")) == NULL) {
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp_name);
+		}
+		fclose(pkg_fd);
+		free(tmp_name);
+		free(toc_name);
+		return -1;
+	}
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+	ret = -1;
+	if (archive_read_open_stream(a, pkg_fd, 16 * 1024) != ARCHIVE_OK)
+		goto done;
+
+	/* Read the first header to find the compression */
+	offset = archive_position_uncompressed(a);
+	if (archive_read_next_header(a, &entry) != ARCHIVE_OK)
+		goto done;
+	seekable = (archive_compression(a) == ARCHIVE_COMPRESSION_NONE);
+	fprintf(toc_fd, "%s %d %jd %jd %ld %ju %d\n", FREEBSD_TOC_MAGIC,
+	    FREEBSD_TOC_VERSION, (intmax_t)sb.st_size,
+	    (intmax_t)sb.st_mtimespec.tv_sec, (long)sb.st_mtimespec.tv_nsec,
+	    (uintmax_t)sb.st_ino, seekable);
+
+	do {
+		/* A name on more than one line can't be read back */
+		if (strchr(archive_entry_pathname(entry), '\n') != NULL)
+			goto done;
+		fprintf(toc_fd, "%jd %jd %s\n", (intmax_t)offset,
+		    (intmax_t)archive_entry_size(entry),
+		    archive_entry_pathname(entry));
+
+		/* The position after skipping includes the entry's padding */
+		if (archive_read_data_skip(a) != ARCHIVE_OK)
+			goto done;
+		offset = archive_position_uncompressed(a);
+	} while ((ret = archive_read_next_header(a, &entry)) == ARCHIVE_OK);
+
+	ret = (ret == ARCHIVE_EOF ? 0 : -1);
+
+done:
+	archive_read_finish(a);
+	fclose(pkg_fd);
+	if (fclose(toc_fd) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp_name, toc_name) != 0)
+		ret = -1;
+	if (ret != 0)
+		unlink(tmp_name);
+	free(tmp_name);
+	free(toc_name);
+
+	return ret;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup FreebsdPackageTocInternal Internal table of contents functions
+ * @ingroup FreebsdPackageToc
+ *
+ * @{
+ */
+
+/**
+ * @brief Reads the table of contents for a package
+ * @param path The package file
+ * @return The table of contents or NULL if there isn't a valid one
+ */
+struct freebsd_toc *
+freebsd_toc_read(const char *path)
+{
+	struct freebsd_toc *toc;
+	struct stat sb;
+	FILE *fd;
+	char *toc_name, *name, *end;
+	char line[FREEBSD_TOC_LINE];
+	intmax_t size, mtime;
+	uintmax_t ino;
+	uint64_t offset, entry_size;
+	long mtime_nsec;
+	int version, seekable;
+
+	assert(path != NULL);
+
+	if (stat(path, &sb) != 0)
+		return NULL;
+
+	toc_name = freebsd_toc_name(path);
+	if (toc_name == NULL)
+		return NULL;
+	fd = fopen(toc_name, "r");
+	free(toc_name);
+	if (fd == NULL)
+		return NULL;
+
+	/* Check the table is for this version of the package */
+	if (fgets(line, sizeof(line), fd) == NULL ||
+	    sscanf(line, FREEBSD_TOC_MAGIC " %d %jd %jd %ld %ju %d", &version,
+	    &size, &mtime, &mtime_nsec, &ino, &seekable) != 6 ||
+	    version != FREEBSD_TOC_VERSION || size != (intmax_t)sb.st_size ||
+	    mtime != (intmax_t)sb.st_mtimespec.tv_sec ||
+	    mtime_nsec != (long)sb.st_mtimespec.tv_nsec ||
+	    ino != (uintmax_t)sb.st_ino) {
+		fclose(fd);
+		return NULL;
+	}
+
+	toc = malloc(sizeof(struct freebsd_toc));
+	if (toc == NULL) {
+		fclose(fd);
+		return NULL;
+	}
+	toc->entries = NULL;
+	toc->count = 0;
+	toc->size = 0;
+	toc->control_count = 0;
+	toc->seekable = seekable;
+
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		end = strchr(line, '\n');
+		if (end == NULL)
+			goto bad;
+		*end = '\0';
+
+		offset = strtoull(line, &end, 10);
+		if (*end != ' ')
+			goto bad;
+		entry_size = strtoull(end + 1, &name, 10);
+		if (*name != ' ' || name[1] == '\0')
+			goto bad;
+		if (freebsd_toc_add(toc, offset, entry_size, name + 1) != 0)
+			goto bad;
+	}
+	if (ferror(fd) || toc->count == 0)
+		goto bad;
+	fclose(fd);
+
+	/* The control files are at the start of a package */
+	while (toc->control_count < toc->count &&
+	    toc->entries[toc->control_count].name[0] == '+')
+		toc->control_count++;
+
+	return toc;
+
+bad:
+	fclose(fd);
+	freebsd_toc_free(toc);
+	return NULL;
+}
+
+/**
+ * @brief Finds a control file in a table of contents
+ * @param name The name of the file without any directory
+ * @return The index of the entry or -1 if it isn't found
+ */
+int
+freebsd_toc_find_control(struct freebsd_toc *toc, const char *name)
+{
+	const char *entry_name;
+	unsigned int pos;
+
+	assert(toc != NULL);
+	assert(name != NULL);
+
+	for (pos = 0; pos < toc->control_count; pos++) {
+		entry_name = strrchr(toc->entries[pos].name, '/');
+		entry_name = (entry_name == NULL ? toc->entries[pos].name :
+		    entry_name + 1);
+		if (strcmp(entry_name, name) == 0)
+			return pos;
+	}
+	return -1;
+}
+
+/**
+ * @brief Frees a table of contents
+ */
+void
+freebsd_toc_free(struct freebsd_toc *toc)
+{
+	unsigned int pos;
+
+	if (toc == NULL)
+		return;
+
+	for (pos = 0; pos < toc->count; pos++)
+		free(toc->entries[pos].name);
+	free(toc->entries);
+	free(toc);
+}
+
+/**
+ * @brief Gets the name of the table of contents for a package
+ * @return A string the caller frees or NULL
+ */
+static char *
+freebsd_toc_name(const char *path)
+{
+	char *name;
+
+	assert(path != NULL);
+
+	asprintf(&name, "%s.toc", path);
+	return name;
+}
+
+/**
+ * @brief Adds an entry to the end of a table of contents
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+freebsd_toc_add(struct freebsd_toc *toc, uint64_t offset, uint64_t size,
+		const char *name)
+{
+	struct freebsd_toc_entry *entries;
+	unsigned int new_size;
+
+	assert(toc != NULL);
+	assert(name != NULL);
+
+	if (toc->count == toc->size) {
+		new_size = (toc->size == 0 ? FREEBSD_TOC_MIN : toc->size * 2);
+		entries = realloc(toc->entries,
+		    new_size * sizeof(struct freebsd_toc_entry));
+		if (entries == NULL)
+			return -1;
+		toc->entries = entries;
+		toc->size = new_size;
+	}
+	entries = toc->entries;
+
+	entries[toc->count].name = strdup(name);
+	if (entries[toc->count].name == NULL)
+		return -1;
+	entries[toc->count].offset = offset;
+	entries[toc->count].size = size;
+	toc->count++;
+
+	return 0;
+}
+
+/**
+ * @}
+ */
@@ -28,11 +28,50 @@
 #include "pkg.h"
 #include "pkg_private.h"
 
+#include <sys/mman.h>
+
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/* The size of a manifest's first arena block, each new block doubles */
+#define PKGM_ARENA_MIN		4096
+#define PKGM_ARENA_MAX		(256 * 1024)
+
+/* The alignment of objects allocated from an arena */
+#define PKGM_ARENA_ALIGN	sizeof(void *)
+
+/* The first size of the interned string table */
+#define PKGM_STRINGS_MIN	64
+
+/* The first size of the dependency, conflict and item arrays */
+#define PKGM_LIST_MIN		8
+
+/* The directories found while making a path table */
+struct pkgm_dir_slots {
+	unsigned int	*slots;		/* Each directory's index plus one */
+	unsigned int	 size;
+	unsigned int	 dirs_size;	/* The size of manifest->dirs */
+};
+
+static void	*pkg_manifest_alloc(struct pkg_manifest *, size_t, size_t);
+static char	*pkg_manifest_strndup(struct pkg_manifest *, const char *,
+			size_t);
+static int	 pkg_manifest_intern_grow(struct pkg_manifest *);
+static uint32_t	 pkg_manifest_hash(const char *, size_t);
+static void	*pkg_manifest_item_alloc(struct pkg_manifest_item *, size_t);
+static void	*pkg_manifest_list_grow(void *, unsigned int, unsigned int *);
+static int	 pkg_manifest_build_paths(struct pkg_manifest *);
+static int	 pkg_manifest_add_dir(struct pkg_manifest *,
+			struct pkgm_dir_slots *, const char *, size_t,
+			unsigned int *);
+static int	 pkg_manifest_join(char *, size_t, const char *, const char *,
+			size_t);
+static void	 pkg_manifest_free_paths(struct pkg_manifest *);
+
 
 /**
  * @defgroup PackageManifest Package manifest functions
@@ -64,23 +103,42 @@ pkg_manifest_new()
 	manifest->manifest_version = NULL;
 	manifest->name = NULL;
 
-	manifest->deps_list_clean = 1;
-	manifest->deps_list_count = 0;
-	manifest->deps_list = NULL;
-
-	manifest->conflict_list = NULL;
-
-	manifest->item_list_clean = 1;
-	manifest->item_list = NULL;
-
 	for (pos = 0; pos < pkgm_max; pos++) {
 		manifest->attrs[pos] = NULL;
 	}
-	STAILQ_INIT(&manifest->deps);
-	STAILQ_INIT(&manifest->conflicts);
-	STAILQ_INIT(&manifest->items);
+
+	manifest->deps = NULL;
+	manifest->deps_count = 0;
+	manifest->deps_size = 0;
+
+	manifest->conflicts = NULL;
+	manifest->conflicts_count = 0;
+	manifest->conflicts_size = 0;
+
+	manifest->items = NULL;
+	manifest->items_count = 0;
+	manifest->items_size = 0;
 
 	manifest->manifest_get_file = NULL;
+	manifest->manifest_load_items = NULL;
+	manifest->source = NULL;
+
+	manifest->arena = NULL;
+	manifest->arena_pos = NULL;
+	manifest->arena_left = 0;
+	manifest->heap_items = 0;
+
+	manifest->strings = NULL;
+	manifest->strings_size = 0;
+	manifest->strings_count = 0;
+
+	manifest->map = NULL;
+	manifest->map_size = 0;
+
+	manifest->paths = NULL;
+	manifest->paths_count = 0;
+	manifest->dirs = NULL;
+	manifest->dirs_count = 0;
 
 	return manifest;
 }
@@ -88,46 +146,40 @@ pkg_manifest_new()
 /**
  * @brief Cleans up a package manifest
  * @param manifest The manifest to free
+ *
+ * Most of the manifest is in it's arena so is freed at once. Only the
+ * dependencies and items created with pkg_manifest_item_new() are
+ * freed on their own.
  * @return  0 on success
  * @return -1 on failure
  */
 int
 pkg_manifest_free(struct pkg_manifest *manifest)
 {
-	struct pkgm_deps *dep;
-	struct pkgm_conflicts *conflict;
-	struct pkgm_items *item;
+	struct pkgm_arena_block *block;
 	unsigned int pos;
 
 	if (manifest == NULL)
 		return -1;
 
-	while ((dep = STAILQ_FIRST(&manifest->deps)) != NULL) {
-		STAILQ_REMOVE_HEAD(&manifest->deps, list);
-		pkg_free(dep->pkg);
-		free(dep);
-	}
+	for (pos = 0; pos < manifest->deps_count; pos++)
+		pkg_free(manifest->deps[pos]);
+	free(manifest->deps);
 
-	while ((conflict = STAILQ_FIRST(&manifest->conflicts)) != NULL) {
-		STAILQ_REMOVE_HEAD(&manifest->conflicts, list);
-		free(conflict->conflict);
-		free(conflict);
-	}
+	/* The conflict strings are in the arena */
+	free(manifest->conflicts);
 
-	while ((item = STAILQ_FIRST(&manifest->items)) != NULL) {
-		STAILQ_REMOVE_HEAD(&manifest->items, list);
-		pkg_manifest_item_free(item->item);
-		free(item);
+	if (manifest->heap_items > 0) {
+		for (pos = 0; pos < manifest->items_count; pos++) {
+			if (manifest->items[pos]->arena == NULL)
+				pkg_manifest_item_free(manifest->items[pos]);
+		}
 	}
+	free(manifest->items);
+	pkg_manifest_free_paths(manifest);
 
-	if (manifest->deps_list != NULL)
-		free(manifest->deps_list);
-
-	if (manifest->conflict_list != NULL)
-		free(manifest->conflict_list);
-
-	if (manifest->item_list != NULL)
-		free(manifest->item_list);
+	if (manifest->source != NULL)
+		pkgfile_free(manifest->source);
 
 	for (pos = 0; pos < pkgm_max; pos++) {
 		if (manifest->attrs[pos] != NULL)
@@ -137,6 +189,15 @@ pkg_manifest_free(struct pkg_manifest *manifest)
 	if (manifest->name != NULL)
 		free(manifest->name);
 
+	free(manifest->strings);
+	while ((block = manifest->arena) != NULL) {
+		manifest->arena = block->next;
+		free(block);
+	}
+
+	if (manifest->map != NULL)
+		munmap(manifest->map, manifest->map_size);
+
 	pkgfile_free(manifest->file);
 
 	if (manifest->manifest_version != NULL)
@@ -200,21 +261,20 @@ pkg_manifest_get_manifest_version(struct pkg_manifest *manifest)
 int
 pkg_manifest_add_dependency(struct pkg_manifest *manifest, struct pkg *dep)
 {
-	struct pkgm_deps *the_dep;
+	struct pkg **deps;
 
 	if (manifest == NULL || dep == NULL)
 		return -1;
 
-	manifest->deps_list_clean = 0;
-
-	/* Create the new dependency */
-	the_dep = malloc(sizeof(struct pkgm_deps));
-	if (the_dep == NULL)
+	deps = pkg_manifest_list_grow(manifest->deps, manifest->deps_count,
+	    &manifest->deps_size);
+	if (deps == NULL)
 		return -1;
-	the_dep->pkg = dep;
+	manifest->deps = deps;
 
 	/* Add the dependency to the list */
-	STAILQ_INSERT_TAIL(&manifest->deps, the_dep, list);
+	deps[manifest->deps_count++] = dep;
+	deps[manifest->deps_count] = NULL;
 
 	return 0;
 }
@@ -231,17 +291,16 @@ int
 pkg_manifest_replace_dependency(struct pkg_manifest *manifest,
     struct pkg *orig_pkg, struct pkg *new_pkg)
 {
-	struct pkgm_deps *dep;
+	unsigned int pos;
 
 	if (manifest == NULL || orig_pkg == NULL || new_pkg == NULL)
 		return -1;
 
 	/* Replace the old package with the new package */
-	STAILQ_FOREACH(dep, &manifest->deps, list) {
-		if (dep->pkg == orig_pkg) {
-			pkg_free(dep->pkg);
-			dep->pkg = new_pkg;
-			manifest->deps_list_clean = 0;
+	for (pos = 0; pos < manifest->deps_count; pos++) {
+		if (manifest->deps[pos] == orig_pkg) {
+			pkg_free(manifest->deps[pos]);
+			manifest->deps[pos] = new_pkg;
 
 			return 0;
 		}
@@ -254,57 +313,22 @@ pkg_manifest_replace_dependency(struct pkg_manifest *manifest,
 /**
  * @brief Gets an array of packages depended on
  * @param manifest The manifest
+ *
+ * The array belongs to the manifest and may move when a dependency is
+ * added.
  * @return A NULL terminated array of packages
  * @return NULL on error or no dependencies
  */
 struct pkg **
 pkg_manifest_get_dependencies(struct pkg_manifest *manifest)
 {
-	struct pkgm_deps *dep;
-	unsigned int count;
-
 	if (manifest == NULL)
 		return NULL;
 
-	if (manifest->deps_list_clean == 0) {
-	}
-
-	if (manifest->deps_list != NULL && manifest->deps_list_clean != 0)
-		return manifest->deps_list;
-
-	/* Find out how much space is needed */
-	count = 0;
-	STAILQ_FOREACH(dep, &manifest->deps, list) {
-		count++;
-	}
-	if (count == 0)
+	if (manifest->deps_count == 0)
 		return NULL;
 
-	/* Only reallocate the memory when the list is a different size */
-	if (manifest->deps_list_count != count) {
-		if (manifest->deps_list != NULL) {
-			/* remove the old list to be replaces later */
-			free(manifest->deps_list);
-		}
-
-		/* Allocate the space for the dependency list */
-		manifest->deps_list = malloc((count + 1) * sizeof(struct pkg*));
-		if (manifest->deps_list == NULL)
-			return NULL;
-
-		manifest->deps_list_count = count;
-	}
-
-	/* Populate the depend list */
-	count = 0;
-	STAILQ_FOREACH(dep, &manifest->deps, list) {
-		manifest->deps_list[count] = dep->pkg;
-		count++;
-	}
-	manifest->deps_list[count] = NULL;
-	manifest->deps_list_clean = 1;
-
-	return manifest->deps_list;
+	return manifest->deps;
 }
 
 /**
@@ -317,24 +341,26 @@ pkg_manifest_get_dependencies(struct pkg_manifest *manifest)
 int
 pkg_manifest_add_conflict(struct pkg_manifest *manifest, const char *conflict)
 {
-	struct pkgm_conflicts *the_conflict;
+	char **conflicts, *the_conflict;
 
 	if (manifest == NULL || conflict == NULL)
 		return -1;
 
-	if (manifest->conflict_list != NULL) {
-		free(manifest->conflict_list);
-		manifest->conflict_list = NULL;
-	}
+	conflicts = pkg_manifest_list_grow(manifest->conflicts,
+	    manifest->conflicts_count, &manifest->conflicts_size);
+	if (conflicts == NULL)
+		return -1;
+	manifest->conflicts = conflicts;
 
 	/* Create the new conflict */
-	the_conflict = malloc(sizeof(struct pkgm_conflicts));
+	the_conflict = pkg_manifest_strndup(manifest, conflict,
+	    strlen(conflict));
 	if (the_conflict == NULL)
 		return -1;
-	the_conflict->conflict = strdup(conflict);
 
 	/* Add the conflict to the list */
-	STAILQ_INSERT_TAIL(&manifest->conflicts, the_conflict, list);
+	conflicts[manifest->conflicts_count++] = the_conflict;
+	conflicts[manifest->conflicts_count] = NULL;
 
 	return 0;
 }
@@ -408,6 +434,10 @@ pkg_manifest_set_attr(struct pkg_manifest *manifest, pkg_manifest_attr attr,
 			return -1;
 	}
 
+	/* The files are in the prefix until the first @cwd */
+	if (attr == pkgm_prefix)
+		pkg_manifest_free_paths(manifest);
+
 	/* If the old attribure was set free it */
 	if (manifest->attrs[attr] != NULL) {
 		free(manifest->attrs[attr]);
@@ -444,21 +474,29 @@ int
 pkg_manifest_append_item(struct pkg_manifest *manifest,
     struct pkg_manifest_item *item)
 {
-	struct pkgm_items *the_item;
+	struct pkg_manifest_item **items;
 
 	if (manifest == NULL || item == NULL)
 		return -1;
 
-	manifest->item_list_clean = 0;
+	/* Keep the item after any that haven't been read yet */
+	if (pkg_manifest_load_items(manifest) != 0)
+		return -1;
+	pkg_manifest_free_paths(manifest);
 
-	/* Create the new item */
-	the_item = malloc(sizeof(struct pkgm_items));
-	if (the_item == NULL)
+	items = pkg_manifest_list_grow(manifest->items, manifest->items_count,
+	    &manifest->items_size);
+	if (items == NULL)
 		return -1;
-	the_item->item = item;
+	manifest->items = items;
 
-	/* Add the conflict to the list */
-	STAILQ_INSERT_TAIL(&manifest->items, the_item, list);
+	if (item->arena == NULL)
+		manifest->heap_items++;
+
+	/* Add the item to the list */
+	item->manifest = manifest;
+	items[manifest->items_count++] = item;
+	items[manifest->items_count] = NULL;
 
 	return 0;
 }
@@ -472,37 +510,13 @@ pkg_manifest_append_item(struct pkg_manifest *manifest,
 const char **
 pkg_manifest_get_conflicts(struct pkg_manifest *manifest)
 {
-	struct pkgm_conflicts *conflict;
-	unsigned int count;
-
 	if (manifest == NULL)
 		return NULL;
 
-	if (manifest->conflict_list != NULL)
-		return (const char **)manifest->conflict_list;
-
-	/* Find out how much space is needed */
-	count = 0;
-	STAILQ_FOREACH(conflict, &manifest->conflicts, list) {
-		count++;
-	}
-	if (count == 0)
-		return NULL;
-
-	/* Allocate the space for the conflict list */
-	manifest->conflict_list = malloc((count + 1) * sizeof(char *));
-	if (manifest->conflict_list == NULL)
+	if (manifest->conflicts_count == 0)
 		return NULL;
 
-	/* Populate the conflict list */
-	count = 0;
-	STAILQ_FOREACH(conflict, &manifest->conflicts, list) {
-		manifest->conflict_list[count] = conflict->conflict;
-		count++;
-	}
-	manifest->conflict_list[count] = NULL;
-
-	return (const char **)manifest->conflict_list;
+	return (const char **)manifest->conflicts;
 }
 
 /**
@@ -518,6 +532,8 @@ pkg_manifest_get_file(struct pkg_manifest *manifest)
 		return NULL;
 
 	if (manifest->file == NULL) {
+		if (pkg_manifest_load_items(manifest) != 0)
+			return NULL;
 		if (manifest->manifest_get_file != NULL)
 			manifest->manifest_get_file(manifest);
 	}
@@ -528,45 +544,51 @@ pkg_manifest_get_file(struct pkg_manifest *manifest)
 /**
  * @brief Gets the manifest items from a manifest
  * @param manifest The manifest
- * @return The manifest items
- * @return NULL on error
+ *
+ * The array belongs to the manifest and may move when an item is added.
+ * @return A NULL terminated array of the manifest items
+ * @return NULL on error or no items
  */
 struct pkg_manifest_item **
 pkg_manifest_get_items(struct pkg_manifest *manifest)
 {
-	unsigned int count;
-	struct pkgm_items *item;
-
 	if (manifest == NULL)
 		return NULL;
 
-	if (manifest->item_list != NULL && manifest->item_list_clean != 0)
-		return manifest->item_list;
-
-	/* Find out how much space is needed */
-	count = 0;
-	STAILQ_FOREACH(item, &manifest->items, list) {
-		count++;
-	}
-	if (count == 0)
+	if (pkg_manifest_load_items(manifest) != 0)
 		return NULL;
 
-	/* Allocate the space for the conflict list */
-	manifest->item_list = malloc((count + 1) *
-	    sizeof(struct pkg_manifest_itemi *));
-	if (manifest->item_list == NULL)
+	if (manifest->items_count == 0)
 		return NULL;
-	manifest->item_list_clean = 1;
 
-	/* Populate the conflict list */
-	count = 0;
-	STAILQ_FOREACH(item, &manifest->items, list) {
-		manifest->item_list[count] = item->item;
-		count++;
-	}
-	manifest->item_list[count] = NULL;
+	return manifest->items;
+}
+
+/**
+ * @brief Reads the items of a manifest when only the start was read
+ * @param manifest The manifest
+ *
+ * Name, origin, prefix, dependency and conflict queries only need the
+ * start of a manifest. A parser may leave the items to be read by the
+ * manifest_load_items callback, this calls it the first time the items
+ * are wanted.
+ * @return  0 on success or when the items have been read
+ * @return -1 on error
+ */
+int
+pkg_manifest_load_items(struct pkg_manifest *manifest)
+{
+	pkg_manifest_load_items_callback *load_items;
 
-	return manifest->item_list;
+	assert(manifest != NULL);
+
+	if (manifest->manifest_load_items == NULL)
+		return 0;
+
+	/* Only try once, the items will be incomplete after an error */
+	load_items = manifest->manifest_load_items;
+	manifest->manifest_load_items = NULL;
+	return load_items(manifest);
 }
 
 /**
@@ -601,6 +623,9 @@ pkg_manifest_item_new(pkg_manifest_item_type type, const char *data)
 
 	item->type = type;
 	item->attrs = NULL;
+	item->arena = NULL;
+	item->manifest = NULL;
+	item->has_md5 = 0;
 
 	if (data == NULL) {
 		item->data = NULL;
@@ -614,6 +639,9 @@ pkg_manifest_item_new(pkg_manifest_item_type type, const char *data)
 /**
  * @brief Cleans up a package manifest object
  * @param item The package manifest item to free
+ *
+ * Items in a manifest's arena are freed with the manifest so this
+ * does nothing to them.
  * @return  0 on success
  * @return -1 on error
  */
@@ -623,6 +651,9 @@ pkg_manifest_item_free(struct pkg_manifest_item *item)
 	if (item == NULL)
 		return -1;
 
+	if (item->arena != NULL)
+		return 0;
+
 	if (item->data != NULL)
 		free(item->data);
 
@@ -675,6 +706,9 @@ pkg_manifest_item_get_type(struct pkg_manifest_item *item)
  * @param item The package item
  * @param attr The attribute to set
  * @param data The value to set the attribute to
+ *
+ * A pmia_md5 attribute that is an MD5 digest is held in binary and
+ * only turned back to a lower case string by pkg_manifest_item_get_attr().
  * @return  0 on success
  * @return -1 on error
  */
@@ -685,25 +719,40 @@ pkg_manifest_item_set_attr(struct pkg_manifest_item *item,
 	if (item == NULL)
 		return -1;
 
+	/* Remove the old value */
+	if (attr == pmia_md5)
+		item->has_md5 = 0;
+	if (item->attrs != NULL && item->attrs[attr] != NULL) {
+		if (item->arena == NULL)
+			free(item->attrs[attr]);
+		item->attrs[attr] = NULL;
+	}
+
+	if (data == NULL)
+		return 0;
+
+	if (attr == pmia_md5 && strlen(data) == 32 &&
+	    pkg_manifest_item_set_md5(item, data) == 0)
+		return 0;
+
 	if (item->attrs == NULL) {
-		item->attrs = malloc(pmia_max * sizeof(char *));
+		item->attrs = pkg_manifest_item_alloc(item,
+		    pmia_max * sizeof(char *));
 		if (item->attrs == NULL)
 			return -1;
 		memset(item->attrs, 0x0, pmia_max *
 		    sizeof(char *));
 	}
 
-	if (item->attrs[attr] != NULL) {
-		free(item->attrs[attr]);
-	}
-
-	if (data == NULL) {
-		item->attrs[attr] = NULL;
+	/* Attributes in the arena are few values, eg. "YES", so intern them */
+	if (item->arena != NULL) {
+		item->attrs[attr] = (char *)(uintptr_t)pkg_manifest_intern(
+		    item->arena, data, strlen(data));
 	} else {
 		item->attrs[attr] = strdup(data);
-		if (item->attrs[attr] == NULL)
-			return -1;
 	}
+	if (item->attrs[attr] == NULL)
+		return -1;
 
 	return 0;
 }
@@ -742,9 +791,30 @@ const char *
 pkg_manifest_item_get_attr(struct pkg_manifest_item *item,
     pkg_manifest_item_attr attr)
 {
+	char *md5;
+	unsigned int pos;
+
 	if (item == NULL)
 		return NULL;
 
+	/* Make the string of a binary digest the first time it's used */
+	if (attr == pmia_md5 && item->has_md5 &&
+	    (item->attrs == NULL || item->attrs[pmia_md5] == NULL)) {
+		if (item->attrs == NULL) {
+			item->attrs = pkg_manifest_item_alloc(item,
+			    pmia_max * sizeof(char *));
+			if (item->attrs == NULL)
+				return NULL;
+			memset(item->attrs, 0x0, pmia_max * sizeof(char *));
+		}
+		md5 = pkg_manifest_item_alloc(item, sizeof(item->md5) * 2 + 1);
+		if (md5 == NULL)
+			return NULL;
+		for (pos = 0; pos < sizeof(item->md5); pos++)
+			sprintf(md5 + pos * 2, "%02x", item->md5[pos]);
+		item->attrs[pmia_md5] = md5;
+	}
+
 	if (item->attrs == NULL)
 		return NULL;
 
@@ -754,6 +824,9 @@ pkg_manifest_item_get_attr(struct pkg_manifest_item *item,
  * @brief Sets the data of the given item
  * @param item The manifest item
  * @param data The new data value
+ *
+ * The path table of the manifest the item is in points at the old
+ * data so it is made again when it is next used.
  * @return  0 on success
  * @return -1 on error
  */
@@ -763,11 +836,19 @@ pkg_manifest_item_set_data(struct pkg_manifest_item *item, const char *data)
 	if (item == NULL)
 		return -1;
 
-	if (item->data != NULL)
+	if (item->manifest != NULL)
+		pkg_manifest_free_paths(item->manifest);
+
+	if (item->data != NULL && item->arena == NULL)
 		free(item->data);
 
 	if (data == NULL) {
 		item->data = NULL;
+	} else if (item->arena != NULL) {
+		item->data = pkg_manifest_strndup(item->arena, data,
+		    strlen(data));
+		if (item->data == NULL)
+			return -1;
 	} else {
 		item->data = strdup(data);
 		if (item->data == NULL)
@@ -780,3 +861,731 @@ pkg_manifest_item_set_data(struct pkg_manifest_item *item, const char *data)
 /**
  * @}
  */
+
+/**
+ * @defgroup PackageManifestPaths Package manifest path table
+ * @ingroup PackageManifest
+ * @brief The absolute path of each file in a manifest
+ *
+ * A file item's data is relative to the last @cwd, or the prefix
+ * before the first one. The path table resolves these once into a
+ * directory and the name in it. Each directory is only held once and
+ * lists it's files, so a file can be found or it's path made without
+ * walking the items or building a string for each file.
+ *
+ * @{
+ */
+
+/**
+ * @brief Gets the files in a manifest's path table
+ * @param manifest The manifest
+ * @param count Set to the number of files
+ *
+ * The files are in the order of the manifest's file items.
+ * @return The files or NULL on error
+ */
+const struct pkgm_path *
+pkg_manifest_get_paths(struct pkg_manifest *manifest, unsigned int *count)
+{
+	assert(count != NULL);
+
+	if (manifest == NULL || pkg_manifest_build_paths(manifest) != 0)
+		return NULL;
+
+	*count = manifest->paths_count;
+	return manifest->paths;
+}
+
+/**
+ * @brief Gets the directories in a manifest's path table
+ * @param manifest The manifest
+ * @param count Set to the number of directories
+ *
+ * A struct pkgm_path's dir is an index in to this.
+ * @return The directories, NULL on error or when there are none
+ */
+const struct pkgm_dir *
+pkg_manifest_get_dirs(struct pkg_manifest *manifest, unsigned int *count)
+{
+	assert(count != NULL);
+
+	if (manifest == NULL || pkg_manifest_build_paths(manifest) != 0)
+		return NULL;
+
+	*count = manifest->dirs_count;
+	return manifest->dirs;
+}
+
+/**
+ * @brief Makes the absolute path of a file in a manifest
+ * @param manifest The manifest
+ * @param path The file's index in the path table
+ * @param buf The buffer to write the path to
+ * @param len The size of buf
+ * @return  0 on success
+ * @return -1 on error or if the path is too long
+ */
+int
+pkg_manifest_get_path(struct pkg_manifest *manifest, unsigned int path,
+    char *buf, size_t len)
+{
+	const struct pkgm_path *file;
+	const struct pkgm_dir *dir;
+	size_t name_len;
+
+	assert(buf != NULL);
+
+	if (manifest == NULL || pkg_manifest_build_paths(manifest) != 0 ||
+	    path >= manifest->paths_count)
+		return -1;
+
+	file = &manifest->paths[path];
+	dir = &manifest->dirs[file->dir];
+	name_len = strlen(file->name);
+	if (dir->len + name_len + 2 > len)
+		return -1;
+
+	memcpy(buf, dir->path, dir->len);
+	buf[dir->len] = '/';
+	memcpy(buf + dir->len + 1, file->name, name_len + 1);
+
+	return 0;
+}
+
+/**
+ * @brief Finds a file in a manifest from it's absolute path
+ * @param manifest The manifest
+ * @param path The path to find, without extra slashes
+ *
+ * Only the files of the directory path is in are compared.
+ * @return The file's index in the path table
+ * @return -1 if it isn't in the manifest or on error
+ */
+int
+pkg_manifest_find_path(struct pkg_manifest *manifest, const char *path)
+{
+	const struct pkgm_dir *dir;
+	const char *name;
+	size_t len;
+	unsigned int pos, file;
+
+	if (manifest == NULL || path == NULL ||
+	    pkg_manifest_build_paths(manifest) != 0)
+		return -1;
+
+	name = strrchr(path, '/');
+	if (name == NULL)
+		return -1;
+	len = name - path;
+	name++;
+
+	for (pos = 0; pos < manifest->dirs_count; pos++) {
+		dir = &manifest->dirs[pos];
+		if (dir->len != len || memcmp(dir->path, path, len) != 0)
+			continue;
+		for (file = dir->first; file != PKGM_PATH_NONE;
+		    file = manifest->paths[file].next) {
+			if (strcmp(manifest->paths[file].name, name) == 0)
+				return file;
+		}
+		break;
+	}
+
+	return -1;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup PackageManifestArena Package manifest arena
+ * @ingroup PackageManifest
+ * @brief Memory freed with the manifest
+ *
+ * A manifest of a large package has tens of thousands of items. Rather
+ * than allocate each item, it's list entry and it's strings on their
+ * own they are taken from blocks of memory owned by the manifest that
+ * are freed with it. Strings that are often repeated, eg. the @cwd
+ * directories, are interned so only one copy is kept.
+ *
+ * @{
+ */
+
+/**
+ * @brief Adds an item with data that isn't a string to a manifest
+ * @param manifest The manifest to add the item to
+ * @param type The type of the item
+ * @param data The item's data, it needn't end with a '\0'
+ * @param len The length of data
+ *
+ * The item is in the manifest's arena so is freed with the manifest.
+ * @return The new item
+ * @return NULL on error
+ */
+struct pkg_manifest_item *
+pkg_manifest_append_data(struct pkg_manifest *manifest,
+    pkg_manifest_item_type type, const char *data, size_t len)
+{
+	const char *copy;
+
+	assert(manifest != NULL);
+	assert(data != NULL);
+
+	/* Each file and directory is only listed once */
+	if (type == pmt_file || type == pmt_dir)
+		copy = pkg_manifest_strndup(manifest, data, len);
+	else
+		copy = pkg_manifest_intern(manifest, data, len);
+	if (copy == NULL)
+		return NULL;
+
+	return pkg_manifest_append_ref(manifest, type, copy);
+}
+
+/**
+ * @brief Adds an item with data the manifest already holds
+ * @param manifest The manifest to add the item to
+ * @param type The type of the item
+ * @param data The item's data, it must last as long as the manifest,
+ *     eg. a string in manifest->map
+ *
+ * The item is in the manifest's arena so is freed with the manifest.
+ * @return The new item
+ * @return NULL on error
+ */
+struct pkg_manifest_item *
+pkg_manifest_append_ref(struct pkg_manifest *manifest,
+    pkg_manifest_item_type type, const char *data)
+{
+	struct pkg_manifest_item *item;
+
+	assert(manifest != NULL);
+	assert(data != NULL);
+
+	item = pkg_manifest_alloc(manifest, sizeof(struct pkg_manifest_item),
+	    PKGM_ARENA_ALIGN);
+	if (item == NULL)
+		return NULL;
+
+	item->type = type;
+	item->arena = manifest;
+	item->manifest = NULL;
+	item->attrs = NULL;
+	item->has_md5 = 0;
+	item->data = (char *)(uintptr_t)data;
+
+	if (pkg_manifest_append_item(manifest, item) != 0)
+		return NULL;
+
+	return item;
+}
+
+/**
+ * @brief Finds or adds a string to a manifest's arena
+ * @param manifest The manifest
+ * @param str The string, it needn't end with a '\0'
+ * @param len The length of str
+ * @return The copy of the string in the arena
+ * @return NULL on error
+ */
+const char *
+pkg_manifest_intern(struct pkg_manifest *manifest, const char *str, size_t len)
+{
+	const char *found;
+	char *copy;
+	uint32_t slot;
+
+	assert(manifest != NULL);
+	assert(str != NULL);
+
+	/* Keep the table at most three quarters full */
+	if ((manifest->strings_count + 1) * 4 > manifest->strings_size * 3 &&
+	    pkg_manifest_intern_grow(manifest) != 0)
+		return NULL;
+
+	slot = pkg_manifest_hash(str, len) & (manifest->strings_size - 1);
+	while ((found = manifest->strings[slot]) != NULL) {
+		if (strncmp(found, str, len) == 0 && found[len] == '\0')
+			return found;
+		slot = (slot + 1) & (manifest->strings_size - 1);
+	}
+
+	copy = pkg_manifest_strndup(manifest, str, len);
+	if (copy == NULL)
+		return NULL;
+	manifest->strings[slot] = copy;
+	manifest->strings_count++;
+
+	return copy;
+}
+
+/**
+ * @brief Sets the MD5 digest of an item from it's hex string
+ * @param item The item
+ * @param md5 32 hex digits of either case, it needn't end with a '\0'
+ * @return  0 on success
+ * @return -1 if md5 isn't a hex digest
+ */
+int
+pkg_manifest_item_set_md5(struct pkg_manifest_item *item, const char *md5)
+{
+	unsigned char digest[sizeof(item->md5)];
+	unsigned int pos;
+	int high, low;
+
+	if (item == NULL || md5 == NULL)
+		return -1;
+
+	for (pos = 0; pos < sizeof(digest); pos++) {
+		high = pkg_hex_value(md5[pos * 2]);
+		if (high == -1)
+			return -1;
+		low = pkg_hex_value(md5[pos * 2 + 1]);
+		if (low == -1)
+			return -1;
+		digest[pos] = (high << 4) | low;
+	}
+
+	/* Drop any string made by pkg_manifest_item_get_attr */
+	if (item->attrs != NULL && item->attrs[pmia_md5] != NULL) {
+		if (item->arena == NULL)
+			free(item->attrs[pmia_md5]);
+		item->attrs[pmia_md5] = NULL;
+	}
+
+	memcpy(item->md5, digest, sizeof(item->md5));
+	item->has_md5 = 1;
+
+	return 0;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup PackageManifestArenaInternal Internal manifest arena functions
+ * @ingroup PackageManifestArena
+ *
+ * @{
+ */
+
+/**
+ * @brief Allocates memory from a manifest's arena
+ * @param manifest The manifest
+ * @param size The number of bytes to allocate
+ * @param align The alignment, a power of 2
+ * @return The memory or NULL on error
+ */
+static void *
+pkg_manifest_alloc(struct pkg_manifest *manifest, size_t size, size_t align)
+{
+	struct pkgm_arena_block *block;
+	size_t pad, block_size;
+	char *ptr;
+
+	assert(manifest != NULL);
+
+	pad = -(uintptr_t)manifest->arena_pos & (align - 1);
+	if (manifest->arena == NULL || pad + size > manifest->arena_left) {
+		block_size = (manifest->arena == NULL ? PKGM_ARENA_MIN :
+		    manifest->arena->size * 2);
+		if (block_size > PKGM_ARENA_MAX)
+			block_size = PKGM_ARENA_MAX;
+		if (block_size < sizeof(struct pkgm_arena_block) + size + align)
+			block_size = sizeof(struct pkgm_arena_block) + size +
+			    align;
+
+		block = malloc(block_size);
+		if (block == NULL)
+			return NULL;
+		block->next = manifest->arena;
+		block->size = block_size;
+		manifest->arena = block;
+		manifest->arena_pos = (char *)(block + 1);
+		manifest->arena_left = block_size - sizeof(*block);
+		pad = -(uintptr_t)manifest->arena_pos & (align - 1);
+	}
+
+	ptr = manifest->arena_pos + pad;
+	manifest->arena_pos += pad + size;
+	manifest->arena_left -= pad + size;
+
+	return ptr;
+}
+
+/**
+ * @brief Copies a string into a manifest's arena
+ * @return The new string or NULL on error
+ */
+static char *
+pkg_manifest_strndup(struct pkg_manifest *manifest, const char *str,
+		size_t len)
+{
+	char *copy;
+
+	assert(manifest != NULL);
+	assert(str != NULL);
+
+	copy = pkg_manifest_alloc(manifest, len + 1, 1);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+
+	return copy;
+}
+
+/**
+ * @brief Doubles the size of the interned string table
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkg_manifest_intern_grow(struct pkg_manifest *manifest)
+{
+	const char **strings;
+	unsigned int pos, size, slot;
+
+	assert(manifest != NULL);
+
+	size = (manifest->strings_size == 0 ? PKGM_STRINGS_MIN :
+	    manifest->strings_size * 2);
+	strings = calloc(size, sizeof(char *));
+	if (strings == NULL)
+		return -1;
+
+	for (pos = 0; pos < manifest->strings_size; pos++) {
+		if (manifest->strings[pos] == NULL)
+			continue;
+		slot = pkg_manifest_hash(manifest->strings[pos],
+		    strlen(manifest->strings[pos])) & (size - 1);
+		while (strings[slot] != NULL)
+			slot = (slot + 1) & (size - 1);
+		strings[slot] = manifest->strings[pos];
+	}
+
+	free(manifest->strings);
+	manifest->strings = strings;
+	manifest->strings_size = size;
+
+	return 0;
+}
+
+/**
+ * @brief The FNV-1a hash of a string
+ */
+static uint32_t
+pkg_manifest_hash(const char *str, size_t len)
+{
+	uint32_t hash;
+	size_t pos;
+
+	hash = 2166136261U;
+	for (pos = 0; pos < len; pos++) {
+		hash ^= (unsigned char)str[pos];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/**
+ * @brief Allocates memory for an item from where the item is
+ * @return The memory or NULL on error
+ */
+static void *
+pkg_manifest_item_alloc(struct pkg_manifest_item *item, size_t size)
+{
+	assert(item != NULL);
+
+	if (item->arena != NULL)
+		return pkg_manifest_alloc(item->arena, size, PKGM_ARENA_ALIGN);
+	return malloc(size);
+}
+
+/**
+ * @brief Makes room for one more entry in a NULL terminated array
+ * @param list The array of pointers
+ * @param count The number of entries in the array
+ * @param size The number of pointers there is space for, updated when
+ *     the array grows
+ *
+ * The array doubles in size so adding to it takes amortised constant time.
+ * @return The array, it may have moved
+ * @return NULL on error, list is left unchanged
+ */
+static void *
+pkg_manifest_list_grow(void *list, unsigned int count, unsigned int *size)
+{
+	void *new_list;
+	unsigned int new_size;
+
+	assert(size != NULL);
+
+	/* Leave space for the new entry and the terminating NULL */
+	if (count + 2 <= *size)
+		return list;
+
+	new_size = (*size == 0 ? PKGM_LIST_MIN : *size * 2);
+	new_list = realloc(list, new_size * sizeof(void *));
+	if (new_list == NULL)
+		return NULL;
+	*size = new_size;
+
+	return new_list;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup PackageManifestPathsInternal Internal manifest path table functions
+ * @ingroup PackageManifestPaths
+ *
+ * @{
+ */
+
+/**
+ * @brief Makes a manifest's path table if it doesn't have one
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkg_manifest_build_paths(struct pkg_manifest *manifest)
+{
+	struct pkgm_dir_slots slots;
+	struct pkg_manifest_item *item;
+	const char *cwd, *data, *name, *last_cwd, *last_data;
+	char buf[PATH_MAX];
+	unsigned int pos, count, dir;
+	size_t last_len;
+	int len, ret;
+
+	assert(manifest != NULL);
+
+	if (manifest->paths != NULL)
+		return 0;
+	if (pkg_manifest_load_items(manifest) != 0)
+		return -1;
+
+	count = 0;
+	for (pos = 0; pos < manifest->items_count; pos++) {
+		if (manifest->items[pos]->type == pmt_file)
+			count++;
+	}
+	/* One more so there is always a table, even when it's empty */
+	manifest->paths = malloc((count + 1) * sizeof(struct pkgm_path));
+	if (manifest->paths == NULL)
+		return -1;
+
+	slots.slots = NULL;
+	slots.size = 0;
+	slots.dirs_size = 0;
+	ret = -1;
+	cwd = manifest->attrs[pkgm_prefix];
+	if (cwd == NULL)
+		cwd = ".";
+	last_cwd = last_data = NULL;
+	last_len = 0;
+	dir = 0;
+	for (pos = 0; pos < manifest->items_count; pos++) {
+		item = manifest->items[pos];
+		data = item->data;
+		if (item->type == pmt_chdir) {
+			cwd = data;
+			continue;
+		}
+		if (item->type != pmt_file)
+			continue;
+
+		name = strrchr(data, '/');
+		name = (name == NULL ? data : name + 1);
+
+		/* Most files are in the same directory as the one before */
+		if (cwd != last_cwd || (size_t)(name - data) != last_len ||
+		    memcmp(data, last_data, last_len) != 0) {
+			len = pkg_manifest_join(buf, sizeof(buf), cwd, data,
+			    name - data);
+			if (len == -1)
+				goto done;
+
+			/* Remove the '/' before the name */
+			if (len > 0 && buf[len - 1] == '/')
+				len--;
+			if (pkg_manifest_add_dir(manifest, &slots, buf, len,
+			    &dir) != 0)
+				goto done;
+			last_cwd = cwd;
+			last_data = data;
+			last_len = name - data;
+		}
+
+		manifest->paths[manifest->paths_count].item = item;
+		manifest->paths[manifest->paths_count].name = name;
+		manifest->paths[manifest->paths_count].dir = dir;
+		manifest->paths[manifest->paths_count].next = PKGM_PATH_NONE;
+		if (manifest->dirs[dir].count == 0)
+			manifest->dirs[dir].first = manifest->paths_count;
+		else
+			manifest->paths[manifest->dirs[dir].last].next =
+			    manifest->paths_count;
+		manifest->dirs[dir].last = manifest->paths_count;
+		manifest->dirs[dir].count++;
+		manifest->paths_count++;
+	}
+	ret = 0;
+
+done:
+	free(slots.slots);
+	if (ret != 0)
+		pkg_manifest_free_paths(manifest);
+	return ret;
+}
+
+/**
+ * @brief Finds or adds a directory to a manifest's path table
+ * @param slots The directories already in the table
+ * @param path The directory's path
+ * @param len The length of path
+ * @param dir Set to the directory's index
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkg_manifest_add_dir(struct pkg_manifest *manifest,
+    struct pkgm_dir_slots *slots, const char *path, size_t len,
+    unsigned int *dir)
+{
+	struct pkgm_dir *dirs;
+	const char *str;
+	unsigned int *new_slots, new_size, pos, slot;
+
+	assert(manifest != NULL);
+	assert(slots != NULL);
+	assert(dir != NULL);
+
+	/* An interned path has the same address each time */
+	str = pkg_manifest_intern(manifest, path, len);
+	if (str == NULL)
+		return -1;
+
+	/* Keep the table at most half full */
+	if ((manifest->dirs_count + 1) * 2 > slots->size) {
+		new_size = (slots->size == 0 ? 16 : slots->size * 2);
+		new_slots = calloc(new_size, sizeof(unsigned int));
+		if (new_slots == NULL)
+			return -1;
+		for (pos = 0; pos < manifest->dirs_count; pos++) {
+			slot = ((uintptr_t)manifest->dirs[pos].path *
+			    2654435761U) & (new_size - 1);
+			while (new_slots[slot] != 0)
+				slot = (slot + 1) & (new_size - 1);
+			new_slots[slot] = pos + 1;
+		}
+		free(slots->slots);
+		slots->slots = new_slots;
+		slots->size = new_size;
+	}
+
+	slot = ((uintptr_t)str * 2654435761U) & (slots->size - 1);
+	while (slots->slots[slot] != 0) {
+		if (manifest->dirs[slots->slots[slot] - 1].path == str) {
+			*dir = slots->slots[slot] - 1;
+			return 0;
+		}
+		slot = (slot + 1) & (slots->size - 1);
+	}
+
+	if (manifest->dirs_count == slots->dirs_size) {
+		new_size = (slots->dirs_size == 0 ? PKGM_LIST_MIN :
+		    slots->dirs_size * 2);
+		dirs = realloc(manifest->dirs,
+		    new_size * sizeof(struct pkgm_dir));
+		if (dirs == NULL)
+			return -1;
+		manifest->dirs = dirs;
+		slots->dirs_size = new_size;
+	}
+	dirs = &manifest->dirs[manifest->dirs_count];
+	dirs->path = str;
+	dirs->len = len;
+	dirs->first = PKGM_PATH_NONE;
+	dirs->last = PKGM_PATH_NONE;
+	dirs->count = 0;
+	slots->slots[slot] = manifest->dirs_count + 1;
+	*dir = manifest->dirs_count++;
+
+	return 0;
+}
+
+/**
+ * @brief Joins a directory and the start of a file's name with a '/'
+ * @param buf The buffer to write the path to
+ * @param size The size of buf
+ * @param dir The directory
+ * @param file The file's name
+ * @param file_len How much of file to use
+ *
+ * Extra slashes are left out as pkg_remove_extra_slashes() would.
+ * @return The length of the path
+ * @return -1 if it doesn't fit in buf
+ */
+static int
+pkg_manifest_join(char *buf, size_t size, const char *dir, const char *file,
+    size_t file_len)
+{
+	const char *str;
+	size_t len, pos, str_len;
+	unsigned int part;
+
+	assert(buf != NULL);
+	assert(dir != NULL);
+	assert(file != NULL);
+
+	len = 0;
+	for (part = 0; part < 3; part++) {
+		if (part == 0) {
+			str = dir;
+			str_len = strlen(dir);
+		} else if (part == 1) {
+			str = "/";
+			str_len = 1;
+		} else {
+			str = file;
+			str_len = file_len;
+		}
+		for (pos = 0; pos < str_len; pos++) {
+			if (str[pos] == '/' && len > 0 && buf[len - 1] == '/')
+				continue;
+			if (len + 1 >= size || len >= INT_MAX)
+				return -1;
+			buf[len++] = str[pos];
+		}
+	}
+	buf[len] = '\0';
+
+	return len;
+}
+
+/**
+ * @brief Throws away a manifest's path table
+ */
+static void
+pkg_manifest_free_paths(struct pkg_manifest *manifest)
+{
+	assert(manifest != NULL);
+
+	free(manifest->paths);
+	free(manifest->dirs);
+	manifest->paths = NULL;
+	manifest->paths_count = 0;
+	manifest->dirs = NULL;
+	manifest->dirs_count = 0;
+}
+
+/**
+ * @}
+ */
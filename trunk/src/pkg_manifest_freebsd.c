@@ -29,11 +29,10 @@
 #include "pkg_private.h"
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-
-/* These are used by the FreeBSD parser */
-extern FILE *pkg_freebsd_in;
-int pkg_freebsd_parse(struct pkg_manifest **);
+#include <unistd.h>
 
 static struct pkgfile *freebsd_manifest_get_file(struct pkg_manifest *);
 
@@ -49,25 +48,86 @@ static struct pkgfile *freebsd_manifest_get_file(struct pkg_manifest *);
  * @param file The file to create the manifest from
  * @return A new package manifest
  * @return NULL on error
- * @todo Check if pkg_freebsd_parse is thread safe
+ *
+ * This is thread safe so many manifests may be parsed at once.
  */
 struct pkg_manifest *
 pkg_manifest_new_freebsd_pkgfile(struct pkgfile *file)
 {
 	struct pkg_manifest *manifest;
+	const char *data;
 
-	pkgfile_seek(file, 0, SEEK_SET);
-	pkg_freebsd_in = pkgfile_get_fileptr(file);
-	manifest = NULL;
-	if (pkg_freebsd_parse(&manifest) != 0) {
+	data = pkgfile_get_data(file);
+	if (data == NULL)
+		return NULL;
+
+	manifest = pkg_freebsd_parse_contents(data, pkgfile_get_size(file));
+	if (manifest == NULL)
 		return NULL;
-	}
 
 	manifest->manifest_get_file = freebsd_manifest_get_file;
 
 	return manifest;
 }
 
+/**
+ * @brief Creates the manifest of an installed FreeBSD package
+ * @param db_dir The package's directory in the package database
+ *
+ * The manifest is read from the package's cache when it is current.
+ * When the cache is missing or stale and the database can be written
+ * to +CONTENTS is parsed and the cache is written for next time. This
+ * is done even when the caller only reads the package, but a failure
+ * to write the cache is ignored. Otherwise only the start of +CONTENTS
+ * is read, the items are read if they are needed.
+ * @return A new package manifest
+ * @return NULL on error
+ */
+struct pkg_manifest *
+pkg_manifest_new_freebsd_installed(const char *db_dir)
+{
+	struct pkg_manifest *manifest;
+	struct pkgfile *file;
+	char *path;
+	int stale;
+
+	if (db_dir == NULL)
+		return NULL;
+
+	manifest = freebsd_cache_read(db_dir, &stale);
+	if (manifest != NULL) {
+		manifest->manifest_get_file = freebsd_manifest_get_file;
+		return manifest;
+	}
+
+	asprintf(&path, "%s/+CONTENTS", db_dir);
+	if (path == NULL)
+		return NULL;
+	pkg_remove_extra_slashes(path);
+	file = pkgfile_new_from_disk(path, 1);
+	free(path);
+	if (file == NULL)
+		return NULL;
+
+	if (!stale || access(db_dir, W_OK) != 0) {
+		manifest = pkg_freebsd_parse_contents_head(file);
+		if (manifest == NULL) {
+			pkgfile_free(file);
+			return NULL;
+		}
+		manifest->manifest_get_file = freebsd_manifest_get_file;
+		return manifest;
+	}
+
+	/* The cache is only an optimisation so it may fail to be written */
+	manifest = pkg_manifest_new_freebsd_pkgfile(file);
+	pkgfile_free(file);
+	if (manifest != NULL)
+		freebsd_cache_write(manifest, db_dir);
+
+	return manifest;
+}
+
 /**
  * @}
  */
@@ -88,9 +148,10 @@ pkg_manifest_new_freebsd_pkgfile(struct pkgfile *file)
 static struct pkgfile *
 freebsd_manifest_get_file(struct pkg_manifest *manifest)
 {
-	struct pkgm_deps *dep;
-	struct pkgm_conflicts *conflict;
-	struct pkgm_items *item;
+	struct pkg_manifest_item *item;
+	struct pkg *dep;
+	const char *md5;
+	unsigned int pos;
 	const char *data = "@comment PKG_FORMAT_REVISION:1.1\n";
 
 	assert(manifest != NULL);
@@ -112,64 +173,65 @@ freebsd_manifest_get_file(struct pkg_manifest *manifest)
 	}
 
 	/* Add the package's dependency's */
-	STAILQ_FOREACH(dep, &manifest->deps, list) {
+	for (pos = 0; pos < manifest->deps_count; pos++) {
+		dep = manifest->deps[pos];
 		pkgfile_append_string(manifest->file, "@pkgdep %s\n",
-		    pkg_get_name(dep->pkg));
+		    pkg_get_name(dep));
 		pkgfile_append_string(manifest->file, "@comment DEPORIGIN:%s\n",
-		    pkg_get_origin(dep->pkg));
+		    pkg_get_origin(dep));
 	}
 
 	/* Add the package's conflicts */
-	STAILQ_FOREACH(conflict, &manifest->conflicts, list) {
+	for (pos = 0; pos < manifest->conflicts_count; pos++) {
 		pkgfile_append_string(manifest->file, "@conflicts %s\n",
-		    conflict->conflict);
+		    manifest->conflicts[pos]);
 	}
 
 	/* Add the package's (de)install items */
-	STAILQ_FOREACH(item, &manifest->items, list) {
-		switch(item->item->type) {
+	for (pos = 0; pos < manifest->items_count; pos++) {
+		item = manifest->items[pos];
+		switch(item->type) {
 		case pmt_file:
 			pkgfile_append_string(manifest->file, "%s\n",
-			    (char *)item->item->data);
-			if (item->item->attrs != NULL &&
-			    item->item->attrs[pmia_md5] != NULL) {
+			    (char *)item->data);
+			md5 = pkg_manifest_item_get_attr(item, pmia_md5);
+			if (md5 != NULL) {
 				pkgfile_append_string(manifest->file,
-				    "@comment MD5:%s\n",
-				    item->item->attrs[pmia_md5]);
+				    "@comment MD5:%s\n", md5);
 			}
 			break;
 		case pmt_dir:
 			pkgfile_append_string(manifest->file, "@dirrm %s\n",
-			    (char *)item->item->data);
+			    (char *)item->data);
 			break;
 		case pmt_dirlist:
 			pkgfile_append_string(manifest->file, "@mtree %s\n",
-			    (char *)item->item->data);
+			    (char *)item->data);
 			break;
 		case pmt_chdir:
 			pkgfile_append_string(manifest->file, "@cwd %s\n",
-			    (char *)item->item->data);
+			    (char *)item->data);
 			break;
 		case pmt_output:
 			pkgfile_append_string(manifest->file, "@display %s\n",
-			    (char *)item->item->data);
+			    (char *)item->data);
 			break;
 		case pmt_comment:
 			pkgfile_append_string(manifest->file, "@comment %s\n",
-			    (char *)item->item->data);
+			    (char *)item->data);
 			break;
 		case pmt_execute:
 		{
 			const char *cmd;
 
-			if (item->item->attrs != NULL &&
-			    item->item->attrs[pmia_deinstall] != NULL) {
+			if (item->attrs != NULL &&
+			    item->attrs[pmia_deinstall] != NULL) {
 				cmd = "@unexec";
 			} else {
 				cmd = "@exec";
 			}
 			pkgfile_append_string(manifest->file, "%s %s\n", cmd,
-			    (char *)item->item->data);
+			    (char *)item->data);
 			break;
 		}
 		case pmt_other:
@@ -28,16 +28,19 @@
 #ifndef __LIBPKG_PKG_PRIVATE_H__
 #define __LIBPKG_PKG_PRIVATE_H__
 
-#include <sys/queue.h>
 #include <archive.h>
+#include <limits.h>
+#include <stdint.h>
 #include "pkg_db.h"
 
 int archive_read_open_stream(struct archive *, FILE *, size_t);
+int archive_read_open_bzip2(struct archive *, FILE *, unsigned int);
 
 /* Package file location */
 typedef enum {
 	pkgfile_loc_disk,
-	pkgfile_loc_mem
+	pkgfile_loc_mem,
+	pkgfile_loc_archive	/* The current entry of an archive */
 } pkgfile_loc;
 
 /**
@@ -51,20 +54,30 @@ typedef enum {
 	pkgfile_dir /**< A directory */
 } pkgfile_type;
 
-/** @todo Reorder the struct to remove alignment gaps */
+struct pkgfile_lines;
+
 struct pkgfile {
 	char		*name;
 	char		*cwd;
 	char		*real_name;
-	pkgfile_type	 type;
-	pkgfile_loc	 loc;
-	int		 follow_link;
 	FILE		*fd;
 	char		*data;
+	struct pkgfile_lines *lines;	/* Index used by pkgfile_find_line */
+	struct pkgfile_edits *edits;	/* Lines removed while editing */
+	struct archive	*archive;	/* Data source of pkgfile_loc_archive */
 	uint64_t	 length;
+	uint64_t	 capacity;	/* Allocated size of unmapped data */
 	uint64_t	 offset;
+	pkgfile_type	 type;
+	pkgfile_loc	 loc;
+	int		 dirfd;		/* Relative names are opened from this */
+	unsigned int	 refs;		/* Users of the object, see pkgfile_ref */
 	mode_t		 mode;
-	char		 md5[33];
+	unsigned int	 follow_link : 1;
+	unsigned int	 mapped : 1;	/* data is a mmap(2) of fd */
+	unsigned int	 editing : 1;	/* Changes are held until edit_commit */
+	unsigned int	 has_md5 : 1;	/* md5 has been set */
+	unsigned char	 md5[16];
 };
 
 /*
@@ -72,33 +85,53 @@ struct pkgfile {
  */
 struct pkg_manifest_item {
 	pkg_manifest_item_type type;
+	unsigned int	 has_md5 : 1;	/* pmia_md5 is held in md5 */
+	unsigned char	 md5[16];
 	void		*data;
+	struct pkg_manifest *arena;	/* Holds the item's memory or NULL */
+	struct pkg_manifest *manifest;	/* The manifest it is in or NULL */
 
 	char **attrs;
 };
 
+int pkg_manifest_item_set_md5(struct pkg_manifest_item *, const char *);
+
 /*
  * Package Manifest Object
  */
 
 typedef struct pkgfile	*pkg_manifest_get_file_callback(struct pkg_manifest *);
+typedef int		 pkg_manifest_load_items_callback(struct pkg_manifest *);
 
-/* List objects for the dependencies, conflicts and items */
-struct pkgm_deps {
-	STAILQ_ENTRY(pkgm_deps) list;
-	struct pkg	*pkg;
+/* A block of memory in a manifest's arena, the memory follows it */
+struct pkgm_arena_block {
+	struct pkgm_arena_block *next;
+	size_t		 size;
 };
 
-struct pkgm_conflicts {
-	STAILQ_ENTRY(pkgm_conflicts) list;
-	char		*conflict;
+/*
+ * A file in a manifest's path table. It's path is the directory's
+ * path, a '/' then name. Files in the same directory are chained.
+ */
+struct pkgm_path {
+	struct pkg_manifest_item *item;
+	const char	*name;		/* The end of the item's data */
+	unsigned int	 dir;		/* The directory's index */
+	unsigned int	 next;		/* The next file in dir */
 };
 
-struct pkgm_items {
-	STAILQ_ENTRY(pkgm_items) list;
-	struct pkg_manifest_item *item;
+/* A directory in a manifest's path table, without a trailing '/' */
+struct pkgm_dir {
+	const char	*path;
+	size_t		 len;
+	unsigned int	 first;		/* The directory's first file */
+	unsigned int	 last;
+	unsigned int	 count;
 };
 
+/* The end of a directory's files */
+#define PKGM_PATH_NONE	UINT_MAX
+
 struct pkg_manifest {
 	void		 *data;
 
@@ -107,23 +140,87 @@ struct pkg_manifest {
 	char		 *name;
 
 	char		 *attrs[pkgm_max];
-	STAILQ_HEAD(, pkgm_deps) deps;
-	STAILQ_HEAD(, pkgm_conflicts) conflicts;
-	STAILQ_HEAD(, pkgm_items) items;
 
-	/* These are used as caches */
-	int		deps_list_clean;
-	unsigned int	deps_list_count;
-	struct pkg	**deps_list;
+	/*
+	 * The dependencies, conflicts and items. Each is a NULL
+	 * terminated array that grows as entries are added so the
+	 * getters can return it as is.
+	 */
+	struct pkg	**deps;
+	unsigned int	 deps_count;
+	unsigned int	 deps_size;
 
-	char		**conflict_list;
+	char		**conflicts;
+	unsigned int	 conflicts_count;
+	unsigned int	 conflicts_size;
 
-	int		item_list_clean;
-	struct pkg_manifest_item **item_list;
+	struct pkg_manifest_item **items;
+	unsigned int	 items_count;
+	unsigned int	 items_size;
 
 	pkg_manifest_get_file_callback	*manifest_get_file;
+
+	/*
+	 * Set when only the start of the manifest has been read. It adds
+	 * the items the first time they are needed, from source or map.
+	 */
+	pkg_manifest_load_items_callback *manifest_load_items;
+	struct pkgfile	*source;
+
+	/*
+	 * Items added by a parser and their strings are allocated from
+	 * the arena and freed with the manifest.
+	 */
+	struct pkgm_arena_block *arena;
+	char		*arena_pos;
+	size_t		 arena_left;
+	unsigned int	 heap_items;	/* Items that aren't in the arena */
+
+	/* Strings interned in the arena, an open addressed hash table */
+	const char	**strings;
+	unsigned int	 strings_size;
+	unsigned int	 strings_count;
+
+	/* A file mapped in to memory the items may point in to */
+	void		*map;
+	size_t		 map_size;
+
+	/*
+	 * The files with each @cwd resolved. It is made the first time
+	 * it's needed and thrown away when an item or the prefix changes.
+	 */
+	struct pkgm_path *paths;
+	unsigned int	 paths_count;
+	struct pkgm_dir	*dirs;
+	unsigned int	 dirs_count;
+};
+
+const char *pkg_manifest_intern(struct pkg_manifest *, const char *, size_t);
+struct pkg_manifest_item *pkg_manifest_append_data(struct pkg_manifest *,
+				pkg_manifest_item_type, const char *, size_t);
+struct pkg_manifest_item *pkg_manifest_append_ref(struct pkg_manifest *,
+				pkg_manifest_item_type, const char *);
+int pkg_manifest_load_items(struct pkg_manifest *);
+const struct pkgm_path *pkg_manifest_get_paths(struct pkg_manifest *,
+				unsigned int *);
+const struct pkgm_dir *pkg_manifest_get_dirs(struct pkg_manifest *,
+				unsigned int *);
+int pkg_manifest_get_path(struct pkg_manifest *, unsigned int, char *,
+				size_t);
+int pkg_manifest_find_path(struct pkg_manifest *, const char *);
+
+/* The state of the FreeBSD +CONTENTS lexer and parser */
+struct freebsd_parse {
+	void		 *scanner;
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item *curitem;
+	struct pkg	 *curdep;	/* The last @pkgdep */
 };
 
+struct pkg_manifest *pkg_freebsd_parse_buffer(const char *, size_t);
+struct pkg_manifest *pkg_freebsd_parse_contents(const char *, size_t);
+struct pkg_manifest *pkg_freebsd_parse_contents_head(struct pkgfile *);
+
 /*
  * Package Object
  */
@@ -229,11 +326,110 @@ struct pkg {
 	pkg_run_script_callback		*pkg_run_script;
 };
 
+struct pkgfile *pkgfile_ref(struct pkgfile *);
+struct pkgfile *pkgfile_new_regular_archive(const char *, struct archive *,
+	uint64_t);
+mode_t pkgfile_umask(void);
+
+int pkg_hex_value(char);
 int pkg_dir_build(const char *, mode_t);
+int pkg_dir_build_at(int, const char *, mode_t);
 int pkg_dir_clean(const char *);
 int pkg_exec(const char *, ...);
+int pkg_exec_at(int, const char *, ...);
 FILE *pkg_cached_file(FILE *, const char *);
 
+extern const char *pkg_extensions[];
+
+/*
+ * FreeBSD package table of contents
+ */
+struct freebsd_toc_entry {
+	char		*name;
+	uint64_t	 offset;	/* Of the header in the uncompressed tar */
+	uint64_t	 size;
+};
+
+struct freebsd_toc {
+	struct freebsd_toc_entry *entries;
+	unsigned int	 count;
+	unsigned int	 size;		/* The space allocated in entries */
+	unsigned int	 control_count;	/* The leading + files */
+	int		 seekable;	/* The offsets are also in the file */
+};
+
+struct freebsd_toc *freebsd_toc_read(const char *);
+int freebsd_toc_find_control(struct freebsd_toc *, const char *);
+void freebsd_toc_free(struct freebsd_toc *);
+
+/*
+ * FreeBSD installed package manifest cache
+ */
+#define FREEBSD_CACHE_NAME	"+CONTENTS.idx"
+
+/* "PKGC" read as a number, a cache from another byte order won't match */
+#define FREEBSD_CACHE_MAGIC	0x504b4743
+#define FREEBSD_CACHE_VERSION	1
+
+/* The string offset of a NULL string */
+#define FREEBSD_CACHE_NONE	UINT32_MAX
+
+/*
+ * The start of the cache file. It is followed by the items, the
+ * dependencies, the conflicts then the strings. Strings are offsets
+ * into the strings and each ends with a '\0'.
+ */
+struct freebsd_cache_header {
+	uint32_t	magic;
+	uint32_t	version;
+
+	/* The +CONTENTS file the cache was made from */
+	uint64_t	contents_size;
+	int64_t		contents_mtime;
+	uint64_t	contents_ino;
+	uint64_t	contents_hash;
+
+	uint32_t	name;
+	uint32_t	manifest_version;
+	uint32_t	origin;
+	uint32_t	prefix;
+
+	uint32_t	item_count;
+	uint32_t	dep_count;
+	uint32_t	conflict_count;
+	uint32_t	strings_size;
+};
+
+struct freebsd_cache_item {
+	uint32_t	data;
+	uint32_t	attrs[pmia_md5];	/* The string attributes */
+	uint8_t		type;
+	uint8_t		has_md5;
+	uint8_t		pad[2];
+	unsigned char	md5[16];
+};
+
+struct freebsd_cache_dep {
+	uint32_t	name;
+	uint32_t	origin;
+};
+
+struct pkg_manifest *freebsd_cache_read(const char *, int *);
+int freebsd_cache_write(struct pkg_manifest *, const char *);
+struct pkg_manifest *pkg_manifest_new_freebsd_installed(const char *);
+
+/*
+ * Chunked package
+ */
+struct pkg_chunked;
+
+struct pkg_chunked *pkg_chunked_open(FILE *);
+struct pkgfile *pkg_chunked_get_control(struct pkg_chunked *, const char *);
+struct pkgfile **pkg_chunked_get_controls(struct pkg_chunked *);
+struct pkgfile *pkg_chunked_next_file(struct pkg_chunked *);
+void pkg_chunked_detach(struct pkg_chunked *);
+void pkg_chunked_free(struct pkg_chunked *);
+
 /* 
  * Remove extra slashes from the path
  * The first is slower
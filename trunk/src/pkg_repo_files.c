@@ -75,27 +75,15 @@ pkg_repo_new_files()
 static struct pkg *
 file_repo_get_pkg(struct pkg_repo *repo, const char *pkg_name)
 {
-	struct pkg *pkg;
-	FILE *fd;
-
 	assert(repo != NULL);
 	assert(pkg_name != NULL);
 
-	/* Open the package file */
-	fd = fopen(pkg_name, "r");
-	if (!fd) {
-		return NULL;
-	}
-
-	/* Create the package */
+	/*
+	 * Create the package. The file is only kept open
+	 * while the package's contents are being read.
+	 */
 	/* XXX auto detect package type */
-	pkg = pkg_new_freebsd_from_file(fd);
-	if (!pkg) {
-		fclose(fd);
-		return NULL;
-	}
-
-	return pkg;
+	return pkg_new_freebsd_from_path(pkg_name);
 }
 
 /**
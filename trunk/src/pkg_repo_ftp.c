@@ -90,7 +90,10 @@ int getosreldate(void);
 static struct pkg	*ftp_get_pkg(struct pkg_repo *, const char *);
 static int		 ftp_free(struct pkg_repo *);
 /* Internal */
-static FILE		*ftp_get_fd(const char *, struct ftp_repo *);
+static FILE		*ftp_get_fd(const char *, struct ftp_repo *,
+					const char **);
+static FILE		*ftp_get_url(struct ftp_repo *, const char *,
+					const char *, const char *);
 static struct ftp_repo	*ftp_create_repo(const char *, const char *,
 					const char *);
 /*pkg_static int		 pkg_in_All(const char *); */
@@ -152,6 +155,7 @@ ftp_get_pkg(struct pkg_repo *repo, const char *pkg_name)
 	FILE *fd, *fd2;
 	struct pkg *pkg;
 	struct ftp_repo *f_repo;
+	const char *ext;
 
 	assert(repo != NULL);
 	assert(pkg_name != NULL);
@@ -159,7 +163,7 @@ ftp_get_pkg(struct pkg_repo *repo, const char *pkg_name)
 	f_repo = repo->data;
 	assert(f_repo != NULL);
 
-	fd = ftp_get_fd(pkg_name, f_repo);
+	fd = ftp_get_fd(pkg_name, f_repo, &ext);
 	if (fd == NULL)
 		return NULL;
 
@@ -167,8 +171,8 @@ ftp_get_pkg(struct pkg_repo *repo, const char *pkg_name)
 		char cache_file[FILENAME_MAX];
 
 		fd2 = fd;
-		snprintf(cache_file, FILENAME_MAX, "%s/%s.tbz",
-		    f_repo->cache_dir, pkg_name);
+		snprintf(cache_file, FILENAME_MAX, "%s/%s%s",
+		    f_repo->cache_dir, pkg_name, ext);
 		fd = pkg_cached_file(fd2, cache_file);
 	}	
 	pkg = pkg_new_freebsd_from_file(fd);
@@ -221,15 +225,17 @@ ftp_free(struct pkg_repo *repo)
 
 /**
  * @brief Retrieves a FILE pointer for a given package name
+ *
+ * If the name has no extension each of pkg_extensions is tried.
+ * @param ext Set to the extension that was added to the name
  * @return A FILE pointer to get a package with fetch(3)
  */
 static FILE *
-ftp_get_fd(const char *pkg_name, struct ftp_repo *f_repo)
+ftp_get_fd(const char *pkg_name, struct ftp_repo *f_repo, const char **ext)
 {
 	const char *subdir;
 	const char *fallback_subdir;
-	const char *ext;
-	char *ftpname;
+	unsigned int pos;
 	FILE *fd;
 
 	/*
@@ -243,11 +249,39 @@ ftp_get_fd(const char *pkg_name, struct ftp_repo *f_repo)
 	//	fallback_subdir = "All";
 	//}
 
-	/* Get the extension */
-	if (pkg_name_has_extension(pkg_name))
-		ext = "";
-	else
-		ext = ".tbz";
+	if (pkg_name_has_extension(pkg_name)) {
+		*ext = "";
+		fd = ftp_get_url(f_repo, subdir, pkg_name, *ext);
+		if (fd == NULL)
+			fd = ftp_get_url(f_repo, fallback_subdir, pkg_name,
+			    *ext);
+		return fd;
+	}
+
+	for (pos = 0; pkg_extensions[pos] != NULL; pos++) {
+		*ext = pkg_extensions[pos];
+		fd = ftp_get_url(f_repo, subdir, pkg_name, *ext);
+		/* Try the alternate subdir if the primary one fails. */
+		if (fd == NULL)
+			fd = ftp_get_url(f_repo, fallback_subdir, pkg_name,
+			    *ext);
+		if (fd != NULL)
+			return fd;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Fetches a package file from a subdirectory of the repository
+ * @return A FILE pointer to get a package with fetch(3)
+ */
+static FILE *
+ftp_get_url(struct ftp_repo *f_repo, const char *subdir, const char *pkg_name,
+    const char *ext)
+{
+	char *ftpname;
+	FILE *fd;
 
 	asprintf(&ftpname, "%s/%s/%s/%s%s", f_repo->site, f_repo->path,
 	    subdir, pkg_name, ext);
@@ -256,22 +290,6 @@ ftp_get_fd(const char *pkg_name, struct ftp_repo *f_repo)
 	}
 
 	fd = fetchGetURL(ftpname, "p");
-
-	/* Try the alternate subdir if the primary one fails. */
-	if (fd == NULL) {
-		free(ftpname);
-		asprintf(&ftpname, "%s/%s/%s/%s%s", f_repo->site,
-		    f_repo->path, fallback_subdir, pkg_name, ext);
-		if (!ftpname) {
-			return NULL;
-		}
-		fd = fetchGetURL(ftpname, "p");
-		if (fd == NULL) {
-			free(ftpname);
-			return NULL;
-		}
-	}
-
 	free(ftpname);
 
 	return fd;
@@ -353,20 +371,20 @@ ftp_create_repo(const char *site, const char *path, const char *cache_dir)
 /**
  * @brief Find if a name has a known extension
  * @todo Return 0 and -1 like other functions
- * @return 1 if name ends with ".t[bg]z", otherwise 0
+ * @return 1 if name ends with one of pkg_extensions, otherwise 0
  */
 static int
 pkg_name_has_extension(const char *name)
 {
 	const char	*p;
+	unsigned int	 pos;
 
 	p = strrchr(name, '.');
 	if (p == NULL)
 		return (0);
-	if (strcmp(p, ".tbz")==0)
-		return (1);
-	if (strcmp(p, ".tgz")==0)
-		return (1);
+	for (pos = 0; pkg_extensions[pos] != NULL; pos++)
+		if (strcmp(p, pkg_extensions[pos]) == 0)
+			return (1);
 	return (0);
 }
 
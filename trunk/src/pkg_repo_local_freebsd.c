@@ -81,33 +81,32 @@ file_get_pkg(struct pkg_repo *repo, const char *pkg_name)
 {
 	char dir[MAXPATHLEN + 1];
 	struct pkg *pkg;
-	FILE *fd;
+	unsigned int pos;
 	assert(repo != NULL);
 	assert(pkg_name != NULL);
 
-	/* XXX Check the file is a package file after every attempt to open it */
-	snprintf(dir, MAXPATHLEN + 1,"%s.tbz", pkg_name);
-	fd = fopen(dir, "r");
-	if (!fd) {
-		snprintf(dir, MAXPATHLEN + 1,
-		    "/usr/ports/packages/All/%s.tbz", pkg_name);
-		fd = fopen(dir, "r");
-	}
-	if (!fd) {
-		fd = fopen(pkg_name, "r");
+	/*
+	 * Only the package's control files are read here, the
+	 * file is reopened if the rest of the package is needed.
+	 */
+	pkg = NULL;
+	for (pos = 0; pkg == NULL && pkg_extensions[pos] != NULL; pos++) {
+		snprintf(dir, MAXPATHLEN + 1,"%s%s", pkg_name,
+		    pkg_extensions[pos]);
+		pkg = pkg_new_freebsd_from_path(dir);
+		if (pkg == NULL) {
+			snprintf(dir, MAXPATHLEN + 1,
+			    "/usr/ports/packages/All/%s%s", pkg_name,
+			    pkg_extensions[pos]);
+			pkg = pkg_new_freebsd_from_path(dir);
+		}
 	}
-	if (!fd) {
+	if (pkg == NULL)
+		pkg = pkg_new_freebsd_from_path(pkg_name);
+	if (pkg == NULL) {
 		snprintf(dir, MAXPATHLEN + 1,
 		    "/usr/ports/packages/All/%s", pkg_name);
-		fd = fopen(dir, "r");
-	}
-	if (!fd)
-		return NULL;
-
-	pkg = pkg_new_freebsd_from_file(fd);
-	if (!pkg) {
-		fclose(fd);
-		return NULL;
+		pkg = pkg_new_freebsd_from_path(dir);
 	}
 
 	return pkg;
@@ -32,17 +32,21 @@ __FBSDID("$FreeBSD$");
 
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <assert.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <md5.h>
+#include <paths.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "pkg_private.h"
@@ -51,19 +55,53 @@ static int	 pkg_cached_readfn(void *, char *, int);
 static fpos_t	 pkg_cached_seekfn(void *, fpos_t, int);
 static int	 pkg_cached_closefn(void *);
 
+/*
+ * The extensions a package file may have, in the order to look for
+ * them. The compression is found from the contents of the file so
+ * this is only used when searching for a package.
+ */
+const char *pkg_extensions[] = { ".tbz", ".txz", ".tzst", ".tgz", NULL };
+
 /**
  * @defgroup PackageUtil Miscellaneous utilities
  *
  * @{
  */
 
+/**
+ * @brief Gets the value of a hexadecimal digit of either case
+ * @return The digit's value or -1 if c is not a hexadecimal digit
+ */
+int
+pkg_hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
 /**
  * @brief A simplified version of `mkdir -p path'
  * @return 0 on success, -1 on error
  */
-/* Based off src/bin/mkdir/mkdir.c 1.32 */
 int
 pkg_dir_build(const char *path, mode_t mode)
+{
+	return pkg_dir_build_at(AT_FDCWD, path, mode);
+}
+
+/**
+ * @brief A simplified version of `mkdir -p path' with relative paths
+ *     starting from the directory dirfd
+ * @return 0 on success, -1 on error
+ */
+/* Based off src/bin/mkdir/mkdir.c 1.32 */
+int
+pkg_dir_build_at(int dirfd, const char *path, mode_t mode)
 {
 	struct stat sb;
 	int last, retval;
@@ -85,10 +123,10 @@ pkg_dir_build(const char *path, mode_t mode)
 		*p = '\0';
 		if (!last && p[1] == '\0')
 			last = 1;
-		if (mkdir(str,
+		if (mkdirat(dirfd, str,
 		    (mode == 0) ? (S_IRWXU | S_IRWXG | S_IRWXO) : mode) < 0) {
 			if (errno == EEXIST || errno == EISDIR) {
-				if (stat(str, &sb) < 0) {
+				if (fstatat(dirfd, str, &sb, 0) < 0) {
 					retval = -1;
 					break;
 				} else if (!S_ISDIR(sb.st_mode)) {
@@ -211,6 +249,52 @@ pkg_exec(const char *fmt, ...)
 	return ret;
 }
 
+/**
+ * @brief Executes a program from the directory dirfd
+ *
+ * This is the same as pkg_exec() but the command is run with dirfd
+ * as it's working directory. The caller's working directory is unchanged.
+ * @return the return value from the child process or -1 on error
+ */
+int
+pkg_exec_at(int dirfd, const char *fmt, ...)
+{
+	va_list ap;
+	pid_t pid;
+	char *str;
+	int status;
+
+	va_start(ap, fmt);
+	vasprintf(&str, fmt, ap);
+	va_end(ap);
+	if (str == NULL)
+		return -1;
+
+	if (dirfd == AT_FDCWD) {
+		status = system(str);
+		free(str);
+		return status;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		free(str);
+		return -1;
+	} else if (pid == 0) {
+		if (fchdir(dirfd) == 0)
+			execl(_PATH_BSHELL, "sh", "-c", str, (char *)NULL);
+		_exit(127);
+	}
+	free(str);
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return status;
+}
+
 /**
  * @}
  */
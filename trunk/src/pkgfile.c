@@ -28,13 +28,17 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
-#include <libgen.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <md5.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,10 +47,103 @@
 #include "pkg.h"
 #include "pkg_private.h"
 
+/*
+ * Files smaller than this are read into a malloc'ed buffer
+ * as mapping them costs more than copying them
+ */
+#define PKGFILE_MMAP_MIN	PAGE_SIZE
+
+/* The smallest buffer allocated when appending to a file */
+#define PKGFILE_APPEND_MIN	64
+
+/* Files at least this large have their space allocated before writing */
+#define PKGFILE_PREALLOC_MIN	(1024 * 1024)
+
+/* The most freed pkgfile objects to keep for reuse */
+#define PKGFILE_CACHE_MAX	64
+
+/* The size of the buffer used when reading a file to checksum it */
+#define PKGFILE_CHECKSUM_BLOCK	(64 * 1024)
+
+/*
+ * Files smaller than this are searched directly by pkgfile_find_line
+ * rather than building an index of their lines
+ */
+#define PKGFILE_LINE_INDEX_MIN	PAGE_SIZE
+
+/* A line in a pkgfile_lines index, empty slots have a hash of 0 */
+struct pkgfile_line {
+	uint64_t	 offset;
+	size_t		 length;
+	uint32_t	 hash;
+};
+
+/* A hash table of the lines in a regular file's data */
+struct pkgfile_lines {
+	struct pkgfile_line	*slots;
+	size_t			 mask;
+};
+
+/* A part of a file's data to be removed */
+struct pkgfile_range {
+	uint64_t	 offset;
+	uint64_t	 length;
+};
+
+/*
+ * The lines removed from a file while it is being edited. The data
+ * isn't moved until the edits are applied so offsets stay valid.
+ */
+struct pkgfile_edits {
+	struct pkgfile_range	*ranges;
+	size_t			 count;
+	size_t			 size;
+	unsigned char		*removed;	/* A bit set at each line's start */
+	size_t			 removed_size;
+};
+
 static struct pkgfile	*pkgfile_new(const char *, pkgfile_type, pkgfile_loc);
 static int		 pkgfile_open_fd(struct pkgfile *);
+static int		 pkgfile_load_data(struct pkgfile *);
+static int		 pkgfile_unmap(struct pkgfile *);
+static int		 pkgfile_replace(struct pkgfile *);
+static int		 pkgfile_rewrite(struct pkgfile *);
+static int		 pkgfile_can_append(struct pkgfile *);
+static int		 pkgfile_grow(struct pkgfile *, uint64_t, int);
+static int		 pkgfile_write_regular(struct pkgfile *);
+static int		 pkgfile_pwrite(int, const char *, uint64_t, uint64_t);
+static int		 pkgfile_archive_load(struct pkgfile *);
+static int		 pkgfile_archive_write(struct pkgfile *, int);
+static int		 pkgfile_checksum_fd(int, pkgfile_checksum_update *,
+				void *);
+static void		 pkgfile_md5_update(void *, const void *, size_t);
+static uint32_t		 pkgfile_line_hash(const char *, size_t);
+static int		 pkgfile_lines_build(struct pkgfile *);
+static void		 pkgfile_lines_free(struct pkgfile *);
+static const char	*pkgfile_lines_find(struct pkgfile *, const char *,
+				size_t);
+static const char	*pkgfile_scan_line(struct pkgfile *, const char *,
+				const char *, size_t);
+static int		 pkgfile_edits_add(struct pkgfile *, uint64_t,
+				uint64_t);
+static int		 pkgfile_edits_removed(struct pkgfile *, uint64_t);
+static int		 pkgfile_edits_apply(struct pkgfile *);
+static int		 pkgfile_range_cmp(const void *, const void *);
+static void		 pkgfile_edits_free(struct pkgfile *);
 static int		 pkgfile_get_type(struct pkgfile *);
 static const char	*pkgfile_real_name(struct pkgfile *);
+static const char	*pkgfile_at_name(struct pkgfile *);
+static int		 pkgfile_build_parent(struct pkgfile *);
+
+/*
+ * Freed pkgfile objects. Programs that walk through the files in a
+ * package create and free one at a time so this saves a malloc(3)
+ * and free(3) for each file. Files may be created and freed by
+ * different threads so it is protected by a lock.
+ */
+static struct pkgfile	*pkgfile_cache[PKGFILE_CACHE_MAX];
+static unsigned int	 pkgfile_cache_count = 0;
+static pthread_mutex_t	 pkgfile_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const char *pkgfile_types[] =
 	{ "none", "file", "hardlink", "symlink", "directory" };
@@ -67,13 +164,20 @@ pkgfile_new(const char *filename, pkgfile_type type, pkgfile_loc location)
 {
 	struct pkgfile *file;
 
-	file = malloc(sizeof(struct pkgfile));
-	if (file == NULL)
-		return NULL;
+	file = NULL;
+	pthread_mutex_lock(&pkgfile_cache_lock);
+	if (pkgfile_cache_count > 0)
+		file = pkgfile_cache[--pkgfile_cache_count];
+	pthread_mutex_unlock(&pkgfile_cache_lock);
+	if (file == NULL) {
+		file = malloc(sizeof(struct pkgfile));
+		if (file == NULL)
+			return NULL;
+	}
 
 	file->name = strdup(filename);
 	if (file->name == NULL) {
-		pkgfile_free(file);
+		free(file);
 		return NULL;
 	}
 
@@ -82,12 +186,20 @@ pkgfile_new(const char *filename, pkgfile_type type, pkgfile_loc location)
 	file->type = type;
 	file->loc = location;
 	file->follow_link = 0;
+	file->dirfd = AT_FDCWD;
 	file->fd = NULL;
 	file->data = NULL;
+	file->mapped = 0;
+	file->lines = NULL;
+	file->edits = NULL;
+	file->archive = NULL;
+	file->editing = 0;
 	file->length = 0;
+	file->capacity = 0;
 	file->offset = 0;
 	file->mode = 0;
-	file->md5[0] = '\0';
+	file->refs = 1;
+	file->has_md5 = 0;
 
 	return file;
 }
@@ -100,6 +212,8 @@ pkgfile_new(const char *filename, pkgfile_type type, pkgfile_loc location)
 static int
 pkgfile_open_fd(struct pkgfile *file)
 {
+	int fd;
+
 	/* Consistancy check */
 	assert(file != NULL);
 	assert(file->loc == pkgfile_loc_disk);
@@ -113,14 +227,21 @@ pkgfile_open_fd(struct pkgfile *file)
 			return 0;
 
 		/* Open the file read write */
-		file->fd = fopen(file->name, "r+");
-		if (file->fd == NULL) {
+		fd = openat(file->dirfd, pkgfile_at_name(file), O_RDWR);
+		if (fd != -1) {
+			file->fd = fdopen(fd, "r+");
+		} else {
 			/* Attempt to open file read only */
-			file->fd = fopen(file->name, "r");
+			fd = openat(file->dirfd, pkgfile_at_name(file),
+			    O_RDONLY);
+			if (fd != -1)
+				file->fd = fdopen(fd, "r");
 		}
 
 		/* If we failed return -1 */
 		if (file->fd == NULL) {
+			if (fd != -1)
+				close(fd);
 			return -1;
 		}
 
@@ -129,6 +250,905 @@ pkgfile_open_fd(struct pkgfile *file)
 	return 0;
 }
 
+/**
+ * @brief Loads the contents of a regular file on disk to file->data
+ *
+ * Files of at least PKGFILE_MMAP_MIN bytes are mapped read only.
+ * Smaller files, or files that fail to map, are read into a buffer.
+ *
+ * The mapping is private so changes to the file after it is mapped
+ * may or may not be seen, as with any mmap(2). If the file is
+ * truncated while mapped, eg. by another process upgrading the
+ * package, reading past the new end raises SIGBUS in the caller.
+ * Callers that can't rule this out should copy the data first.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_load_data(struct pkgfile *file)
+{
+	void *map;
+
+	assert(file != NULL);
+	assert(file->loc == pkgfile_loc_disk);
+	assert(file->type == pkgfile_regular);
+	assert(file->fd != NULL);
+
+	if (file->data != NULL || file->length == 0)
+		return 0;
+
+	if (file->length >= PKGFILE_MMAP_MIN && file->length <= SIZE_MAX) {
+		map = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE,
+		    fileno(file->fd), 0);
+		if (map != MAP_FAILED) {
+			madvise(map, file->length, MADV_SEQUENTIAL);
+			file->data = map;
+			file->mapped = 1;
+			return 0;
+		}
+		/* Fall back to reading the file */
+	}
+
+	file->data = malloc(file->length);
+	if (file->data == NULL)
+		return -1;
+	file->capacity = file->length;
+
+	/* A short read, eg. the file was truncated, would leave data unset */
+	if (fread(file->data, 1, file->length, file->fd) != file->length) {
+		free(file->data);
+		file->data = NULL;
+		file->capacity = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Replaces a mapped file's data with a private copy
+ *
+ * This is needed before the data is modified as the mapping is read only.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_unmap(struct pkgfile *file)
+{
+	char *data;
+
+	assert(file != NULL);
+
+	if (!file->mapped)
+		return 0;
+
+	data = malloc(file->length);
+	if (data == NULL)
+		return -1;
+	memcpy(data, file->data, file->length);
+
+	munmap(file->data, file->length);
+	file->data = data;
+	file->capacity = file->length;
+	file->mapped = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Replaces a regular file on disk with the file's data
+ *
+ * The data is written to a temporary file in the same directory
+ * which is then renamed over the original file. This means the file
+ * on disk will either have the old or the new contents if the
+ * program is interrupted. The new file is given the old file's owner,
+ * group and mode. If the file has other hard links, or its owner can't
+ * be copied, it is rewritten in place with pkgfile_rewrite() instead
+ * as a new file would break the links or change the owner.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_replace(struct pkgfile *file)
+{
+	struct stat sb;
+	FILE *new_fd;
+	char *tmp_name;
+	const char *buf;
+	uint64_t left;
+	ssize_t len;
+	unsigned int count;
+	int fd;
+
+	assert(file != NULL);
+	assert(file->loc == pkgfile_loc_disk);
+	assert(file->type == pkgfile_regular);
+	assert(file->fd != NULL);
+	assert(file->length == 0 || file->data != NULL);
+
+	if (fstat(fileno(file->fd), &sb) != 0)
+		return -1;
+	if (sb.st_nlink > 1)
+		return pkgfile_rewrite(file);
+
+	/* Create a new file next to the file being replaced */
+	for (count = 0;; count++) {
+		if (asprintf(&tmp_name, "%s.%d.%u", pkgfile_at_name(file),
+		    (int)getpid(), count) == -1)
+			return -1;
+
+		fd = openat(file->dirfd, tmp_name, O_RDWR | O_CREAT | O_EXCL,
+		    S_IRUSR | S_IWUSR);
+		if (fd != -1)
+			break;
+
+		free(tmp_name);
+		if (errno != EEXIST)
+			return -1;
+	}
+
+	if (fchown(fd, sb.st_uid, sb.st_gid) != 0) {
+		close(fd);
+		unlinkat(file->dirfd, tmp_name, 0);
+		free(tmp_name);
+		return pkgfile_rewrite(file);
+	}
+	if (fchmod(fd, sb.st_mode & ALLPERMS) != 0)
+		goto fail;
+
+	buf = file->data;
+	left = file->length;
+	while (left > 0) {
+		len = write(fd, buf, MIN(left, SSIZE_MAX));
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		buf += len;
+		left -= len;
+	}
+
+	/* The data must be on disk before the rename */
+	if (fsync(fd) != 0)
+		goto fail;
+
+	if (renameat(file->dirfd, tmp_name, file->dirfd,
+	    pkgfile_at_name(file)) != 0)
+		goto fail;
+	free(tmp_name);
+
+	/* Use the new file from now on */
+	new_fd = fdopen(fd, "r+");
+	if (new_fd == NULL) {
+		close(fd);
+		return -1;
+	}
+	fclose(file->fd);
+	file->fd = new_fd;
+
+	return 0;
+
+fail:
+	close(fd);
+	unlinkat(file->dirfd, tmp_name, 0);
+	free(tmp_name);
+	return -1;
+}
+
+/**
+ * @brief Writes a regular file's data over the file on disk
+ *
+ * Unlike pkgfile_replace() the file keeps its inode so other hard
+ * links to it see the new contents, but the file will be partly
+ * written if the program is interrupted.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_rewrite(struct pkgfile *file)
+{
+	const char *buf;
+	uint64_t left;
+	off_t offset;
+	ssize_t len;
+	int fd;
+
+	assert(file != NULL);
+	assert(file->loc == pkgfile_loc_disk);
+	assert(file->fd != NULL);
+
+	/* The mapping may change as the file is written */
+	if (pkgfile_unmap(file) != 0)
+		return -1;
+
+	fd = fileno(file->fd);
+	buf = file->data;
+	left = file->length;
+	offset = 0;
+	while (left > 0) {
+		len = pwrite(fd, buf, MIN(left, SSIZE_MAX), offset);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += len;
+		left -= len;
+		offset += len;
+	}
+
+	if (ftruncate(fd, file->length) != 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Checks if data can be added to a file
+ * @return  0 if the file can be appended to
+ * @return -1 if it can't
+ */
+static int
+pkgfile_can_append(struct pkgfile *file)
+{
+	assert(file != NULL);
+
+	/* Files on disk can only be appended to while being edited */
+	if (file->loc == pkgfile_loc_disk && !file->editing)
+		return -1;
+
+	if (file->loc == pkgfile_loc_archive && pkgfile_archive_load(file) != 0)
+		return -1;
+
+	if (file->type != pkgfile_regular)
+		return -1;
+
+	/* The data will be resized so can't be a mapping */
+	if (pkgfile_unmap(file) != 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Makes sure a file's data buffer can hold size bytes
+ *
+ * Unless exact is set the buffer is at least doubled in size when it
+ * grows so appending many small pieces of data takes linear time.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_grow(struct pkgfile *file, uint64_t size, int exact)
+{
+	uint64_t capacity;
+	char *new_data;
+
+	assert(file != NULL);
+	assert(!file->mapped);
+	assert(file->length == 0 || file->data != NULL);
+
+	if (size <= file->capacity)
+		return 0;
+
+	capacity = size;
+	if (!exact) {
+		capacity = MAX(file->capacity * 2, PKGFILE_APPEND_MIN);
+		if (capacity < size)
+			capacity = size;
+	}
+	if (capacity > SIZE_MAX)
+		return -1;
+
+	new_data = realloc(file->data, capacity);
+	if (new_data == NULL)
+		return -1;
+
+	file->data = new_data;
+	file->capacity = capacity;
+
+	return 0;
+}
+
+/**
+ * @brief Gets the process's file creation mask
+ *
+ * The mask is only read the first time as reading it requires
+ * setting it. The library never changes it.
+ * @return The umask
+ */
+mode_t
+pkgfile_umask(void)
+{
+	static int have_mask = 0;
+	static mode_t mask;
+
+	if (!have_mask) {
+		mask = umask(0);
+		umask(mask);
+		have_mask = 1;
+	}
+
+	return mask;
+}
+
+/**
+ * @brief Writes an in memory regular file to disk
+ *
+ * The file is created with it's mode so it only needs to be changed
+ * later if the umask would remove some of the bits. The data is
+ * written directly from the file's buffer, or from the archive's
+ * buffers when it hasn't been read into memory.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_write_regular(struct pkgfile *file)
+{
+	struct stat sb;
+	mode_t mode;
+	int fd, created, set_mode;
+
+	assert(file != NULL);
+	assert(file->loc == pkgfile_loc_mem ||
+	    file->loc == pkgfile_loc_archive);
+	assert(file->type == pkgfile_regular);
+	assert(file->fd == NULL);
+
+	/* The archive's data can only be read once */
+	if (file->loc == pkgfile_loc_archive && file->archive == NULL)
+		return -1;
+
+	mode = (file->mode != 0 ? file->mode : DEFFILEMODE);
+	fd = openat(file->dirfd, pkgfile_at_name(file),
+	    O_WRONLY | O_CREAT | O_EXCL, mode);
+	if (fd == -1 && errno == ENOENT) {
+		/*
+		 * The open failed, try running mkdir -p
+		 * on the dir and opening again
+		 */
+		pkgfile_build_parent(file);
+		fd = openat(file->dirfd, pkgfile_at_name(file),
+		    O_WRONLY | O_CREAT | O_EXCL, mode);
+	}
+
+	created = 1;
+	set_mode = (file->mode != 0 &&
+	    (file->mode & (pkgfile_umask() | S_ISVTX)) != 0);
+	if (fd == -1 && errno == EEXIST) {
+		/* An existing file may be used if it is empty */
+		fd = openat(file->dirfd, pkgfile_at_name(file), O_WRONLY);
+		if (fd == -1)
+			return -1;
+
+		if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+		    sb.st_size > 0 || sb.st_nlink != 1) {
+			close(fd);
+			return -1;
+		}
+		created = 0;
+		set_mode = (file->mode != 0);
+	}
+	if (fd == -1)
+		return -1;
+
+	/* Let the filesystem allocate large files in one go */
+	if (file->length >= PKGFILE_PREALLOC_MIN)
+		posix_fallocate(fd, 0, file->length);
+
+	if (file->loc == pkgfile_loc_archive) {
+		if (pkgfile_archive_write(file, fd) != 0)
+			goto fail;
+	} else if (pkgfile_pwrite(fd, file->data, file->length, 0) != 0)
+		goto fail;
+
+	if (set_mode && fchmod(fd, file->mode) != 0)
+		goto fail;
+
+	close(fd);
+
+	return 0;
+
+fail:
+	close(fd);
+	if (created)
+		unlinkat(file->dirfd, pkgfile_at_name(file), 0);
+	return -1;
+}
+
+/**
+ * @brief Writes all of a buffer to a file descriptor at a given offset
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_pwrite(int fd, const char *buf, uint64_t length, uint64_t offset)
+{
+	ssize_t len;
+
+	while (length > 0) {
+		len = pwrite(fd, buf, MIN(length, SSIZE_MAX), offset);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += len;
+		length -= len;
+		offset += len;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Reads the rest of an archive backed file into memory
+ *
+ * After this the file is a regular in memory file. It is used when
+ * the data is needed by something other than pkgfile_write().
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_archive_load(struct pkgfile *file)
+{
+	char *data;
+	uint64_t pos;
+	ssize_t len;
+
+	assert(file != NULL);
+	assert(file->loc == pkgfile_loc_archive);
+
+	if (file->archive == NULL || file->length + 1 > SIZE_MAX)
+		return -1;
+
+	data = malloc(file->length + 1);
+	if (data == NULL)
+		return -1;
+
+	for (pos = 0; pos < file->length; pos += len) {
+		len = archive_read_data(file->archive, data + pos,
+		    MIN(file->length - pos, SSIZE_MAX));
+		if (len <= 0) {
+			free(data);
+			return -1;
+		}
+	}
+	data[file->length] = '\0';
+
+	file->data = data;
+	file->capacity = file->length + 1;
+	file->archive = NULL;
+	file->loc = pkgfile_loc_mem;
+
+	return 0;
+}
+
+/**
+ * @brief Copies an archive backed file's data to a file descriptor
+ *
+ * The data is written from libarchive's buffers as it is
+ * decompressed so the amount of memory used doesn't depend
+ * on the size of the file. Holes in sparse files are kept.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_archive_write(struct pkgfile *file, int fd)
+{
+	struct archive *a;
+	const void *buf;
+	size_t len;
+	off_t offset;
+	int ret;
+
+	assert(file != NULL);
+	assert(file->loc == pkgfile_loc_archive);
+	assert(file->archive != NULL);
+
+	/* Whatever happens the data has now been used */
+	a = file->archive;
+	file->archive = NULL;
+
+	while ((ret = archive_read_data_block(a, &buf, &len, &offset)) ==
+	    ARCHIVE_OK) {
+		if (pkgfile_pwrite(fd, buf, len, offset) != 0)
+			return -1;
+	}
+	if (ret != ARCHIVE_EOF)
+		return -1;
+
+	/* Make sure a trailing hole is part of the file */
+	if (ftruncate(fd, file->length) != 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Passes the contents of a file descriptor to a checksum callback
+ *
+ * The file is read from the start in PKGFILE_CHECKSUM_BLOCK sized blocks
+ * with pread(2) so the file's offset is unchanged.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_checksum_fd(int fd, pkgfile_checksum_update *update, void *ctx)
+{
+	char *buf;
+	ssize_t len;
+	off_t offset;
+
+	assert(fd >= 0);
+	assert(update != NULL);
+
+	buf = malloc(PKGFILE_CHECKSUM_BLOCK);
+	if (buf == NULL)
+		return -1;
+
+	offset = 0;
+	while ((len = pread(fd, buf, PKGFILE_CHECKSUM_BLOCK, offset)) != 0) {
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return -1;
+		}
+		update(ctx, buf, len);
+		offset += len;
+	}
+	free(buf);
+
+	return 0;
+}
+
+/**
+ * @brief pkgfile_checksum_update callback to pass data to MD5Update
+ */
+static void
+pkgfile_md5_update(void *ctx, const void *data, size_t length)
+{
+	const char *buf;
+	size_t len;
+
+	/* MD5Update takes an unsigned int length so pass large data in parts */
+	buf = data;
+	while (length > 0) {
+		len = MIN(length, PKGFILE_CHECKSUM_BLOCK);
+		MD5Update(ctx, buf, len);
+		buf += len;
+		length -= len;
+	}
+}
+
+/**
+ * @brief Hashes a line for the line index
+ *
+ * This is the 32 bit FNV-1a hash. It will never return 0
+ * as that is used to mark an empty slot in the index.
+ */
+static uint32_t
+pkgfile_line_hash(const char *line, size_t length)
+{
+	uint32_t hash;
+	size_t pos;
+
+	hash = 2166136261U;
+	for (pos = 0; pos < length; pos++) {
+		hash ^= (unsigned char)line[pos];
+		hash *= 16777619U;
+	}
+
+	return (hash == 0 ? 1 : hash);
+}
+
+/**
+ * @brief Builds an index of the lines in a regular file's data
+ *
+ * Only the first of any duplicate lines is added to the index so
+ * lookups will find the same line as a search from the start of the file.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_lines_build(struct pkgfile *file)
+{
+	struct pkgfile_line *slot;
+	const char *line, *end, *eol;
+	size_t count, size, length;
+	uint32_t hash;
+
+	assert(file != NULL);
+	assert(file->lines == NULL);
+	assert(file->data != NULL);
+
+	/* Find the number of lines to size the table */
+	end = file->data + file->length;
+	count = 0;
+	for (line = file->data; line < end; line = eol + 1) {
+		count++;
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			break;
+	}
+
+	/* Keep the table at most half full */
+	size = 16;
+	while (size < count * 2)
+		size *= 2;
+
+	file->lines = malloc(sizeof(struct pkgfile_lines));
+	if (file->lines == NULL)
+		return -1;
+	file->lines->slots = calloc(size, sizeof(struct pkgfile_line));
+	if (file->lines->slots == NULL) {
+		free(file->lines);
+		file->lines = NULL;
+		return -1;
+	}
+	file->lines->mask = size - 1;
+
+	for (line = file->data; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+		length = eol - line;
+
+		hash = pkgfile_line_hash(line, length);
+		slot = &file->lines->slots[hash & file->lines->mask];
+		while (slot->hash != 0) {
+			if (slot->hash == hash && slot->length == length &&
+			    memcmp(file->data + slot->offset, line,
+			    length) == 0)
+				break;
+			slot = &file->lines->slots[
+			    (slot - file->lines->slots + 1) & file->lines->mask];
+		}
+		if (slot->hash == 0) {
+			slot->offset = line - file->data;
+			slot->length = length;
+			slot->hash = hash;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Frees a file's line index
+ *
+ * This must be called whenever the file's data is changed.
+ */
+static void
+pkgfile_lines_free(struct pkgfile *file)
+{
+	assert(file != NULL);
+
+	if (file->lines == NULL)
+		return;
+
+	free(file->lines->slots);
+	free(file->lines);
+	file->lines = NULL;
+}
+
+/**
+ * @brief Finds a line in a file using it's line index
+ * @return A pointer to the start of the line or NULL
+ */
+static const char *
+pkgfile_lines_find(struct pkgfile *file, const char *line, size_t length)
+{
+	struct pkgfile_line *slot;
+	uint32_t hash;
+
+	assert(file != NULL);
+	assert(file->lines != NULL);
+
+	hash = pkgfile_line_hash(line, length);
+	slot = &file->lines->slots[hash & file->lines->mask];
+	while (slot->hash != 0) {
+		if (slot->hash == hash && slot->length == length &&
+		    memcmp(file->data + slot->offset, line, length) == 0)
+			return file->data + slot->offset;
+		slot = &file->lines->slots[
+		    (slot - file->lines->slots + 1) & file->lines->mask];
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Searches a file's data for a line
+ * @param start Where in the data to start searching
+ * @return A pointer to the start of the line or NULL
+ */
+static const char *
+pkgfile_scan_line(struct pkgfile *file, const char *start, const char *line,
+    size_t length)
+{
+	const char *buf, *end;
+
+	assert(file != NULL);
+	assert(start != NULL);
+
+	end = file->data + file->length;
+	buf = start;
+	while (buf < end && (size_t)(end - buf) >= length) {
+		buf = memmem(buf, end - buf, line, length);
+		if (buf == NULL)
+			break;
+
+		/* Check the found line is complete */
+		if ((buf == file->data || buf[-1] == '\n') &&
+		    (buf + length == end || buf[length] == '\n'))
+			return buf;
+
+		/* Restart the search after the start of the partial match */
+		buf++;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Records a line removed while editing a file
+ * @param offset The offset of the start of the line
+ * @param length The length of the line and it's new line
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_edits_add(struct pkgfile *file, uint64_t offset, uint64_t length)
+{
+	struct pkgfile_edits *edits;
+	struct pkgfile_range *ranges;
+	unsigned char *removed;
+	size_t size;
+
+	assert(file != NULL);
+	assert(offset + length <= file->length);
+
+	if (file->edits == NULL) {
+		file->edits = calloc(1, sizeof(struct pkgfile_edits));
+		if (file->edits == NULL)
+			return -1;
+	}
+	edits = file->edits;
+
+	if (edits->count == edits->size) {
+		size = (edits->size == 0 ? 16 : edits->size * 2);
+		ranges = realloc(edits->ranges,
+		    size * sizeof(struct pkgfile_range));
+		if (ranges == NULL)
+			return -1;
+		edits->ranges = ranges;
+		edits->size = size;
+	}
+
+	/* Data may have been appended since the bit set was made */
+	if (offset / 8 >= edits->removed_size) {
+		size = file->length / 8 + 1;
+		removed = realloc(edits->removed, size);
+		if (removed == NULL)
+			return -1;
+		memset(removed + edits->removed_size, 0,
+		    size - edits->removed_size);
+		edits->removed = removed;
+		edits->removed_size = size;
+	}
+
+	edits->ranges[edits->count].offset = offset;
+	edits->ranges[edits->count].length = length;
+	edits->count++;
+	edits->removed[offset / 8] |= 1 << (offset % 8);
+
+	return 0;
+}
+
+/**
+ * @brief Checks if the line starting at offset has been removed
+ * @return 1 if it has been removed, 0 if it hasn't
+ */
+static int
+pkgfile_edits_removed(struct pkgfile *file, uint64_t offset)
+{
+	assert(file != NULL);
+	assert(file->edits != NULL);
+
+	if (offset / 8 >= file->edits->removed_size)
+		return 0;
+	return (file->edits->removed[offset / 8] >> (offset % 8)) & 1;
+}
+
+/**
+ * @brief Takes the lines removed while editing out of a file's data
+ *
+ * The data is moved once however many lines were removed.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_edits_apply(struct pkgfile *file)
+{
+	struct pkgfile_range *range;
+	uint64_t from, to, end;
+	size_t pos;
+
+	assert(file != NULL);
+
+	if (file->edits == NULL)
+		return 0;
+
+	/* pkgfile_edits_add() may have failed before recording a line */
+	if (file->edits->count == 0) {
+		pkgfile_edits_free(file);
+		return 0;
+	}
+
+	/* The data will be modified so can't be a read only mapping */
+	if (pkgfile_unmap(file) != 0)
+		return -1;
+
+	qsort(file->edits->ranges, file->edits->count,
+	    sizeof(struct pkgfile_range), pkgfile_range_cmp);
+
+	/* from is the next byte to keep, to where it is moved to */
+	from = to = file->edits->ranges[0].offset;
+	for (pos = 0; pos < file->edits->count; pos++) {
+		range = &file->edits->ranges[pos];
+		if (range->offset > from) {
+			memmove(file->data + to, file->data + from,
+			    range->offset - from);
+			to += range->offset - from;
+			from = range->offset;
+		}
+		end = range->offset + range->length;
+		if (end > from)
+			from = end;
+	}
+	memmove(file->data + to, file->data + from, file->length - from);
+	file->length = to + (file->length - from);
+
+	/* The line offsets have changed */
+	pkgfile_lines_free(file);
+	pkgfile_edits_free(file);
+
+	return 0;
+}
+
+/**
+ * @brief qsort(3) callback to sort removed ranges by their offset
+ */
+static int
+pkgfile_range_cmp(const void *a, const void *b)
+{
+	const struct pkgfile_range *range_a = a, *range_b = b;
+
+	if (range_a->offset < range_b->offset)
+		return -1;
+	return (range_a->offset > range_b->offset);
+}
+
+/**
+ * @brief Frees the lines removed while editing without applying them
+ */
+static void
+pkgfile_edits_free(struct pkgfile *file)
+{
+	assert(file != NULL);
+
+	if (file->edits == NULL)
+		return;
+
+	free(file->edits->ranges);
+	free(file->edits->removed);
+	free(file->edits);
+	file->edits = NULL;
+}
+
 /**
  * @brief Gets a file's type from disk
  *
@@ -150,13 +1170,9 @@ pkgfile_get_type(struct pkgfile *file)
 	if (file->type == pkgfile_none) {
 		struct stat sb;
 
-		if (file->follow_link) {
-			if (stat(pkgfile_real_name(file), &sb) != 0)
-				return -1;
-		} else {
-			if (lstat(pkgfile_real_name(file), &sb) != 0)
-				return -1;
-		}
+		if (fstatat(file->dirfd, pkgfile_at_name(file), &sb,
+		    file->follow_link ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+			return -1;
 
 		if (S_ISREG(sb.st_mode)) {
 			file->type = pkgfile_regular;
@@ -195,6 +1211,56 @@ pkgfile_real_name(struct pkgfile *file)
 	return file->real_name;
 }
 
+/**
+ * @brief Gets the name to pass to the *at() system calls
+ *
+ * When the file has a directory descriptor the name is relative
+ * to it, otherwise it is the real name.
+ * @param file The file to find the name for
+ * @return The file's name
+ */
+static const char *
+pkgfile_at_name(struct pkgfile *file)
+{
+	assert(file != NULL);
+
+	if (file->dirfd != AT_FDCWD)
+		return file->name;
+
+	return pkgfile_real_name(file);
+}
+
+/**
+ * @brief Creates the directory a file is in
+ *
+ * This is used rather than dirname(3) as it may be called from
+ * more than one thread by a pkgfile_batch.
+ * @return  0 on success
+ * @return -1 on error
+ */
+static int
+pkgfile_build_parent(struct pkgfile *file)
+{
+	char dir[MAXPATHLEN];
+	char *slash;
+
+	assert(file != NULL);
+
+	if (strlcpy(dir, pkgfile_at_name(file), sizeof(dir)) >= sizeof(dir))
+		return -1;
+
+	/* The file is in the current directory */
+	slash = strrchr(dir, '/');
+	if (slash == NULL)
+		return 0;
+
+	if (slash == dir)
+		slash++;
+	*slash = '\0';
+
+	return pkg_dir_build_at(file->dirfd, dir, 0);
+}
+
 /**
  * @brief funopen callback used to read with a FILE pointer
  * @param pkgfile The file to read
@@ -207,6 +1273,8 @@ pkgfile_fileptr_read(void *pkgfile, char *buf, int len)
 	struct pkgfile *file;
 
 	file = pkgfile;
+	if (pkgfile_edits_apply(file) != 0)
+		return -1;
 	if (len <= 0 || file->offset >= file->length)
 		return 0;
 
@@ -275,12 +1343,76 @@ pkgfile_new_regular(const char *name, const char *contents, uint64_t length)
 			pkgfile_free(file);
 			return NULL;
 		}
+		file->capacity = file->length;
 		memcpy(file->data, contents, file->length);
 	}
 
 	return file;
 }
 
+/**
+ * @brief Creates a new regular file that takes ownership of a buffer
+ *
+ * This avoids copying the data when the caller has already allocated
+ * it with malloc(3). The buffer will be freed with the file, or
+ * before returning if an error occurs.
+ * @return A new pkgfile object or NULL
+ */
+struct pkgfile*
+pkgfile_new_regular_owned(const char *name, char *contents, uint64_t length)
+{
+	struct pkgfile *file;
+
+	if (name == NULL || (contents == NULL && length > 0)) {
+		free(contents);
+		return NULL;
+	}
+
+	file = pkgfile_new(name, pkgfile_regular, pkgfile_loc_mem);
+	if (file == NULL) {
+		free(contents);
+		return NULL;
+	}
+
+	file->data = contents;
+	file->length = length;
+	file->capacity = length;
+
+	return file;
+}
+
+/**
+ * @brief Creates a new regular file from the current entry of an archive
+ *
+ * The data is only read from the archive when it is needed.
+ * pkgfile_write() will copy it to disk a block at a time, anything
+ * else that uses the data will read it all into memory. The file
+ * must be used before the next header is read from the archive
+ * and the data can only be written once.
+ * @param name The name of the file
+ * @param a The archive to read the data from
+ * @param length The size of the archive entry
+ * @return A new pkgfile object or NULL
+ */
+struct pkgfile *
+pkgfile_new_regular_archive(const char *name, struct archive *a,
+    uint64_t length)
+{
+	struct pkgfile *file;
+
+	if (name == NULL || a == NULL)
+		return NULL;
+
+	file = pkgfile_new(name, pkgfile_regular, pkgfile_loc_archive);
+	if (file == NULL)
+		return NULL;
+
+	file->archive = a;
+	file->length = length;
+
+	return file;
+}
+
 /**
  * @brief Creates a new symlink pkgfile object containing the given data
  * @return A new pkgfile object or NULL
@@ -307,6 +1439,36 @@ pkgfile_new_symlink(const char *file, const char *data)
 	return pkgfile;
 }
 
+/**
+ * @brief Creates a new symlink pkgfile object that takes ownership of
+ *     a malloc(3)'ed target
+ *
+ * The target will be freed with the file, or before returning
+ * if an error occurs.
+ * @return A new pkgfile object or NULL
+ */
+struct pkgfile *
+pkgfile_new_symlink_owned(const char *file, char *data)
+{
+	struct pkgfile *pkgfile;
+
+	if (file == NULL || data == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	pkgfile = pkgfile_new(file, pkgfile_symlink, pkgfile_loc_mem);
+	if (pkgfile == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	pkgfile->length = strlen(data);
+	pkgfile->data = data;
+
+	return pkgfile;
+}
+
 /**
  * @brief Creates a new hardlink pkgfile object pointing to another file
  * @return A new pkgfile object or NULL
@@ -333,6 +1495,36 @@ pkgfile_new_hardlink(const char *file, const char *other_file)
 	return pkgfile;
 }
 
+/**
+ * @brief Creates a new hardlink pkgfile object that takes ownership of
+ *     a malloc(3)'ed target
+ *
+ * The target will be freed with the file, or before returning
+ * if an error occurs.
+ * @return A new pkgfile object or NULL
+ */
+struct pkgfile *
+pkgfile_new_hardlink_owned(const char *file, char *other_file)
+{
+	struct pkgfile *pkgfile;
+
+	if (file == NULL || other_file == NULL) {
+		free(other_file);
+		return NULL;
+	}
+
+	pkgfile = pkgfile_new(file, pkgfile_hardlink, pkgfile_loc_mem);
+	if (pkgfile == NULL) {
+		free(other_file);
+		return NULL;
+	}
+
+	pkgfile->length = strlen(other_file);
+	pkgfile->data = other_file;
+
+	return pkgfile;
+}
+
 /**
  * @brief Creates a new directory pkgfile object
  * @return A new pkgfile object or NULL
@@ -374,6 +1566,9 @@ pkgfile_get_size(struct pkgfile *file)
 	if (file == NULL)
 		return 0;
 
+	if (pkgfile_edits_apply(file) != 0)
+		return 0;
+
 	if (file->loc == pkgfile_loc_disk)
 		pkgfile_open_fd(file);
 
@@ -399,7 +1594,8 @@ pkgfile_get_size(struct pkgfile *file)
 
 				fstat(fileno(file->fd), &sb);
 				return sb.st_size;
-			} else if (file->data != NULL) {
+			} else if (file->data != NULL ||
+			    file->loc == pkgfile_loc_archive) {
 				return file->length;
 			}
 			break;
@@ -424,6 +1620,10 @@ pkgfile_get_data(struct pkgfile *file)
 	if (file == NULL)
 		return NULL;
 
+	/* Lines removed while editing are taken out before it's read */
+	if (pkgfile_edits_apply(file) != 0)
+		return NULL;
+
 	if (file->loc == pkgfile_loc_disk)
 		pkgfile_open_fd(file);
 
@@ -443,17 +1643,11 @@ pkgfile_get_data(struct pkgfile *file)
 	case pkgfile_regular:
 		if (file->loc == pkgfile_loc_disk) {
 			/* Load the file to the data pointer */
-			if (file->data == NULL && file->length > 0) {
-				file->data = malloc(file->length);
-				if (file->data == NULL)
-					return NULL;
-				/*
-				 * Read up to length bytes
-				 * from the file to data
-				 */
-				/** @todo check length < size left in file */
-				fread(file->data, 1, file->length, file->fd);
-			}
+			if (pkgfile_load_data(file) != 0)
+				return NULL;
+		} else if (file->loc == pkgfile_loc_archive) {
+			if (pkgfile_archive_load(file) != 0)
+				return NULL;
 		}
 	case pkgfile_symlink:
 		return file->data;
@@ -530,6 +1724,36 @@ pkgfile_set_cwd(struct pkgfile *file, const char *cwd)
 	return 0;
 }
 
+/**
+ * @brief Sets a directory to access the file relative to
+ *
+ * If set, relative file names are looked up from the open directory
+ * dirfd with the *at() system calls rather than by building a path
+ * from the directory set with pkgfile_set_cwd(). The directory is
+ * not closed by the pkgfile.
+ * @param file The file
+ * @param dirfd An open directory or AT_FDCWD to use the cwd
+ * @return  0 on success
+ * @return -1 on failure
+ */
+int
+pkgfile_set_dirfd(struct pkgfile *file, int dirfd)
+{
+	if (file == NULL)
+		return -1;
+
+	if (dirfd < 0 && dirfd != AT_FDCWD)
+		return -1;
+
+	/* The file may have been opened from the old directory */
+	if (file->fd != NULL)
+		return -1;
+
+	file->dirfd = dirfd;
+
+	return 0;
+}
+
 /**
  * @brief Sets the expected md5 of a file
  * @return  0 on success
@@ -538,10 +1762,85 @@ pkgfile_set_cwd(struct pkgfile *file, const char *cwd)
 int
 pkgfile_set_checksum_md5(struct pkgfile *file, const char *md5)
 {
+	unsigned char digest[16];
+	unsigned int pos;
+	int high, low;
+
 	if (file == NULL || md5 == NULL || strlen(md5) != 32)
 		return -1;
 
-	strlcpy(file->md5, md5, 33);
+	/* Store the checksum as binary to compare with MD5Final */
+	for (pos = 0; pos < sizeof(digest); pos++) {
+		high = pkg_hex_value(md5[pos * 2]);
+		low = pkg_hex_value(md5[pos * 2 + 1]);
+		if (high == -1 || low == -1)
+			return -1;
+		digest[pos] = (high << 4) | low;
+	}
+
+	memcpy(file->md5, digest, sizeof(file->md5));
+	file->has_md5 = 1;
+	return 0;
+}
+
+/**
+ * @brief Passes the contents of a file to a checksum function
+ * @param file The file to checksum
+ * @param update A callback to pass each block of data to
+ * @param ctx The hash context to pass to update
+ *
+ * Files on disk are read in fixed size blocks so the amount of memory
+ * used is independent of the size of the file.
+ * A hardlink will checksum the file it points to and a symlink
+ * will checksum the path it points to.
+ * @return  0 on success
+ * @return -1 on error
+ */
+int
+pkgfile_checksum_stream(struct pkgfile *file, pkgfile_checksum_update *update,
+    void *ctx)
+{
+	int fd, ret;
+
+	if (file == NULL || update == NULL)
+		return -1;
+
+	if (pkgfile_edits_apply(file) != 0)
+		return -1;
+
+	if (file->loc == pkgfile_loc_disk)
+		pkgfile_open_fd(file);
+
+	switch (file->type) {
+	case pkgfile_none:
+	case pkgfile_dir:
+		return -1;
+	case pkgfile_hardlink:
+		assert(file->loc == pkgfile_loc_mem);
+		fd = openat(file->dirfd, file->data, O_RDONLY);
+		if (fd == -1)
+			return -1;
+		ret = pkgfile_checksum_fd(fd, update, ctx);
+		close(fd);
+		return ret;
+	case pkgfile_regular:
+		/* Don't read the file again if it is already in memory */
+		if (file->loc == pkgfile_loc_disk && file->data == NULL) {
+			if (file->fd == NULL)
+				return -1;
+			return pkgfile_checksum_fd(fileno(file->fd), update,
+			    ctx);
+		}
+		if (file->loc == pkgfile_loc_archive &&
+		    pkgfile_archive_load(file) != 0)
+			return -1;
+		/* FALLTHROUGH */
+	case pkgfile_symlink:
+		if (file->length > 0)
+			update(ctx, file->data, file->length);
+		break;
+	}
+
 	return 0;
 }
 
@@ -554,9 +1853,10 @@ pkgfile_set_checksum_md5(struct pkgfile *file, const char *md5)
 int
 pkgfile_compare_checksum_md5(struct pkgfile *file)
 {
-	char checksum[33];
+	unsigned char checksum[16];
+	MD5_CTX ctx;
 
-	if (file == NULL || file->md5[0] == '\0')
+	if (file == NULL || !file->has_md5)
 		return -1;
 
 	if (file->loc == pkgfile_loc_disk)
@@ -565,34 +1865,14 @@ pkgfile_compare_checksum_md5(struct pkgfile *file)
 	assert(file->type != pkgfile_none);
 	assert(file->type != pkgfile_dir);
 
-	switch (file->type) {
-		case pkgfile_none:
-		case pkgfile_dir:
-			return -1;
-		case pkgfile_hardlink:
-		{
-			char real_file[MAXPATHLEN + 1];
-
-			getcwd(real_file, MAXPATHLEN + 1);
-			snprintf(real_file, MAXPATHLEN + 1, "%s/%s", real_file,
-			    file->data);
-			MD5File(real_file, checksum);
-			break;
-		}
-		case pkgfile_symlink:
-		case pkgfile_regular:
-		{
-			/*
-			 * Make sure the data has been loaded
-			 * then calculate the checksum
-			 */
-			pkgfile_get_data(file);
-			MD5Data(file->data, file->length, checksum);
-
-			break;
-		}
+	MD5Init(&ctx);
+	if (pkgfile_checksum_stream(file, pkgfile_md5_update, &ctx) != 0) {
+		MD5Final(checksum, &ctx);
+		return -1;
 	}
-	if (strncmp(checksum, file->md5, 32) == 0)
+	MD5Final(checksum, &ctx);
+
+	if (memcmp(checksum, file->md5, sizeof(checksum)) == 0)
 		return 0;
 
 	return 1;
@@ -616,9 +1896,10 @@ pkgfile_unlink(struct pkgfile *file)
 
 	pkgfile_get_type(file);
 	if (file->type == pkgfile_dir) {
-		return rmdir(pkgfile_real_name(file));
+		return unlinkat(file->dirfd, pkgfile_at_name(file),
+		    AT_REMOVEDIR);
 	} else {
-		return unlink(pkgfile_real_name(file));
+		return unlinkat(file->dirfd, pkgfile_at_name(file), 0);
 	}
 }
 
@@ -632,6 +1913,9 @@ pkgfile_seek(struct pkgfile *file, int64_t position, int whence)
 	if (file == NULL)
 		return -1;
 
+	if (pkgfile_edits_apply(file) != 0)
+		return -1;
+
 	if (file->loc == pkgfile_loc_disk)
 		pkgfile_open_fd(file);
 
@@ -711,7 +1995,9 @@ pkgfile_set_mode(struct pkgfile *file, mode_t mode)
 const char *
 pkgfile_find_line(struct pkgfile *file, const char *line)
 {
-	char *buf;
+	const char *found;
+	size_t length;
+	int multi_line;
 
 	if (file == NULL || line == NULL)
 		return NULL;
@@ -720,22 +2006,43 @@ pkgfile_find_line(struct pkgfile *file, const char *line)
 	if (file->type != pkgfile_regular)
 		return NULL;
 
-	/* Read in the file */
-	pkgfile_get_data(file);
+	/*
+	 * Read in the file. With lines removed by an edit it is already
+	 * in memory and the removed lines are skipped rather than taken
+	 * out now.
+	 */
+	if (file->edits == NULL)
+		pkgfile_get_data(file);
+	if (file->data == NULL)
+		return NULL;
 
-	buf = file->data;
-	/** @todo Change the length of the buffer left on each iteration */
-	while ((buf = memmem(buf, file->length, line, strlen(line))) != NULL) {
-		/* Check the found line is complete */
-		if ((buf == file->data || buf[-1] == '\n') &&
-		    (buf + strlen(line) == file->data + file->length || 
-		     buf[strlen(line)] == '\n')) {
-			break;
-		}
-	}
+	/* Empty lines are never matched */
+	length = strlen(line);
+	if (length == 0)
+		return NULL;
 
-	return buf;
+	/*
+	 * Large files are indexed the first time they are searched.
+	 * The index only holds single lines so multi line
+	 * strings have to be searched for.
+	 */
+	multi_line = (memchr(line, '\n', length) != NULL);
+	if (!multi_line && file->lines == NULL &&
+	    file->length >= PKGFILE_LINE_INDEX_MIN)
+		pkgfile_lines_build(file);
+	if (!multi_line && file->lines != NULL)
+		found = pkgfile_lines_find(file, line, length);
+	else
+		found = pkgfile_scan_line(file, file->data, line, length);
+
+	/* Skip lines removed in the current edit */
+	while (found != NULL && file->edits != NULL &&
+	    pkgfile_edits_removed(file, found - file->data))
+		found = pkgfile_scan_line(file, found + 1, line, length);
+
+	return found;
 }
+
 /**
  * @brief Removes the first occurance of line from a file
  * @param file The file
@@ -749,6 +2056,7 @@ pkgfile_remove_line(struct pkgfile *file, const char *line)
 {
 	union { const char *in; char *out; } buf;
 	char *ptr;
+	size_t length;
 
 	if (file == NULL || line == NULL)
 		return -1;
@@ -759,22 +2067,105 @@ pkgfile_remove_line(struct pkgfile *file, const char *line)
 
 	/* Find the line in the file to remove */
 	buf.in = pkgfile_find_line(file, line);
+	if (buf.in == NULL)
+		return 1;
+
+	/* When editing all the removed lines are taken out at once */
+	length = strlen(line);
+	if (file->editing) {
+		if (buf.in + length < file->data + file->length)
+			length++;
+		return pkgfile_edits_add(file, buf.in - file->data, length);
+	}
+
+	/* The data will be modified so can't be a read only mapping */
+	if (file->mapped) {
+		ptrdiff_t pos = buf.in - file->data;
+
+		if (pkgfile_unmap(file) != 0)
+			return -1;
+		buf.out = file->data + pos;
+	}
+
+	/* The line offsets after the removed line will change */
+	pkgfile_lines_free(file);
 
 	/* Move the rest of the file */
-	ptr = buf.out + strlen(line) + 1;
-	memcpy(buf.out, ptr, file->length - (ptr - file->data));
-	file->length -= strlen(line) + 1;
+	ptr = buf.out + length;
+	if (ptr < file->data + file->length)
+		ptr++;
+	memmove(buf.out, ptr, file->length - (ptr - file->data));
+	file->length -= ptr - buf.out;
+
+	/* When editing the file is written by pkgfile_edit_commit */
+	if (file->loc == pkgfile_loc_disk && !file->editing)
+		return pkgfile_replace(file);
+
+	return 0;
+}
+
+/**
+ * @brief Starts a set of changes to a regular file
+ *
+ * Until pkgfile_edit_commit() is called any lines removed with
+ * pkgfile_remove_line() or data added with pkgfile_append() will
+ * only change the file in memory. This allows a file on disk to
+ * be appended to. Removed lines are only recorded and are taken out
+ * of the data in a single pass when the edit is committed, or when
+ * the data is next read.
+ * @param file The file to edit
+ * @return  0 on success
+ * @return -1 on error
+ */
+int
+pkgfile_edit_begin(struct pkgfile *file)
+{
+	if (file == NULL)
+		return -1;
+
+	if (file->editing)
+		return -1;
 
+	if (pkgfile_get_type(file) != 0 || file->type != pkgfile_regular)
+		return -1;
+
+	/* The file is read in now so it can be changed in memory */
 	if (file->loc == pkgfile_loc_disk) {
-		fseek(file->fd, 0, SEEK_SET);
-		if (fwrite(file->data, 1, file->length, file->fd) !=
-		    file->length) {
-			assert(0);
+		if (pkgfile_open_fd(file) != 0)
+			return -1;
+		if (pkgfile_load_data(file) != 0)
 			return -1;
-		}
-		ftruncate(fileno(file->fd), file->length);
 	}
 
+	file->editing = 1;
+
+	return 0;
+}
+
+/**
+ * @brief Finishes a set of changes started with pkgfile_edit_begin()
+ *
+ * If the file is on disk it will be replaced with the new contents
+ * in a single write. The old file is kept until the new one is complete.
+ * @param file The file being edited
+ * @return  0 on success
+ * @return -1 on error
+ */
+int
+pkgfile_edit_commit(struct pkgfile *file)
+{
+	if (file == NULL)
+		return -1;
+
+	if (!file->editing)
+		return -1;
+
+	file->editing = 0;
+	if (pkgfile_edits_apply(file) != 0)
+		return -1;
+	if (file->loc == pkgfile_loc_disk)
+		return pkgfile_replace(file);
+
 	return 0;
 }
 
@@ -795,28 +2186,16 @@ pkgfile_append(struct pkgfile *file, const char *data, uint64_t length)
 	if (data == NULL && length != 0)
 		return -1;
 
-	assert(file->loc == pkgfile_loc_mem);
-	if (file->type != pkgfile_regular)
+	if (pkgfile_can_append(file) != 0)
 		return -1;
 
-	assert(file->length == 0 || file->data != NULL);
-	if (file->data != NULL) {
-		char *new_data;
-
-		new_data = realloc(file->data, file->length + length);
-		if (new_data == NULL)
-			return -1;
+	if (pkgfile_grow(file, file->length + length, 0) != 0)
+		return -1;
 
-		/* Update the internal pointer and copy the new data */
-		file->data = new_data;
-	} else {
-		file->data = malloc(length);
-		if (file->data == NULL) {
-			return -1;
-		}
-	}
 	/* Append the data to the file */
-	memcpy(file->data + file->length, data, length);
+	pkgfile_lines_free(file);
+	if (length > 0)
+		memcpy(file->data + file->length, data, length);
 	file->length += length;
 
 	return 0;
@@ -832,24 +2211,61 @@ pkgfile_append(struct pkgfile *file, const char *data, uint64_t length)
 int
 pkgfile_append_string(struct pkgfile *file, const char *format, ...)
 {
-	char *buf;
-	int len, ret;
 	va_list ap;
+	uint64_t space;
+	int len;
 
 	if (file == NULL || format == NULL)
 		return -1;
 
-	/* Build a buffer from the format string */
-	va_start(ap, format);
-	len = vasprintf(&buf, format, ap);
-	if (buf == NULL)
+	if (pkgfile_can_append(file) != 0)
 		return -1;
+
+	/* Try to format the string into the space at the end of the data */
+	space = file->capacity - file->length;
+	va_start(ap, format);
+	len = vsnprintf(space > 0 ? file->data + file->length : NULL,
+	    MIN(space, INT_MAX), format, ap);
 	va_end(ap);
+	if (len < 0)
+		return -1;
 
-	ret = pkgfile_append(file, buf, len);
-	free(buf);
+	/* There wasn't enough space so grow the buffer and try again */
+	if ((uint64_t)len >= space) {
+		if (pkgfile_grow(file, file->length + len + 1, 0) != 0)
+			return -1;
+
+		va_start(ap, format);
+		vsnprintf(file->data + file->length, len + 1, format, ap);
+		va_end(ap);
+	}
+
+	pkgfile_lines_free(file);
+	file->length += len;
+
+	return 0;
+}
 
-	return ret;
+/**
+ * @brief Makes sure a file has space for a given amount of data
+ *
+ * This allows the buffer to be allocated once when the final size
+ * of a file is known before it is built with pkgfile_append().
+ * @param file The file to reserve space in
+ * @param length The total length of data the file will hold
+ * @return  0 on success
+ * @return -1 on error
+ */
+int
+pkgfile_reserve(struct pkgfile *file, uint64_t length)
+{
+	if (file == NULL)
+		return -1;
+
+	if (pkgfile_can_append(file) != 0)
+		return -1;
+
+	return pkgfile_grow(file, length, 1);
 }
 
 /**
@@ -863,6 +2279,9 @@ pkgfile_write(struct pkgfile *file)
 	if (file == NULL)
 		return -1;
 
+	if (pkgfile_edits_apply(file) != 0)
+		return -1;
+
 	if (file->loc == pkgfile_loc_disk)
 		pkgfile_open_fd(file);
 
@@ -872,95 +2291,37 @@ pkgfile_write(struct pkgfile *file)
 	case pkgfile_none:
 		return -1;
 	case pkgfile_regular:
-		if (file->loc == pkgfile_loc_mem) {
-			uint64_t length;
-			struct stat sb;
-			size_t write_size;
-			char *buf;
-			FILE *fd;
-
-			assert(file->fd == NULL);
-			fd = fopen(pkgfile_real_name(file), "a");
-			if (fd == NULL) {
-				char *dir_name;
-
-				/*
-				 * The open failed, try running mkdir -p
-				 * on the dir and opening again
-				 */
-				dir_name = dirname(pkgfile_real_name(file));
-				pkg_dir_build(dir_name, 0);
-				fd = fopen(pkgfile_real_name(file), "a");
-				if (fd == NULL) {
-					return -1;
-				}
-				/* We created the file */
-			}
-			if (fstat(fileno(fd), &sb) != 0) {
-				/* And fstat can find it */
-				fclose(fd);
-				return -1;
-			} else if (!S_ISREG(sb.st_mode)) {
-				/* And it is regular */
-				fclose(fd);
-				return -1;
-			} else if (sb.st_size > 0) {
-				/* And the file is empty */
-				fclose(fd);
-				return -1;
-			} else if (sb.st_nlink != 1) {
-				/* And there are no hardlinks to it */
-				fclose(fd);
-				return -1;
-			}
-			if (file->data != NULL) {
-				/* We can now write to the file */
-				buf = file->data;
-
-				length = file->length;
-				while (length > 0) {
-					write_size = fwrite(buf, 1, length, fd);
-					length -= write_size;
-					buf += write_size;
-					if (write_size == 0) {
-						assert(0);
-						break;
-					}
-				}
-			}
-
-			if (file->mode != 0)
-				fchmod(fileno(fd), file->mode);
-
-			fclose(fd);
-		}
+		if (file->loc == pkgfile_loc_mem ||
+		    file->loc == pkgfile_loc_archive)
+			return pkgfile_write_regular(file);
 		break;
 	case pkgfile_hardlink:
-		if (link(file->data, file->name) != 0) {
-			char *dir_name;
+		if (linkat(file->dirfd, file->data, file->dirfd,
+		    pkgfile_at_name(file), 0) != 0) {
 			if (errno != ENOENT)
 				return -1;
 
-			dir_name = dirname(pkgfile_real_name(file));
-			pkg_dir_build(dir_name, 0);
-			if (link(file->data, file->name) != 0)
+			pkgfile_build_parent(file);
+			if (linkat(file->dirfd, file->data, file->dirfd,
+			    pkgfile_at_name(file), 0) != 0)
 				return -1;
 		}
 		break;
 	case pkgfile_symlink:
-		if (symlink(file->data, file->name) != 0) {
-			char *dir_name;
+		if (symlinkat(file->data, file->dirfd,
+		    pkgfile_at_name(file)) != 0) {
 			if (errno != ENOENT)
 				return -1;
 
-			dir_name = dirname(pkgfile_real_name(file));
-			pkg_dir_build(dir_name, 0);
-			if (symlink(file->data, file->name) != 0)
+			pkgfile_build_parent(file);
+			if (symlinkat(file->data, file->dirfd,
+			    pkgfile_at_name(file)) != 0)
 				return -1;
 		}
 		break;
 	case pkgfile_dir:
-		if (pkg_dir_build(pkgfile_real_name(file), file->mode) != 0)
+		if (pkg_dir_build_at(file->dirfd, pkgfile_at_name(file),
+		    file->mode) != 0)
 			return -1;
 		break;
 	}
@@ -968,6 +2329,22 @@ pkgfile_write(struct pkgfile *file)
 	return 0;
 }
 
+/**
+ * @brief Takes a reference to a pkgfile object
+ *
+ * The object will not be freed until pkgfile_free() has been
+ * called once more than pkgfile_ref().
+ * @return The file
+ */
+struct pkgfile *
+pkgfile_ref(struct pkgfile *file)
+{
+	assert(file != NULL);
+
+	file->refs++;
+	return file;
+}
+
 /**
  * @brief Frees a pkgfile object
  * @return 0 on success or -1 on error
@@ -978,8 +2355,12 @@ pkgfile_free(struct pkgfile *file)
 	if (file == NULL)
 		return -1;
 
-	if (file->name != NULL)
-		free(file->name);
+	/* Another user still has a reference to the file */
+	assert(file->refs > 0);
+	if (--file->refs > 0)
+		return 0;
+
+	free(file->name);
 
 	if (file->cwd != NULL)
 		free(file->cwd);
@@ -990,9 +2371,23 @@ pkgfile_free(struct pkgfile *file)
 	if (file->fd != NULL)
 		fclose(file->fd);
 
-	if (file->data != NULL)
-		free(file->data);
-	
+	pkgfile_lines_free(file);
+	pkgfile_edits_free(file);
+
+	if (file->data != NULL) {
+		if (file->mapped)
+			munmap(file->data, file->length);
+		else
+			free(file->data);
+	}
+
+	/* Keep the object to be reused by pkgfile_new() */
+	pthread_mutex_lock(&pkgfile_cache_lock);
+	if (pkgfile_cache_count < PKGFILE_CACHE_MAX) {
+		pkgfile_cache[pkgfile_cache_count++] = file;
+		file = NULL;
+	}
+	pthread_mutex_unlock(&pkgfile_cache_lock);
 	free(file);
 
 	return 0;
@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2005, Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pkg.h"
+#include "pkg_private.h"
+
+/* The number of files that may be waiting to be written */
+#define PKGFILE_BATCH_SIZE	256
+
+typedef enum {
+	pkgfile_batch_queued,
+	pkgfile_batch_writing,
+	pkgfile_batch_done
+} pkgfile_batch_state;
+
+struct pkgfile_batch_slot {
+	struct pkgfile		*file;
+	pkgfile_batch_state	 state;
+};
+
+/*
+ * A ring of files. Files between head and next are being written
+ * or have been written, files between next and tail are waiting
+ * for a thread to write them.
+ */
+struct pkgfile_batch {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 queued;	/* A file was added */
+	pthread_cond_t		 written;	/* A file was written */
+	pthread_t		*threads;
+	unsigned int		 thread_count;
+	struct pkgfile_batch_slot slots[PKGFILE_BATCH_SIZE];
+	unsigned int		 head;
+	unsigned int		 next;
+	unsigned int		 tail;
+	int			 error;
+	int			 stop;
+};
+
+static void	*pkgfile_batch_thread(void *);
+static void	 pkgfile_batch_release(struct pkgfile_batch *);
+
+/**
+ * @defgroup PackageFileBatch Batched file writing
+ * @ingroup PackageFile
+ * @brief Write many files in parallel
+ *
+ * Writing a package with many small files spends most of it's time
+ * waiting on system calls. A pkgfile_batch passes the files to a
+ * pool of threads so more than one is being written at a time.
+ *
+ * @{
+ */
+
+/**
+ * @brief Creates a new batch of files to write
+ * @param threads The number of threads to write the files with. If
+ *     this is 0 files will be written by pkgfile_batch_write().
+ * @return A new pkgfile_batch or NULL
+ */
+struct pkgfile_batch *
+pkgfile_batch_new(unsigned int threads)
+{
+	struct pkgfile_batch *batch;
+
+	batch = malloc(sizeof(struct pkgfile_batch));
+	if (batch == NULL)
+		return NULL;
+
+	batch->thread_count = 0;
+	batch->head = batch->next = batch->tail = 0;
+	batch->error = 0;
+	batch->stop = 0;
+	batch->threads = NULL;
+
+	/* This isn't safe to call for the first time from the threads */
+	pkgfile_umask();
+
+	if (pthread_mutex_init(&batch->lock, NULL) != 0) {
+		free(batch);
+		return NULL;
+	}
+	if (pthread_cond_init(&batch->queued, NULL) != 0) {
+		pthread_mutex_destroy(&batch->lock);
+		free(batch);
+		return NULL;
+	}
+	if (pthread_cond_init(&batch->written, NULL) != 0) {
+		pthread_cond_destroy(&batch->queued);
+		pthread_mutex_destroy(&batch->lock);
+		free(batch);
+		return NULL;
+	}
+
+	if (threads > 0) {
+		batch->threads = malloc(threads * sizeof(pthread_t));
+		if (batch->threads == NULL) {
+			pkgfile_batch_free(batch);
+			return NULL;
+		}
+	}
+	for (; batch->thread_count < threads; batch->thread_count++) {
+		if (pthread_create(&batch->threads[batch->thread_count], NULL,
+		    pkgfile_batch_thread, batch) != 0) {
+			pkgfile_batch_free(batch);
+			return NULL;
+		}
+	}
+
+	return batch;
+}
+
+/**
+ * @brief Adds a file to be written
+ *
+ * The file is written by one of the batch's threads some time after
+ * this returns. The batch holds a reference to the file so the
+ * caller may free it. Hardlinks, directories and symlinks are only
+ * written once every file before them has been written, and are
+ * written before returning. A hardlink may point to an earlier file,
+ * and later files may be created in a directory or through a symlink
+ * so it must exist first with its own mode and owner. A file backed
+ * by an archive is written before returning as the archive will move
+ * on to the next entry.
+ * @return  0 on success
+ * @return -1 on error, this may be from an earlier file
+ */
+int
+pkgfile_batch_write(struct pkgfile_batch *batch, struct pkgfile *file)
+{
+	int ret;
+
+	if (batch == NULL || file == NULL)
+		return -1;
+
+	if (batch->thread_count == 0)
+		return pkgfile_write(file);
+
+	if (file->type == pkgfile_hardlink || file->type == pkgfile_dir ||
+	    file->type == pkgfile_symlink) {
+		if (pkgfile_batch_wait(batch) != 0)
+			return -1;
+		return pkgfile_write(file);
+	}
+	if (file->loc == pkgfile_loc_archive)
+		return pkgfile_write(file);
+
+	pthread_mutex_lock(&batch->lock);
+
+	/* Wait for space in the ring */
+	pkgfile_batch_release(batch);
+	while (batch->tail - batch->head == PKGFILE_BATCH_SIZE) {
+		pthread_cond_wait(&batch->written, &batch->lock);
+		pkgfile_batch_release(batch);
+	}
+
+	batch->slots[batch->tail % PKGFILE_BATCH_SIZE].file =
+	    pkgfile_ref(file);
+	batch->slots[batch->tail % PKGFILE_BATCH_SIZE].state =
+	    pkgfile_batch_queued;
+	batch->tail++;
+	pthread_cond_signal(&batch->queued);
+	ret = batch->error;
+
+	pthread_mutex_unlock(&batch->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Waits for all files added to a batch to be written
+ * @return  0 if all files were written
+ * @return -1 if any file failed to be written since the last call
+ */
+int
+pkgfile_batch_wait(struct pkgfile_batch *batch)
+{
+	int ret;
+
+	if (batch == NULL)
+		return -1;
+
+	pthread_mutex_lock(&batch->lock);
+	pkgfile_batch_release(batch);
+	while (batch->head != batch->tail) {
+		pthread_cond_wait(&batch->written, &batch->lock);
+		pkgfile_batch_release(batch);
+	}
+	ret = batch->error;
+	batch->error = 0;
+	pthread_mutex_unlock(&batch->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Waits for a batch to finish then frees it
+ * @return  0 if all files were written
+ * @return -1 if any file failed to be written or batch is NULL
+ */
+int
+pkgfile_batch_free(struct pkgfile_batch *batch)
+{
+	unsigned int pos;
+	int ret;
+
+	if (batch == NULL)
+		return -1;
+
+	ret = pkgfile_batch_wait(batch);
+
+	pthread_mutex_lock(&batch->lock);
+	batch->stop = 1;
+	pthread_cond_broadcast(&batch->queued);
+	pthread_mutex_unlock(&batch->lock);
+
+	for (pos = 0; pos < batch->thread_count; pos++)
+		pthread_join(batch->threads[pos], NULL);
+	free(batch->threads);
+
+	pthread_cond_destroy(&batch->written);
+	pthread_cond_destroy(&batch->queued);
+	pthread_mutex_destroy(&batch->lock);
+	free(batch);
+
+	return ret;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup PackageFileBatchInternal Internal batched file writing functions
+ * @ingroup PackageFileBatch
+ *
+ * @{
+ */
+
+/**
+ * @brief The function run by each thread in a batch
+ *
+ * It writes files in the order they were added until the batch is freed.
+ */
+static void *
+pkgfile_batch_thread(void *data)
+{
+	struct pkgfile_batch *batch;
+	struct pkgfile_batch_slot *slot;
+	int ret;
+
+	batch = data;
+	pthread_mutex_lock(&batch->lock);
+	for (;;) {
+		while (batch->next == batch->tail && !batch->stop)
+			pthread_cond_wait(&batch->queued, &batch->lock);
+		if (batch->next == batch->tail)
+			break;
+
+		slot = &batch->slots[batch->next % PKGFILE_BATCH_SIZE];
+		batch->next++;
+		slot->state = pkgfile_batch_writing;
+
+		/* Write without the lock so other threads can run */
+		pthread_mutex_unlock(&batch->lock);
+		ret = pkgfile_write(slot->file);
+		pthread_mutex_lock(&batch->lock);
+
+		if (ret != 0)
+			batch->error = -1;
+		slot->state = pkgfile_batch_done;
+		pthread_cond_broadcast(&batch->written);
+	}
+	pthread_mutex_unlock(&batch->lock);
+
+	return NULL;
+}
+
+/**
+ * @brief Drops the batch's reference to files that have been written
+ *
+ * This must be called with the lock held by the thread that adds
+ * files, as pkgfile_free() isn't thread safe.
+ */
+static void
+pkgfile_batch_release(struct pkgfile_batch *batch)
+{
+	struct pkgfile_batch_slot *slot;
+
+	assert(batch != NULL);
+
+	while (batch->head != batch->tail) {
+		slot = &batch->slots[batch->head % PKGFILE_BATCH_SIZE];
+		if (slot->state != pkgfile_batch_done)
+			break;
+
+		pkgfile_free(slot->file);
+		slot->file = NULL;
+		batch->head++;
+	}
+}
+
+/**
+ * @}
+ */
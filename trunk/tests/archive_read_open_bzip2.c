@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2007 Andrew Turner, All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include "test.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <bzlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+#include <pkg_private.h>
+
+#define BZIP2_DATA "testdir/data"
+#define BZIP2_TAR "testdir/data.tar"
+#define BZIP2_FILE "testdir/data.tbz"
+
+/* The most threads to decode with, more than one to use this reader */
+#define BZIP2_THREADS 4
+
+static char *bzip2_make_data(size_t, int);
+static char *bzip2_read_all(const char *, size_t *);
+static char *bzip2_compress(const char *, size_t, int, size_t *);
+static void bzip2_make_file(const char *, size_t, int, int);
+static int bzip2_check_file(const char *, size_t);
+
+/*
+ * The bytes used in a block are stored as a 16 bit map of which
+ * groups of 16 are used followed by a 16 bit map of each used group.
+ * When only these are used the maps are 0x3141 0x5926 0x5359, the
+ * magic that starts a block.
+ */
+static const unsigned char bzip2_magic_bytes[] = {
+	0x21, 0x23, 0x24, 0x27, 0x2a, 0x2d, 0x2e,
+	0x31, 0x33, 0x36, 0x37, 0x39, 0x3b, 0x3c, 0x3f,
+	0x70, 0x90, 0xf0
+};
+
+/*
+ * Creates len bytes of data. With magic only the bytes above are used
+ * and there are no runs of 4 as bzip2 would store the run's length.
+ */
+static char *
+bzip2_make_data(size_t len, int magic)
+{
+	char *data;
+	size_t pos;
+	unsigned int seed;
+
+	data = malloc(len);
+	fail_unless(data != NULL, NULL);
+	seed = 1;
+	for (pos = 0; pos < len; pos++) {
+		seed = seed * 1103515245 + 12345;
+		if (magic) {
+			data[pos] = bzip2_magic_bytes[(seed >> 16) %
+			    sizeof(bzip2_magic_bytes)];
+			if (pos >= 3 && data[pos] == data[pos - 1] &&
+			    data[pos] == data[pos - 2] &&
+			    data[pos] == data[pos - 3])
+				pos--;
+		} else {
+			/* Text like data that compresses */
+			data[pos] = 'a' + (seed >> 16) % 8;
+		}
+	}
+	return data;
+}
+
+static char *
+bzip2_read_all(const char *path, size_t *len)
+{
+	struct stat sb;
+	FILE *fd;
+	char *data;
+
+	fail_unless(stat(path, &sb) == 0, NULL);
+	*len = sb.st_size;
+	data = malloc(*len);
+	fail_unless(data != NULL, NULL);
+	fd = fopen(path, "r");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(fread(data, *len, 1, fd) == 1, NULL);
+	fclose(fd);
+	return data;
+}
+
+static char *
+bzip2_compress(const char *data, size_t len, int level, size_t *out_len)
+{
+	unsigned int dest_len;
+	char *out;
+
+	dest_len = len + len / 100 + 600;
+	out = malloc(dest_len);
+	fail_unless(out != NULL, NULL);
+	fail_unless(BZ2_bzBuffToBuffCompress(out, &dest_len, (char *)data,
+	    len, level, 0, 0) == BZ_OK, NULL);
+	*out_len = dest_len;
+	return out;
+}
+
+/*
+ * Creates a bzip2 compressed tar file holding len bytes of data. With
+ * streams above 1 the tar file is split and each part compressed on
+ * it's own, as pbzip2 does.
+ */
+static void
+bzip2_make_file(const char *data, size_t len, int level, int streams)
+{
+	FILE *fd;
+	char *tar, *out;
+	size_t tar_len, part, pos, out_len;
+	int i;
+
+	WRITE_TESTFILE(BZIP2_DATA, data, len);
+	fail_unless(system("tar -cf " BZIP2_TAR " -C testdir data") == 0,
+	    NULL);
+	tar = bzip2_read_all(BZIP2_TAR, &tar_len);
+
+	fd = fopen(BZIP2_FILE, "w");
+	fail_unless(fd != NULL, NULL);
+	part = tar_len / streams;
+	for (i = 0, pos = 0; i < streams; i++, pos += part) {
+		if (i == streams - 1)
+			part = tar_len - pos;
+		out = bzip2_compress(tar + pos, part, level, &out_len);
+		fail_unless(fwrite(out, out_len, 1, fd) == 1, NULL);
+		free(out);
+	}
+	fail_unless(fclose(fd) == 0, NULL);
+	free(tar);
+
+	unlink(BZIP2_DATA);
+	unlink(BZIP2_TAR);
+}
+
+/*
+ * Reads BZIP2_FILE with more than one thread. Returns 0 if it holds
+ * data, -1 if it couldn't be read.
+ */
+static int
+bzip2_check_file(const char *data, size_t len)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	FILE *fd;
+	char *buf;
+	ssize_t ret;
+	size_t pos;
+
+	fd = fopen(BZIP2_FILE, "r");
+	fail_unless(fd != NULL, NULL);
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+	if (archive_read_open_bzip2(a, fd, BZIP2_THREADS) != ARCHIVE_OK) {
+		archive_read_finish(a);
+		fclose(fd);
+		unlink(BZIP2_FILE);
+		return -1;
+	}
+
+	buf = malloc(len + 1);
+	fail_unless(buf != NULL, NULL);
+	pos = 0;
+	if (archive_read_next_header(a, &entry) == ARCHIVE_OK &&
+	    archive_entry_size(entry) == (int64_t)len) {
+		while ((ret = archive_read_data(a, buf + pos,
+		    len + 1 - pos)) > 0)
+			pos += ret;
+		if (ret < 0)
+			pos = 0;
+	}
+	ret = (pos == len && memcmp(buf, data, len) == 0 &&
+	    archive_read_next_header(a, &entry) == ARCHIVE_EOF) ? 0 : -1;
+
+	free(buf);
+	archive_read_finish(a);
+	fclose(fd);
+	unlink(BZIP2_FILE);
+
+	return ret;
+}
+
+/* Check files this can't read are left for another reader */
+START_TEST(archive_read_open_bzip2_other_test)
+{
+	struct archive *a;
+	FILE *fd;
+	char *data;
+
+	SETUP_TESTDIR();
+	data = bzip2_make_data(1000, 0);
+	WRITE_TESTFILE(BZIP2_FILE, data, 1000);
+
+	fd = fopen(BZIP2_FILE, "r");
+	fail_unless(fd != NULL, NULL);
+	a = archive_read_new();
+	fail_unless(archive_read_open_bzip2(a, fd, BZIP2_THREADS) ==
+	    ARCHIVE_WARN, NULL);
+	fail_unless(archive_read_open_bzip2(a, NULL, BZIP2_THREADS) ==
+	    ARCHIVE_WARN, NULL);
+	archive_read_finish(a);
+	fclose(fd);
+
+	/* With one thread the file is read by archive_read_open_stream() */
+	bzip2_make_file(data, 1000, 9, 1);
+	fd = fopen(BZIP2_FILE, "r");
+	fail_unless(fd != NULL, NULL);
+	a = archive_read_new();
+	fail_unless(archive_read_open_bzip2(a, fd, 1) == ARCHIVE_WARN, NULL);
+	archive_read_finish(a);
+	fclose(fd);
+
+	free(data);
+	unlink(BZIP2_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+START_TEST(archive_read_open_bzip2_single_test)
+{
+	char *data;
+
+	SETUP_TESTDIR();
+	data = bzip2_make_data(20000, 0);
+	bzip2_make_file(data, 20000, 9, 1);
+	fail_unless(bzip2_check_file(data, 20000) == 0, NULL);
+	free(data);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+START_TEST(archive_read_open_bzip2_multi_test)
+{
+	char *data;
+
+	/* Enough for more blocks than are decoded ahead of the reader */
+	SETUP_TESTDIR();
+	data = bzip2_make_data(1500000, 0);
+	bzip2_make_file(data, 1500000, 1, 1);
+	fail_unless(bzip2_check_file(data, 1500000) == 0, NULL);
+	free(data);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+START_TEST(archive_read_open_bzip2_streams_test)
+{
+	char *data;
+
+	SETUP_TESTDIR();
+	data = bzip2_make_data(500000, 0);
+	bzip2_make_file(data, 500000, 1, 3);
+	fail_unless(bzip2_check_file(data, 500000) == 0, NULL);
+	bzip2_make_file(data, 500000, 9, 2);
+	fail_unless(bzip2_check_file(data, 500000) == 0, NULL);
+	free(data);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/* Check a block or stream with a bad CRC is an error */
+START_TEST(archive_read_open_bzip2_crc_test)
+{
+	char *data, *file;
+	size_t len, pos;
+
+	SETUP_TESTDIR();
+	data = bzip2_make_data(500000, 0);
+
+	/* The first block's CRC follows the stream header and magic */
+	bzip2_make_file(data, 500000, 1, 1);
+	file = bzip2_read_all(BZIP2_FILE, &len);
+	file[10] ^= 0x01;
+	WRITE_TESTFILE(BZIP2_FILE, file, len);
+	free(file);
+	fail_unless(bzip2_check_file(data, 500000) == -1, NULL);
+
+	/*
+	 * The stream's CRC is the last 32 bits before the padding. The
+	 * tar reader stops at the end of the archive so only a stream
+	 * before the last is checked.
+	 */
+	bzip2_make_file(data, 500000, 1, 2);
+	file = bzip2_read_all(BZIP2_FILE, &len);
+	for (pos = 10; pos < len - 10; pos++)
+		if (memcmp(file + pos, "BZh1\x31\x41\x59\x26\x53\x59",
+		    10) == 0)
+			break;
+	fail_unless(pos < len - 10, NULL);
+	file[pos - 2] ^= 0x10;
+	WRITE_TESTFILE(BZIP2_FILE, file, len);
+	free(file);
+	fail_unless(bzip2_check_file(data, 500000) == -1, NULL);
+
+	/* A file that ends in a block */
+	bzip2_make_file(data, 500000, 1, 1);
+	file = bzip2_read_all(BZIP2_FILE, &len);
+	WRITE_TESTFILE(BZIP2_FILE, file, len / 2);
+	free(file);
+	fail_unless(bzip2_check_file(data, 500000) == -1, NULL);
+
+	free(data);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/* Check a block with the block magic inside it can be read */
+START_TEST(archive_read_open_bzip2_false_magic_test)
+{
+	char *data;
+
+	SETUP_TESTDIR();
+	data = bzip2_make_data(500000, 1);
+	bzip2_make_file(data, 500000, 1, 1);
+	fail_unless(bzip2_check_file(data, 500000) == 0, NULL);
+	bzip2_make_file(data, 500000, 1, 2);
+	fail_unless(bzip2_check_file(data, 500000) == 0, NULL);
+	free(data);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+Suite *
+archive_read_open_bzip2_suite()
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Parallel bzip2 reader");
+
+	tc = tcase_create("bzip2");
+	tcase_add_test(tc, archive_read_open_bzip2_other_test);
+	tcase_add_test(tc, archive_read_open_bzip2_single_test);
+	tcase_add_test(tc, archive_read_open_bzip2_multi_test);
+	tcase_add_test(tc, archive_read_open_bzip2_streams_test);
+	tcase_add_test(tc, archive_read_open_bzip2_crc_test);
+	tcase_add_test(tc, archive_read_open_bzip2_false_magic_test);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2007, Andrew Turner, All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "test.h"
+
+#include <sys/types.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+#include <pkg_private.h>
+
+#define STREAM_TAR "testdir/data.tar"
+#define STREAM_FILE "testdir/prefixed.tar"
+
+/* Larger than the biggest block read from a pipe */
+#define STREAM_SKIP_LEN (3 * 1024 * 1024)
+#define STREAM_DATA_LEN 100000
+
+/* Bytes before the archive in STREAM_FILE */
+#define STREAM_PREFIX_LEN 100
+
+static char *stream_make_data(size_t, unsigned int);
+static void stream_make_tar(void);
+static void stream_check(FILE *, size_t);
+
+static char *
+stream_make_data(size_t len, unsigned int seed)
+{
+	char *data;
+	size_t pos;
+
+	data = malloc(len);
+	fail_unless(data != NULL, NULL);
+	for (pos = 0; pos < len; pos++) {
+		seed = seed * 1103515245 + 12345;
+		data[pos] = 'a' + (seed >> 16) % 26;
+	}
+	return data;
+}
+
+/*
+ * Creates STREAM_TAR holding skip, a file to be skipped over, then
+ * data. STREAM_FILE is the same archive after STREAM_PREFIX_LEN bytes.
+ */
+static void
+stream_make_tar(void)
+{
+	char prefix[STREAM_PREFIX_LEN];
+	char *data;
+
+	MAKE_TESTDIR("testdir/tar");
+	data = stream_make_data(STREAM_SKIP_LEN, 1);
+	WRITE_TESTFILE("testdir/tar/skip", data, STREAM_SKIP_LEN);
+	free(data);
+	data = stream_make_data(STREAM_DATA_LEN, 2);
+	WRITE_TESTFILE("testdir/tar/data", data, STREAM_DATA_LEN);
+	free(data);
+	fail_unless(system("tar -cf " STREAM_TAR " -C testdir/tar "
+	    "skip data") == 0, NULL);
+	memset(prefix, 0, sizeof(prefix));
+	WRITE_TESTFILE(STREAM_FILE, prefix, sizeof(prefix));
+	fail_unless(system("cat " STREAM_TAR " >> " STREAM_FILE) == 0, NULL);
+	REMOVE_TESTFILES("testdir/tar");
+}
+
+/*
+ * Reads the archive made by stream_make_tar() from fd with
+ * archive_read_open_stream(), skipping the first file's data.
+ */
+static void
+stream_check(FILE *fd, size_t block_size)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	char *data, *buf;
+	ssize_t ret;
+	size_t pos;
+
+	a = archive_read_new();
+	archive_read_support_format_tar(a);
+	fail_unless(archive_read_open_stream(a, fd, block_size) ==
+	    ARCHIVE_OK, NULL);
+
+	fail_unless(archive_read_next_header(a, &entry) == ARCHIVE_OK, NULL);
+	fail_unless(strcmp(archive_entry_pathname(entry), "skip") == 0, NULL);
+	fail_unless(archive_read_data_skip(a) == ARCHIVE_OK, NULL);
+
+	fail_unless(archive_read_next_header(a, &entry) == ARCHIVE_OK, NULL);
+	fail_unless(strcmp(archive_entry_pathname(entry), "data") == 0, NULL);
+	fail_unless(archive_entry_size(entry) == STREAM_DATA_LEN, NULL);
+	buf = malloc(STREAM_DATA_LEN + 1);
+	fail_unless(buf != NULL, NULL);
+	pos = 0;
+	while ((ret = archive_read_data(a, buf + pos,
+	    STREAM_DATA_LEN + 1 - pos)) > 0)
+		pos += ret;
+	fail_unless(ret == 0, NULL);
+	fail_unless(pos == STREAM_DATA_LEN, NULL);
+	data = stream_make_data(STREAM_DATA_LEN, 2);
+	fail_unless(memcmp(buf, data, STREAM_DATA_LEN) == 0, NULL);
+	free(data);
+	free(buf);
+
+	fail_unless(archive_read_next_header(a, &entry) == ARCHIVE_EOF, NULL);
+	archive_read_finish(a);
+}
+
+/* Check a regular file is read from where the caller has read to */
+START_TEST(archive_read_open_stream_file_test)
+{
+	FILE *fd;
+
+	SETUP_TESTDIR();
+	stream_make_tar();
+
+	fd = fopen(STREAM_TAR, "r");
+	fail_unless(fd != NULL, NULL);
+	stream_check(fd, 10240);
+	fclose(fd);
+
+	fd = fopen(STREAM_FILE, "r");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(fseeko(fd, STREAM_PREFIX_LEN, SEEK_SET) == 0, NULL);
+	stream_check(fd, 10240);
+	fclose(fd);
+
+	REMOVE_TESTFILES(STREAM_TAR " " STREAM_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/*
+ * Check a pipe, which can't be mapped or skip, is read correctly as
+ * the blocks grow from a small starting size to their largest.
+ */
+START_TEST(archive_read_open_stream_pipe_test)
+{
+	FILE *fd;
+
+	SETUP_TESTDIR();
+	stream_make_tar();
+
+	fd = popen("cat " STREAM_TAR, "r");
+	fail_unless(fd != NULL, NULL);
+	stream_check(fd, 512);
+	fail_unless(pclose(fd) == 0, NULL);
+
+	REMOVE_TESTFILES(STREAM_TAR " " STREAM_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/* Check an empty file has no entries and a missing FILE is an error */
+START_TEST(archive_read_open_stream_empty_test)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	FILE *fd;
+
+	SETUP_TESTDIR();
+	WRITE_TESTFILE(STREAM_TAR, "", 0);
+	fd = fopen(STREAM_TAR, "r");
+	fail_unless(fd != NULL, NULL);
+	a = archive_read_new();
+	archive_read_support_format_tar(a);
+	archive_read_open_stream(a, fd, 10240);
+	fail_unless(archive_read_next_header(a, &entry) != ARCHIVE_OK, NULL);
+	archive_read_finish(a);
+	fclose(fd);
+
+	a = archive_read_new();
+	fail_unless(archive_read_open_stream(a, NULL, 10240) == ARCHIVE_FATAL,
+	    NULL);
+	archive_read_finish(a);
+
+	REMOVE_TESTFILES(STREAM_TAR);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+Suite *
+archive_read_open_stream_suite()
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Stream reader");
+
+	tc = tcase_create("stream");
+	tcase_add_test(tc, archive_read_open_stream_file_test);
+	tcase_add_test(tc, archive_read_open_stream_pipe_test);
+	tcase_add_test(tc, archive_read_open_stream_empty_test);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -25,6 +25,7 @@
  */
 
 #include "test.h"
+#include <stdio.h>
 #include <stdlib.h>
 
 int
@@ -44,6 +45,49 @@ cleanup_testdir()
 	return 1;
 }
 
+/*
+ * Creates an empty directory in the test dir, and any parents it needs.
+ * Anything already at dir is removed first.
+ */
+int
+make_testdir(const char *dir)
+{
+	char cmd[FILENAME_MAX];
+
+	if (remove_testfiles(dir) != 0)
+		return -1;
+	snprintf(cmd, sizeof(cmd), "mkdir -p %s", dir);
+	return system(cmd) == 0 ? 0 : -1;
+}
+
+/* Removes the space separated files and directories so the test dir is empty */
+int
+remove_testfiles(const char *files)
+{
+	char cmd[FILENAME_MAX];
+
+	snprintf(cmd, sizeof(cmd), "rm -fr %s", files);
+	return system(cmd) == 0 ? 0 : -1;
+}
+
+/* Writes len bytes of data to a new file at path */
+int
+write_testfile(const char *path, const char *data, size_t len)
+{
+	FILE *fd;
+	int ret;
+
+	fd = fopen(path, "w");
+	if (fd == NULL)
+		return -1;
+	ret = 0;
+	if (len > 0 && fwrite(data, len, 1, fd) != 1)
+		ret = -1;
+	if (fclose(fd) != 0)
+		ret = -1;
+	return ret;
+}
+
 int
 main(int argc __unused, char *argv[] __unused)
 {
@@ -54,6 +98,12 @@ main(int argc __unused, char *argv[] __unused)
 	srunner_add_suite(sr, pkg_manifest_item_suite());
 	srunner_add_suite(sr, pkg_manifest_suite());
 	srunner_add_suite(sr, pkg_manifest_freebsd_suite());
+	srunner_add_suite(sr, pkg_freebsd_toc_suite());
+	srunner_add_suite(sr, pkg_freebsd_suite());
+	srunner_add_suite(sr, archive_read_open_bzip2_suite());
+	srunner_add_suite(sr, archive_read_open_stream_suite());
+	srunner_add_suite(sr, pkg_chunked_suite());
+	srunner_add_suite(sr, pkg_freebsd_cache_suite());
 
 	srunner_run_all(sr, CK_NORMAL);
 	fail_count = srunner_ntests_failed(sr);
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2007 Andrew Turner, All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include "test.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+#include <pkg_private.h>
+
+#define CHUNKED_FILE "testdir/package.chunked"
+
+#define CHUNKED_CONTENTS "@comment PKG_FORMAT_REVISION:1.1\n" \
+    "@name package_name-1.0\n" \
+    "@comment ORIGIN:package/origin\n" \
+    "@cwd /usr/local\n" \
+    "dir/small\n" \
+    "dir/empty\n" \
+    "dir/big\n" \
+    "dir/link\n" \
+    "dir/hard\n" \
+    "dir/after\n"
+#define CHUNKED_COMMENT "A chunked package\n"
+#define CHUNKED_DESC "A package in the chunked format\n"
+#define CHUNKED_SMALL "A small file\n"
+#define CHUNKED_AFTER "In the same chunk as the end of dir/big\n"
+
+/* Larger than two chunks so it is in at least three */
+#define CHUNKED_BIG_LEN (2 * 1024 * 1024 + 1000)
+
+static struct pkg_manifest *chunked_manifest(void);
+static char *chunked_big(void);
+static void chunked_write(struct pkgfile **);
+static struct pkg *chunked_open(void);
+static void chunked_check(struct pkgfile *, const char *, pkgfile_type,
+	const char *, uint64_t, mode_t);
+static void chunked_corrupt(long);
+
+static struct pkg_manifest *
+chunked_manifest(void)
+{
+	struct pkg_manifest *manifest;
+	struct pkgfile *contents;
+
+	contents = pkgfile_new_regular("+CONTENTS", CHUNKED_CONTENTS,
+	    strlen(CHUNKED_CONTENTS));
+	fail_unless(contents != NULL, NULL);
+	manifest = pkg_manifest_new_freebsd_pkgfile(contents);
+	fail_unless(manifest != NULL, NULL);
+	pkgfile_free(contents);
+	return manifest;
+}
+
+/* Data that doesn't repeat every chunk so a misplaced chunk is found */
+static char *
+chunked_big(void)
+{
+	char *data;
+	unsigned int pos, seed;
+
+	data = malloc(CHUNKED_BIG_LEN);
+	fail_unless(data != NULL, NULL);
+	seed = 1;
+	for (pos = 0; pos < CHUNKED_BIG_LEN; pos++) {
+		seed = seed * 1103515245 + 12345;
+		data[pos] = 'a' + (seed >> 16) % 26;
+	}
+	return data;
+}
+
+static void
+chunked_write(struct pkgfile **files)
+{
+	struct pkg_manifest *manifest;
+	FILE *fd;
+
+	manifest = chunked_manifest();
+	fd = fopen(CHUNKED_FILE, "w+");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(pkg_chunked_write(fd, manifest, files) == 0, NULL);
+	fail_unless(fclose(fd) == 0, NULL);
+	pkg_manifest_free(manifest);
+}
+
+static struct pkg *
+chunked_open(void)
+{
+	struct pkg *pkg;
+	FILE *fd;
+
+	fd = fopen(CHUNKED_FILE, "r");
+	fail_unless(fd != NULL, NULL);
+	pkg = pkg_new_chunked_from_file(fd);
+	if (pkg == NULL)
+		fclose(fd);
+	return pkg;
+}
+
+static void
+chunked_check(struct pkgfile *file, const char *name, pkgfile_type type,
+	const char *data, uint64_t len, mode_t mode)
+{
+	fail_unless(file != NULL, NULL);
+	fail_unless(strcmp(pkgfile_get_name(file), name) == 0, NULL);
+	fail_unless(file->type == type, NULL);
+	fail_unless((file->mode & ALLPERMS) == mode, NULL);
+	if (type == pkgfile_dir)
+		return;
+	fail_unless(pkgfile_get_size(file) == len, NULL);
+	if (len > 0)
+		fail_unless(memcmp(pkgfile_get_data(file), data, len) == 0,
+		    NULL);
+}
+
+/* Flips the bits of the byte at offset, from the end if negative */
+static void
+chunked_corrupt(long offset)
+{
+	FILE *fd;
+	int c;
+
+	fd = fopen(CHUNKED_FILE, "r+");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(fseek(fd, offset, offset < 0 ? SEEK_END : SEEK_SET) == 0,
+	    NULL);
+	c = getc(fd);
+	fail_unless(c != EOF, NULL);
+	fail_unless(fseek(fd, -1, SEEK_CUR) == 0, NULL);
+	fail_unless(putc(c ^ 0xff, fd) != EOF, NULL);
+	fail_unless(fclose(fd) == 0, NULL);
+}
+
+START_TEST(pkg_chunked_bad_args_test)
+{
+	struct pkg_manifest *manifest;
+	struct pkgfile *files[1], *contents;
+	FILE *fd;
+
+	files[0] = NULL;
+	manifest = chunked_manifest();
+	fail_unless(pkg_chunked_write(NULL, manifest, files) == -1, NULL);
+	fail_unless(pkg_chunked_write(stdout, NULL, files) == -1, NULL);
+	fail_unless(pkg_chunked_write(stdout, manifest, NULL) == -1, NULL);
+	pkg_manifest_free(manifest);
+	fail_unless(pkg_new_chunked_from_file(NULL) == NULL, NULL);
+
+	/* A file that isn't a chunked package */
+	SETUP_TESTDIR();
+	fd = fopen(CHUNKED_FILE, "w+");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(fputs(CHUNKED_CONTENTS, fd) != EOF, NULL);
+	fail_unless(fflush(fd) == 0, NULL);
+	rewind(fd);
+	fail_unless(pkg_new_chunked_from_file(fd) == NULL, NULL);
+	fclose(fd);
+
+	/* The file of a package that can't be read is left for the caller */
+	files[0] = NULL;
+	manifest = chunked_manifest();
+	contents = pkg_manifest_get_file(manifest);
+	fail_unless(pkgfile_remove_line(contents, "@name package_name-1.0") ==
+	    0, NULL);
+	fd = fopen(CHUNKED_FILE, "w+");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(pkg_chunked_write(fd, manifest, files) == 0, NULL);
+	pkg_manifest_free(manifest);
+	rewind(fd);
+	fail_unless(pkg_new_chunked_from_file(fd) == NULL, NULL);
+	fail_unless(ftello(fd) == 0, NULL);
+	fail_unless(fclose(fd) == 0, NULL);
+
+	unlink(CHUNKED_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/* Check every type of file is read back in order */
+START_TEST(pkg_chunked_write_test)
+{
+	struct pkgfile *files[11], **control;
+	struct pkg *pkg;
+	char *big;
+	int i;
+
+	SETUP_TESTDIR();
+	big = chunked_big();
+
+	/* The control files are moved before the others */
+	files[0] = pkgfile_new_directory("dir");
+	files[1] = pkgfile_new_regular("+COMMENT", CHUNKED_COMMENT,
+	    strlen(CHUNKED_COMMENT));
+	files[2] = pkgfile_new_regular("dir/small", CHUNKED_SMALL,
+	    strlen(CHUNKED_SMALL));
+	files[3] = pkgfile_new_regular("dir/empty", NULL, 0);
+	files[4] = pkgfile_new_regular("dir/big", big, CHUNKED_BIG_LEN);
+	files[5] = pkgfile_new_symlink("dir/link", "small");
+	files[6] = pkgfile_new_hardlink("dir/hard", "dir/small");
+	files[7] = pkgfile_new_regular("dir/after", CHUNKED_AFTER,
+	    strlen(CHUNKED_AFTER));
+	files[8] = pkgfile_new_regular("+DESC", CHUNKED_DESC,
+	    strlen(CHUNKED_DESC));
+	/* +CONTENTS is taken from the manifest */
+	files[9] = pkgfile_new_regular("+CONTENTS", "Not used", 8);
+	files[10] = NULL;
+	for (i = 0; i < 10; i++)
+		fail_unless(files[i] != NULL, NULL);
+	/* The other files keep the default mode of 0 */
+	pkgfile_set_mode(files[0], 0755);
+	pkgfile_set_mode(files[2], 0640);
+	pkgfile_set_mode(files[4], 0555);
+	chunked_write(files);
+
+	pkg = chunked_open();
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(strcmp(pkg_get_name(pkg), "package_name-1.0") == 0, NULL);
+
+	/* The control files can be read before any others */
+	chunked_check(pkg_get_control_file(pkg, "+DESC"), "+DESC",
+	    pkgfile_regular, CHUNKED_DESC, strlen(CHUNKED_DESC), 0);
+	chunked_check(pkg_get_control_file(pkg, "+CONTENTS"), "+CONTENTS",
+	    pkgfile_regular, CHUNKED_CONTENTS, strlen(CHUNKED_CONTENTS),
+	    0);
+	fail_unless(pkg_get_control_file(pkg, "+MTREE_DIRS") == NULL, NULL);
+	control = pkg_get_control_files(pkg);
+	fail_unless(control != NULL, NULL);
+	fail_unless(strcmp(pkgfile_get_name(control[0]), "+CONTENTS") == 0,
+	    NULL);
+	chunked_check(control[1], "+COMMENT", pkgfile_regular,
+	    CHUNKED_COMMENT, strlen(CHUNKED_COMMENT), 0);
+	chunked_check(control[2], "+DESC", pkgfile_regular, CHUNKED_DESC,
+	    strlen(CHUNKED_DESC), 0);
+	fail_unless(control[3] == NULL, NULL);
+
+	chunked_check(pkg_get_next_file(pkg), "dir", pkgfile_dir, NULL, 0,
+	    0755);
+	chunked_check(pkg_get_next_file(pkg), "dir/small", pkgfile_regular,
+	    CHUNKED_SMALL, strlen(CHUNKED_SMALL), 0640);
+	chunked_check(pkg_get_next_file(pkg), "dir/empty", pkgfile_regular,
+	    NULL, 0, 0);
+	chunked_check(pkg_get_next_file(pkg), "dir/big", pkgfile_regular,
+	    big, CHUNKED_BIG_LEN, 0555);
+	chunked_check(pkg_get_next_file(pkg), "dir/link", pkgfile_symlink,
+	    "small", 5, 0);
+	chunked_check(pkg_get_next_file(pkg), "dir/hard", pkgfile_hardlink,
+	    "dir/small", 9, 0);
+	chunked_check(pkg_get_next_file(pkg), "dir/after", pkgfile_regular,
+	    CHUNKED_AFTER, strlen(CHUNKED_AFTER), 0);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	for (i = 0; i < 10; i++)
+		pkgfile_free(files[i]);
+	free(big);
+	unlink(CHUNKED_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/* Check a package with no data has no chunks */
+START_TEST(pkg_chunked_empty_test)
+{
+	struct pkgfile *files[3];
+	struct pkg *pkg;
+
+	SETUP_TESTDIR();
+	files[0] = pkgfile_new_regular("+COMMENT", CHUNKED_COMMENT,
+	    strlen(CHUNKED_COMMENT));
+	files[1] = pkgfile_new_directory("dir");
+	files[2] = NULL;
+	chunked_write(files);
+
+	pkg = chunked_open();
+	fail_unless(pkg != NULL, NULL);
+	chunked_check(pkg_get_control_file(pkg, "+COMMENT"), "+COMMENT",
+	    pkgfile_regular, CHUNKED_COMMENT, strlen(CHUNKED_COMMENT), 0);
+	chunked_check(pkg_get_next_file(pkg), "dir", pkgfile_dir, NULL, 0,
+	    0);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	files[0] = NULL;
+	chunked_write(files);
+	pkg = chunked_open();
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(pkg_get_control_file(pkg, "+COMMENT") == NULL, NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	pkgfile_free(files[1]);
+	unlink(CHUNKED_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/* Check a package with a bad CRC is found */
+START_TEST(pkg_chunked_crc_test)
+{
+	struct pkgfile *files[4];
+	struct pkg *pkg;
+	char *big;
+	int i;
+
+	SETUP_TESTDIR();
+	big = chunked_big();
+	files[0] = pkgfile_new_regular("+COMMENT", CHUNKED_COMMENT,
+	    strlen(CHUNKED_COMMENT));
+	files[1] = pkgfile_new_regular("dir/small", CHUNKED_SMALL,
+	    strlen(CHUNKED_SMALL));
+	files[2] = pkgfile_new_regular("dir/big", big, CHUNKED_BIG_LEN);
+	files[3] = NULL;
+
+	/* In the manifest, which is covered by the header's CRC */
+	chunked_write(files);
+	chunked_corrupt(64 + 10);
+	fail_unless(chunked_open() == NULL, NULL);
+
+	/* The CRC itself */
+	chunked_write(files);
+	chunked_corrupt(20);
+	fail_unless(chunked_open() == NULL, NULL);
+
+	/*
+	 * In the last chunk. The header is good so the package can be
+	 * opened and the files in the first chunk read.
+	 */
+	chunked_write(files);
+	chunked_corrupt(-1);
+	pkg = chunked_open();
+	fail_unless(pkg != NULL, NULL);
+	chunked_check(pkg_get_control_file(pkg, "+COMMENT"), "+COMMENT",
+	    pkgfile_regular, CHUNKED_COMMENT, strlen(CHUNKED_COMMENT), 0);
+	chunked_check(pkg_get_next_file(pkg), "dir/small", pkgfile_regular,
+	    CHUNKED_SMALL, strlen(CHUNKED_SMALL), 0);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	/* The bad chunk may be decompressed ahead of dir/small */
+	chunked_write(files);
+	chunked_corrupt(-1);
+	pkg = chunked_open();
+	fail_unless(pkg != NULL, NULL);
+	chunked_check(pkg_get_next_file(pkg), "dir/small", pkgfile_regular,
+	    CHUNKED_SMALL, strlen(CHUNKED_SMALL), 0);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	for (i = 0; i < 3; i++)
+		pkgfile_free(files[i]);
+	free(big);
+	unlink(CHUNKED_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+Suite *
+pkg_chunked_suite()
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Chunked package");
+
+	tc = tcase_create("chunked");
+	tcase_add_test(tc, pkg_chunked_bad_args_test);
+	tcase_add_test(tc, pkg_chunked_write_test);
+	tcase_add_test(tc, pkg_chunked_empty_test);
+	tcase_add_test(tc, pkg_chunked_crc_test);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
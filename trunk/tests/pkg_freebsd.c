@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2007, Andrew Turner, All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "test.h"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+#include <pkg_private.h>
+#include <pkg_repo.h>
+
+#define FREEBSD_DIR "testdir/pkg"
+#define FREEBSD_PKG "testdir/pkg.tar"
+
+#define FREEBSD_CONTENTS "@comment PKG_FORMAT_REVISION:1.1\n" \
+    "@name package_name-1.0\n" \
+    "@comment ORIGIN:package/origin\n" \
+    "@cwd /usr/local\n"
+#define FREEBSD_COMMENT "A package\n"
+#define FREEBSD_DESC "A package with many files\n"
+
+/*
+ * The files in the package. The small files are more than the decoder
+ * thread's ring holds, the medium ones more than the data it may read
+ * ahead, and the large ones are read from the archive as they are used.
+ */
+#define FREEBSD_SMALL 150
+#define FREEBSD_MEDIUM 20
+#define FREEBSD_MEDIUM_LEN (1024 * 1024 - 1)
+#define FREEBSD_LARGE 2
+#define FREEBSD_LARGE_LEN (1024 * 1024 + 100)
+#define FREEBSD_FILES (FREEBSD_SMALL + FREEBSD_MEDIUM + FREEBSD_LARGE)
+
+static size_t freebsd_file_len(unsigned int);
+static char *freebsd_file_data(unsigned int);
+static void freebsd_make_package(const char *, const char *, int);
+static void freebsd_check_file(struct pkgfile *, unsigned int);
+static void freebsd_cleanup(void);
+
+/* Large files are between the small and medium ones */
+static size_t
+freebsd_file_len(unsigned int pos)
+{
+	if (pos < FREEBSD_SMALL / 2 ||
+	    pos >= FREEBSD_SMALL / 2 + FREEBSD_LARGE + FREEBSD_MEDIUM)
+		return 16;
+	if (pos < FREEBSD_SMALL / 2 + FREEBSD_LARGE)
+		return FREEBSD_LARGE_LEN;
+	return FREEBSD_MEDIUM_LEN;
+}
+
+static char *
+freebsd_file_data(unsigned int pos)
+{
+	char *data;
+	size_t len;
+
+	len = freebsd_file_len(pos);
+	data = malloc(len);
+	fail_unless(data != NULL, NULL);
+	memset(data, 'a' + pos % 26, len);
+	snprintf(data, len, "%u", pos);
+	data[len - 1] = '\n';
+	return data;
+}
+
+/*
+ * Creates a package with the control files then, if files is set,
+ * FREEBSD_FILES others.
+ */
+static void
+freebsd_make_package(const char *contents, const char *tar_flags, int files)
+{
+	char cmd[128], name[64];
+	char *data;
+	unsigned int pos;
+
+	REMOVE_TESTFILES(FREEBSD_DIR);
+	MAKE_TESTDIR(FREEBSD_DIR "/files");
+	WRITE_TESTFILE(FREEBSD_DIR "/+CONTENTS", contents, strlen(contents));
+	WRITE_TESTFILE(FREEBSD_DIR "/+COMMENT", FREEBSD_COMMENT,
+	    strlen(FREEBSD_COMMENT));
+	WRITE_TESTFILE(FREEBSD_DIR "/+DESC", FREEBSD_DESC,
+	    strlen(FREEBSD_DESC));
+	for (pos = 0; files && pos < FREEBSD_FILES; pos++) {
+		snprintf(name, sizeof(name), FREEBSD_DIR "/files/%03u", pos);
+		data = freebsd_file_data(pos);
+		WRITE_TESTFILE(name, data, freebsd_file_len(pos));
+		free(data);
+	}
+	/* Packages don't have entries for directories */
+	snprintf(cmd, sizeof(cmd), "cd " FREEBSD_DIR " && tar -c%sf ../pkg.tar "
+	    "+CONTENTS +COMMENT +DESC%s", tar_flags, files ? " files/*" : "");
+	fail_unless(system(cmd) == 0, NULL);
+	REMOVE_TESTFILES(FREEBSD_DIR);
+}
+
+static void
+freebsd_check_file(struct pkgfile *file, unsigned int pos)
+{
+	char name[32];
+	char *data;
+
+	fail_unless(file != NULL, NULL);
+	snprintf(name, sizeof(name), "files/%03u", pos);
+	fail_unless(strcmp(pkgfile_get_name(file), name) == 0, NULL);
+	fail_unless(pkgfile_get_size(file) == freebsd_file_len(pos), NULL);
+	data = freebsd_file_data(pos);
+	fail_unless(memcmp(pkgfile_get_data(file), data,
+	    freebsd_file_len(pos)) == 0, NULL);
+	free(data);
+}
+
+static void
+freebsd_cleanup(void)
+{
+	REMOVE_TESTFILES(FREEBSD_PKG);
+	CLEANUP_TESTDIR();
+}
+
+/*
+ * Check the files read by the decoder thread are returned in archive
+ * order when it has to wait for the installer to catch up.
+ */
+START_TEST(pkg_freebsd_decoder_order_test)
+{
+	struct pkg *pkg;
+	FILE *fd;
+	unsigned int pos;
+
+	SETUP_TESTDIR();
+	freebsd_make_package(FREEBSD_CONTENTS, "", 1);
+
+	fd = fopen(FREEBSD_PKG, "r");
+	fail_unless(fd != NULL, NULL);
+	pkg = pkg_new_freebsd_from_file(fd);
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(strcmp(pkg_get_name(pkg), "package_name-1.0") == 0, NULL);
+
+	for (pos = 0; pos < FREEBSD_FILES; pos++)
+		freebsd_check_file(pkg_get_next_file(pkg), pos);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	/* The package closes fd */
+	pkg_free(pkg);
+
+	freebsd_cleanup();
+}
+END_TEST
+
+/*
+ * Check a package can be freed while the decoder thread is waiting
+ * for space in the ring or for a file from the archive to be used.
+ */
+START_TEST(pkg_freebsd_decoder_stop_test)
+{
+	struct pkg *pkg;
+	FILE *fd;
+	unsigned int pos, stop;
+
+	SETUP_TESTDIR();
+	freebsd_make_package(FREEBSD_CONTENTS, "", 1);
+
+	/* Stop in the small files, after a large file and at the end */
+	for (stop = 1; stop <= FREEBSD_FILES;
+	    stop += FREEBSD_SMALL / 2 + 1) {
+		fd = fopen(FREEBSD_PKG, "r");
+		fail_unless(fd != NULL, NULL);
+		pkg = pkg_new_freebsd_from_file(fd);
+		fail_unless(pkg != NULL, NULL);
+		for (pos = 0; pos < stop; pos++)
+			freebsd_check_file(pkg_get_next_file(pkg), pos);
+		pkg_free(pkg);
+	}
+
+	freebsd_cleanup();
+}
+END_TEST
+
+/*
+ * Check a package opened by path, which only reads the control files,
+ * reopens the archive for the other files and reads them once.
+ */
+START_TEST(pkg_freebsd_path_reopen_test)
+{
+	struct pkgfile *file;
+	struct pkg *pkg;
+	unsigned int pos;
+
+	SETUP_TESTDIR();
+
+	/* The control files are read before or after the other files */
+	freebsd_make_package(FREEBSD_CONTENTS, "", 1);
+	pkg = pkg_new_freebsd_from_path(FREEBSD_PKG);
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(strcmp(pkg_get_name(pkg), "package_name-1.0") == 0, NULL);
+	file = pkg_get_control_file(pkg, "+DESC");
+	fail_unless(file != NULL, NULL);
+	fail_unless(pkgfile_get_size(file) == strlen(FREEBSD_DESC), NULL);
+	for (pos = 0; pos < FREEBSD_FILES; pos++)
+		freebsd_check_file(pkg_get_next_file(pkg), pos);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	freebsd_make_package(FREEBSD_CONTENTS, "z", 1);
+	pkg = pkg_new_freebsd_from_path(FREEBSD_PKG);
+	fail_unless(pkg != NULL, NULL);
+	for (pos = 0; pos < FREEBSD_FILES; pos++)
+		freebsd_check_file(pkg_get_next_file(pkg), pos);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	file = pkg_get_control_file(pkg, "+COMMENT");
+	fail_unless(file != NULL, NULL);
+	fail_unless(pkgfile_get_size(file) == strlen(FREEBSD_COMMENT), NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	freebsd_cleanup();
+}
+END_TEST
+
+/*
+ * Check a package opened by path with only control files has no other
+ * files, even when the files in it's +CONTENTS are on disk.
+ */
+START_TEST(pkg_freebsd_path_meta_test)
+{
+	char contents[FILENAME_MAX + 128], cwd[FILENAME_MAX];
+	struct pkg *pkg;
+
+	SETUP_TESTDIR();
+	fail_unless(getcwd(cwd, sizeof(cwd)) != NULL, NULL);
+	snprintf(contents, sizeof(contents), FREEBSD_CONTENTS
+	    "@cwd %s/testdir\nDISK\n", cwd);
+	freebsd_make_package(contents, "", 0);
+	WRITE_TESTFILE("testdir/DISK", "On disk\n", 8);
+
+	pkg = pkg_new_freebsd_from_path(FREEBSD_PKG);
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	REMOVE_TESTFILES("testdir/DISK");
+	freebsd_cleanup();
+}
+END_TEST
+
+/* Check the compression is found from the data, not the name */
+START_TEST(pkg_freebsd_compress_sniff_test)
+{
+	const char *flags[] = { "", "z", "j", "J", NULL };
+	struct pkgfile *file;
+	struct pkg *pkg;
+	unsigned int pos;
+
+	SETUP_TESTDIR();
+	for (pos = 0; flags[pos] != NULL; pos++) {
+		freebsd_make_package(FREEBSD_CONTENTS, flags[pos], 0);
+		pkg = pkg_new_freebsd_from_path(FREEBSD_PKG);
+		fail_unless(pkg != NULL, NULL);
+		fail_unless(strcmp(pkg_get_name(pkg), "package_name-1.0") == 0,
+		    NULL);
+		file = pkg_get_control_file(pkg, "+DESC");
+		fail_unless(file != NULL, NULL);
+		fail_unless(pkgfile_get_size(file) == strlen(FREEBSD_DESC),
+		    NULL);
+		fail_unless(memcmp(pkgfile_get_data(file), FREEBSD_DESC,
+		    strlen(FREEBSD_DESC)) == 0, NULL);
+		pkg_free(pkg);
+	}
+
+	/* Data that isn't a package is still rejected */
+	WRITE_TESTFILE(FREEBSD_PKG, FREEBSD_DESC, strlen(FREEBSD_DESC));
+	fail_unless(pkg_new_freebsd_from_path(FREEBSD_PKG) == NULL, NULL);
+
+	freebsd_cleanup();
+}
+END_TEST
+
+/* Check the local repository finds packages with each extension */
+START_TEST(pkg_freebsd_compress_lookup_test)
+{
+	const char *names[] = { "testdir/pkg.txz", "testdir/pkg.tzst", NULL };
+	const char *flags[] = { "J", "z" };
+	struct pkg_repo *repo;
+	struct pkg *pkg;
+	unsigned int pos;
+
+	SETUP_TESTDIR();
+	fail_unless((repo = pkg_repo_new_local_freebsd()) != NULL, NULL);
+	fail_unless(pkg_repo_get_pkg(repo, "testdir/pkg") == NULL, NULL);
+
+	/* The .tzst file holds gzip data as zstd may not be available */
+	for (pos = 0; names[pos] != NULL; pos++) {
+		freebsd_make_package(FREEBSD_CONTENTS, flags[pos], 0);
+		fail_unless(rename(FREEBSD_PKG, names[pos]) == 0, NULL);
+		pkg = pkg_repo_get_pkg(repo, "testdir/pkg");
+		fail_unless(pkg != NULL, NULL);
+		fail_unless(strcmp(pkg_get_name(pkg), "package_name-1.0") == 0,
+		    NULL);
+		pkg_free(pkg);
+		fail_unless(unlink(names[pos]) == 0, NULL);
+	}
+	fail_unless(pkg_repo_free(repo) == 0, NULL);
+
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+Suite *
+pkg_freebsd_suite()
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("FreeBSD package");
+
+	tc = tcase_create("decoder");
+	tcase_add_test(tc, pkg_freebsd_decoder_order_test);
+	tcase_add_test(tc, pkg_freebsd_decoder_stop_test);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("path");
+	tcase_add_test(tc, pkg_freebsd_path_reopen_test);
+	tcase_add_test(tc, pkg_freebsd_path_meta_test);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("compression");
+	tcase_add_test(tc, pkg_freebsd_compress_sniff_test);
+	tcase_add_test(tc, pkg_freebsd_compress_lookup_test);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2007 Andrew Turner, All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "test.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+#include <pkg_private.h>
+
+#define CACHE_DB "testdir/db"
+#define CACHE_DIR CACHE_DB "/var/db/pkg/foo-1.0"
+#define CACHE_CONTENTS CACHE_DIR "/+CONTENTS"
+#define CACHE_FILE CACHE_DIR "/" FREEBSD_CACHE_NAME
+
+/* The time +CONTENTS was last changed, long before the cache is written */
+#define CACHE_MTIME 1000000000
+
+#define CACHE_DATA "@comment PKG_FORMAT_REVISION:1.1\n" \
+    "@name foo-1.0\n" \
+    "@comment ORIGIN:misc/foo\n" \
+    "@cwd /usr/local\n" \
+    "@pkgdep bar-2.0\n" \
+    "@comment DEPORIGIN:misc/bar\n" \
+    "@pkgdep baz-3.0\n" \
+    "@conflicts foo-2.*\n" \
+    "bin/foo\n" \
+    "@comment MD5:d544f30242ff0dab40727ba1acc0751a\n" \
+    "@ignore\n" \
+    "+DISPLAY\n" \
+    "@cwd /usr/local\n" \
+    "share/foo\n" \
+    "@unexec rm -f %D/share/foo\n" \
+    "@dirrm share/foo\n"
+
+static char *cache_read_file(const char *, size_t *);
+static void cache_set_mtime(const char *, time_t);
+static void cache_make(const char *);
+static void cache_check(void);
+static int cache_count_files(void);
+static void cache_check_bad(const char *, size_t);
+static void cache_action(enum pkg_action_level, const char *, ...);
+static void cache_cleanup(void);
+
+static char *
+cache_read_file(const char *path, size_t *len)
+{
+	struct stat sb;
+	FILE *fd;
+	char *data;
+
+	fail_unless(stat(path, &sb) == 0, NULL);
+	*len = sb.st_size;
+	data = malloc(*len);
+	fail_unless(data != NULL, NULL);
+	fd = fopen(path, "r");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(fread(data, *len, 1, fd) == 1, NULL);
+	fclose(fd);
+	return data;
+}
+
+static void
+cache_set_mtime(const char *path, time_t mtime)
+{
+	struct timeval times[2];
+
+	times[0].tv_sec = times[1].tv_sec = mtime;
+	times[0].tv_usec = times[1].tv_usec = 0;
+	fail_unless(utimes(path, times) == 0, NULL);
+}
+
+/* Creates an installed package and it's cache from the given +CONTENTS */
+static void
+cache_make(const char *data)
+{
+	struct pkg_manifest *manifest;
+
+	REMOVE_TESTFILES(CACHE_DB);
+	MAKE_TESTDIR(CACHE_DIR);
+	WRITE_TESTFILE(CACHE_CONTENTS, data, strlen(data));
+	cache_set_mtime(CACHE_CONTENTS, CACHE_MTIME);
+
+	manifest = pkg_freebsd_parse_contents(data, strlen(data));
+	fail_unless(manifest != NULL, NULL);
+	fail_unless(freebsd_cache_write(manifest, CACHE_DIR) == 0, NULL);
+	pkg_manifest_free(manifest);
+}
+
+/* Checks the cache holds the same manifest as +CONTENTS */
+static void
+cache_check(void)
+{
+	struct pkg_manifest *manifest, *cached;
+	char *data;
+	size_t len;
+
+	data = cache_read_file(CACHE_CONTENTS, &len);
+	manifest = pkg_freebsd_parse_contents(data, len);
+	fail_unless(manifest != NULL, NULL);
+
+	cached = freebsd_cache_read(CACHE_DIR, NULL);
+	fail_unless(cached != NULL, NULL);
+	fail_unless(cached->map != NULL, NULL);
+	fail_unless(cached->manifest_load_items != NULL, NULL);
+	check_same_manifest(manifest, cached);
+	check_same_manifest(cached, manifest);
+
+	pkg_manifest_free(cached);
+	pkg_manifest_free(manifest);
+	free(data);
+}
+
+/* Counts the files in the package's directory, eg. left over temp files */
+static int
+cache_count_files(void)
+{
+	DIR *d;
+	struct dirent *de;
+	int count;
+
+	d = opendir(CACHE_DIR);
+	fail_unless(d != NULL, NULL);
+	count = 0;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.')
+			count++;
+	}
+	closedir(d);
+	return count;
+}
+
+/* Writes a cache and checks it isn't used */
+static void
+cache_check_bad(const char *data, size_t len)
+{
+	struct pkg_manifest *manifest;
+
+	WRITE_TESTFILE(CACHE_FILE, data, len);
+	manifest = freebsd_cache_read(CACHE_DIR, NULL);
+	fail_unless(manifest == NULL, NULL);
+}
+
+static void
+cache_action(enum pkg_action_level level __unused, const char *fmt __unused,
+    ...)
+{
+}
+
+static void
+cache_cleanup(void)
+{
+	REMOVE_TESTFILES(CACHE_DB);
+	CLEANUP_TESTDIR();
+}
+
+/* Check a manifest read from the cache is the same as the one written */
+START_TEST(pkg_freebsd_cache_write_test)
+{
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item **items;
+	struct stat sb;
+	int stale;
+
+	SETUP_TESTDIR();
+
+	cache_make(CACHE_DATA);
+	fail_unless(cache_count_files() == 2, NULL);
+	cache_check();
+
+	/* The MD5 is kept as a digest */
+	stale = -1;
+	manifest = freebsd_cache_read(CACHE_DIR, &stale);
+	fail_unless(manifest != NULL, NULL);
+	fail_unless(stale == 0, NULL);
+	items = pkg_manifest_get_items(manifest);
+	fail_unless(items != NULL, NULL);
+	fail_unless(items[0]->has_md5 == 1, NULL);
+	fail_unless(strcmp(pkg_manifest_item_get_attr(items[0], pmia_md5),
+	    "d544f30242ff0dab40727ba1acc0751a") == 0, NULL);
+	pkg_manifest_free(manifest);
+
+	/*
+	 * The cache is written when an installed package is first read
+	 * and can be read by anyone who can read +CONTENTS
+	 */
+	unlink(CACHE_FILE);
+	fail_unless(chmod(CACHE_CONTENTS, 0644) == 0, NULL);
+	fail_unless(freebsd_cache_read(CACHE_DIR, &stale) == NULL, NULL);
+	fail_unless(stale == 1, NULL);
+	manifest = pkg_manifest_new_freebsd_installed(CACHE_DIR);
+	fail_unless(manifest != NULL, NULL);
+	fail_unless(manifest->map == NULL, NULL);
+	pkg_manifest_free(manifest);
+	fail_unless(stat(CACHE_FILE, &sb) == 0, NULL);
+	fail_unless((sb.st_mode & ALLPERMS) == 0644, NULL);
+	manifest = pkg_manifest_new_freebsd_installed(CACHE_DIR);
+	fail_unless(manifest != NULL, NULL);
+	fail_unless(manifest->map != NULL, NULL);
+	pkg_manifest_free(manifest);
+	cache_check();
+
+	/* A cache that can't be opened isn't replaced */
+	unlink(CACHE_FILE);
+	fail_unless(symlink(FREEBSD_CACHE_NAME, CACHE_FILE) == 0, NULL);
+	fail_unless(freebsd_cache_read(CACHE_DIR, &stale) == NULL, NULL);
+	fail_unless(stale == 0, NULL);
+	manifest = pkg_manifest_new_freebsd_installed(CACHE_DIR);
+	fail_unless(manifest != NULL, NULL);
+	fail_unless(manifest->map == NULL, NULL);
+	pkg_manifest_free(manifest);
+	fail_unless(lstat(CACHE_FILE, &sb) == 0, NULL);
+	fail_unless(S_ISLNK(sb.st_mode), NULL);
+
+	/* An upper case MD5 is a digest */
+	unlink(CACHE_FILE);
+	manifest = pkg_freebsd_parse_contents(CACHE_DATA, strlen(CACHE_DATA));
+	fail_unless(manifest != NULL, NULL);
+	items = pkg_manifest_get_items(manifest);
+	fail_unless(pkg_manifest_item_set_attr(items[0], pmia_md5,
+	    "D544F30242FF0DAB40727BA1ACC0751A") == 0, NULL);
+	fail_unless(freebsd_cache_write(manifest, CACHE_DIR) == 0, NULL);
+	pkg_manifest_free(manifest);
+	cache_check();
+
+	/* An MD5 that isn't a digest can't be cached */
+	unlink(CACHE_FILE);
+	manifest = pkg_freebsd_parse_contents(CACHE_DATA, strlen(CACHE_DATA));
+	fail_unless(manifest != NULL, NULL);
+	items = pkg_manifest_get_items(manifest);
+	fail_unless(pkg_manifest_item_set_attr(items[0], pmia_md5, "md5") == 0,
+	    NULL);
+	fail_unless(freebsd_cache_write(manifest, CACHE_DIR) == -1, NULL);
+	pkg_manifest_free(manifest);
+	/* The temporary file was removed */
+	fail_unless(cache_count_files() == 1, NULL);
+
+	cache_cleanup();
+}
+END_TEST
+
+/* Check a cache isn't used after +CONTENTS has changed */
+START_TEST(pkg_freebsd_cache_stale_test)
+{
+	struct pkg_manifest *manifest;
+	struct stat sb;
+	FILE *fd;
+	int stale;
+
+	SETUP_TESTDIR();
+
+	/* The size changed */
+	cache_make(CACHE_DATA);
+	WRITE_TESTFILE(CACHE_CONTENTS, CACHE_DATA "@comment new\n",
+	    strlen(CACHE_DATA "@comment new\n"));
+	cache_set_mtime(CACHE_CONTENTS, CACHE_MTIME);
+	stale = 0;
+	fail_unless(freebsd_cache_read(CACHE_DIR, &stale) == NULL, NULL);
+	fail_unless(stale == 1, NULL);
+
+	/* Reading the package replaces the stale cache */
+	manifest = pkg_manifest_new_freebsd_installed(CACHE_DIR);
+	fail_unless(manifest != NULL, NULL);
+	fail_unless(manifest->map == NULL, NULL);
+	pkg_manifest_free(manifest);
+	cache_check();
+
+	/* The modification time changed */
+	cache_make(CACHE_DATA);
+	cache_set_mtime(CACHE_CONTENTS, CACHE_MTIME + 1);
+	fail_unless(freebsd_cache_read(CACHE_DIR, NULL) == NULL, NULL);
+
+	/* +CONTENTS was replaced with a new file */
+	cache_make(CACHE_DATA);
+	WRITE_TESTFILE(CACHE_CONTENTS ".new", CACHE_DATA,
+	    strlen(CACHE_DATA));
+	cache_set_mtime(CACHE_CONTENTS ".new", CACHE_MTIME);
+	fail_unless(rename(CACHE_CONTENTS ".new", CACHE_CONTENTS) == 0, NULL);
+	fail_unless(freebsd_cache_read(CACHE_DIR, NULL) == NULL, NULL);
+
+	/*
+	 * The cache was written in the same second +CONTENTS last changed
+	 * so it may have changed again since. Only then the hash is used.
+	 */
+	cache_make(CACHE_DATA);
+	cache_set_mtime(CACHE_FILE, CACHE_MTIME);
+	cache_check();
+
+	fd = fopen(CACHE_CONTENTS, "r+");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(fseek(fd, strlen("@comment PKG_FORMAT_REVISION:1.1\n"
+	    "@name foo-1."), SEEK_SET) == 0, NULL);
+	fail_unless(fputc('1', fd) != EOF, NULL);
+	fail_unless(fclose(fd) == 0, NULL);
+	cache_set_mtime(CACHE_CONTENTS, CACHE_MTIME);
+	fail_unless(stat(CACHE_CONTENTS, &sb) == 0, NULL);
+	fail_unless(sb.st_size == (off_t)strlen(CACHE_DATA), NULL);
+	fail_unless(freebsd_cache_read(CACHE_DIR, NULL) == NULL, NULL);
+
+	cache_set_mtime(CACHE_FILE, CACHE_MTIME + 1);
+	manifest = freebsd_cache_read(CACHE_DIR, NULL);
+	fail_unless(manifest != NULL, NULL);
+	pkg_manifest_free(manifest);
+
+	cache_cleanup();
+}
+END_TEST
+
+/* Check a cache that is truncated or corrupt isn't used */
+START_TEST(pkg_freebsd_cache_bad_test)
+{
+	struct freebsd_cache_header *header;
+	struct freebsd_cache_item *items;
+	struct freebsd_cache_dep *deps;
+	uint32_t *conflicts;
+	char *orig, *data;
+	size_t len;
+
+	SETUP_TESTDIR();
+
+	cache_make(CACHE_DATA);
+	orig = cache_read_file(CACHE_FILE, &len);
+	data = malloc(len + 1);
+	fail_unless(data != NULL, NULL);
+	header = (struct freebsd_cache_header *)data;
+	items = (struct freebsd_cache_item *)(header + 1);
+	memcpy(data, orig, len);
+	fail_unless(header->item_count == 6, NULL);
+	fail_unless(header->dep_count == 2, NULL);
+	fail_unless(header->conflict_count == 1, NULL);
+	deps = (struct freebsd_cache_dep *)(items + header->item_count);
+	conflicts = (uint32_t *)(deps + header->dep_count);
+
+	/* Truncated or too long */
+	cache_check_bad(orig, 0);
+	cache_check_bad(orig, sizeof(struct freebsd_cache_header) - 1);
+	cache_check_bad(orig, sizeof(struct freebsd_cache_header));
+	cache_check_bad(orig, len - 1);
+	data[len] = '\0';
+	cache_check_bad(data, len + 1);
+
+	/* A bad header */
+	header->magic ^= 1;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	header->version++;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+
+	/* Counts that don't match the size of the file */
+	header->item_count = UINT32_MAX;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	header->item_count++;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	header->dep_count--;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	header->conflict_count++;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	header->strings_size++;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+
+	/* The last string must end */
+	data[len - 1] = 'a';
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+
+	/* String offsets outside the strings */
+	header->name = header->strings_size;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	header->name = FREEBSD_CACHE_NONE;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	header->origin = UINT32_MAX - 1;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	items[5].data = header->strings_size;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	items[0].data = FREEBSD_CACHE_NONE;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	items[1].attrs[pmia_ignore] = header->strings_size;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	deps[1].name = FREEBSD_CACHE_NONE;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	deps[0].origin = header->strings_size;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	conflicts[0] = header->strings_size;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+
+	/* Item types that don't exist */
+	items[2].type = pmt_error;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+	items[2].type = pmt_execute + 1;
+	cache_check_bad(data, len);
+	memcpy(data, orig, len);
+
+	/* A directory where the cache should be */
+	unlink(CACHE_FILE);
+	fail_unless(mkdir(CACHE_FILE, 0755) == 0, NULL);
+	fail_unless(freebsd_cache_read(CACHE_DIR, NULL) == NULL, NULL);
+	fail_unless(rmdir(CACHE_FILE) == 0, NULL);
+
+	/* Nothing else was changed so the original is still good */
+	WRITE_TESTFILE(CACHE_FILE, orig, len);
+	cache_check();
+
+	free(data);
+	free(orig);
+	cache_cleanup();
+}
+END_TEST
+
+/* Check the cache is removed with the rest of the package */
+START_TEST(pkg_freebsd_cache_deregister_test)
+{
+	struct pkg_db *db;
+	struct pkg *pkg;
+	struct pkgfile **control;
+	struct stat sb;
+	const char *data;
+	unsigned int pos;
+
+	SETUP_TESTDIR();
+
+	/* A package without files so only the database is changed */
+	data = "@comment PKG_FORMAT_REVISION:1.1\n@name foo-1.0\n"
+	    "@comment ORIGIN:misc/foo\n@cwd " CACHE_DB "\n@comment empty\n";
+	REMOVE_TESTFILES(CACHE_DB);
+	MAKE_TESTDIR(CACHE_DIR);
+	WRITE_TESTFILE(CACHE_CONTENTS, data, strlen(data));
+	WRITE_TESTFILE(CACHE_DIR "/+COMMENT", "A package\n", 10);
+	WRITE_TESTFILE(CACHE_DIR "/+DESC", "A package\n", 10);
+
+	db = pkg_db_open_freebsd(CACHE_DB);
+	fail_unless(db != NULL, NULL);
+	pkg = pkg_db_get_package(db, "foo-1.0");
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(pkg_get_manifest(pkg) != NULL, NULL);
+	fail_unless(stat(CACHE_FILE, &sb) == 0, NULL);
+
+	/* The cache isn't a control file */
+	control = pkg_get_control_files(pkg);
+	fail_unless(control != NULL, NULL);
+	for (pos = 0; control[pos] != NULL; pos++)
+		fail_unless(strcmp(pkgfile_get_name(control[pos]),
+		    FREEBSD_CACHE_NAME) != 0, NULL);
+	fail_unless(pos == 3, NULL);
+
+	fail_unless(pkg_db_delete_package_action(db, pkg, 0, 0, 0, 0,
+	    cache_action) == 0, NULL);
+	fail_unless(stat(CACHE_FILE, &sb) == -1, NULL);
+	fail_unless(stat(CACHE_DIR, &sb) == -1, NULL);
+
+	pkg_free(pkg);
+	pkg_db_free(db);
+	cache_cleanup();
+}
+END_TEST
+
+Suite *
+pkg_freebsd_cache_suite()
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("FreeBSD installed manifest cache");
+
+	tc = tcase_create("cache");
+	tcase_add_test(tc, pkg_freebsd_cache_write_test);
+	tcase_add_test(tc, pkg_freebsd_cache_stale_test);
+	tcase_add_test(tc, pkg_freebsd_cache_bad_test);
+	tcase_add_test(tc, pkg_freebsd_cache_deregister_test);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
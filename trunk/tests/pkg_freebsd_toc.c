@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2007 Andrew Turner, All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "test.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+#include <pkg_private.h>
+
+#define TOC_DIR "testdir/pkg"
+#define TOC_PKG "testdir/pkg.tar"
+#define TOC_FILE TOC_PKG ".toc"
+#define TOC_FILES "+CONTENTS +COMMENT +DESC bin/a bin/b"
+
+#define TOC_CONTENTS "@comment PKG_FORMAT_REVISION:1.1\n" \
+    "@name package_name-1.0\n" \
+    "@comment ORIGIN:package/origin\n" \
+    "@cwd /usr/local\n" \
+    "bin/a\n" \
+    "bin/b\n"
+#define TOC_COMMENT "A package\n"
+#define TOC_DESC "A package with a table of contents\n"
+#define TOC_B "The second file\n"
+
+static void toc_make_package(const char *, const char *);
+static void toc_write_file(const char *, const char *);
+static void toc_check_file(struct pkgfile *, const char *, const char *);
+static void toc_cleanup(void);
+
+static char toc_a[1200];
+
+/*
+ * Creates an uncompressed package with 3 control files then 2 others.
+ * bin/a is longer than a tar block so the entry after it is padded.
+ */
+static void
+toc_make_package(const char *a, const char *tar_flags)
+{
+	char cmd[128];
+
+	REMOVE_TESTFILES(TOC_DIR);
+	MAKE_TESTDIR(TOC_DIR "/bin");
+	toc_write_file("+CONTENTS", TOC_CONTENTS);
+	toc_write_file("+COMMENT", TOC_COMMENT);
+	toc_write_file("+DESC", TOC_DESC);
+	toc_write_file("bin/a", a);
+	toc_write_file("bin/b", TOC_B);
+	snprintf(cmd, sizeof(cmd), "tar -c%sf " TOC_PKG " -C " TOC_DIR " "
+	    TOC_FILES, tar_flags);
+	fail_unless(system(cmd) == 0, NULL);
+}
+
+static void
+toc_write_file(const char *name, const char *data)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), TOC_DIR "/%s", name);
+	WRITE_TESTFILE(path, data, strlen(data));
+}
+
+static void
+toc_check_file(struct pkgfile *file, const char *name, const char *data)
+{
+	fail_unless(file != NULL, NULL);
+	fail_unless(strcmp(pkgfile_get_name(file), name) == 0, NULL);
+	fail_unless(pkgfile_get_size(file) == strlen(data), NULL);
+	fail_unless(memcmp(pkgfile_get_data(file), data, strlen(data)) == 0,
+	    NULL);
+}
+
+static void
+toc_cleanup(void)
+{
+	REMOVE_TESTFILES(TOC_DIR " " TOC_PKG " " TOC_FILE);
+	CLEANUP_TESTDIR();
+}
+
+/* Check the table lists each entry and where they start */
+START_TEST(pkg_freebsd_toc_create_test)
+{
+	struct freebsd_toc *toc;
+
+	fail_unless(pkg_freebsd_create_toc(NULL) == -1, NULL);
+	fail_unless(pkg_freebsd_create_toc("testdir/missing.tar") == -1, NULL);
+	fail_unless(freebsd_toc_read("testdir/missing.tar") == NULL, NULL);
+
+	SETUP_TESTDIR();
+	memset(toc_a, 'a', sizeof(toc_a) - 1);
+	toc_make_package(toc_a, "");
+
+	/* There is no table until one is created */
+	fail_unless(freebsd_toc_read(TOC_PKG) == NULL, NULL);
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+	toc = freebsd_toc_read(TOC_PKG);
+	fail_unless(toc != NULL, NULL);
+	fail_unless(toc->seekable == 1, NULL);
+	fail_unless(toc->count == 5, NULL);
+	fail_unless(toc->control_count == 3, NULL);
+	fail_unless(strcmp(toc->entries[0].name, "+CONTENTS") == 0, NULL);
+	fail_unless(toc->entries[0].offset == 0, NULL);
+	fail_unless(strcmp(toc->entries[3].name, "bin/a") == 0, NULL);
+	fail_unless(toc->entries[3].size == sizeof(toc_a) - 1, NULL);
+	/* A header then 3 blocks of data */
+	fail_unless(toc->entries[4].offset == toc->entries[3].offset + 4 * 512,
+	    NULL);
+	fail_unless(freebsd_toc_find_control(toc, "+DESC") == 2, NULL);
+	fail_unless(freebsd_toc_find_control(toc, "bin/a") == -1, NULL);
+	freebsd_toc_free(toc);
+
+	/* A compressed package can't be seeked in */
+	toc_make_package(toc_a, "z");
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+	toc = freebsd_toc_read(TOC_PKG);
+	fail_unless(toc != NULL, NULL);
+	fail_unless(toc->seekable == 0, NULL);
+	fail_unless(toc->count == 5, NULL);
+	fail_unless(toc->control_count == 3, NULL);
+	freebsd_toc_free(toc);
+
+	toc_cleanup();
+}
+END_TEST
+
+/* Check files after the control files are found by seeking to them */
+START_TEST(pkg_freebsd_toc_seek_test)
+{
+	struct pkg *pkg;
+
+	SETUP_TESTDIR();
+	memset(toc_a, 'a', sizeof(toc_a) - 1);
+	toc_make_package(toc_a, "");
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+
+	pkg = pkg_new_freebsd_from_path(TOC_PKG);
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(strcmp(pkg_get_name(pkg), "package_name-1.0") == 0, NULL);
+	toc_check_file(pkg_get_control_file(pkg, "+DESC"), "+DESC", TOC_DESC);
+	toc_check_file(pkg_get_control_file(pkg, "+COMMENT"), "+COMMENT",
+	    TOC_COMMENT);
+	fail_unless(pkg_get_control_file(pkg, "+MTREE_DIRS") == NULL, NULL);
+
+	toc_check_file(pkg_get_next_file(pkg), "bin/a", toc_a);
+	toc_check_file(pkg_get_next_file(pkg), "bin/b", TOC_B);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	/* The files are the same when the control files were all read */
+	pkg = pkg_new_freebsd_from_path(TOC_PKG);
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(pkg_get_control_files(pkg) != NULL, NULL);
+	toc_check_file(pkg_get_control_file(pkg, "+DESC"), "+DESC", TOC_DESC);
+	toc_check_file(pkg_get_next_file(pkg), "bin/a", toc_a);
+	toc_check_file(pkg_get_next_file(pkg), "bin/b", TOC_B);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	toc_cleanup();
+}
+END_TEST
+
+/* Check only the control files are read when there is a table */
+START_TEST(pkg_freebsd_toc_control_test)
+{
+	struct freebsd_toc *toc;
+	struct stat sb;
+	struct timeval times[2];
+	struct pkg *pkg;
+	FILE *fd;
+
+	SETUP_TESTDIR();
+	memset(toc_a, 'a', sizeof(toc_a) - 1);
+	toc_make_package(toc_a, "");
+
+	/* utimes() can't set the nanoseconds so start from a whole second */
+	fail_unless(stat(TOC_PKG, &sb) == 0, NULL);
+	times[0].tv_sec = times[1].tv_sec = sb.st_mtime;
+	times[0].tv_usec = times[1].tv_usec = 0;
+	fail_unless(utimes(TOC_PKG, times) == 0, NULL);
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+	toc = freebsd_toc_read(TOC_PKG);
+	fail_unless(toc != NULL, NULL);
+
+	/*
+	 * Break the header of bin/a without changing the size or
+	 * modification time so the table is still used.
+	 */
+	fd = fopen(TOC_PKG, "r+");
+	fail_unless(fd != NULL, NULL);
+	fail_unless(fseeko(fd, toc->entries[3].offset, SEEK_SET) == 0, NULL);
+	fail_unless(fwrite("\377\377\377\377\377\377\377\377", 8, 1, fd) == 1,
+	    NULL);
+	fail_unless(fclose(fd) == 0, NULL);
+	freebsd_toc_free(toc);
+	fail_unless(utimes(TOC_PKG, times) == 0, NULL);
+	toc = freebsd_toc_read(TOC_PKG);
+	fail_unless(toc != NULL, NULL);
+	freebsd_toc_free(toc);
+
+	pkg = pkg_new_freebsd_from_path(TOC_PKG);
+	fail_unless(pkg != NULL, NULL);
+	fail_unless(strcmp(pkg_get_name(pkg), "package_name-1.0") == 0, NULL);
+	toc_check_file(pkg_get_control_file(pkg, "+COMMENT"), "+COMMENT",
+	    TOC_COMMENT);
+	toc_check_file(pkg_get_control_file(pkg, "+DESC"), "+DESC", TOC_DESC);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	/* The same with a compressed package, it is read from the start */
+	toc_make_package(toc_a, "z");
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+	pkg = pkg_new_freebsd_from_path(TOC_PKG);
+	fail_unless(pkg != NULL, NULL);
+	toc_check_file(pkg_get_control_file(pkg, "+DESC"), "+DESC", TOC_DESC);
+	toc_check_file(pkg_get_next_file(pkg), "bin/a", toc_a);
+	toc_check_file(pkg_get_next_file(pkg), "bin/b", TOC_B);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	toc_cleanup();
+}
+END_TEST
+
+/* Check a table for a different version of the package is ignored */
+START_TEST(pkg_freebsd_toc_stale_test)
+{
+	struct freebsd_toc *toc;
+	struct stat sb;
+	struct timeval times[2];
+	struct pkg *pkg;
+
+	SETUP_TESTDIR();
+	memset(toc_a, 'a', sizeof(toc_a) - 1);
+	toc_make_package(toc_a, "");
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+
+	/* Only the modification time is different */
+	fail_unless(stat(TOC_PKG, &sb) == 0, NULL);
+	times[0].tv_sec = times[1].tv_sec = sb.st_mtime - 10;
+	times[0].tv_usec = times[1].tv_usec = 0;
+	fail_unless(utimes(TOC_PKG, times) == 0, NULL);
+	fail_unless(freebsd_toc_read(TOC_PKG) == NULL, NULL);
+
+	/*
+	 * A shorter bin/a moves bin/b so the old offset is wrong. The
+	 * package is padded to the same size and is likely to be written
+	 * in the same second as the first.
+	 */
+	toc_make_package("Short\n", "");
+	fail_unless(freebsd_toc_read(TOC_PKG) == NULL, NULL);
+
+	pkg = pkg_new_freebsd_from_path(TOC_PKG);
+	fail_unless(pkg != NULL, NULL);
+	toc_check_file(pkg_get_control_file(pkg, "+DESC"), "+DESC", TOC_DESC);
+	toc_check_file(pkg_get_next_file(pkg), "bin/a", "Short\n");
+	toc_check_file(pkg_get_next_file(pkg), "bin/b", TOC_B);
+	fail_unless(pkg_get_next_file(pkg) == NULL, NULL);
+	pkg_free(pkg);
+
+	/* A table that isn't complete is ignored */
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+	fail_unless(truncate(TOC_FILE, 40) == 0, NULL);
+	fail_unless(freebsd_toc_read(TOC_PKG) == NULL, NULL);
+	fail_unless(truncate(TOC_FILE, 0) == 0, NULL);
+	fail_unless(freebsd_toc_read(TOC_PKG) == NULL, NULL);
+
+	/* Creating it again replaces it */
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+	toc = freebsd_toc_read(TOC_PKG);
+	fail_unless(toc != NULL, NULL);
+	fail_unless(toc->count == 5, NULL);
+	freebsd_toc_free(toc);
+
+	toc_cleanup();
+}
+END_TEST
+
+/* Check a table with more entries than are first allocated is read */
+START_TEST(pkg_freebsd_toc_many_test)
+{
+	struct freebsd_toc *toc;
+	char name[64];
+	unsigned int pos;
+
+	SETUP_TESTDIR();
+	REMOVE_TESTFILES(TOC_DIR);
+	MAKE_TESTDIR(TOC_DIR "/bin");
+	toc_write_file("+CONTENTS", TOC_CONTENTS);
+	for (pos = 0; pos < 100; pos++) {
+		snprintf(name, sizeof(name), "bin/%02u", pos);
+		toc_write_file(name, TOC_B);
+	}
+	fail_unless(system("cd " TOC_DIR " && tar -cf ../pkg.tar +CONTENTS "
+	    "bin/*") == 0, NULL);
+	fail_unless(pkg_freebsd_create_toc(TOC_PKG) == 0, NULL);
+
+	toc = freebsd_toc_read(TOC_PKG);
+	fail_unless(toc != NULL, NULL);
+	fail_unless(toc->count == 101, NULL);
+	fail_unless(toc->size >= toc->count, NULL);
+	fail_unless(toc->control_count == 1, NULL);
+	for (pos = 0; pos < 100; pos++) {
+		snprintf(name, sizeof(name), "bin/%02u", pos);
+		fail_unless(strcmp(toc->entries[pos + 1].name, name) == 0,
+		    NULL);
+		fail_unless(toc->entries[pos + 1].size == strlen(TOC_B), NULL);
+	}
+	freebsd_toc_free(toc);
+
+	toc_cleanup();
+}
+END_TEST
+
+Suite *
+pkg_freebsd_toc_suite()
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("FreeBSD package table of contents");
+
+	tc = tcase_create("toc");
+	tcase_add_test(tc, pkg_freebsd_toc_create_test);
+	tcase_add_test(tc, pkg_freebsd_toc_seek_test);
+	tcase_add_test(tc, pkg_freebsd_toc_control_test);
+	tcase_add_test(tc, pkg_freebsd_toc_stale_test);
+	tcase_add_test(tc, pkg_freebsd_toc_many_test);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -29,7 +29,11 @@
 #include <pkg.h>
 #include <pkg_private.h>
 
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 START_TEST(pkg_manifest_empty)
 {
@@ -150,6 +154,58 @@ START_TEST(pkg_manifest_conflict)
 }
 END_TEST
 
+/* Check the dependency and conflict arrays grow and keep their order */
+START_TEST(pkg_manifest_dependency_many)
+{
+	struct pkg_manifest *manifest;
+	struct pkg *pkgs[100], *pkg, **pkg_list;
+	char name[16];
+	const char **conflicts;
+	unsigned int pos;
+
+	fail_unless((manifest = pkg_manifest_new()) != NULL);
+
+	for (pos = 0; pos < 100; pos++) {
+		snprintf(name, sizeof(name), "pkg%u", pos);
+		fail_unless((pkgs[pos] = pkg_new_freebsd_empty(name)) != NULL);
+		fail_unless(pkg_manifest_add_dependency(manifest, pkgs[pos]) ==
+		    0);
+		/* The name buffer is reused so the conflict must be copied */
+		fail_unless(pkg_manifest_add_conflict(manifest, name) == 0);
+	}
+
+	fail_unless((pkg_list = pkg_manifest_get_dependencies(manifest)) !=
+	    NULL);
+	fail_unless(pkg_manifest_get_dependencies(manifest) == pkg_list);
+	for (pos = 0; pos < 100; pos++)
+		fail_unless(pkg_list[pos] == pkgs[pos]);
+	fail_unless(pkg_list[100] == NULL);
+
+	fail_unless((conflicts = pkg_manifest_get_conflicts(manifest)) !=
+	    NULL);
+	fail_unless(pkg_manifest_get_conflicts(manifest) == conflicts);
+	for (pos = 0; pos < 100; pos++) {
+		snprintf(name, sizeof(name), "pkg%u", pos);
+		fail_unless(strcmp(conflicts[pos], name) == 0);
+	}
+	fail_unless(conflicts[100] == NULL);
+
+	/* Replacing a dependency keeps it's place */
+	fail_unless((pkg = pkg_new_freebsd_empty("new")) != NULL);
+	fail_unless(pkg_manifest_replace_dependency(manifest, pkgs[50], pkg) ==
+	    0);
+	fail_unless(pkg_manifest_replace_dependency(manifest, pkgs[50], pkg) ==
+	    -1);
+	fail_unless(pkg_manifest_get_dependencies(manifest) == pkg_list);
+	fail_unless(pkg_list[49] == pkgs[49]);
+	fail_unless(pkg_list[50] == pkg);
+	fail_unless(pkg_list[51] == pkgs[51]);
+	fail_unless(pkg_list[100] == NULL);
+
+	fail_unless(pkg_manifest_free(manifest) == 0);
+}
+END_TEST
+
 START_TEST(pkg_manifest_name)
 {
 	struct pkg_manifest *manifest;
@@ -218,6 +274,620 @@ START_TEST(pkg_manifest_item)
 }
 END_TEST
 
+START_TEST(pkg_manifest_item_many)
+{
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item *items[100], **item_list;
+	unsigned int pos;
+
+	fail_unless((manifest = pkg_manifest_new()) != NULL);
+	fail_unless(pkg_manifest_get_items(manifest) == NULL);
+
+	/* Add enough items for the list to grow a few times */
+	for (pos = 0; pos < 100; pos++) {
+		fail_unless((items[pos] = pkg_manifest_item_new(pmt_file,
+		    "file")) != NULL);
+		fail_unless(pkg_manifest_append_item(manifest, items[pos]) ==0);
+		fail_unless((item_list = pkg_manifest_get_items(manifest))
+		    != NULL);
+		fail_unless(item_list[pos] == items[pos]);
+		fail_unless(item_list[pos + 1] == NULL);
+	}
+
+	for (pos = 0; pos < 100; pos++)
+		fail_unless(item_list[pos] == items[pos]);
+
+	fail_unless(pkg_manifest_free(manifest) == 0);
+}
+END_TEST
+
+/* Check a string is only copied into the arena once */
+START_TEST(pkg_manifest_interned)
+{
+	struct pkg_manifest *manifest;
+	const char *str, *strs[1000];
+	char buf[16];
+	unsigned int pos;
+
+	fail_unless((manifest = pkg_manifest_new()) != NULL);
+
+	fail_unless((str = pkg_manifest_intern(manifest, "abcdef", 3)) !=
+	    NULL);
+	fail_unless(strcmp(str, "abc") == 0);
+	fail_unless(pkg_manifest_intern(manifest, "abc", 3) == str);
+	fail_unless(pkg_manifest_intern(manifest, "abcd", 4) != str);
+	fail_unless(pkg_manifest_intern(manifest, "ab", 2) != str);
+	fail_unless(strcmp(pkg_manifest_intern(manifest, "", 0), "") == 0);
+
+	/* Enough strings for the table to grow a few times */
+	for (pos = 0; pos < 1000; pos++) {
+		snprintf(buf, sizeof(buf), "str%u", pos);
+		fail_unless((strs[pos] = pkg_manifest_intern(manifest, buf,
+		    strlen(buf))) != NULL);
+		fail_unless(strcmp(strs[pos], buf) == 0);
+	}
+	for (pos = 0; pos < 1000; pos++) {
+		snprintf(buf, sizeof(buf), "str%u", pos);
+		fail_unless(pkg_manifest_intern(manifest, buf, strlen(buf)) ==
+		    strs[pos]);
+	}
+	fail_unless(pkg_manifest_intern(manifest, "abc", 3) == str);
+
+	fail_unless(pkg_manifest_free(manifest) == 0);
+}
+END_TEST
+
+/* Check which item data and attributes in the arena are shared */
+START_TEST(pkg_manifest_item_arena)
+{
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item *item1, *item2, **item_list;
+
+	fail_unless((manifest = pkg_manifest_new()) != NULL);
+
+	/* Directories from @cwd repeat so are interned */
+	fail_unless((item1 = pkg_manifest_append_data(manifest, pmt_chdir,
+	    "/usr/local\nbin", 10)) != NULL);
+	fail_unless((item2 = pkg_manifest_append_data(manifest, pmt_chdir,
+	    "/usr/local", 10)) != NULL);
+	fail_unless(strcmp(pkg_manifest_item_get_data(item1),
+	    "/usr/local") == 0);
+	fail_unless(pkg_manifest_item_get_data(item1) ==
+	    pkg_manifest_item_get_data(item2));
+
+	/* Each file is only listed once so isn't */
+	fail_unless((item1 = pkg_manifest_append_data(manifest, pmt_file,
+	    "bin/a", 5)) != NULL);
+	fail_unless((item2 = pkg_manifest_append_data(manifest, pmt_file,
+	    "bin/a", 5)) != NULL);
+	fail_unless(strcmp(pkg_manifest_item_get_data(item2), "bin/a") == 0);
+	fail_unless(pkg_manifest_item_get_data(item1) !=
+	    pkg_manifest_item_get_data(item2));
+
+	fail_unless(pkg_manifest_item_set_attr(item1, pmia_ignore, "YES") ==
+	    0);
+	fail_unless(pkg_manifest_item_set_attr(item2, pmia_ignore, "YES") ==
+	    0);
+	fail_unless(pkg_manifest_item_get_attr(item1, pmia_ignore) ==
+	    pkg_manifest_item_get_attr(item2, pmia_ignore));
+	fail_unless(pkg_manifest_item_set_attr(item2, pmia_ignore, NULL) ==
+	    0);
+	fail_unless(pkg_manifest_item_get_attr(item2, pmia_ignore) == NULL);
+	fail_unless(strcmp(pkg_manifest_item_get_attr(item1, pmia_ignore),
+	    "YES") == 0);
+
+	fail_unless((item_list = pkg_manifest_get_items(manifest)) != NULL);
+	fail_unless(item_list[3] == item2);
+	fail_unless(item_list[4] == NULL);
+
+	fail_unless(pkg_manifest_free(manifest) == 0);
+}
+END_TEST
+
+static void
+check_item_md5(struct pkg_manifest_item *item)
+{
+	const char *md5 = "d544f30242ff0dab40727ba1acc0751a";
+	const char *upper = "D544F30242FF0DAB40727BA1ACC0751A";
+
+	/* A digest is held in binary and returned as hex */
+	fail_unless(pkg_manifest_item_set_attr(item, pmia_md5, md5) == 0);
+	fail_unless(item->has_md5 == 1);
+	fail_unless(item->md5[0] == 0xd5 && item->md5[15] == 0x1a);
+	fail_unless(pkg_manifest_item_get_attr(item, pmia_md5) != md5);
+	fail_unless(strcmp(pkg_manifest_item_get_attr(item, pmia_md5), md5) ==
+	    0);
+	fail_unless(pkg_manifest_item_get_attr(item, pmia_md5) ==
+	    pkg_manifest_item_get_attr(item, pmia_md5));
+
+	/* Setting it again drops the old string */
+	fail_unless(pkg_manifest_item_set_md5(item,
+	    "00000000000000000000000000000000...") == 0);
+	fail_unless(strcmp(pkg_manifest_item_get_attr(item, pmia_md5),
+	    "00000000000000000000000000000000") == 0);
+
+	/* An upper case digest is read and returned in lower case */
+	fail_unless(pkg_manifest_item_set_md5(item, upper) == 0);
+	fail_unless(item->has_md5 == 1);
+	fail_unless(item->md5[0] == 0xd5 && item->md5[15] == 0x1a);
+	fail_unless(pkg_manifest_item_set_attr(item, pmia_md5, upper) == 0);
+	fail_unless(item->has_md5 == 1);
+	fail_unless(strcmp(pkg_manifest_item_get_attr(item, pmia_md5),
+	    md5) == 0);
+
+	/* Anything else is kept as it was given */
+	fail_unless(pkg_manifest_item_set_md5(item,
+	    "g544f30242ff0dab40727ba1acc0751a") == -1);
+	fail_unless(pkg_manifest_item_set_attr(item, pmia_md5, "md5") == 0);
+	fail_unless(strcmp(pkg_manifest_item_get_attr(item, pmia_md5),
+	    "md5") == 0);
+
+	fail_unless(pkg_manifest_item_set_attr(item, pmia_md5, md5) == 0);
+	fail_unless(pkg_manifest_item_set_attr(item, pmia_md5, NULL) == 0);
+	fail_unless(item->has_md5 == 0);
+	fail_unless(pkg_manifest_item_get_attr(item, pmia_md5) == NULL);
+}
+
+START_TEST(pkg_manifest_item_md5)
+{
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item *item;
+
+	fail_unless(pkg_manifest_item_set_md5(NULL, "") == -1);
+
+	fail_unless((item = pkg_manifest_item_new(pmt_file, "file")) != NULL);
+	fail_unless(pkg_manifest_item_set_md5(item, NULL) == -1);
+	check_item_md5(item);
+	fail_unless(pkg_manifest_item_free(item) == 0);
+
+	fail_unless((manifest = pkg_manifest_new()) != NULL);
+	fail_unless((item = pkg_manifest_append_data(manifest, pmt_file,
+	    "file", 4)) != NULL);
+	check_item_md5(item);
+	fail_unless(pkg_manifest_free(manifest) == 0);
+}
+END_TEST
+
+#define PKG_MANIFEST_CONTENTS "@comment PKG_FORMAT_REVISION:1.1\n" \
+    "@name foo-1.0\n" \
+    "@comment ORIGIN:misc/foo\n" \
+    "@cwd /usr/local\n" \
+    "@pkgdep bar-2.0\n" \
+    "@comment DEPORIGIN:misc/bar\n" \
+    "@pkgdep baz-3.0\n" \
+    "@conflicts foo-2.*\n" \
+    "@conflicts oldfoo-*\n" \
+    "bin/foo\n" \
+    "@comment MD5:d544f30242ff0dab40727ba1acc0751a\n" \
+    "@ignore\n" \
+    "+DISPLAY\n" \
+    "@exec touch %D/%F\n" \
+    "@cwd /etc\n" \
+    "foo.conf\n" \
+    "@comment MD5:00000000000000000000000000000000\n" \
+    "@unexec rm -f %D/foo.conf\n" \
+    "@comment A comment\n" \
+    "@dirrm foo\n"
+
+static void
+check_same_attr(struct pkg_manifest_item *item1,
+    struct pkg_manifest_item *item2, pkg_manifest_item_attr attr)
+{
+	const char *value1, *value2;
+
+	value1 = pkg_manifest_item_get_attr(item1, attr);
+	value2 = pkg_manifest_item_get_attr(item2, attr);
+	fail_unless((value1 == NULL) == (value2 == NULL));
+	if (value1 != NULL)
+		fail_unless(strcmp(value1, value2) == 0);
+}
+
+/* Checks two manifests hold the same values */
+void
+check_same_manifest(struct pkg_manifest *manifest1,
+    struct pkg_manifest *manifest2)
+{
+	struct pkg **deps1, **deps2;
+	struct pkg_manifest_item **items1, **items2;
+	const char **conflicts1, **conflicts2;
+	unsigned int pos;
+
+	fail_unless(strcmp(pkg_manifest_get_name(manifest1),
+	    pkg_manifest_get_name(manifest2)) == 0);
+	fail_unless(strcmp(pkg_manifest_get_attr(manifest1, pkgm_origin),
+	    pkg_manifest_get_attr(manifest2, pkgm_origin)) == 0);
+	fail_unless(strcmp(pkg_manifest_get_attr(manifest1, pkgm_prefix),
+	    pkg_manifest_get_attr(manifest2, pkgm_prefix)) == 0);
+
+	fail_unless((deps1 = pkg_manifest_get_dependencies(manifest1)) !=
+	    NULL);
+	fail_unless((deps2 = pkg_manifest_get_dependencies(manifest2)) !=
+	    NULL);
+	for (pos = 0; deps1[pos] != NULL; pos++) {
+		fail_unless(deps2[pos] != NULL);
+		fail_unless(strcmp(pkg_get_name(deps1[pos]),
+		    pkg_get_name(deps2[pos])) == 0);
+		fail_unless((pkg_get_origin(deps1[pos]) == NULL) ==
+		    (pkg_get_origin(deps2[pos]) == NULL));
+		if (pkg_get_origin(deps1[pos]) != NULL)
+			fail_unless(strcmp(pkg_get_origin(deps1[pos]),
+			    pkg_get_origin(deps2[pos])) == 0);
+	}
+	fail_unless(deps2[pos] == NULL);
+
+	fail_unless((conflicts1 = pkg_manifest_get_conflicts(manifest1)) !=
+	    NULL);
+	fail_unless((conflicts2 = pkg_manifest_get_conflicts(manifest2)) !=
+	    NULL);
+	for (pos = 0; conflicts1[pos] != NULL; pos++) {
+		fail_unless(conflicts2[pos] != NULL);
+		fail_unless(strcmp(conflicts1[pos], conflicts2[pos]) == 0);
+	}
+	fail_unless(conflicts2[pos] == NULL);
+
+	fail_unless((items1 = pkg_manifest_get_items(manifest1)) != NULL);
+	fail_unless((items2 = pkg_manifest_get_items(manifest2)) != NULL);
+	for (pos = 0; items1[pos] != NULL; pos++) {
+		fail_unless(items2[pos] != NULL);
+		fail_unless(pkg_manifest_item_get_type(items1[pos]) ==
+		    pkg_manifest_item_get_type(items2[pos]));
+		fail_unless(strcmp(pkg_manifest_item_get_data(items1[pos]),
+		    pkg_manifest_item_get_data(items2[pos])) == 0);
+		check_same_attr(items1[pos], items2[pos], pmia_other);
+		check_same_attr(items1[pos], items2[pos], pmia_ignore);
+		check_same_attr(items1[pos], items2[pos], pmia_deinstall);
+		check_same_attr(items1[pos], items2[pos], pmia_md5);
+	}
+	fail_unless(items2[pos] == NULL);
+}
+
+/* Check the items of a manifest can be read after the rest of it */
+START_TEST(pkg_manifest_load_items_test)
+{
+	struct pkg_manifest *manifest, *full;
+	struct pkg_manifest_item *item, **items;
+	struct pkgfile *file;
+	const char *data = PKG_MANIFEST_CONTENTS;
+	unsigned int pos;
+
+	fail_unless((full = pkg_freebsd_parse_contents(data, strlen(data))) !=
+	    NULL);
+	fail_unless(full->manifest_load_items == NULL);
+	fail_unless(full->items_count == 8);
+
+	/* The items aren't read until they are asked for */
+	fail_unless((file = pkgfile_new_regular("+CONTENTS", data,
+	    strlen(data))) != NULL);
+	fail_unless((manifest = pkg_freebsd_parse_contents_head(file)) !=
+	    NULL);
+	fail_unless(manifest->source == file);
+	fail_unless(manifest->manifest_load_items != NULL);
+	fail_unless(manifest->items_count == 0);
+	fail_unless(strcmp(pkg_manifest_get_name(manifest), "foo-1.0") == 0);
+	fail_unless(manifest->manifest_load_items != NULL);
+
+	fail_unless((items = pkg_manifest_get_items(manifest)) != NULL);
+	fail_unless(manifest->manifest_load_items == NULL);
+	fail_unless(pkg_manifest_get_items(manifest) == items);
+	fail_unless(strcmp(pkg_manifest_item_get_attr(items[0], pmia_md5),
+	    "d544f30242ff0dab40727ba1acc0751a") == 0);
+	fail_unless(pkg_manifest_item_get_attr(items[1], pmia_ignore) != NULL);
+	check_same_manifest(full, manifest);
+	check_same_manifest(manifest, full);
+	fail_unless(pkg_manifest_free(manifest) == 0);
+
+	/* An item appended before they are read goes after them */
+	fail_unless((file = pkgfile_new_regular("+CONTENTS", data,
+	    strlen(data))) != NULL);
+	fail_unless((manifest = pkg_freebsd_parse_contents_head(file)) !=
+	    NULL);
+	fail_unless((item = pkg_manifest_item_new(pmt_file, "bin/new")) !=
+	    NULL);
+	fail_unless(pkg_manifest_append_item(manifest, item) == 0);
+	fail_unless(manifest->manifest_load_items == NULL);
+	fail_unless((items = pkg_manifest_get_items(manifest)) != NULL);
+	for (pos = 0; pos < full->items_count; pos++)
+		fail_unless(strcmp(pkg_manifest_item_get_data(items[pos]),
+		    pkg_manifest_item_get_data(full->items[pos])) == 0);
+	fail_unless(items[pos] == item);
+	fail_unless(items[pos + 1] == NULL);
+	fail_unless(pkg_manifest_free(manifest) == 0);
+
+	/* An invalid file isn't accepted by either */
+	data = "@comment PKG_FORMAT_REVISION:1.1\n@name foo-1.0\n@bad\n";
+	fail_unless(pkg_freebsd_parse_contents(data, strlen(data)) == NULL);
+	fail_unless((file = pkgfile_new_regular("+CONTENTS", data,
+	    strlen(data))) != NULL);
+	fail_unless(pkg_freebsd_parse_contents_head(file) == NULL);
+	fail_unless(pkgfile_free(file) == 0);
+	fail_unless(pkg_freebsd_parse_contents_head(NULL) == NULL);
+
+	/* The first pass stops after the dependencies and conflicts */
+	data = PKG_MANIFEST_CONTENTS "@bad\n";
+	fail_unless(pkg_freebsd_parse_contents(data, strlen(data)) == NULL);
+	fail_unless((file = pkgfile_new_regular("+CONTENTS", data,
+	    strlen(data))) != NULL);
+	fail_unless((manifest = pkg_freebsd_parse_contents_head(file)) !=
+	    NULL);
+	fail_unless(pkg_manifest_get_dependencies(manifest)[1] != NULL);
+	fail_unless(pkg_manifest_get_conflicts(manifest)[1] != NULL);
+	fail_unless(pkg_manifest_get_items(manifest) == NULL);
+	fail_unless(pkg_manifest_free(manifest) == 0);
+
+	/* A dependency after the items is added with them */
+	data = PKG_MANIFEST_CONTENTS "@pkgdep late-1.0\n"
+	    "@comment DEPORIGIN:misc/late\n" "@conflicts late-2.*\n";
+	pkg_manifest_free(full);
+	fail_unless((full = pkg_freebsd_parse_contents(data, strlen(data))) !=
+	    NULL);
+	fail_unless(pkg_manifest_get_dependencies(full)[2] != NULL);
+	fail_unless((file = pkgfile_new_regular("+CONTENTS", data,
+	    strlen(data))) != NULL);
+	fail_unless((manifest = pkg_freebsd_parse_contents_head(file)) !=
+	    NULL);
+	fail_unless(pkg_manifest_get_dependencies(manifest)[2] == NULL);
+	fail_unless(pkg_manifest_get_items(manifest) != NULL);
+	check_same_manifest(full, manifest);
+	check_same_manifest(manifest, full);
+	fail_unless(pkg_manifest_free(manifest) == 0);
+
+	fail_unless(pkg_manifest_free(full) == 0);
+}
+END_TEST
+
+/* Checks each file in a manifest's path table has the expected path */
+static void
+check_paths(struct pkg_manifest *manifest, const char **expected,
+    unsigned int count)
+{
+	const struct pkgm_path *paths;
+	const struct pkgm_dir *dirs;
+	char buf[PATH_MAX];
+	unsigned int pos, paths_count, dirs_count;
+
+	fail_unless((paths = pkg_manifest_get_paths(manifest, &paths_count)) !=
+	    NULL);
+	fail_unless(paths_count == count);
+	dirs = pkg_manifest_get_dirs(manifest, &dirs_count);
+	fail_unless(dirs != NULL || count == 0);
+	for (pos = 0; pos < count; pos++) {
+		fail_unless(paths[pos].dir < dirs_count);
+		fail_unless(pkg_manifest_get_path(manifest, pos, buf,
+		    sizeof(buf)) == 0);
+		fail_unless(strcmp(buf, expected[pos]) == 0);
+		fail_unless(strcmp(paths[pos].name,
+		    strrchr(expected[pos], '/') + 1) == 0);
+		fail_unless(dirs[paths[pos].dir].len ==
+		    (size_t)(strrchr(expected[pos], '/') - expected[pos]));
+		fail_unless(pkg_manifest_find_path(manifest, expected[pos]) ==
+		    (int)pos);
+	}
+	fail_unless(pkg_manifest_get_path(manifest, count, buf, sizeof(buf)) ==
+	    -1);
+}
+
+/* Check the absolute path of each file is found */
+START_TEST(pkg_manifest_paths)
+{
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item *item;
+	const struct pkgm_path *paths;
+	const struct pkgm_dir *dirs;
+	char buf[PATH_MAX];
+	unsigned int count;
+	const char *expected[] = {
+		"/usr/local/bin/before",
+		"/etc/rc.conf",
+		"/kernel",
+		"/usr/local/share/doc/foo/README",
+		"/usr/local/share/doc/foo/INSTALL",
+		"/opt/a/b/c/d",
+		"/usr/local/share/doc/foo/NEWS",
+		"/usr/local/share/new",
+	};
+
+	fail_unless((manifest = pkg_manifest_new()) != NULL);
+	fail_unless(pkg_manifest_set_attr(manifest, pkgm_prefix,
+	    "/usr/local") == 0);
+	check_paths(manifest, expected, 0);
+
+	/* Files before the first @cwd are in the prefix */
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file,
+	    "bin/before", 10) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_chdir, "/", 1) !=
+	    NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file,
+	    "etc/rc.conf", 11) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file,
+	    "kernel", 6) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_chdir,
+	    "/usr/local//share/", 18) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file,
+	    "doc//foo///README", 17) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_dir,
+	    "doc/foo", 7) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file,
+	    "doc/foo/INSTALL", 15) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_chdir, "/opt", 4) !=
+	    NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file,
+	    "a/b/c/d", 7) != NULL);
+	check_paths(manifest, expected, 6);
+
+	/* Extra slashes are removed so files in a directory are together */
+	fail_unless((paths = pkg_manifest_get_paths(manifest, &count)) !=
+	    NULL);
+	fail_unless((dirs = pkg_manifest_get_dirs(manifest, &count)) != NULL);
+	fail_unless(count == 5);
+	fail_unless(paths[3].dir == paths[4].dir);
+	fail_unless(dirs[paths[3].dir].count == 2);
+	fail_unless(dirs[paths[3].dir].first == 3);
+	fail_unless(dirs[paths[3].dir].last == 4);
+	fail_unless(paths[3].next == 4);
+	fail_unless(paths[4].next == PKGM_PATH_NONE);
+
+	/* A file in / is in the directory "" */
+	fail_unless(dirs[paths[2].dir].len == 0);
+
+	/* Only an absolute path without extra slashes is found */
+	fail_unless(pkg_manifest_find_path(manifest,
+	    "/usr/local//bin/before") == -1);
+	fail_unless(pkg_manifest_find_path(manifest, "bin/before") == -1);
+	fail_unless(pkg_manifest_find_path(manifest, "before") == -1);
+	fail_unless(pkg_manifest_find_path(manifest, "/usr/local/bin") == -1);
+	fail_unless(pkg_manifest_find_path(manifest, "/usr/local/bin/") ==
+	    -1);
+	fail_unless(pkg_manifest_find_path(manifest, "/opt/a/b/c/e") == -1);
+	fail_unless(pkg_manifest_find_path(manifest,
+	    "/usr/local/share/doc/foo") == -1);
+	fail_unless(pkg_manifest_find_path(manifest, NULL) == -1);
+	fail_unless(pkg_manifest_find_path(NULL, "/kernel") == -1);
+
+	fail_unless(pkg_manifest_get_path(manifest, 0, buf,
+	    strlen(expected[0])) == -1);
+	fail_unless(pkg_manifest_get_path(manifest, 0, buf,
+	    strlen(expected[0]) + 1) == 0);
+
+	/* The table is made again when a file is added */
+	fail_unless(pkg_manifest_append_data(manifest, pmt_chdir,
+	    "/usr/local/share", 16) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file,
+	    "doc/foo/NEWS", 12) != NULL);
+	check_paths(manifest, expected, 7);
+	fail_unless((paths = pkg_manifest_get_paths(manifest, &count)) !=
+	    NULL);
+	fail_unless(paths[4].next == 6);
+	fail_unless(paths[6].dir == paths[3].dir);
+
+	/* Or the prefix is changed */
+	fail_unless(pkg_manifest_set_attr(manifest, pkgm_prefix, "/usr/pkg/") ==
+	    0);
+	expected[0] = "/usr/pkg/bin/before";
+	check_paths(manifest, expected, 7);
+	fail_unless(pkg_manifest_find_path(manifest,
+	    "/usr/local/bin/before") == -1);
+
+	/* Or a file's name is changed, in the arena or not */
+	item = pkg_manifest_get_items(manifest)[2];
+	fail_unless(pkg_manifest_item_set_data(item, "etc/motd") == 0);
+	expected[1] = "/etc/motd";
+	check_paths(manifest, expected, 7);
+	fail_unless(pkg_manifest_find_path(manifest, "/etc/rc.conf") == -1);
+
+	fail_unless((item = pkg_manifest_item_new(pmt_file, "new")) != NULL);
+	fail_unless(pkg_manifest_append_item(manifest, item) == 0);
+	check_paths(manifest, expected, 8);
+	fail_unless(pkg_manifest_item_set_data(item, "renamed") == 0);
+	expected[7] = "/usr/local/share/renamed";
+	check_paths(manifest, expected, 8);
+
+	fail_unless(pkg_manifest_free(manifest) == 0);
+
+	/* Without a prefix the files are relative to the current directory */
+	fail_unless((manifest = pkg_manifest_new()) != NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file, "a/b", 3) !=
+	    NULL);
+	fail_unless(pkg_manifest_append_data(manifest, pmt_file, "c", 1) !=
+	    NULL);
+	expected[0] = "./a/b";
+	expected[1] = "./c";
+	check_paths(manifest, expected, 2);
+	fail_unless(pkg_manifest_free(manifest) == 0);
+}
+END_TEST
+
+#define MATCH_DB "testdir/db"
+#define MATCH_ROOT "testdir/root"
+#define MATCH_FOO "@comment PKG_FORMAT_REVISION:1.1\n@name foo-1.0\n" \
+    "@comment ORIGIN:misc/foo\n@cwd " MATCH_ROOT "\nbin/foo\n" \
+    "share//foo/README\n@cwd " MATCH_ROOT "/etc/\nfoo.conf\n" \
+    "@cwd " MATCH_ROOT "\n@dirrm share/foo\n"
+#define MATCH_BAR "@comment PKG_FORMAT_REVISION:1.1\n@name bar-1.0\n" \
+    "@comment ORIGIN:misc/bar\n@cwd " MATCH_ROOT "\nbin/bar\n"
+
+/* Matches a file as pkg_match_by_file() did before the path table */
+static int
+match_by_reading(struct pkg *pkg, const char *filename)
+{
+	struct pkgfile *file;
+
+	while ((file = pkg_get_next_file(pkg)) != NULL) {
+		if (strcmp(filename, pkgfile_get_name(file)) == 0) {
+			pkgfile_free(file);
+			return 0;
+		}
+		pkgfile_free(file);
+	}
+	return -1;
+}
+
+/* Check installed packages are matched by file as they were before */
+START_TEST(pkg_manifest_match_by_file)
+{
+	struct pkg_db *db;
+	struct pkg *pkg, **pkgs;
+	unsigned int pos;
+	const char *files[] = {
+		MATCH_ROOT "/bin/foo",
+		MATCH_ROOT "/share/foo/README",
+		MATCH_ROOT "/etc/foo.conf",
+		MATCH_ROOT "/bin/bar",
+		MATCH_ROOT "//bin/foo",
+		MATCH_ROOT "/bin/",
+		MATCH_ROOT "/share/foo",
+		MATCH_ROOT "/etc/bar.conf",
+		"bin/foo",
+		"foo",
+	};
+
+	SETUP_TESTDIR();
+	MAKE_TESTDIR(MATCH_DB "/var/db/pkg/foo-1.0 "
+	    MATCH_DB "/var/db/pkg/bar-1.0 " MATCH_ROOT "/bin "
+	    MATCH_ROOT "/etc " MATCH_ROOT "/share/foo");
+	WRITE_TESTFILE(MATCH_DB "/var/db/pkg/foo-1.0/+CONTENTS", MATCH_FOO,
+	    strlen(MATCH_FOO));
+	WRITE_TESTFILE(MATCH_DB "/var/db/pkg/bar-1.0/+CONTENTS", MATCH_BAR,
+	    strlen(MATCH_BAR));
+	for (pos = 0; pos < 4; pos++)
+		WRITE_TESTFILE(files[pos], "file\n", 5);
+
+	fail_unless((db = pkg_db_open_freebsd(MATCH_DB)) != NULL);
+	for (pos = 0; pos < sizeof(files) / sizeof(files[0]); pos++) {
+		fail_unless((pkg = pkg_db_get_package(db, "foo-1.0")) != NULL);
+		fail_unless(pkg_match_by_file(pkg, files[pos]) ==
+		    match_by_reading(pkg, files[pos]));
+		fail_unless(pkg_match_by_file(pkg, files[pos]) ==
+		    (pos < 3 ? 0 : -1));
+		pkg_free(pkg);
+	}
+
+	/* Only the package with the file is found */
+	pkgs = pkg_db_get_installed_match(db, pkg_match_by_file, files[2]);
+	fail_unless(pkgs != NULL);
+	fail_unless(pkgs[0] != NULL);
+	fail_unless(strcmp(pkg_get_name(pkgs[0]), "foo-1.0") == 0);
+	fail_unless(pkgs[1] == NULL);
+	pkg_list_free(pkgs);
+	pkgs = pkg_db_get_installed_match(db, pkg_match_by_file, files[3]);
+	fail_unless(pkgs != NULL);
+	fail_unless(pkgs[0] != NULL);
+	fail_unless(strcmp(pkg_get_name(pkgs[0]), "bar-1.0") == 0);
+	fail_unless(pkgs[1] == NULL);
+	pkg_list_free(pkgs);
+
+	/* A file that has been removed from disk isn't matched */
+	unlink(files[2]);
+	fail_unless((pkg = pkg_db_get_package(db, "foo-1.0")) != NULL);
+	fail_unless(pkg_match_by_file(pkg, files[2]) != 0);
+	fail_unless(pkg_match_by_file(pkg, files[0]) == 0);
+	pkg_free(pkg);
+
+	pkg_db_free(db);
+	REMOVE_TESTFILES(MATCH_DB " " MATCH_ROOT);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
 /*
  * TODO: Test pkg_manifest_get_file()
  */
@@ -236,9 +906,17 @@ pkg_manifest_suite()
 	tcase_add_test(tc, pkg_manifest_version);
 	tcase_add_test(tc, pkg_manifest_dependency);
 	tcase_add_test(tc, pkg_manifest_conflict);
+	tcase_add_test(tc, pkg_manifest_dependency_many);
 	tcase_add_test(tc, pkg_manifest_name);
 	tcase_add_test(tc, pkg_manifest_attrib);
 	tcase_add_test(tc, pkg_manifest_item);
+	tcase_add_test(tc, pkg_manifest_item_many);
+	tcase_add_test(tc, pkg_manifest_interned);
+	tcase_add_test(tc, pkg_manifest_item_arena);
+	tcase_add_test(tc, pkg_manifest_item_md5);
+	tcase_add_test(tc, pkg_manifest_load_items_test);
+	tcase_add_test(tc, pkg_manifest_paths);
+	tcase_add_test(tc, pkg_manifest_match_by_file);
 	suite_add_tcase(s, tc);
 
 	return s;
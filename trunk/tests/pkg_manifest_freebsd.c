@@ -27,7 +27,9 @@
 #include "test.h"
 
 #include <pkg.h>
+#include <pkg_private.h>
 
+#include <pthread.h>
 #include <string.h>
 
 #define pkg_manifest_default "@comment PKG_FORMAT_REVISION:1.1\n" \
@@ -35,6 +37,28 @@
     "@comment ORIGIN:package/origin\n" \
     "@cwd /usr/local\n"
 
+/* A +CONTENTS file with every type of line */
+#define pkg_manifest_freebsd_all pkg_manifest_default \
+    "@pkgdep dep-1.0\n" \
+    "@comment DEPORIGIN:dep/origin\n" \
+    "@conflicts other-*\n" \
+    "@mtree +MTREE_DIRS\n" \
+    "@display +DISPLAY\n" \
+    "bin/file\n" \
+    "@comment MD5:d544f30242ff0dab40727ba1acc0751a\n" \
+    "@ignore\n" \
+    "+IGNORED\n" \
+    "@exec /bin/true %D/%F\n" \
+    "@unexec /bin/true %D/%F\n" \
+    "@comment a comment\n" \
+    "@cwd /usr\n" \
+    "share/file\n" \
+    "@dirrm share/dir\n"
+
+/* The threads and parses per thread of the threads test */
+#define PARSE_THREADS	4
+#define PARSE_RUNS	50
+
 START_TEST(pkg_manifest_freebsd_empty_test)
 {
 	struct pkgfile *file;
@@ -286,6 +310,94 @@ START_TEST(pkg_manifest_freebsd_good_conflicts_test)
 }
 END_TEST
 
+/*
+ * Check empty lines are skipped, as FreeBSD's plist reader does
+ */
+START_TEST(pkg_manifest_freebsd_good_blank_test)
+{
+	const char *pkg_data = "\n@comment PKG_FORMAT_REVISION:1.1\n\n"
+	    "@name package_name-1.0\n\n\n"
+	    "@comment ORIGIN:package/origin\n"
+	    "@cwd /usr/local\n\n"
+	    "bin/a\n\n"
+	    "@ignore\n\n"
+	    "bin/b\n\n";
+	struct pkgfile *file;
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item **items;
+
+	file = pkgfile_new_regular("+CONTENTS", pkg_data, strlen(pkg_data));
+	manifest = pkg_manifest_new_freebsd_pkgfile(file);
+	pkg_manifest_freebsd_good_common(manifest);
+
+	items = pkg_manifest_get_items(manifest);
+	fail_unless(items != NULL);
+	fail_unless(items[0] != NULL);
+	fail_unless(pkg_manifest_item_get_type(items[0]) == pmt_file);
+	fail_unless(strcmp(pkg_manifest_item_get_data(items[0]),
+	    "bin/a") == 0);
+	fail_unless(pkg_manifest_item_get_attr(items[0], pmia_ignore) == NULL);
+	fail_unless(items[1] != NULL);
+	fail_unless(pkg_manifest_item_get_type(items[1]) == pmt_file);
+	fail_unless(strcmp(pkg_manifest_item_get_data(items[1]),
+	    "bin/b") == 0);
+	fail_unless(pkg_manifest_item_get_attr(items[1], pmia_ignore) != NULL);
+	fail_unless(items[2] == NULL);
+
+	pkg_manifest_free(manifest);
+	pkgfile_free(file);
+}
+END_TEST
+
+/*
+ * Check the last line needn't end with a new line
+ */
+START_TEST(pkg_manifest_freebsd_good_unterminated_test)
+{
+	const char *pkg_data = pkg_manifest_default "@comment data";
+	const char *head_data = "@comment PKG_FORMAT_REVISION:1.1\n"
+	    "@name package_name-1.0\n"
+	    "@comment ORIGIN:package/origin\n"
+	    "@cwd /usr/local";
+	struct pkgfile *file;
+	struct pkg_manifest *manifest;
+	struct pkg_manifest_item **items;
+
+	file = pkgfile_new_regular("+CONTENTS", pkg_data, strlen(pkg_data));
+	manifest = pkg_manifest_new_freebsd_pkgfile(file);
+	check_good_command(manifest, pmt_comment);
+	items = pkg_manifest_get_items(manifest);
+	fail_unless(strcmp(pkg_manifest_item_get_data(items[0]),
+	    "data") == 0);
+	pkg_manifest_free(manifest);
+	pkgfile_free(file);
+
+	/* The prefix is the last line */
+	file = pkgfile_new_regular("+CONTENTS", head_data, strlen(head_data));
+	manifest = pkg_manifest_new_freebsd_pkgfile(file);
+	pkg_manifest_freebsd_good_basic_test_run(manifest);
+	pkg_manifest_free(manifest);
+	pkgfile_free(file);
+}
+END_TEST
+
+/*
+ * Check a file of only empty lines fails
+ */
+START_TEST(pkg_manifest_freebsd_bad_blank_test)
+{
+	const char *pkg_data = "\n\n\n";
+	struct pkgfile *file;
+	struct pkg_manifest *manifest;
+
+	file = pkgfile_new_regular("+CONTENTS", pkg_data, strlen(pkg_data));
+	manifest = pkg_manifest_new_freebsd_pkgfile(file);
+	fail_unless(manifest == NULL);
+
+	pkgfile_free(file);
+}
+END_TEST
+
 /*
  * Check a command with no data fails
  */
@@ -544,6 +656,58 @@ START_TEST(pkg_manifest_freebsd_bad_empty2_display_test)
 }
 END_TEST
 
+/*
+ * Parses pkg_manifest_freebsd_all PARSE_RUNS times with the bison
+ * parser. The manifests are checked by the main thread.
+ */
+static void *
+pkg_manifest_freebsd_parse_thread(void *data)
+{
+	struct pkg_manifest **manifests = data;
+	const char *contents = pkg_manifest_freebsd_all;
+	unsigned int pos;
+
+	for (pos = 0; pos < PARSE_RUNS; pos++)
+		manifests[pos] = pkg_freebsd_parse_buffer(contents,
+		    strlen(contents));
+	return NULL;
+}
+
+/*
+ * Check the bison parser may be used from many threads at once and
+ * gives the same manifest as the hand written parser
+ */
+START_TEST(pkg_manifest_freebsd_threads_test)
+{
+	struct pkg_manifest *manifests[PARSE_THREADS][PARSE_RUNS];
+	struct pkg_manifest *manifest;
+	const char *contents = pkg_manifest_freebsd_all;
+	pthread_t threads[PARSE_THREADS];
+	unsigned int pos, run;
+
+	manifest = pkg_freebsd_parse_contents(contents, strlen(contents));
+	fail_unless(manifest != NULL, NULL);
+	fail_unless(pkg_manifest_get_items(manifest)[8] != NULL, NULL);
+
+	for (pos = 0; pos < PARSE_THREADS; pos++)
+		fail_unless(pthread_create(&threads[pos], NULL,
+		    pkg_manifest_freebsd_parse_thread, manifests[pos]) == 0,
+		    NULL);
+	for (pos = 0; pos < PARSE_THREADS; pos++)
+		fail_unless(pthread_join(threads[pos], NULL) == 0, NULL);
+
+	for (pos = 0; pos < PARSE_THREADS; pos++) {
+		for (run = 0; run < PARSE_RUNS; run++) {
+			fail_unless(manifests[pos][run] != NULL, NULL);
+			check_same_manifest(manifest, manifests[pos][run]);
+			check_same_manifest(manifests[pos][run], manifest);
+			pkg_manifest_free(manifests[pos][run]);
+		}
+	}
+	pkg_manifest_free(manifest);
+}
+END_TEST
+
 Suite *
 pkg_manifest_freebsd_suite()
 {
@@ -567,6 +731,8 @@ pkg_manifest_freebsd_suite()
 	tcase_add_test(tc, pkg_manifest_freebsd_good_display_test);
 	tcase_add_test(tc, pkg_manifest_freebsd_good_pkgdep_test);
 	tcase_add_test(tc, pkg_manifest_freebsd_good_conflicts_test);
+	tcase_add_test(tc, pkg_manifest_freebsd_good_blank_test);
+	tcase_add_test(tc, pkg_manifest_freebsd_good_unterminated_test);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("bad");
@@ -589,6 +755,12 @@ pkg_manifest_freebsd_suite()
 	tcase_add_test(tc, pkg_manifest_freebsd_bad_empty2_dirrm_test);
 	tcase_add_test(tc, pkg_manifest_freebsd_bad_empty2_mtree_test);
 	tcase_add_test(tc, pkg_manifest_freebsd_bad_empty2_display_test);
+
+	tcase_add_test(tc, pkg_manifest_freebsd_bad_blank_test);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("threads");
+	tcase_add_test(tc, pkg_manifest_freebsd_threads_test);
 	suite_add_tcase(s, tc);
 
 	return s;
@@ -29,6 +29,7 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <archive_entry.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -49,12 +50,15 @@
 static void basic_file_tests(struct pkgfile *, const char *, pkgfile_type,
 	pkgfile_loc, const char *, unsigned int);
 static void test_checksums(struct pkgfile *, const char *);
+static void check_md5(struct pkgfile *, const char *);
 static void existing_regular_test(struct pkgfile *);
 static void existing_symlink_test(struct pkgfile *);
 static void existing_directory_test(struct pkgfile *);
 static void depth_test_fail_write(struct pkgfile *);
 static void empty_regular_file_tests(const char *);
 static void check_regular_file_data(const char *, const char *, int, int);
+static void check_regular_file_data_len(const char *, const char *,
+	unsigned int);
 static void check_symlink_data(const char *, const char *);
 static void check_directory_data(const char *);
 
@@ -72,7 +76,7 @@ basic_file_tests(struct pkgfile *file, const char *filename, pkgfile_type type,
 	fail_unless(file->type == type, NULL);
 	fail_unless(file->fd == NULL, NULL);
 	fail_unless(file->mode == 0, NULL);
-	fail_unless(file->md5[0] == '\0', NULL);
+	fail_unless(file->has_md5 == 0, NULL);
 
 	fail_unless(strcmp(pkgfile_get_name(file), filename) == 0, NULL);
 	fail_unless(strcmp(file->name, filename) == 0, NULL);
@@ -191,6 +195,21 @@ basic_file_tests(struct pkgfile *file, const char *filename, pkgfile_type type,
 	fail_unless(pkgfile_unlink(file) == -1, NULL);
 }
 
+/*
+ * Check the binary checksum in a pkgfile matches a hex string
+ */
+static void
+check_md5(struct pkgfile *file, const char *md5)
+{
+	char hex[33];
+	unsigned int pos;
+
+	fail_unless(file->has_md5 == 1, NULL);
+	for (pos = 0; pos < 16; pos++)
+		sprintf(hex + pos * 2, "%02x", file->md5[pos]);
+	fail_unless(strcmp(hex, md5) == 0, NULL);
+}
+
 static void
 test_checksums(struct pkgfile *file, const char *md5)
 {
@@ -199,18 +218,23 @@ test_checksums(struct pkgfile *file, const char *md5)
 
 	fail_unless(strlen(md5) == 32, NULL);
 	fail_unless(pkgfile_set_checksum_md5(file, md5) == 0, NULL);
-	fail_unless(strcmp(file->md5, md5) == 0, NULL);
+	check_md5(file, md5);
 	fail_unless(pkgfile_compare_checksum_md5(file) == 0, NULL);
 
 	/* Check this fails with bad data that is too short */
 	fail_unless(pkgfile_set_checksum_md5(file, "") == -1, NULL);
-	fail_unless(strcmp(file->md5, md5) == 0, NULL);
+	check_md5(file, md5);
 	fail_unless(pkgfile_compare_checksum_md5(file) == 0, NULL);
 
+	/* Check this fails with data that isn't hexadecimal */
+	fail_unless(pkgfile_set_checksum_md5(file,
+	    "1234567890123456789012345678901g") == -1, NULL);
+	check_md5(file, md5);
+
 	/* Check this fails with bad data that is too long */
 	fail_unless(pkgfile_set_checksum_md5(file,
 	    "123456789012345678901234567890123") == -1, NULL);
-	fail_unless(strcmp(file->md5, md5) == 0, NULL);
+	check_md5(file, md5);
 
 	/*
 	 * Check it accepts a correct length checksum
@@ -218,8 +242,7 @@ test_checksums(struct pkgfile *file, const char *md5)
 	 */
 	fail_unless(pkgfile_set_checksum_md5(file,
 		"12345678901234567890123456789012") == 0, NULL);
-	fail_unless(strcmp(file->md5, "12345678901234567890123456789012") == 0,
-		NULL);
+	check_md5(file, "12345678901234567890123456789012");
 	fail_unless(pkgfile_compare_checksum_md5(file) == 1, NULL);
 }
 
@@ -340,6 +363,29 @@ check_regular_file_data(const char *filename, const char *expected_data,
 	fclose(fd);
 }
 
+/* Like check_regular_file_data but for data that may not be a string */
+static void
+check_regular_file_data_len(const char *filename, const char *expected_data,
+    unsigned int length)
+{
+	struct stat sb;
+	FILE *fd;
+	char *buf;
+
+	fail_unless((fd = fopen(filename, "r")) != NULL, NULL);
+
+	fstat(fileno(fd), &sb);
+	fail_unless(S_ISREG(sb.st_mode), NULL);
+	fail_unless(sb.st_size == length, NULL);
+
+	fail_unless((buf = malloc(length)) != NULL, NULL);
+	fail_unless(fread(buf, 1, length, fd) == length, NULL);
+	fail_unless(memcmp(buf, expected_data, length) == 0, NULL);
+	free(buf);
+
+	fclose(fd);
+}
+
 static void
 check_symlink_data(const char *filename, const char *expected_data)
 {
@@ -412,6 +458,37 @@ START_TEST(pkgfile_regular_data_test)
 }
 END_TEST
 
+START_TEST(pkgfile_regular_owned_test)
+{
+	struct pkgfile *file;
+	char *buf;
+
+	/* The file should use the buffer it is given */
+	fail_unless((buf = strdup("0123456789")) != NULL, NULL);
+	fail_unless((file = pkgfile_new_regular_owned(BASIC_FILE, buf, 10))
+	    != NULL, NULL);
+	fail_unless(file->data == buf, NULL);
+	basic_file_tests(file, BASIC_FILE, pkgfile_regular, pkgfile_loc_mem,
+	    "0123456789", 10);
+	test_checksums(file, "781e5e245d69b566979b86e28d23f2c7");
+	fail_unless(pkgfile_append(file, "abc", 3) == 0, NULL);
+	fail_unless(memcmp(file->data, "0123456789abc", 13) == 0, NULL);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+
+	fail_unless((file = pkgfile_new_regular_owned(BASIC_FILE, NULL, 0))
+	    != NULL, NULL);
+	basic_file_tests(file, BASIC_FILE, pkgfile_regular, pkgfile_loc_mem,
+	    "", 0);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+
+	/* The buffer is freed on error */
+	fail_unless(pkgfile_new_regular_owned(BASIC_FILE, NULL, 1) == NULL,
+	    NULL);
+	fail_unless(pkgfile_new_regular_owned(NULL, strdup("1"), 1) == NULL,
+	    NULL);
+}
+END_TEST
+
 START_TEST(pkgfile_regular_existing_regular_test)
 {
 	struct pkgfile *file;
@@ -541,6 +618,236 @@ START_TEST(pkgfile_regular_modify_empty_test)
 }
 END_TEST
 
+START_TEST(pkgfile_regular_write_test)
+{
+	struct pkgfile *file;
+	struct stat sb;
+	unsigned int length, pos;
+	char *buf;
+
+	SETUP_TESTDIR();
+
+	/* The mode should be set even if the umask removes bits from it */
+	umask(022);
+	file = pkgfile_new_regular(BASIC_FILE, "12345", 5);
+	fail_unless(pkgfile_set_mode(file, 0666) == 0, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	fail_unless(stat(BASIC_FILE, &sb) == 0, NULL);
+	fail_unless((sb.st_mode & ALLPERMS) == 0666, NULL);
+	pkgfile_free(file);
+	system("rm " BASIC_FILE);
+
+	file = pkgfile_new_regular(BASIC_FILE, "12345", 5);
+	fail_unless(pkgfile_set_mode(file, 0640) == 0, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	fail_unless(stat(BASIC_FILE, &sb) == 0, NULL);
+	fail_unless((sb.st_mode & ALLPERMS) == 0640, NULL);
+	pkgfile_free(file);
+	system("rm " BASIC_FILE);
+
+	/* Write a file large enough to be preallocated */
+	length = 3 * 1024 * 1024 + 5;
+	fail_unless((buf = malloc(length)) != NULL, NULL);
+	for (pos = 0; pos < length; pos++)
+		buf[pos] = pos % 251;
+	file = pkgfile_new_regular(BASIC_FILE, buf, length);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	pkgfile_free(file);
+	check_regular_file_data_len(BASIC_FILE, buf, length);
+	free(buf);
+	system("rm " BASIC_FILE);
+
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+START_TEST(pkgfile_regular_append_test)
+{
+	struct pkgfile *file;
+	const char *data;
+	char line[32];
+	unsigned int pos, length;
+
+	/* Appending many strings should grow the buffer geometrically */
+	file = pkgfile_new_regular(DEPTH_FILE, "", 0);
+	length = 0;
+	for (pos = 0; pos < 10000; pos++) {
+		length += snprintf(line, sizeof(line), "line %u\n", pos);
+		fail_unless(pkgfile_append_string(file, "line %u\n", pos) == 0,
+		    NULL);
+		fail_unless(file->length == length, NULL);
+		fail_unless(file->capacity >= file->length, NULL);
+		fail_unless(file->capacity <= file->length * 2 + 64, NULL);
+	}
+	fail_unless(pkgfile_append_string(file, "%s", "") == 0, NULL);
+	fail_unless(file->length == length, NULL);
+	for (pos = 0, data = file->data; pos < 10000; pos++) {
+		length = snprintf(line, sizeof(line), "line %u\n", pos);
+		fail_unless(strncmp(data, line, length) == 0, NULL);
+		data += length;
+	}
+	pkgfile_free(file);
+
+	/* Reserved space is used without reallocating */
+	file = pkgfile_new_regular(DEPTH_FILE, "12345", 5);
+	fail_unless(pkgfile_reserve(file, 4) == 0, NULL);
+	fail_unless(file->capacity == 5, NULL);
+	fail_unless(pkgfile_reserve(file, 1000) == 0, NULL);
+	fail_unless(file->capacity == 1000, NULL);
+	data = file->data;
+	for (pos = 0; pos < 198; pos++)
+		fail_unless(pkgfile_append(file, "67890", 5) == 0, NULL);
+	fail_unless(pkgfile_append_string(file, "%d", 123) == 0, NULL);
+	fail_unless(file->data == data, NULL);
+	fail_unless(file->length == 998, NULL);
+	fail_unless(strncmp(file->data + 990, "67890123", 8) == 0, NULL);
+	pkgfile_free(file);
+
+	/* Only in memory regular files can be reserved */
+	file = pkgfile_new_symlink(DEPTH_FILE, "12345");
+	fail_unless(pkgfile_reserve(file, 100) == -1, NULL);
+	pkgfile_free(file);
+}
+END_TEST
+
+START_TEST(pkgfile_regular_find_line_test)
+{
+	struct pkgfile *file;
+	const char *data = "foobar\nbarfoo\nfoo\nfoo";
+
+	file = pkgfile_new_regular(DEPTH_FILE, data, strlen(data));
+
+	/* Partial matches must be skipped */
+	fail_unless(pkgfile_find_line(file, "foo") == file->data + 14, NULL);
+	fail_unless(pkgfile_find_line(file, "bar") == NULL, NULL);
+	fail_unless(pkgfile_find_line(file, "foobar") == file->data, NULL);
+	fail_unless(pkgfile_find_line(file, "barfoo\nfoo") == file->data + 7,
+	    NULL);
+	fail_unless(pkgfile_find_line(file, "") == NULL, NULL);
+
+	/* Remove the last line when it has no trailing new line */
+	fail_unless(pkgfile_remove_line(file, "foo") == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "foo") == 0, NULL);
+	fail_unless(pkgfile_find_line(file, "foo") == NULL, NULL);
+	basic_file_tests(file, DEPTH_FILE, pkgfile_regular, pkgfile_loc_mem,
+	    "foobar\nbarfoo\n", 14);
+	pkgfile_free(file);
+}
+END_TEST
+
+START_TEST(pkgfile_regular_find_line_index_test)
+{
+	/* Test finding lines in a file large enough to be indexed */
+	struct pkgfile *file;
+	char line[32];
+	const char *ptr;
+	unsigned int pos;
+
+	file = pkgfile_new_regular(DEPTH_FILE, "", 0);
+	for (pos = 0; pos < 1000; pos++) {
+		snprintf(line, sizeof(line), "package-%u\n", pos);
+		fail_unless(pkgfile_append(file, line, strlen(line)) == 0,
+		    NULL);
+	}
+	/* Duplicate line should find the first */
+	fail_unless(pkgfile_append(file, "package-1", 9) == 0, NULL);
+
+	fail_unless(pkgfile_find_line(file, "package-0") == file->data, NULL);
+	fail_unless(pkgfile_find_line(file, "package-1") == file->data + 10,
+	    NULL);
+	fail_unless(pkgfile_find_line(file, "package-") == NULL, NULL);
+	fail_unless(pkgfile_find_line(file, "package-1000") == NULL, NULL);
+	for (pos = 0; pos < 1000; pos++) {
+		snprintf(line, sizeof(line), "package-%u", pos);
+		ptr = pkgfile_find_line(file, line);
+		fail_unless(ptr != NULL, NULL);
+		fail_unless(strncmp(ptr, line, strlen(line)) == 0, NULL);
+		fail_unless(ptr[strlen(line)] == '\n', NULL);
+	}
+
+	/* The index must be updated when the file changes */
+	fail_unless(pkgfile_remove_line(file, "package-0") == 0, NULL);
+	fail_unless(pkgfile_find_line(file, "package-0") == NULL, NULL);
+	fail_unless(pkgfile_find_line(file, "package-1") == file->data, NULL);
+	fail_unless(pkgfile_remove_line(file, "package-1") == 0, NULL);
+	ptr = pkgfile_find_line(file, "package-1");
+	fail_unless(ptr == file->data + file->length - 9, NULL);
+	fail_unless(pkgfile_append(file, "\npackage-1000", 13) == 0, NULL);
+	fail_unless(pkgfile_find_line(file, "package-1000") ==
+	    file->data + file->length - 12, NULL);
+	pkgfile_free(file);
+}
+END_TEST
+
+/* Tests on a regular file read from an archive */
+START_TEST(pkgfile_regular_archive_test)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	struct pkgfile *file;
+	FILE *fd;
+	char *data;
+	unsigned int pos, length;
+
+	SETUP_TESTDIR();
+
+	/* Create an archive with a large and a small file */
+	length = 200000;
+	fail_unless((data = malloc(length)) != NULL, NULL);
+	for (pos = 0; pos < length; pos++)
+		data[pos] = 'a' + pos % 26;
+	fail_unless((fd = fopen("testdir/LARGE", "w")) != NULL, NULL);
+	fail_unless(fwrite(data, 1, length, fd) == length, NULL);
+	fclose(fd);
+	fail_unless((fd = fopen("testdir/SMALL", "w")) != NULL, NULL);
+	fail_unless(fwrite("12345\n", 1, 6, fd) == 6, NULL);
+	fclose(fd);
+	fail_unless(system("cd testdir && tar -cf test.tar LARGE SMALL") == 0,
+	    NULL);
+	system("rm testdir/LARGE testdir/SMALL");
+
+	fail_unless((fd = fopen("testdir/test.tar", "r")) != NULL, NULL);
+	a = archive_read_new();
+	archive_read_support_format_tar(a);
+	fail_unless(archive_read_open_FILE(a, fd) == ARCHIVE_OK, NULL);
+
+	/* Writing copies the data straight from the archive */
+	fail_unless(pkgfile_new_regular_archive(NULL, a, 0) == NULL, NULL);
+	fail_unless(pkgfile_new_regular_archive("testdir/OUT", NULL, 0) == NULL,
+	    NULL);
+	fail_unless(archive_read_next_header(a, &entry) == ARCHIVE_OK, NULL);
+	file = pkgfile_new_regular_archive("testdir/OUT", a,
+	    archive_entry_size(entry));
+	fail_unless(file != NULL, NULL);
+	fail_unless(file->loc == pkgfile_loc_archive, NULL);
+	fail_unless(pkgfile_get_size(file) == length, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	fail_unless(file->data == NULL, NULL);
+	check_regular_file_data_len("testdir/OUT", data, length);
+	/* The data can only be used once */
+	fail_unless(pkgfile_get_data(file) == NULL, NULL);
+	pkgfile_free(file);
+
+	/* Other uses read the data into memory */
+	fail_unless(archive_read_next_header(a, &entry) == ARCHIVE_OK, NULL);
+	file = pkgfile_new_regular_archive("testdir/SMALL", a,
+	    archive_entry_size(entry));
+	fail_unless(file != NULL, NULL);
+	fail_unless(strcmp(pkgfile_get_data(file), "12345\n") == 0, NULL);
+	fail_unless(file->loc == pkgfile_loc_mem, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	check_regular_file_data_len("testdir/SMALL", "12345\n", 6);
+	pkgfile_free(file);
+
+	archive_read_finish(a);
+	fclose(fd);
+	free(data);
+
+	system("rm testdir/OUT testdir/SMALL testdir/test.tar");
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
 /* Tests on creating a symlink from a buffer */
 START_TEST(pkgfile_symlink_bad_test)
 {
@@ -576,6 +883,26 @@ START_TEST(pkgfile_symlink_good_test)
 }
 END_TEST
 
+START_TEST(pkgfile_symlink_owned_test)
+{
+	struct pkgfile *file;
+	char *target;
+
+	fail_unless(pkgfile_new_symlink_owned(BASIC_FILE, NULL) == NULL, NULL);
+	fail_unless(pkgfile_new_symlink_owned(NULL, strdup(LINK_TARGET)) ==
+	    NULL, NULL);
+
+	fail_unless((target = strdup(LINK_TARGET)) != NULL, NULL);
+	fail_unless((file = pkgfile_new_symlink_owned(BASIC_FILE, target))
+	    != NULL, NULL);
+	fail_unless(file->data == target, NULL);
+	basic_file_tests(file, BASIC_FILE, pkgfile_symlink, pkgfile_loc_mem,
+	    LINK_TARGET, LINK_TARGET_LENGTH);
+	test_checksums(file, LINK_TARGET_MD5);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+}
+END_TEST
+
 START_TEST(pkgfile_symlink_existing_regular_test)
 {
 	struct pkgfile *file;
@@ -657,6 +984,27 @@ START_TEST(pkgfile_hardlink_bad_test)
 }
 END_TEST
 
+START_TEST(pkgfile_hardlink_owned_test)
+{
+	struct pkgfile *file;
+	char *target;
+
+	fail_unless(pkgfile_new_hardlink_owned(BASIC_FILE, NULL) == NULL,
+	    NULL);
+	fail_unless(pkgfile_new_hardlink_owned(NULL, strdup(LINK_TARGET)) ==
+	    NULL, NULL);
+
+	fail_unless((target = strdup(LINK_TARGET)) != NULL, NULL);
+	fail_unless((file = pkgfile_new_hardlink_owned(BASIC_FILE, target))
+	    != NULL, NULL);
+	fail_unless(file->data == target, NULL);
+	fail_unless(file->type == pkgfile_hardlink, NULL);
+	fail_unless(file->length == LINK_TARGET_LENGTH, NULL);
+	fail_unless(strcmp(pkgfile_get_data(file), LINK_TARGET) == 0, NULL);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+}
+END_TEST
+
 START_TEST(pkgfile_hardlink_test)
 {
 	struct pkgfile *file;
@@ -855,8 +1203,484 @@ START_TEST(pkgfile_directory_depth_exists_test)
 }
 END_TEST
 
+/* Tests on files read from disk */
+static void
+disk_file_test(unsigned int length, int mapped)
+{
+	struct pkgfile *file;
+	char *buf;
+	FILE *fd;
+	unsigned int pos;
+
+	fail_unless((buf = malloc(length)) != NULL, NULL);
+	for (pos = 0; pos < length; pos++)
+		buf[pos] = (pos % 16 == 15) ? '\n' : 'a' + (pos % 16);
+
+	SETUP_TESTDIR();
+	fail_unless((fd = fopen(BASIC_FILE, "w")) != NULL, NULL);
+	fail_unless(fwrite(buf, 1, length, fd) == length, NULL);
+	fclose(fd);
+
+	fail_unless((file = pkgfile_new_from_disk(BASIC_FILE, 0)) != NULL,
+	    NULL);
+	fail_unless(pkgfile_get_size(file) == length, NULL);
+	fail_unless(pkgfile_get_data(file) != NULL, NULL);
+	fail_unless(file->mapped == mapped, NULL);
+	fail_unless(memcmp(pkgfile_get_data(file), buf, length) == 0, NULL);
+
+	/* Removing a line must not write through a read only mapping */
+	fail_unless(pkgfile_remove_line(file, "abcdefghijklmno") == 0, NULL);
+	fail_unless(file->mapped == 0, NULL);
+	fail_unless(file->length == length - 16, NULL);
+	fail_unless(memcmp(file->data, buf + 16, length - 16) == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "not a line") == 1, NULL);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+
+	check_regular_file_data_len(BASIC_FILE, buf + 16, length - 16);
+
+	system("rm " BASIC_FILE);
+	CLEANUP_TESTDIR();
+	free(buf);
+}
+
+/* A pkgfile_checksum_update callback that copies the data it is passed */
+struct stream_data {
+	char		*buf;
+	unsigned int	 length;
+	unsigned int	 calls;
+};
+
+static void
+stream_copy(void *ctx, const void *data, size_t length)
+{
+	struct stream_data *sd;
+
+	sd = ctx;
+	memcpy(sd->buf + sd->length, data, length);
+	sd->length += length;
+	sd->calls++;
+}
+
+START_TEST(pkgfile_disk_checksum_stream_test)
+{
+	struct pkgfile *file;
+	struct stream_data sd;
+	unsigned int length, pos;
+	char *buf;
+	FILE *fd;
+
+	/* Large enough to be read in more than one block */
+	length = 200 * 1024;
+	fail_unless((buf = malloc(length)) != NULL, NULL);
+	fail_unless((sd.buf = malloc(length)) != NULL, NULL);
+	for (pos = 0; pos < length; pos++)
+		buf[pos] = pos % 251;
+
+	SETUP_TESTDIR();
+	fail_unless((fd = fopen(BASIC_FILE, "w")) != NULL, NULL);
+	fail_unless(fwrite(buf, 1, length, fd) == length, NULL);
+	fclose(fd);
+
+	file = pkgfile_new_from_disk(BASIC_FILE, 0);
+	fail_unless(pkgfile_checksum_stream(file, NULL, &sd) == -1, NULL);
+
+	/* The file should not be loaded to memory */
+	sd.length = sd.calls = 0;
+	fail_unless(pkgfile_checksum_stream(file, stream_copy, &sd) == 0, NULL);
+	fail_unless(file->data == NULL, NULL);
+	fail_unless(sd.length == length, NULL);
+	fail_unless(sd.calls > 1, NULL);
+	fail_unless(memcmp(sd.buf, buf, length) == 0, NULL);
+
+	/* Check it is the same after the data is loaded */
+	fail_unless(pkgfile_get_data(file) != NULL, NULL);
+	sd.length = sd.calls = 0;
+	fail_unless(pkgfile_checksum_stream(file, stream_copy, &sd) == 0, NULL);
+	fail_unless(sd.length == length, NULL);
+	fail_unless(memcmp(sd.buf, buf, length) == 0, NULL);
+	pkgfile_free(file);
+
+	system("rm " BASIC_FILE);
+	CLEANUP_TESTDIR();
+	free(sd.buf);
+	free(buf);
+}
+END_TEST
+
+START_TEST(pkgfile_disk_edit_test)
+{
+	struct pkgfile *file;
+	struct stat sb;
+	FILE *fd;
+
+	SETUP_TESTDIR();
+	fail_unless((fd = fopen(BASIC_FILE, "w")) != NULL, NULL);
+	fputs("pkg-1\npkg-2\npkg-3\npkg-4\n", fd);
+	fclose(fd);
+	fail_unless(chmod(BASIC_FILE, 0640) == 0, NULL);
+
+	file = pkgfile_new_from_disk(BASIC_FILE, 0);
+	fail_unless(pkgfile_edit_commit(file) == -1, NULL);
+	fail_unless(pkgfile_append(file, "pkg-5\n", 6) == -1, NULL);
+	fail_unless(pkgfile_reserve(file, 100) == -1, NULL);
+	fail_unless(pkgfile_edit_begin(file) == 0, NULL);
+	fail_unless(pkgfile_edit_begin(file) == -1, NULL);
+
+	/* The file on disk is unchanged until the edit is committed */
+	fail_unless(pkgfile_remove_line(file, "pkg-3") == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "pkg-1") == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "pkg-6") == 1, NULL);
+	fail_unless(pkgfile_append(file, "pkg-5\n", 6) == 0, NULL);
+	fail_unless(pkgfile_append_string(file, "%s\n", "pkg-6") == 0, NULL);
+	check_regular_file_data_len(BASIC_FILE,
+	    "pkg-1\npkg-2\npkg-3\npkg-4\n", 24);
+
+	fail_unless(pkgfile_edit_commit(file) == 0, NULL);
+	fail_unless(pkgfile_edit_commit(file) == -1, NULL);
+	check_regular_file_data_len(BASIC_FILE,
+	    "pkg-2\npkg-4\npkg-5\npkg-6\n", 24);
+	fail_unless(stat(BASIC_FILE, &sb) == 0, NULL);
+	fail_unless((sb.st_mode & ALLPERMS) == 0640, NULL);
+
+	/* Removing a line outside an edit is written straight away */
+	fail_unless(pkgfile_remove_line(file, "pkg-5") == 0, NULL);
+	check_regular_file_data_len(BASIC_FILE, "pkg-2\npkg-4\npkg-6\n", 18);
+	pkgfile_free(file);
+
+	/* Only regular files can be edited */
+	file = pkgfile_new_from_disk("testdir", 0);
+	fail_unless(pkgfile_edit_begin(file) == -1, NULL);
+	pkgfile_free(file);
+
+	/* Files in memory are only changed in memory */
+	file = pkgfile_new_regular(DEPTH_FILE, "12345\n", 6);
+	fail_unless(pkgfile_edit_begin(file) == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "12345") == 0, NULL);
+	fail_unless(pkgfile_append(file, "67890", 5) == 0, NULL);
+	fail_unless(pkgfile_edit_commit(file) == 0, NULL);
+	basic_file_tests(file, DEPTH_FILE, pkgfile_regular, pkgfile_loc_mem,
+	    "67890", 5);
+	pkgfile_free(file);
+
+	/* Any temporary files will stop the directory being removed */
+	system("rm " BASIC_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/*
+ * Check replacing a file on disk keeps its owner and any hard links
+ */
+START_TEST(pkgfile_disk_replace_test)
+{
+	struct pkgfile *file;
+	struct stat sb, link_sb;
+
+	SETUP_TESTDIR();
+	system("echo pkg-1 > " BASIC_FILE "; echo pkg-2 >> " BASIC_FILE);
+
+	/* Only root can give the file away */
+	if (geteuid() == 0)
+		fail_unless(chown(BASIC_FILE, 1, 2) == 0, NULL);
+	fail_unless(stat(BASIC_FILE, &sb) == 0, NULL);
+	file = pkgfile_new_from_disk(BASIC_FILE, 0);
+	fail_unless(pkgfile_remove_line(file, "pkg-1") == 0, NULL);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+	check_regular_file_data_len(BASIC_FILE, "pkg-2\n", 6);
+	fail_unless(stat(BASIC_FILE, &link_sb) == 0, NULL);
+	fail_unless(link_sb.st_uid == sb.st_uid, NULL);
+	fail_unless(link_sb.st_gid == sb.st_gid, NULL);
+
+	/* A file with other links is changed in place */
+	fail_unless(link(BASIC_FILE, "testdir/HARDLINK") == 0, NULL);
+	file = pkgfile_new_from_disk(BASIC_FILE, 0);
+	fail_unless(pkgfile_edit_begin(file) == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "pkg-2") == 0, NULL);
+	fail_unless(pkgfile_append(file, "pkg-3\n", 6) == 0, NULL);
+	fail_unless(pkgfile_edit_commit(file) == 0, NULL);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+	check_regular_file_data_len("testdir/HARDLINK", "pkg-3\n", 6);
+	fail_unless(stat(BASIC_FILE, &sb) == 0, NULL);
+	fail_unless(stat("testdir/HARDLINK", &link_sb) == 0, NULL);
+	fail_unless(sb.st_ino == link_sb.st_ino, NULL);
+	fail_unless(sb.st_size == 6, NULL);
+
+	system("rm " BASIC_FILE " testdir/HARDLINK");
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/*
+ * Check lines removed in an edit are all taken out when it's committed
+ */
+START_TEST(pkgfile_edit_remove_test)
+{
+	struct pkgfile *file;
+	char *data, *expect, *ptr, line[16];
+	const char *found;
+	unsigned int pos;
+
+	/* Large enough to have it's lines indexed */
+	data = malloc(2000 * 10);
+	expect = malloc(2000 * 10);
+	fail_unless(data != NULL && expect != NULL, NULL);
+	ptr = data;
+	for (pos = 0; pos < 2000; pos++)
+		ptr += sprintf(ptr, "line-%u\n", pos % 1000);
+	file = pkgfile_new_regular("+REQUIRED_BY", data, ptr - data);
+	fail_unless(pkgfile_edit_begin(file) == 0, NULL);
+
+	/* Remove every odd line, each line is in the file twice */
+	for (pos = 1; pos < 1000; pos += 2) {
+		snprintf(line, sizeof(line), "line-%u", pos);
+		fail_unless(pkgfile_remove_line(file, line) == 0, NULL);
+		fail_unless(pkgfile_remove_line(file, line) == 0, NULL);
+		fail_unless(pkgfile_find_line(file, line) == NULL, NULL);
+		fail_unless(pkgfile_remove_line(file, line) == 1, NULL);
+	}
+
+	/* The second copy of a line is found once the first is removed */
+	fail_unless(pkgfile_remove_line(file, "line-0") == 0, NULL);
+	found = pkgfile_find_line(file, "line-0");
+	fail_unless(found != NULL, NULL);
+	fail_unless(strncmp(found - 9, "line-999\n", 9) == 0, NULL);
+
+	fail_unless(pkgfile_append(file, "last", 4) == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "last") == 0, NULL);
+	fail_unless(pkgfile_edit_commit(file) == 0, NULL);
+
+	ptr = expect;
+	for (pos = 1; pos < 2000; pos++) {
+		if (pos % 2 == 0)
+			ptr += sprintf(ptr, "line-%u\n", pos % 1000);
+	}
+	fail_unless(pkgfile_get_size(file) == (uint64_t)(ptr - expect), NULL);
+	fail_unless(memcmp(pkgfile_get_data(file), expect, ptr - expect) == 0,
+	    NULL);
+
+	/* Reading the data part way through an edit applies the removes */
+	fail_unless(pkgfile_edit_begin(file) == 0, NULL);
+	fail_unless(pkgfile_remove_line(file, "line-2") == 0, NULL);
+	fail_unless(pkgfile_get_size(file) == (uint64_t)(ptr - expect - 7),
+	    NULL);
+	fail_unless(pkgfile_remove_line(file, "line-4") == 0, NULL);
+	fail_unless(pkgfile_edit_commit(file) == 0, NULL);
+	fail_unless(pkgfile_get_size(file) == (uint64_t)(ptr - expect - 14),
+	    NULL);
+	fail_unless(strncmp(pkgfile_get_data(file), "line-6\n", 7) == 0, NULL);
+
+	pkgfile_free(file);
+	free(expect);
+	free(data);
+}
+END_TEST
+
+START_TEST(pkgfile_disk_dirfd_test)
+{
+	struct pkgfile *file;
+	struct stat sb;
+	char buf[32];
+	int dirfd;
+
+	SETUP_TESTDIR();
+	fail_unless((dirfd = open("testdir", O_RDONLY)) != -1, NULL);
+
+	/* Files are created relative to the directory */
+	file = pkgfile_new_regular("dir/REGULAR", "12345\n", 6);
+	fail_unless(pkgfile_set_dirfd(file, -2) == -1, NULL);
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	pkgfile_free(file);
+	check_regular_file_data_len("testdir/dir/REGULAR", "12345\n", 6);
+
+	file = pkgfile_new_hardlink("HARDLINK", "dir/REGULAR");
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	pkgfile_free(file);
+	fail_unless(stat("testdir/HARDLINK", &sb) == 0, NULL);
+	fail_unless(sb.st_nlink == 2, NULL);
+
+	file = pkgfile_new_symlink("SYMLINK", "dir/REGULAR");
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	pkgfile_free(file);
+	fail_unless(readlink("testdir/SYMLINK", buf, sizeof(buf)) == 11, NULL);
+	fail_unless(strncmp(buf, "dir/REGULAR", 11) == 0, NULL);
+
+	file = pkgfile_new_directory("dir2");
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_write(file) == 0, NULL);
+	pkgfile_free(file);
+	fail_unless(stat("testdir/dir2", &sb) == 0, NULL);
+	fail_unless(S_ISDIR(sb.st_mode), NULL);
+
+	/* Files on disk are read and changed relative to the directory */
+	file = pkgfile_new_from_disk("dir/REGULAR", 0);
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_get_size(file) == 6, NULL);
+	fail_unless(pkgfile_set_dirfd(file, AT_FDCWD) == -1, NULL);
+	fail_unless(pkgfile_edit_begin(file) == 0, NULL);
+	fail_unless(pkgfile_append(file, "67890\n", 6) == 0, NULL);
+	fail_unless(pkgfile_edit_commit(file) == 0, NULL);
+	pkgfile_free(file);
+	check_regular_file_data_len("testdir/dir/REGULAR", "12345\n67890\n",
+	    12);
+
+	/* Remove the files */
+	file = pkgfile_new_from_disk("SYMLINK", 0);
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_unlink(file) == 0, NULL);
+	pkgfile_free(file);
+	file = pkgfile_new_from_disk("HARDLINK", 0);
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_unlink(file) == 0, NULL);
+	pkgfile_free(file);
+	file = pkgfile_new_from_disk("dir2", 0);
+	fail_unless(pkgfile_set_dirfd(file, dirfd) == 0, NULL);
+	fail_unless(pkgfile_unlink(file) == 0, NULL);
+	pkgfile_free(file);
+	fail_unless(lstat("testdir/SYMLINK", &sb) == -1, NULL);
+	fail_unless(lstat("testdir/HARDLINK", &sb) == -1, NULL);
+	fail_unless(lstat("testdir/dir2", &sb) == -1, NULL);
+
+	close(dirfd);
+	system("rm testdir/dir/REGULAR");
+	system("rmdir testdir/dir");
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+/* Tests writing many files with a pool of threads */
+START_TEST(pkgfile_disk_batch_test)
+{
+	struct pkgfile_batch *batch;
+	struct pkgfile *file;
+	struct stat sb;
+	char name[32], data[32];
+	unsigned int pos;
+
+	SETUP_TESTDIR();
+
+	/* More files than fit in the batch's ring */
+	fail_unless((batch = pkgfile_batch_new(4)) != NULL, NULL);
+	for (pos = 0; pos < 1000; pos++) {
+		snprintf(name, sizeof(name), "testdir/dir%u/%u", pos % 10, pos);
+		snprintf(data, sizeof(data), "%u\n", pos);
+		file = pkgfile_new_regular(name, data, strlen(data));
+		fail_unless(pkgfile_batch_write(batch, file) == 0, NULL);
+		/* The batch holds it's own reference to the file */
+		pkgfile_free(file);
+	}
+
+	/* Hardlinks are written after the file they point to */
+	file = pkgfile_new_hardlink("testdir/HARDLINK", "testdir/dir9/999");
+	fail_unless(pkgfile_batch_write(batch, file) == 0, NULL);
+	pkgfile_free(file);
+	fail_unless(pkgfile_batch_wait(batch) == 0, NULL);
+	fail_unless(stat("testdir/HARDLINK", &sb) == 0, NULL);
+	fail_unless(sb.st_nlink == 2, NULL);
+
+	for (pos = 0; pos < 1000; pos++) {
+		snprintf(name, sizeof(name), "testdir/dir%u/%u", pos % 10, pos);
+		snprintf(data, sizeof(data), "%u\n", pos);
+		check_regular_file_data_len(name, data, strlen(data));
+	}
+
+	/* A directory is made before the files in it with it's own mode */
+	file = pkgfile_new_directory("testdir/dirA");
+	fail_unless(pkgfile_set_mode(file, 0700) == 0, NULL);
+	fail_unless(pkgfile_batch_write(batch, file) == 0, NULL);
+	pkgfile_free(file);
+	fail_unless(stat("testdir/dirA", &sb) == 0, NULL);
+	fail_unless((sb.st_mode & ALLPERMS) == 0700, NULL);
+	for (pos = 0; pos < 100; pos++) {
+		snprintf(name, sizeof(name), "testdir/dirA/%u", pos);
+		file = pkgfile_new_regular(name, "", 0);
+		fail_unless(pkgfile_batch_write(batch, file) == 0, NULL);
+		pkgfile_free(file);
+	}
+	fail_unless(pkgfile_batch_wait(batch) == 0, NULL);
+	fail_unless(stat("testdir/dirA", &sb) == 0, NULL);
+	fail_unless((sb.st_mode & ALLPERMS) == 0700, NULL);
+
+	/* A failed write is reported */
+	file = pkgfile_new_regular("testdir/dir0/0", "", 0);
+	pkgfile_batch_write(batch, file);
+	pkgfile_free(file);
+	fail_unless(pkgfile_batch_wait(batch) == -1, NULL);
+	fail_unless(pkgfile_batch_free(batch) == 0, NULL);
+
+	/* Without threads files are written immediately */
+	fail_unless((batch = pkgfile_batch_new(0)) != NULL, NULL);
+	file = pkgfile_new_regular("testdir/REGULAR", "12345\n", 6);
+	fail_unless(pkgfile_batch_write(batch, file) == 0, NULL);
+	pkgfile_free(file);
+	check_regular_file_data_len("testdir/REGULAR", "12345\n", 6);
+	fail_unless(pkgfile_batch_free(batch) == 0, NULL);
+
+	system("rm -r testdir/dir? testdir/HARDLINK testdir/REGULAR");
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+START_TEST(pkgfile_disk_small_test)
+{
+	/* Small files are read into a buffer */
+	disk_file_test(64, 0);
+}
+END_TEST
+
+START_TEST(pkgfile_disk_mapped_test)
+{
+	/* Larger files are mapped */
+	disk_file_test(64 * 1024, 1);
+}
+END_TEST
+
+/* Check a file that shrinks before it is read isn't given partly read */
+START_TEST(pkgfile_disk_truncated_test)
+{
+	struct pkgfile *file;
+
+	SETUP_TESTDIR();
+	system("echo -n 0123456789 > " BASIC_FILE);
+	fail_unless((file = pkgfile_new_from_disk(BASIC_FILE, 0)) != NULL,
+	    NULL);
+	fail_unless(pkgfile_get_size(file) == 10, NULL);
+	fail_unless(truncate(BASIC_FILE, 5) == 0, NULL);
+	fail_unless(pkgfile_get_data(file) == NULL, NULL);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+
+	system("rm " BASIC_FILE);
+	CLEANUP_TESTDIR();
+}
+END_TEST
+
+START_TEST(pkgfile_misc_name_test)
+{
+	struct pkgfile *file, *old_file;
+
+	file = pkgfile_new_regular("aaaa", "", 0);
+	fail_unless(strcmp(pkgfile_get_name(file), "aaaa") == 0, NULL);
+
+	/* A freed object is used for the next file */
+	old_file = file;
+	fail_unless(pkgfile_free(file) == 0, NULL);
+	file = pkgfile_new_directory(BASIC_FILE);
+	fail_unless(file == old_file, NULL);
+	basic_file_tests(file, BASIC_FILE, pkgfile_dir, pkgfile_loc_mem,
+	    BASIC_FILE, BASIC_FILE_LENGTH);
+	fail_unless(pkgfile_free(file) == 0, NULL);
+}
+END_TEST
+
 START_TEST(pkgfile_misc_bad_args)
 {
+	fail_unless(pkgfile_set_dirfd(NULL, AT_FDCWD) == -1, NULL);
+	fail_unless(pkgfile_reserve(NULL, 0) == -1, NULL);
+	fail_unless(pkgfile_batch_write(NULL, NULL) == -1, NULL);
+	fail_unless(pkgfile_batch_wait(NULL) == -1, NULL);
+	fail_unless(pkgfile_batch_free(NULL) == -1, NULL);
 	fail_unless(pkgfile_append(NULL, NULL, 0) == -1, NULL);
 	fail_unless(pkgfile_append(NULL, NULL, 1) == -1, NULL);
 	fail_unless(pkgfile_append(NULL, "1234567890", 10) == -1, NULL);
@@ -864,6 +1688,7 @@ START_TEST(pkgfile_misc_bad_args)
 	fail_unless(pkgfile_append_string(NULL, "") == -1, NULL);
 	fail_unless(pkgfile_append_string(NULL, "%s", "string") == -1, NULL);
 	fail_unless(pkgfile_compare_checksum_md5(NULL) == -1, NULL);
+	fail_unless(pkgfile_checksum_stream(NULL, NULL, NULL) == -1, NULL);
 	fail_unless(pkgfile_free(NULL) == -1, NULL);
 	fail_unless(pkgfile_get_data(NULL) == NULL, NULL);
 	fail_unless(pkgfile_get_fileptr(NULL) == NULL, NULL);
@@ -896,6 +1721,7 @@ pkgfile_suite()
 	tcase_add_test(tc, pkgfile_regular_bad_test);
 	tcase_add_test(tc, pkgfile_regular_empty_test);
 	tcase_add_test(tc, pkgfile_regular_data_test);
+	tcase_add_test(tc, pkgfile_regular_owned_test);
 
 	tcase_add_test(tc, pkgfile_regular_existing_regular_test);
 	tcase_add_test(tc, pkgfile_regular_existing_symlink_test);
@@ -906,12 +1732,18 @@ pkgfile_suite()
 
 	tcase_add_test(tc, pkgfile_regular_modify_test);
 	tcase_add_test(tc, pkgfile_regular_modify_empty_test);
+	tcase_add_test(tc, pkgfile_regular_write_test);
+	tcase_add_test(tc, pkgfile_regular_append_test);
+	tcase_add_test(tc, pkgfile_regular_find_line_test);
+	tcase_add_test(tc, pkgfile_regular_find_line_index_test);
+	tcase_add_test(tc, pkgfile_regular_archive_test);
 	suite_add_tcase(s, tc);
 
 
 	tc = tcase_create("symlink");
 	tcase_add_test(tc, pkgfile_symlink_bad_test);
 	tcase_add_test(tc, pkgfile_symlink_good_test);
+	tcase_add_test(tc, pkgfile_symlink_owned_test);
 
 	tcase_add_test(tc, pkgfile_symlink_existing_regular_test);
 	tcase_add_test(tc, pkgfile_symlink_existing_symlink_test);
@@ -924,6 +1756,7 @@ pkgfile_suite()
 
 	tc = tcase_create("hardlink");
 	tcase_add_test(tc, pkgfile_hardlink_bad_test);
+	tcase_add_test(tc, pkgfile_hardlink_owned_test);
 	tcase_add_test(tc, pkgfile_hardlink_test);
 
 	tcase_add_test(tc, pkgfile_hardlink_existing_regular_test);
@@ -947,8 +1780,22 @@ pkgfile_suite()
 	suite_add_tcase(s, tc);
 
 
+	tc = tcase_create("disk");
+	tcase_add_test(tc, pkgfile_disk_small_test);
+	tcase_add_test(tc, pkgfile_disk_mapped_test);
+	tcase_add_test(tc, pkgfile_disk_truncated_test);
+	tcase_add_test(tc, pkgfile_disk_checksum_stream_test);
+	tcase_add_test(tc, pkgfile_disk_edit_test);
+	tcase_add_test(tc, pkgfile_disk_replace_test);
+	tcase_add_test(tc, pkgfile_edit_remove_test);
+	tcase_add_test(tc, pkgfile_disk_dirfd_test);
+	tcase_add_test(tc, pkgfile_disk_batch_test);
+	suite_add_tcase(s, tc);
+
+
 	tc = tcase_create("misc");
 	tcase_add_test(tc, pkgfile_misc_bad_args);
+	tcase_add_test(tc, pkgfile_misc_name_test);
 	suite_add_tcase(s, tc);
 
 	return s;
@@ -24,15 +24,31 @@
  *
  */
 
+#include <sys/types.h>
 #include <check.h>
 int setup_testdir(void);
 int cleanup_testdir(void);
+int make_testdir(const char *);
+int remove_testfiles(const char *);
+int write_testfile(const char *, const char *, size_t);
 
 #define SETUP_TESTDIR() fail_unless(setup_testdir() == 0, "Couldn't create the test dir")
 #define CLEANUP_TESTDIR() fail_unless(cleanup_testdir() == 0, "Couldn't cleanup the test dir")
+#define MAKE_TESTDIR(dir) fail_unless(make_testdir(dir) == 0, "Couldn't create " dir)
+#define REMOVE_TESTFILES(files) fail_unless(remove_testfiles(files) == 0, "Couldn't remove " files)
+#define WRITE_TESTFILE(path, data, len) fail_unless(write_testfile(path, data, len) == 0, "Couldn't write a test file")
+
+struct pkg_manifest;
+void check_same_manifest(struct pkg_manifest *, struct pkg_manifest *);
 
 Suite *pkgfile_suite(void);
 Suite *pkg_manifest_suite(void);
 Suite *pkg_manifest_item_suite(void);
 Suite *pkg_manifest_freebsd_suite(void);
+Suite *pkg_freebsd_toc_suite(void);
+Suite *pkg_freebsd_suite(void);
+Suite *archive_read_open_bzip2_suite(void);
+Suite *archive_read_open_stream_suite(void);
+Suite *pkg_chunked_suite(void);
+Suite *pkg_freebsd_cache_suite(void);
 
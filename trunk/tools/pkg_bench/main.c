@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2005, Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Measures how fast the files can be read from package archives.
+ * Give the same package compressed in different ways, eg.
+ *   pkg_bench -n 5 bash-3.0.16_1.tbz bash-3.0.16_1.txz bash-3.0.16_1.tzst
+ * and the best time of each is used to find the decode throughput.
+ *
+ * With -t a table of contents is written next to each package before
+ * it is timed, see pkg_freebsd_create_toc(). With -c only the control
+ * files are read, eg. to compare a package with and without a table of
+ * contents:
+ *   pkg_bench -c bash-3.0.16_1.tar
+ *   pkg_bench -c -t bash-3.0.16_1.tar
+ *
+ * With -m the files are +CONTENTS files and the time to parse them with
+ * the bison parser and the hand written parser is compared, eg.
+ *   pkg_bench -m -n 100 /var/db/pkg/bash-3.0.16_1/+CONTENTS
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <pkg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The +CONTENTS parsers, these are internal to libpkg */
+typedef struct pkg_manifest *parse_func(const char *, size_t);
+parse_func pkg_freebsd_parse_buffer;
+parse_func pkg_freebsd_parse_contents;
+
+static void usage(void);
+static int bench_pkg(const char *, int, uint64_t *, double *);
+static int bench_manifests(int, char *[], int);
+static int bench_parse(parse_func *, struct pkgfile **, int, double *);
+
+int
+main(int argc, char *argv[])
+{
+	struct stat sb;
+	uint64_t size;
+	double best, secs;
+	int ch, control, i, manifests, run, runs, toc;
+
+	control = 0;
+	manifests = 0;
+	runs = 3;
+	toc = 0;
+	while ((ch = getopt(argc, argv, "cmn:t")) != -1) {
+		switch (ch) {
+		case 'c':
+			control = 1;
+			break;
+		case 'm':
+			manifests = 1;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			if (runs < 1)
+				usage();
+			break;
+		case 't':
+			toc = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0)
+		usage();
+
+	if (manifests) {
+		if (control || toc)
+			usage();
+		return bench_manifests(argc, argv, runs);
+	}
+
+	printf("%-40s %12s %12s %10s %10s\n", "package", "compressed",
+	    "uncompressed", "seconds", "MB/s");
+	for (i = 0; i < argc; i++) {
+		if (stat(argv[i], &sb) != 0)
+			err(1, "%s", argv[i]);
+		if (toc && pkg_freebsd_create_toc(argv[i]) != 0)
+			errx(1, "%s: Could not create the table of contents",
+			    argv[i]);
+
+		best = 0;
+		for (run = 0; run < runs; run++) {
+			if (bench_pkg(argv[i], control, &size, &secs) != 0)
+				errx(1, "%s: Could not read package", argv[i]);
+			if (run == 0 || secs < best)
+				best = secs;
+		}
+		printf("%-40s %12jd %12ju %10.3f %10.1f\n", argv[i],
+		    (intmax_t)sb.st_size, (uintmax_t)size, best,
+		    best > 0 ? size / best / (1024 * 1024) : 0);
+	}
+
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pkg_bench [-ct] [-n runs] package-file ...\n"
+	    "       pkg_bench -m [-n runs] contents-file ...\n");
+	exit(1);
+}
+
+/*
+ * Reads every file in a package, or only the control files when
+ * control is set. The size of the files is returned in size and
+ * the time taken in secs.
+ */
+static int
+bench_pkg(const char *file, int control, uint64_t *size, double *secs)
+{
+	struct timespec start, end;
+	struct pkg *pkg;
+	struct pkgfile *pkgfile, **control_files;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pkg = pkg_new_freebsd_from_path(file);
+	if (pkg == NULL)
+		return -1;
+
+	*size = 0;
+	if (control) {
+		control_files = pkg_get_control_files(pkg);
+		if (control_files == NULL) {
+			pkg_free(pkg);
+			return -1;
+		}
+		for (i = 0; control_files[i] != NULL; i++)
+			*size += pkgfile_get_size(control_files[i]);
+	} else {
+		while ((pkgfile = pkg_get_next_file(pkg)) != NULL)
+			*size += pkgfile_get_size(pkgfile);
+	}
+	pkg_free(pkg);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	return 0;
+}
+
+/*
+ * Parses every +CONTENTS file with each parser runs times. The best
+ * time for each parser is printed.
+ */
+static int
+bench_manifests(int count, char *files[], int runs)
+{
+	struct pkgfile **contents;
+	uint64_t size;
+	double best_bison, best_hand, secs;
+	int i, run;
+
+	contents = calloc(count, sizeof(struct pkgfile *));
+	if (contents == NULL)
+		err(1, "calloc");
+
+	/* Read the files in to memory so only the parsing is timed */
+	size = 0;
+	for (i = 0; i < count; i++) {
+		contents[i] = pkgfile_new_from_disk(files[i], 0);
+		if (contents[i] == NULL ||
+		    pkgfile_get_data(contents[i]) == NULL)
+			errx(1, "%s: Could not read file", files[i]);
+		size += pkgfile_get_size(contents[i]);
+	}
+
+	best_bison = best_hand = 0;
+	for (run = 0; run < runs; run++) {
+		if (bench_parse(pkg_freebsd_parse_buffer, contents, count,
+		    &secs) != 0)
+			errx(1, "The bison parser failed");
+		if (run == 0 || secs < best_bison)
+			best_bison = secs;
+
+		if (bench_parse(pkg_freebsd_parse_contents, contents, count,
+		    &secs) != 0)
+			errx(1, "The hand written parser failed");
+		if (run == 0 || secs < best_hand)
+			best_hand = secs;
+	}
+
+	printf("%d files, %ju bytes\n", count, (uintmax_t)size);
+	printf("%-12s %10s %10s\n", "parser", "seconds", "MB/s");
+	printf("%-12s %10.4f %10.1f\n", "bison", best_bison,
+	    best_bison > 0 ? size / best_bison / (1024 * 1024) : 0);
+	printf("%-12s %10.4f %10.1f\n", "hand", best_hand,
+	    best_hand > 0 ? size / best_hand / (1024 * 1024) : 0);
+
+	for (i = 0; i < count; i++)
+		pkgfile_free(contents[i]);
+	free(contents);
+
+	return 0;
+}
+
+/*
+ * Parses then frees a manifest for each file. The time taken is
+ * returned in secs.
+ */
+static int
+bench_parse(parse_func *parse, struct pkgfile **contents, int count,
+    double *secs)
+{
+	struct timespec start, end;
+	struct pkg_manifest *manifest;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < count; i++) {
+		manifest = parse(pkgfile_get_data(contents[i]),
+		    pkgfile_get_size(contents[i]));
+		if (manifest == NULL)
+			return -1;
+		pkg_manifest_free(manifest);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	return 0;
+}